@@ -0,0 +1,49 @@
+################################################################################
+#  THIS FILE IS 100% GENERATED BY ZPROJECT; DO NOT EDIT EXCEPT EXPERIMENTALLY  #
+#  Read the zproject/README.md for information about making permanent changes. #
+################################################################################
+
+if (NOT MSVC)
+    include(FindPkgConfig)
+    pkg_check_modules(PC_LIBZSTD "libzstd")
+    if (NOT PC_LIBZSTD_FOUND)
+        pkg_check_modules(PC_LIBZSTD "libzstd")
+    endif (NOT PC_LIBZSTD_FOUND)
+    if (PC_LIBZSTD_FOUND)
+        # add CFLAGS from pkg-config file, e.g. draft api.
+        add_definitions(${PC_LIBZSTD_CFLAGS} ${PC_LIBZSTD_CFLAGS_OTHER})
+        # some libraries install the headers is a subdirectory of the include dir
+        # returned by pkg-config, so use a wildcard match to improve chances of finding
+        # headers and SOs.
+        set(PC_LIBZSTD_INCLUDE_HINTS ${PC_LIBZSTD_INCLUDE_DIRS} ${PC_LIBZSTD_INCLUDE_DIRS}/*)
+        set(PC_LIBZSTD_LIBRARY_HINTS ${PC_LIBZSTD_LIBRARY_DIRS} ${PC_LIBZSTD_LIBRARY_DIRS}/*)
+    endif(PC_LIBZSTD_FOUND)
+endif (NOT MSVC)
+
+find_path (
+    LIBZSTD_INCLUDE_DIRS
+    NAMES zstd.h
+    HINTS ${PC_LIBZSTD_INCLUDE_HINTS}
+)
+
+find_library (
+    LIBZSTD_LIBRARIES
+    NAMES zstd
+    HINTS ${PC_LIBZSTD_LIBRARY_HINTS}
+)
+
+include(FindPackageHandleStandardArgs)
+
+find_package_handle_standard_args(
+    LIBZSTD
+    REQUIRED_VARS LIBZSTD_LIBRARIES LIBZSTD_INCLUDE_DIRS
+)
+mark_as_advanced(
+    LIBZSTD_FOUND
+    LIBZSTD_LIBRARIES LIBZSTD_INCLUDE_DIRS
+)
+
+################################################################################
+#  THIS FILE IS 100% GENERATED BY ZPROJECT; DO NOT EDIT EXCEPT EXPERIMENTALLY  #
+#  Read the zproject/README.md for information about making permanent changes. #
+################################################################################
@@ -73,6 +73,32 @@ typedef struct _lmdbtxn_t lmdbtxn_t;
 #define LMDBTXN_T_DEFINED
 typedef struct _lmdbcur_t lmdbcur_t;
 #define LMDBCUR_T_DEFINED
+typedef struct _lmdbidx_t lmdbidx_t;
+#define LMDBIDX_T_DEFINED
+typedef struct _lmdbidxcur_t lmdbidxcur_t;
+#define LMDBIDXCUR_T_DEFINED
+typedef struct _lmdbsweeper_t lmdbsweeper_t;
+#define LMDBSWEEPER_T_DEFINED
+typedef struct _lmdbrepl_t lmdbrepl_t;
+#define LMDBREPL_T_DEFINED
+typedef struct _lmdbasync_t lmdbasync_t;
+#define LMDBASYNC_T_DEFINED
+typedef struct _lmdbsnapshot_t lmdbsnapshot_t;
+#define LMDBSNAPSHOT_T_DEFINED
+typedef struct _lmdbarrow_t lmdbarrow_t;
+#define LMDBARROW_T_DEFINED
+typedef struct _lmdbarena_t lmdbarena_t;
+#define LMDBARENA_T_DEFINED
+typedef struct _lmdbmemtable_t lmdbmemtable_t;
+#define LMDBMEMTABLE_T_DEFINED
+typedef struct _lmdbblob_t lmdbblob_t;
+#define LMDBBLOB_T_DEFINED
+typedef struct _lmdbspace_t lmdbspace_t;
+#define LMDBSPACE_T_DEFINED
+typedef struct _lmdbbatch_t lmdbbatch_t;
+#define LMDBBATCH_T_DEFINED
+typedef struct _lmdballoc_t lmdballoc_t;
+#define LMDBALLOC_T_DEFINED
 #endif // CLASSLMDB_BUILD_DRAFT_API
 
 
@@ -83,6 +109,19 @@ typedef struct _lmdbcur_t lmdbcur_t;
 #include "lmdbdbi.h"
 #include "lmdbtxn.h"
 #include "lmdbcur.h"
+#include "lmdbidx.h"
+#include "lmdbidxcur.h"
+#include "lmdbsweeper.h"
+#include "lmdbrepl.h"
+#include "lmdbasync.h"
+#include "lmdbsnapshot.h"
+#include "lmdbarrow.h"
+#include "lmdbarena.h"
+#include "lmdbmemtable.h"
+#include "lmdbblob.h"
+#include "lmdbspace.h"
+#include "lmdbbatch.h"
+#include "lmdballoc.h"
 #endif // CLASSLMDB_BUILD_DRAFT_API
 
 #ifdef CLASSLMDB_BUILD_DRAFT_API
@@ -0,0 +1,75 @@
+#ifndef CLASSLMDB_LMDBFAST_H_INCLUDED
+#define CLASSLMDB_LMDBFAST_H_INCLUDED
+
+/*  =========================================================================
+    lmdbfast - Inline gets, puts and cursor steps on plain dbis, for hot loops
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+//  Not included by classlmdb.h; include it where you need it.
+//
+//  These skip everything lmdbdbi does on top of LMDB, so only use them on
+//  dbis where lmdbdbi_plain() is true, in txns that aren't staging puts.
+//  They take the raw handles, fetched once with lmdbtxn_handle() and
+//  lmdbdbi_handle(), so each call is one call into LMDB, with no asserts
+//  and no call into this library, and compilers can inline them into the
+//  loop.
+
+#include "classlmdb_library.h"
+
+
+//  --------------------------------------------------------------------------
+//  Get and put
+
+// As lmdbdbi_get
+inline static lmdbspan
+lmdbfast_get (MDB_txn *txn, MDB_dbi dbi, const void *key, size_t key_size)
+{
+    // LMDB api requires us to cast away const here, but doesn't mutate
+    MDB_val mkey = { .mv_size = key_size, .mv_data = (void *) key };
+    MDB_val mval;
+    if (mdb_get (txn, dbi, &mkey, &mval))
+        return lmdbspan_makenull ();
+    return (lmdbspan) { .data = mval.mv_data, .size = mval.mv_size };
+}
+
+// As lmdbdbi_get_strn: len doesn't count the terminating NULL, which is
+// still part of the key
+inline static lmdbspan
+lmdbfast_get_strn (MDB_txn *txn, MDB_dbi dbi, const char *key, size_t len)
+{
+    return lmdbfast_get (txn, dbi, key, len + 1);
+}
+
+// As lmdbdbi_put
+inline static int
+lmdbfast_put (MDB_txn *txn, MDB_dbi dbi,
+              const void *key, size_t key_size,
+              const void *val, size_t val_size)
+{
+    MDB_val mkey = { .mv_size = key_size, .mv_data = (void *) key };
+    MDB_val mval = { .mv_size = val_size, .mv_data = (void *) val };
+    return mdb_put (txn, dbi, &mkey, &mval, 0) ? -1 : 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Cursor steps
+
+// Move a cursor from lmdbcur_handle() on to the next pair, and fill in
+// its key and value.
+// Returns 0 on success, -1 at the end.
+inline static int
+lmdbfast_next (MDB_cursor *cur, MDB_val *key, MDB_val *val)
+{
+    return mdb_cursor_get (cur, key, val, MDB_NEXT) ? -1 : 0;
+}
+
+
+#endif
@@ -75,23 +75,43 @@ lmdbspan_asstr (lmdbspan self)
 // Reinterpret the pointed-to data as a double, and return a copy.
 // The caller must ensure the pointed-to data allows a valid conversion
 // (though we have an assert that the size is right, depending on compile flags).
+// Values in packed blocks and compressed dbis aren't aligned, so this copies.
 inline static double
 lmdbspan_asdouble (lmdbspan self)
 {
     assert (self.data);
     assert (self.size == sizeof (double));
-    return *((const double *) self.data);
+    double value;
+    memcpy (&value, self.data, sizeof (value));
+    return value;
 }
 
 // Reinterpret the pointed-to data as a uint32_t, and return a copy.
 // The caller must ensure the pointed-to data allows a valid conversion
 // (though we have an assert that the size is right, depending on compile flags).
+// Copies rather than casts, for the same reason as lmdbspan_asdouble.
 inline static uint32_t
 lmdbspan_asui32 (lmdbspan self)
 {
     assert (self.data);
     assert (self.size == sizeof (uint32_t));
-    return *((uint32_t *) self.data);
+    uint32_t value;
+    memcpy (&value, self.data, sizeof (value));
+    return value;
+}
+
+// Reinterpret the pointed-to data as a uint64_t, and return a copy.
+// The caller must ensure the pointed-to data allows a valid conversion
+// (though we have an assert that the size is right, depending on compile flags).
+// LMDB only aligns keys to 2 bytes, so this copies rather than casts.
+inline static uint64_t
+lmdbspan_asui64 (lmdbspan self)
+{
+    assert (self.data);
+    assert (self.size == sizeof (uint64_t));
+    uint64_t value;
+    memcpy (&value, self.data, sizeof (value));
+    return value;
 }
 
 
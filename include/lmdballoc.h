@@ -0,0 +1,93 @@
+/*  =========================================================================
+    lmdballoc - The allocator the library's objects and buffers come from, which can be replaced
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+#ifndef LMDBALLOC_H_INCLUDED
+#define LMDBALLOC_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @warning THE FOLLOWING @INTERFACE BLOCK IS AUTO-GENERATED BY ZPROJECT
+//  @warning Please edit the model at "api/lmdballoc.xml" to make changes.
+//  @interface
+//  This API is a draft, and may change without notice.
+#ifdef CLASSLMDB_BUILD_DRAFT_API
+//  Return size bytes, max-aligned, or NULL if out of memory.
+typedef void * (lmdballoc_malloc_fn) (
+    size_t size, void *ctx);
+
+//  Resize ptr, which the malloc or realloc fn returned or is NULL, to
+//  size bytes, as realloc does. Return NULL, leaving ptr alone, if out of
+//  memory.
+typedef void * (lmdballoc_realloc_fn) (
+    void *ptr, size_t size, void *ctx);
+
+//  Free ptr, which the malloc or realloc fn returned and isn't NULL.
+typedef void (lmdballoc_free_fn) (
+    void *ptr, void *ctx);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Have every later allocation by the library's objects, and the buffers
+//  they own, go through these, each passed ctx. Pass all NULL to go back
+//  to the C library's. Call it before creating any object, or once
+//  they're all destroyed, and not while other threads use the library:
+//  memory must be freed by the allocator it came from. Arrow exports keep
+//  the free hook they were made with, so can be released after it
+//  changes. The hooks are called from any thread using the library, and
+//  from memtable flushers, sweepers and async workers, so must be safe
+//  for that.
+CLASSLMDB_EXPORT void
+    lmdballoc_set (lmdballoc_malloc_fn malloc_fn, lmdballoc_realloc_fn realloc_fn, lmdballoc_free_fn free_fn, void *ctx);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Allocate size bytes, uninitialised, from the current allocator.
+//  Returns NULL if out of memory.
+CLASSLMDB_EXPORT void *
+    lmdballoc_malloc (size_t size);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Allocate size bytes, zeroed, from the current allocator.
+//  Returns NULL if out of memory.
+CLASSLMDB_EXPORT void *
+    lmdballoc_zmalloc (size_t size);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Resize ptr, from this allocator or NULL, to size bytes, as realloc
+//  does. Returns NULL, leaving ptr allocated, if out of memory.
+CLASSLMDB_EXPORT void *
+    lmdballoc_realloc (void *ptr, size_t size);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Copy string into memory from the current allocator, to be freed with
+//  free here. Returns NULL if out of memory.
+//  Caller owns return value and must destroy it when done.
+CLASSLMDB_EXPORT char *
+    lmdballoc_strdup (const char *string);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Free ptr, from this allocator; does nothing if ptr is NULL.
+CLASSLMDB_EXPORT void
+    lmdballoc_free (void *ptr);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Self test of this class.
+CLASSLMDB_EXPORT void
+    lmdballoc_test (bool verbose);
+
+#endif // CLASSLMDB_BUILD_DRAFT_API
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
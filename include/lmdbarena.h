@@ -0,0 +1,83 @@
+/*  =========================================================================
+    lmdbarena - Bump allocator for copies of spans that must outlive their txn
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+#ifndef LMDBARENA_H_INCLUDED
+#define LMDBARENA_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @warning THE FOLLOWING @INTERFACE BLOCK IS AUTO-GENERATED BY ZPROJECT
+//  @warning Please edit the model at "api/lmdbarena.xml" to make changes.
+//  @interface
+//  This API is a draft, and may change without notice.
+#ifdef CLASSLMDB_BUILD_DRAFT_API
+//  *** Draft method, for development use, may change without warning ***
+//  Create an empty arena, which takes memory from the heap chunk_size
+//  bytes at a time (0 for 64KB).
+CLASSLMDB_EXPORT lmdbarena_t *
+    lmdbarena_new (size_t chunk_size);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Free the arena and everything allocated from it.
+CLASSLMDB_EXPORT void
+    lmdbarena_destroy (lmdbarena_t **self_p);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Return size bytes, max-aligned, valid until the arena is reset or
+//  destroyed. There's no freeing them one by one.
+//  Returns NULL if out of memory.
+CLASSLMDB_EXPORT void *
+    lmdbarena_alloc (lmdbarena_t *self, size_t size);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Copy the data a span points at into the arena, and return a span over
+//  the copy, which outlives the txn the span came from. Nullish spans
+//  are returned as they are.
+//  Returns a nullish span if out of memory.
+CLASSLMDB_EXPORT lmdbspan
+    lmdbarena_copy (lmdbarena_t *self, lmdbspan span);
+
+//  *** Draft method, for development use, may change without warning ***
+//  As copy, but for count spans at once, replacing each in the array with
+//  a span over its copy, using one allocation for them all. Nullish spans
+//  are left as they are.
+//  Returns 0 on success, -1 if out of memory, leaving the spans as they
+//  were.
+CLASSLMDB_EXPORT int
+    lmdbarena_copy_spans (lmdbarena_t *self, lmdbspan *spans, size_t count);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Release everything allocated, keeping one chunk to allocate from
+//  again, so an arena reset per request seldom goes to the heap at all.
+CLASSLMDB_EXPORT void
+    lmdbarena_reset (lmdbarena_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Bytes allocated since the arena was created or last reset, including
+//  alignment padding.
+CLASSLMDB_EXPORT size_t
+    lmdbarena_size (lmdbarena_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Self test of this class.
+CLASSLMDB_EXPORT void
+    lmdbarena_test (bool verbose);
+
+#endif // CLASSLMDB_BUILD_DRAFT_API
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
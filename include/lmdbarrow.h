@@ -0,0 +1,99 @@
+/*  =========================================================================
+    lmdbarrow - Exports records from a cursor as Apache Arrow arrays, through the Arrow C Data Interface
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+#ifndef LMDBARROW_H_INCLUDED
+#define LMDBARROW_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  The Arrow C Data Interface, as the Arrow project publishes it for
+//  producers and consumers to copy; the guard lets it coexist with the
+//  Arrow headers, or another library's copy.
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema {
+    const char *format;
+    const char *name;
+    const char *metadata;
+    int64_t flags;
+    int64_t n_children;
+    struct ArrowSchema **children;
+    struct ArrowSchema *dictionary;
+    void (*release) (struct ArrowSchema *);
+    void *private_data;
+};
+
+struct ArrowArray {
+    int64_t length;
+    int64_t null_count;
+    int64_t offset;
+    int64_t n_buffers;
+    int64_t n_children;
+    const void **buffers;
+    struct ArrowArray **children;
+    struct ArrowArray *dictionary;
+    void (*release) (struct ArrowArray *);
+    void *private_data;
+};
+
+#endif // ARROW_C_DATA_INTERFACE
+
+//  @warning THE FOLLOWING @INTERFACE BLOCK IS AUTO-GENERATED BY ZPROJECT
+//  @warning Please edit the model at "api/lmdbarrow.xml" to make changes.
+//  @interface
+//  This API is a draft, and may change without notice.
+#ifdef CLASSLMDB_BUILD_DRAFT_API
+#define LMDBARROW_NONE 0                    // leave the column out
+#define LMDBARROW_BINARY 1                  // binary ("z"): 32 bit offsets into a copy
+#define LMDBARROW_LARGE_BINARY 2            // large binary ("Z"): 64 bit offsets into a copy
+#define LMDBARROW_FIXED 3                   // fixed size binary ("w:N"): a copy, every item width bytes
+#define LMDBARROW_VIEW 4                    // binary view ("vz"): points into the map where it can
+
+//  *** Draft method, for development use, may change without warning ***
+//  Fill schema and array with up to max_rows records, starting with the
+//  cursor's current one, as a struct array ("+s") with a "key" child
+//  laid out as key_layout says and a "val" child as val_layout says;
+//  either may be left out. The cursor is left on the first record not
+//  exported, so calling again carries on; the array is empty at the end.
+//  With the fixed layout every item must be width bytes, and the export
+//  stops at the first record that isn't. Binary columns stop before their
+//  data would pass 2GB. If the cursor's current record can't be exported
+//  at all, that's a failure, not the end, and the cursor stays on it.
+//  The view layout copies nothing that's in the map (or short enough to
+//  sit in the view itself): its views point straight into the map, so the
+//  array is only valid until the txn ends or is reset; release it, or stop
+//  reading it, before then. Other layouts copy, so outlive the txn.
+//  On success the caller owns both, and must call their release
+//  callbacks, as the interface requires.
+//  Returns 0 on success, -1 on failure, leaving schema and array untouched.
+CLASSLMDB_EXPORT int
+    lmdbarrow_export (lmdbcur_t *cur, size_t max_rows, int key_layout, size_t key_width, int val_layout, size_t val_width, struct ArrowSchema *schema, struct ArrowArray *array);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Self test of this class.
+CLASSLMDB_EXPORT void
+    lmdbarrow_test (bool verbose);
+
+#endif // CLASSLMDB_BUILD_DRAFT_API
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
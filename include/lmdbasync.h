@@ -0,0 +1,96 @@
+/*  =========================================================================
+    lmdbasync - Runs reads on a pool of worker threads, for callers that mustn't block
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+#ifndef LMDBASYNC_H_INCLUDED
+#define LMDBASYNC_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @warning THE FOLLOWING @INTERFACE BLOCK IS AUTO-GENERATED BY ZPROJECT
+//  @warning Please edit the model at "api/lmdbasync.xml" to make changes.
+//  @interface
+//  This API is a draft, and may change without notice.
+#ifdef CLASSLMDB_BUILD_DRAFT_API
+//  Called from dispatch with a result. A get's is called once, with the
+//  key and its value, which is nullish if the key is missing. A scan's is
+//  called once per record, then once with a nullish key to mark the end.
+//  The spans are only valid during the call.
+typedef void (lmdbasync_fn) (
+    lmdbspan key, lmdbspan val, void *arg);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Start threads workers, each with its own read txn on env, which it
+//  resets between requests; so the env needs that many reader slots free.
+//  Submit requests and dispatch results from one thread, e.g. an event
+//  loop's; only the workers ever wait on the disk.
+//  Returns NULL on failure.
+CLASSLMDB_EXPORT lmdbasync_t *
+    lmdbasync_new (lmdbenv_t *env, size_t threads);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Stop the workers, waiting for the requests they're running. Requests
+//  not yet dispatched are dropped without calling back. Destroy this
+//  before the env, or any dbis it has requests on.
+CLASSLMDB_EXPORT void
+    lmdbasync_destroy (lmdbasync_t **self_p);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Look key up in dbi on a worker, and call done with the value from
+//  dispatch. Each request sees the latest committed data when a worker
+//  takes it, so two requests may see different snapshots.
+//  Returns 0 on success, -1 on failure.
+CLASSLMDB_EXPORT int
+    lmdbasync_get (lmdbasync_t *self, lmdbdbi_t *dbi, const void *key, size_t key_size, lmdbasync_fn done, void *arg);
+
+//  *** Draft method, for development use, may change without warning ***
+//  As get, but read up to max_records records in key order, starting at
+//  the first key at or after from (or the first key, if from is NULL),
+//  all from the same snapshot.
+//  Returns 0 on success, -1 on failure.
+CLASSLMDB_EXPORT int
+    lmdbasync_scan (lmdbasync_t *self, lmdbdbi_t *dbi, const void *from, size_t from_size, size_t max_records, lmdbasync_fn done, void *arg);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Call back for every request that's finished, on this thread. Waits up
+//  to timeout_msecs (-1 for ever) for the first, if none have finished
+//  and some are pending; event loops pass 0.
+//  Returns the number of requests called back for.
+CLASSLMDB_EXPORT size_t
+    lmdbasync_dispatch (lmdbasync_t *self, int timeout_msecs);
+
+//  *** Draft method, for development use, may change without warning ***
+//  The socket results arrive on. Poll it, or its zsock_fd() from another
+//  kind of event loop, and dispatch when it's readable. As ZeroMQ's fds
+//  are edge triggered, dispatch with a timeout of 0 drains everything
+//  that's ready, so call it each time the fd fires.
+CLASSLMDB_EXPORT zsock_t *
+    lmdbasync_sock (lmdbasync_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Number of requests submitted and not yet called back for.
+CLASSLMDB_EXPORT size_t
+    lmdbasync_pending (lmdbasync_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Self test of this class.
+CLASSLMDB_EXPORT void
+    lmdbasync_test (bool verbose);
+
+#endif // CLASSLMDB_BUILD_DRAFT_API
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
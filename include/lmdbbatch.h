@@ -0,0 +1,130 @@
+/*  =========================================================================
+    lmdbbatch - Puts, dels and merges across DBs, kept in one flat buffer and applied in one write txn
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+#ifndef LMDBBATCH_H_INCLUDED
+#define LMDBBATCH_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @warning THE FOLLOWING @INTERFACE BLOCK IS AUTO-GENERATED BY ZPROJECT
+//  @warning Please edit the model at "api/lmdbbatch.xml" to make changes.
+//  @interface
+//  This API is a draft, and may change without notice.
+#ifdef CLASSLMDB_BUILD_DRAFT_API
+#define LMDBBATCH_PUT 1                     // put val under key
+#define LMDBBATCH_DEL 2                     // delete key
+#define LMDBBATCH_MERGE 3                   // merge val into key with the header's merge op
+#define LMDBBATCH_HEADER_SIZE 16            // bytes before each op's key and val
+
+//  *** Draft method, for development use, may change without warning ***
+//  Create an empty batch.
+CLASSLMDB_EXPORT lmdbbatch_t *
+    lmdbbatch_new (void);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Create a batch holding a copy of size bytes of ops, built elsewhere,
+//  perhaps by another language, in the format data returns. Each op is a
+//  16 byte header then its key then its val, with no padding: the type
+//  (1 byte), 0 (1 byte), the DB's slot (2 bytes), the merge op (4 bytes,
+//  signed), the key size and the val size (4 bytes each), all in the
+//  host's byte order. Add the DBs the slots refer to before applying.
+//  Returns NULL if the ops are malformed.
+CLASSLMDB_EXPORT lmdbbatch_t *
+    lmdbbatch_new_from (const void *data, size_t size);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Destroy the lmdbbatch.
+CLASSLMDB_EXPORT void
+    lmdbbatch_destroy (lmdbbatch_t **self_p);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Give dbi the next slot, counting from 0, for ops to refer to it by.
+//  The dbi must outlive the batch's applies.
+//  Returns the slot, or -1 if there are 65536 already.
+CLASSLMDB_EXPORT int
+    lmdbbatch_add_dbi (lmdbbatch_t *self, lmdbdbi_t *dbi);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Add a put of val under key, to the DB in slot.
+//  Returns 0 on success, -1 if key or val is over 4GB.
+CLASSLMDB_EXPORT int
+    lmdbbatch_put (lmdbbatch_t *self, int slot, const void *key, size_t key_size, const void *val, size_t val_size);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Add a del of key, from the DB in slot.
+//  Returns 0 on success, -1 if key is over 4GB.
+CLASSLMDB_EXPORT int
+    lmdbbatch_del (lmdbbatch_t *self, int slot, const void *key, size_t key_size);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Add a merge of operand into key, in the DB in slot, with merge op op,
+//  as lmdbdbi_merge does.
+//  Returns 0 on success, -1 if key or operand is over 4GB.
+CLASSLMDB_EXPORT int
+    lmdbbatch_merge (lmdbbatch_t *self, int slot, const void *key, size_t key_size, int op, const void *operand, size_t operand_size);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Drop every op, keeping the DBs' slots, to fill the batch again.
+CLASSLMDB_EXPORT void
+    lmdbbatch_reset (lmdbbatch_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Apply every op in one write txn of its own, so readers see all of them
+//  or none. Ops are applied in order of DB then key, for locality, with
+//  ops on the same key kept in the order they were added. An op that is
+//  refused cleanly, as a del of a missing key or a refused merge is, is
+//  marked failed and the rest carry on; an op that fails any other way
+//  may be half applied, so the txn is aborted. Don't have a write txn
+//  open on env.
+//  Returns how many ops were refused, or -1 if none were applied: the
+//  batch is malformed, an op's slot has no DB, an op failed other than
+//  cleanly, or the txn failed.
+CLASSLMDB_EXPORT int
+    lmdbbatch_apply (lmdbbatch_t *self, lmdbenv_t *env);
+
+//  *** Draft method, for development use, may change without warning ***
+//  After apply, whether the index'th op, counting from 0 in the order
+//  they were added, succeeded.
+//  Returns 0 if it did, -1 if it failed, wasn't applied, or index is out
+//  of range.
+CLASSLMDB_EXPORT int
+    lmdbbatch_status (lmdbbatch_t *self, size_t index);
+
+//  *** Draft method, for development use, may change without warning ***
+//  The ops, in the format new from takes, for sending or saving.
+CLASSLMDB_EXPORT const void *
+    lmdbbatch_data (lmdbbatch_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Size of the ops, in bytes.
+CLASSLMDB_EXPORT size_t
+    lmdbbatch_size (lmdbbatch_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Number of ops.
+CLASSLMDB_EXPORT size_t
+    lmdbbatch_count (lmdbbatch_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Self test of this class.
+CLASSLMDB_EXPORT void
+    lmdbbatch_test (bool verbose);
+
+#endif // CLASSLMDB_BUILD_DRAFT_API
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,97 @@
+/*  =========================================================================
+    lmdbblob - Large values stored as chunks, written and read as streams
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+#ifndef LMDBBLOB_H_INCLUDED
+#define LMDBBLOB_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @warning THE FOLLOWING @INTERFACE BLOCK IS AUTO-GENERATED BY ZPROJECT
+//  @warning Please edit the model at "api/lmdbblob.xml" to make changes.
+//  @interface
+//  This API is a draft, and may change without notice.
+#ifdef CLASSLMDB_BUILD_DRAFT_API
+//  *** Draft method, for development use, may change without warning ***
+//  Start writing a blob under key, in write txn, replacing any there.
+//  The blob is stored as chunks of chunk_size bytes (0 for a size that
+//  fills 16 pages), and is missing until the writer is finished. Keep
+//  dbi for blobs; it must be plain (see lmdbdbi_plain), without intkeys.
+//  Returns NULL on failure.
+CLASSLMDB_EXPORT lmdbblob_t *
+    lmdbblob_new_writer (lmdbdbi_t *dbi, lmdbtxn_t *txn, const void *key, size_t key_size, size_t chunk_size);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Open the blob under key for reading through txn.
+//  Returns NULL if there's no finished blob there.
+CLASSLMDB_EXPORT lmdbblob_t *
+    lmdbblob_new_reader (lmdbdbi_t *dbi, lmdbtxn_t *txn, const void *key, size_t key_size);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Destroy the lmdbblob. Destroying a writer before finishing it leaves
+//  chunks behind, so abort the txn in that case.
+CLASSLMDB_EXPORT void
+    lmdbblob_destroy (lmdbblob_t **self_p);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Append size bytes to a writer's blob. Only one chunk is held in
+//  memory; each one filled is put straight away.
+//  Returns 0 on success, -1 on failure or if finished.
+CLASSLMDB_EXPORT int
+    lmdbblob_write (lmdbblob_t *self, const void *data, size_t size);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Put the last chunk and the blob's header, after which readers see it.
+//  Returns 0 on success, -1 on failure or if already finished.
+CLASSLMDB_EXPORT int
+    lmdbblob_finish (lmdbblob_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  A span from offset in a reader's blob to the end of the chunk holding
+//  it, pointing into the map, so valid as a get's would be. Call again at
+//  offset plus its size to stream the blob without copying.
+//  Returns nullish lmdbspan at or past the end, or if the blob is damaged.
+CLASSLMDB_EXPORT lmdbspan
+    lmdbblob_chunk (lmdbblob_t *self, uint64_t offset);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Copy up to size bytes of a reader's blob, from offset, into buf,
+//  reading only the chunks that range covers.
+//  Returns the number of bytes copied, less than size only at the end of
+//  the blob, or if it's damaged.
+CLASSLMDB_EXPORT size_t
+    lmdbblob_read (lmdbblob_t *self, uint64_t offset, void *buf, size_t size);
+
+//  *** Draft method, for development use, may change without warning ***
+//  A reader's blob size, or how much a writer has written.
+CLASSLMDB_EXPORT uint64_t
+    lmdbblob_size (lmdbblob_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Delete the blob under key, chunks and all.
+//  Returns 0 on success, -1 if there's no blob there or on failure.
+CLASSLMDB_EXPORT int
+    lmdbblob_del (lmdbdbi_t *dbi, lmdbtxn_t *txn, const void *key, size_t key_size);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Self test of this class.
+CLASSLMDB_EXPORT void
+    lmdbblob_test (bool verbose);
+
+#endif // CLASSLMDB_BUILD_DRAFT_API
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -21,6 +21,10 @@ extern "C" {
 //  @interface
 //  This API is a draft, and may change without notice.
 #ifdef CLASSLMDB_BUILD_DRAFT_API
+#define LMDBCUR_COLUMN_COPY 0               // copy as stored, size bytes each
+#define LMDBCUR_COLUMN_U32_U64 1            // uint32_t widened to uint64_t
+#define LMDBCUR_COLUMN_I32_I64 2            // int32_t widened to int64_t
+#define LMDBCUR_COLUMN_F32_F64 3            // float widened to double
 //  *** Draft method, for development use, may change without warning ***
 //  Creates a cursor that traverses all k/v pairs in the DB in ascending order.
 //  Returns NULL on any error.
@@ -46,6 +50,17 @@ CLASSLMDB_EXPORT lmdbcur_t *
 CLASSLMDB_EXPORT lmdbcur_t *
     lmdbcur_new_gekey (lmdbdbi_t *dbi, lmdbtxn_t *txn, const void *key, size_t key_size);
 
+//  *** Draft method, for development use, may change without warning ***
+//  As _fromkey ctr, but takes a uint64_t as key.
+CLASSLMDB_EXPORT lmdbcur_t *
+    lmdbcur_new_fromkey_ui64 (lmdbdbi_t *dbi, lmdbtxn_t *txn, uint64_t key);
+
+//  *** Draft method, for development use, may change without warning ***
+//  As _gekey ctr, but takes a uint64_t as key. For an intkeys dbi with 64
+//  bit keys this seeks numerically, so is how to start a range scan.
+CLASSLMDB_EXPORT lmdbcur_t *
+    lmdbcur_new_gekey_ui64 (lmdbdbi_t *dbi, lmdbtxn_t *txn, uint64_t key);
+
 //  *** Draft method, for development use, may change without warning ***
 //  Destroy the lmdbcur.
 CLASSLMDB_EXPORT void
@@ -70,14 +85,33 @@ CLASSLMDB_EXPORT bool
 //  You need this when you call _next() and don't know what's there.
 //  Returns nullish lmdbspan on error (!lmdspan_valid (s)), which isn't a real
 //  value that can be returned from the DB.
+//  For packed dbis the key is reassembled inside the cursor, so the span is
+//  only valid until the cursor next moves.
 CLASSLMDB_EXPORT lmdbspan
     lmdbcur_key (lmdbcur_t *self);
 
 //  *** Draft method, for development use, may change without warning ***
 //  Like key(), but returns the value the cursor is curently pointing to.
+//  Values of compressed dbis are decoded into a buffer the cursor owns,
+//  so are only valid until it next moves.
 CLASSLMDB_EXPORT lmdbspan
     lmdbcur_val (lmdbcur_t *self);
 
+//  *** Draft method, for development use, may change without warning ***
+//  Copy up to max_rows records, starting with the current one, into
+//  column arrays: the keys one after another in keys, and the values in
+//  vals, converting each as key_type and val_type say. The cursor is left
+//  on the first record not copied, so calling again carries on.
+//  Every key must be key_size bytes and every value val_size bytes, as in
+//  an intkeys dbi with fixed size values; copying stops early, leaving the
+//  cursor on it, at the first record that isn't. Pass NULL for keys or
+//  vals to skip that column; its size is still checked.
+//  Columns are written with memcpy, so any alignment works, but aligning
+//  them suits vectorised code reading them after.
+//  Returns the number of records copied, 0 at the end.
+CLASSLMDB_EXPORT size_t
+    lmdbcur_columns (lmdbcur_t *self, size_t max_rows, void *keys, size_t key_size, int key_type, void *vals, size_t val_size, int val_type);
+
 //  *** Draft method, for development use, may change without warning ***
 //  Return a pointer to the underlying MDB_cur we're managing.
 //  BEWARE: this is an escape hatch for people that *really* need it; if you
@@ -21,6 +21,37 @@ extern "C" {
 //  @interface
 //  This API is a draft, and may change without notice.
 #ifdef CLASSLMDB_BUILD_DRAFT_API
+#define LMDBDBI_MERGE_ADD_I64 1             // old + operand, as int64_t
+#define LMDBDBI_MERGE_ADD_U64 2             // old + operand, as uint64_t
+#define LMDBDBI_MERGE_ADD_DOUBLE 3          // old + operand, as double
+#define LMDBDBI_MERGE_MAX_I64 4             // larger of old and operand, as int64_t
+#define LMDBDBI_MERGE_MIN_I64 5             // smaller of old and operand, as int64_t
+#define LMDBDBI_MERGE_MAX_U64 6             // larger of old and operand, as uint64_t
+#define LMDBDBI_MERGE_MIN_U64 7             // smaller of old and operand, as uint64_t
+#define LMDBDBI_MERGE_MAX_DOUBLE 8          // larger of old and operand, as double
+#define LMDBDBI_MERGE_MIN_DOUBLE 9          // smaller of old and operand, as double
+#define LMDBDBI_MERGE_APPEND 10             // old followed by operand
+#define LMDBDBI_MERGE_OR 11                 // bytewise or, zero extending the shorter
+#define LMDBDBI_MERGE_USER 64               // first id add merge op hands out
+
+//  A user merge operator. Given the old value (NULL if the key is absent)
+//  and the operand, return the size of the merged value, writing it to
+//  out only if it's at most out_size bytes. Return SIZE_MAX to refuse
+//  the merge. It's called twice per merge, first with out_size 0 to size
+//  the result, so must give the same answer both times.
+typedef size_t (lmdbdbi_merge_fn) (
+    const void *old_val, size_t old_size, const void *operand, size_t operand_size, void *out, size_t out_size, void *arg);
+
+//  Called by foreach range for each record, with spans valid as a
+//  cursor's would be. Return 0 to carry on, or a positive value to stop.
+typedef int (lmdbdbi_visit_fn) (
+    const void *key, size_t key_size, const void *val, size_t val_size, void *arg);
+
+//  Called by foreach range filtered with each key, before its value is
+//  read. Return true to visit the record, false to skip it.
+typedef bool (lmdbdbi_filter_fn) (
+    const void *key, size_t key_size, void *arg);
+
 //  *** Draft method, for development use, may change without warning ***
 //  Create a named database interface object, using the provided lmdbenv.
 //  Note that a database is not a file, but a key/val collection inside one.
@@ -38,6 +69,32 @@ CLASSLMDB_EXPORT lmdbdbi_t *
 CLASSLMDB_EXPORT lmdbdbi_t *
     lmdbdbi_new_intkeys (lmdbenv_t *env, const char *name);
 
+//  *** Draft method, for development use, may change without warning ***
+//  As simple ctr, but stores runs of consecutive k/v pairs together in
+//  prefix-compressed blocks, one LMDB value per block. This cuts per-record
+//  overhead a lot for DBs holding many small records, at the cost of each
+//  put rewriting the block it lands in.
+//  Gets still return spans pointing into the map, but cursor keys point into
+//  the cursor and are only valid until it moves.
+//  Keys are compared byte by byte; values must be at most 16KB, and have
+//  no alignment guarantees at all.
+//  Always reopen a packed DB with this ctr.
+CLASSLMDB_EXPORT lmdbdbi_t *
+    lmdbdbi_new_packed (lmdbenv_t *env, const char *name);
+
+//  *** Draft method, for development use, may change without warning ***
+//  As simple ctr, but compresses values of threshold bytes or more with
+//  zstd, storing smaller ones (and any that don't shrink) as they are.
+//  Gets of compressed values return spans over a copy that's valid until
+//  the txn closes; use get into to decode straight into your own buffer.
+//  Trained dictionaries live in a second DB, named after this one with
+//  ".zdict" appended, so name must not be NULL, and the env needs room for
+//  both.
+//  Returns NULL if the library was built without zstd.
+//  Always reopen a compressed DB with this ctr.
+CLASSLMDB_EXPORT lmdbdbi_t *
+    lmdbdbi_new_compressed (lmdbenv_t *env, const char *name, size_t threshold);
+
 //  *** Draft method, for development use, may change without warning ***
 //  Aborts the transaction if not already committed.
 CLASSLMDB_EXPORT void
@@ -50,12 +107,27 @@ CLASSLMDB_EXPORT void
 CLASSLMDB_EXPORT lmdbspan
     lmdbdbi_get (lmdbdbi_t *self, lmdbtxn_t *txn, const void *key, size_t key_size);
 
+//  *** Draft method, for development use, may change without warning ***
+//  As get method, but copies the value into buf, decoding it there if the
+//  DB is compressed, and returns a span over buf.
+//  Returns nullish lmdbspan if the key doesn't exist, or if the value won't
+//  fit in buf_size bytes.
+CLASSLMDB_EXPORT lmdbspan
+    lmdbdbi_get_into (lmdbdbi_t *self, lmdbtxn_t *txn, const void *key, size_t key_size, void *buf, size_t buf_size);
+
 //  *** Draft method, for development use, may change without warning ***
 //  As get method, but takes a string as key.
 //  NB counts the terminating NULL as part of the string.
 CLASSLMDB_EXPORT lmdbspan
     lmdbdbi_get_str (lmdbdbi_t *self, lmdbtxn_t *txn, const char *key);
 
+//  *** Draft method, for development use, may change without warning ***
+//  As get str method, but takes the string's length, saving a strlen in hot
+//  loops. len doesn't count the terminating NULL, which must be at key[len]
+//  and is still part of the key.
+CLASSLMDB_EXPORT lmdbspan
+    lmdbdbi_get_strn (lmdbdbi_t *self, lmdbtxn_t *txn, const char *key, size_t len);
+
 //  *** Draft method, for development use, may change without warning ***
 //  As get method, but takes an uint32_t as key.
 CLASSLMDB_EXPORT lmdbspan
@@ -66,6 +138,12 @@ CLASSLMDB_EXPORT lmdbspan
 CLASSLMDB_EXPORT lmdbspan
     lmdbdbi_get_i32 (lmdbdbi_t *self, lmdbtxn_t *txn, int32_t key);
 
+//  *** Draft method, for development use, may change without warning ***
+//  As get method, but takes a uint64_t as key. In an intkeys dbi these
+//  are its size_t keys, so only valid where size_t is 64 bits.
+CLASSLMDB_EXPORT lmdbspan
+    lmdbdbi_get_ui64 (lmdbdbi_t *self, lmdbtxn_t *txn, uint64_t key);
+
 //  *** Draft method, for development use, may change without warning ***
 //  Put a key/val pair to the DB.
 //  Returns 0 on sucess, -1 on failure.
@@ -78,6 +156,11 @@ CLASSLMDB_EXPORT int
 CLASSLMDB_EXPORT int
     lmdbdbi_put_str (lmdbdbi_t *self, lmdbtxn_t *txn, const char *key, const void *value, size_t value_size);
 
+//  *** Draft method, for development use, may change without warning ***
+//  As put str method, but takes the string's length, as get strn method.
+CLASSLMDB_EXPORT int
+    lmdbdbi_put_strn (lmdbdbi_t *self, lmdbtxn_t *txn, const char *key, size_t len, const void *value, size_t value_size);
+
 //  *** Draft method, for development use, may change without warning ***
 //  As put method, but takes both key and val are strings.
 //  NB for both strings counts the terminating NULL as part of the string.
@@ -94,11 +177,260 @@ CLASSLMDB_EXPORT int
 CLASSLMDB_EXPORT int
     lmdbdbi_put_i32 (lmdbdbi_t *self, lmdbtxn_t *txn, int32_t key, const void *val, size_t val_size);
 
+//  *** Draft method, for development use, may change without warning ***
+//  As put method, but takes a uint64_t as key. In an intkeys dbi these
+//  are its size_t keys, so only valid where size_t is 64 bits.
+CLASSLMDB_EXPORT int
+    lmdbdbi_put_ui64 (lmdbdbi_t *self, lmdbtxn_t *txn, uint64_t key, const void *val, size_t val_size);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Delete a key and its value from the DB, and its entries from any
+//  indexes on it.
+//  Returns 0 on success, -1 if the key wasn't there or on failure.
+CLASSLMDB_EXPORT int
+    lmdbdbi_del (lmdbdbi_t *self, lmdbtxn_t *txn, const void *key, size_t key_size);
+
+//  *** Draft method, for development use, may change without warning ***
+//  As del method, but takes a string as the key.
+//  NB treats the terminating NULL as part of the string.
+CLASSLMDB_EXPORT int
+    lmdbdbi_del_str (lmdbdbi_t *self, lmdbtxn_t *txn, const char *key);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Combine operand with the value stored under key, using one of the
+//  LMDBDBI_MERGE_xxx operators or an op id from add merge op, and store
+//  the result; if the key is absent the operator sees a NULL old value.
+//  Saves a get and a put from the caller, and on plain DBs the result is
+//  written straight into the map.
+//  Returns 0 on success, -1 if the operator refused the values (e.g. an
+//  add to a value that isn't 8 bytes) or on failure.
+CLASSLMDB_EXPORT int
+    lmdbdbi_merge (lmdbdbi_t *self, lmdbtxn_t *txn, const void *key, size_t key_size, int op, const void *operand, size_t operand_size);
+
+//  *** Draft method, for development use, may change without warning ***
+//  As merge, applied to count keys in turn, all with the same operator.
+//  Keys and operands are packed end to end in two arrays, every key
+//  key_size bytes and every operand operand_size bytes; keys may repeat.
+//  Returns 0 on success, or -1 at the first failure, having applied the
+//  merges before it (abort the txn to undo them).
+CLASSLMDB_EXPORT int
+    lmdbdbi_merge_batch (lmdbdbi_t *self, lmdbtxn_t *txn, int op, const void *keys, size_t key_size, const void *operands, size_t operand_size, size_t count);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Register a user merge operator for this DB, which arg is passed to.
+//  Register them in the same order each time you open the DB, as the op
+//  ids are handed out in order.
+//  Returns the op id to pass to merge, or -1 if there are too many.
+CLASSLMDB_EXPORT int
+    lmdbdbi_add_merge_op (lmdbdbi_t *self, lmdbdbi_merge_fn fn, void *arg);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Compressed DBs only. Train a zstd dictionary of up to dict_size bytes on
+//  the values already stored, and compress all later puts with it. Values
+//  stored before keep using whatever they were compressed with.
+//  Like the ctrs this runs its own write txn, so don't have one open.
+//  Returns 0 on success, -1 on failure (e.g. too few values to train on).
+CLASSLMDB_EXPORT int
+    lmdbdbi_train_dict (lmdbdbi_t *self, lmdbenv_t *env, size_t dict_size);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Keep a membership filter for this DB's keys, so gets of keys that were
+//  never put can return without searching the DB. Misses then cost a hash
+//  and one cache line, bar about 1 in 100 that still search the DB. Keys
+//  that were stored are never filtered out.
+//  The filter is sized for expected_keys and stored in a second DB, named
+//  after this one with ".bloom" appended, which each write txn updates as
+//  it commits; so name must not be NULL, and the env needs room for both.
+//  The first time, it's built from the keys already there.
+//  Once enabled, enable it on every handle you open on the DB, in any
+//  process, before any puts through it, or it will miss their keys.
+//  Handles take in keys put through one another: each commit that stores
+//  the filter bumps its generation there, and a handle reloads it the
+//  first time a txn sees a newer generation than its own.
+//  Like the ctrs this runs its own write txn, so don't have one open.
+//  Returns 0 on success, -1 on failure.
+CLASSLMDB_EXPORT int
+    lmdbdbi_enable_filter (lmdbdbi_t *self, lmdbenv_t *env, size_t expected_keys);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Rebuild the filter from the keys currently in the DB, dropping ones
+//  that were put in txns that aborted, and resizing it for expected_keys,
+//  or keeping its size if that's 0. Do this if the false positive rate
+//  climbs (see below) as the DB grows past the size the filter was made for.
+//  Safe alongside gets and puts in other threads: the new filter is
+//  swapped in, and the old one freed once no get is using it, or when the
+//  DB is destroyed. Other handles on the DB reload it as above.
+//  Like the ctrs this runs its own write txn, so don't have one open.
+//  Returns 0 on success, -1 on failure.
+CLASSLMDB_EXPORT int
+    lmdbdbi_rebuild_filter (lmdbdbi_t *self, lmdbenv_t *env, size_t expected_keys);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Number of gets that consulted the filter.
+CLASSLMDB_EXPORT uint64_t
+    lmdbdbi_filter_checks (lmdbdbi_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Number of gets the filter answered without searching the DB.
+CLASSLMDB_EXPORT uint64_t
+    lmdbdbi_filter_skips (lmdbdbi_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Number of gets the filter let through that then found nothing. The
+//  filter's false positive rate is this / (skips + false positives).
+CLASSLMDB_EXPORT uint64_t
+    lmdbdbi_filter_false_positives (lmdbdbi_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Let keys expire: put ttl stores a key that gets then treat as missing
+//  once its time is up, and expire deletes such keys for good. Expiry times
+//  live in a second DB, named after this one with ".ttl" appended, in
+//  expiry order; so name must not be NULL, and the env needs room for both.
+//  Once enabled, enable it every time you open the DB, before any puts.
+//  Plain puts and dels then also clear any expiry the key had, which costs
+//  them a lookup in the ".ttl" DB. Cursors still see expired keys until
+//  they're deleted.
+//  Like the ctrs this runs its own write txn, so don't have one open.
+//  Returns 0 on success, -1 on failure.
+CLASSLMDB_EXPORT int
+    lmdbdbi_enable_ttl (lmdbdbi_t *self, lmdbenv_t *env);
+
+//  *** Draft method, for development use, may change without warning ***
+//  As put method, but the key expires ttl_msecs from now (by the wall
+//  clock). Putting the key again with put, or merging into it once it has
+//  expired, makes it permanent; merging into it before then keeps its expiry.
+//  Returns 0 on sucess, -1 on failure (e.g. a key over 502 bytes).
+CLASSLMDB_EXPORT int
+    lmdbdbi_put_ttl (lmdbdbi_t *self, lmdbtxn_t *txn, const void *key, size_t key_size, const void *val, size_t val_size, uint64_t ttl_msecs);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Delete up to max_keys keys whose time is up, soonest expired first, in
+//  one write txn of its own, so don't have one open. Call it often with a
+//  small max_keys to keep each txn short, or let an lmdbsweeper do it.
+//  Returns the number of keys deleted, or -1 on failure.
+CLASSLMDB_EXPORT int
+    lmdbdbi_expire (lmdbdbi_t *self, lmdbenv_t *env, size_t max_keys);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Record every put and del in a change log, in the same txn, so that an
+//  lmdbrepl publisher can stream the changes to replicas. The log lives in
+//  a second DB, named after this one with ".log" appended; so name must
+//  not be NULL, and the env needs room for both. It grows with every
+//  change until trimmed.
+//  Merges are logged as the puts they end in, and expiring keys as plain
+//  puts, so replicas keep them until the sweep's dels reach them.
+//  Once enabled, enable it every time you open the DB, before any puts.
+//  Like the ctrs this runs its own write txn, so don't have one open.
+//  Returns 0 on success, -1 on failure.
+CLASSLMDB_EXPORT int
+    lmdbdbi_enable_log (lmdbdbi_t *self, lmdbenv_t *env);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Sequence number of the newest change in the log, counting from 1, or
+//  0 if there are none yet (or no log).
+CLASSLMDB_EXPORT uint64_t
+    lmdbdbi_log_seq (lmdbdbi_t *self, lmdbtxn_t *txn);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Drop log entries older than before_seq, once every replica has them,
+//  though the newest entry is always kept. Replicas further behind can't
+//  catch up from the log any more.
+//  Like the ctrs this runs its own write txn, so don't have one open.
+//  Returns the number of entries dropped, or -1 on failure, which
+//  includes finding a key in the log that isn't a sequence number.
+CLASSLMDB_EXPORT int
+    lmdbdbi_trim_log (lmdbdbi_t *self, lmdbenv_t *env, uint64_t before_seq);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Number of k/v pairs in the DB, as of txn. Reads LMDB's own count, so
+//  takes the same time however big the DB is; packed DBs read each
+//  block's count instead, without decoding any.
+//  Returns 0 on failure.
+CLASSLMDB_EXPORT uint64_t
+    lmdbdbi_count (lmdbdbi_t *self, lmdbtxn_t *txn);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Number of k/v pairs with keys from lo up to but not including hi. Pass
+//  NULL for lo to count from the first key, and for hi to count to the
+//  last. Exact counts walk the range. Approximate ones walk its first 256
+//  keys, so short ranges are still exact, then estimate the rest from
+//  where hi falls between the DB's first and last keys, which is close
+//  for keys spread evenly, like sequence numbers or hashes. It goes by
+//  key values, not by rank, so skewed keys throw it off: a few keys far
+//  beyond the rest make any range among the rest look nearly empty.
+//  Returns 0 on failure.
+CLASSLMDB_EXPORT uint64_t
+    lmdbdbi_count_range (lmdbdbi_t *self, lmdbtxn_t *txn, const void *lo, size_t lo_size, const void *hi, size_t hi_size, bool approximate);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Fill keys with count keys picked at random, seeking to random points
+//  between the DB's first and last keys, so each costs one tree descent
+//  rather than a scan. Keys are picked evenly over the span of key
+//  values, not of keys: a key after a wide gap is picked more often. The
+//  same seed picks the same keys from the same data; 0 picks a default.
+//  Keys of packed DBs are copied into memory that lasts as long as txn;
+//  others point into the map.
+//  Returns how many keys were filled in, count unless the DB is empty.
+CLASSLMDB_EXPORT size_t
+    lmdbdbi_sample_keys (lmdbdbi_t *self, lmdbtxn_t *txn, size_t count, uint64_t seed, lmdbspan *keys);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Fill keys with up to parts - 1 keys splitting the DB into parts
+//  ranges, each key starting a range, found as sample keys does, at even
+//  steps between the first and last keys. The steps are even in key
+//  values, not by rank, so the ranges only hold similar numbers of keys
+//  where keys are spread evenly; where they're skewed, most can end up in
+//  one range. Keys are ascending with no repeats, so there are fewer
+//  where the DB is small or keys bunch up.
+//  Returns how many keys were filled in.
+CLASSLMDB_EXPORT size_t
+    lmdbdbi_split_points (lmdbdbi_t *self, lmdbtxn_t *txn, size_t parts, lmdbspan *keys);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Call visit with arg for each record with a key from lo up to but not
+//  including hi, in key order, driving the cursor in a loop of our own,
+//  so visiting a record costs one call rather than three. Pass NULL for
+//  lo to start at the first key, and for hi to go on to the last.
+//  Returns 0 once the range is visited, visit's return if it stopped
+//  early, or -1 on failure.
+CLASSLMDB_EXPORT int
+    lmdbdbi_foreach_range (lmdbdbi_t *self, lmdbtxn_t *txn, const void *lo, size_t lo_size, const void *hi, size_t hi_size, lmdbdbi_visit_fn visit, void *arg);
+
+//  *** Draft method, for development use, may change without warning ***
+//  As foreach range, but first calls filter with filter_arg on each key,
+//  and skips records it turns down without reading their values, so
+//  skipped overflow pages stay untouched and compressed values stay
+//  undecoded.
+CLASSLMDB_EXPORT int
+    lmdbdbi_foreach_range_filtered (lmdbdbi_t *self, lmdbtxn_t *txn, const void *lo, size_t lo_size, const void *hi, size_t hi_size, lmdbdbi_filter_fn filter, void *filter_arg, lmdbdbi_visit_fn visit, void *arg);
+
 //  *** Draft method, for development use, may change without warning ***
 //  Returns true iff the instance was created as an intkeys dbi.
 CLASSLMDB_EXPORT bool
     lmdbdbi_intkeys (lmdbdbi_t *self);
 
+//  *** Draft method, for development use, may change without warning ***
+//  Returns true iff the instance was created as a packed dbi.
+CLASSLMDB_EXPORT bool
+    lmdbdbi_packed (lmdbdbi_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Returns true iff the instance was created as a compressed dbi.
+CLASSLMDB_EXPORT bool
+    lmdbdbi_compressed (lmdbdbi_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Returns true iff the instance has a membership filter enabled.
+CLASSLMDB_EXPORT bool
+    lmdbdbi_filtered (lmdbdbi_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Returns true iff the instance stores values in LMDB as given, with no
+//  packing, compression, filter, TTLs, change log or indexes, so the
+//  lmdbfast inline functions can be used on its handle.
+CLASSLMDB_EXPORT bool
+    lmdbdbi_plain (lmdbdbi_t *self);
+
 //  *** Draft method, for development use, may change without warning ***
 //  Return a copy of the the underlying MDB_dbi.
 //  BEWARE: this is an escape hatch for people that *really* need it; if you
@@ -36,6 +36,18 @@ CLASSLMDB_EXPORT lmdbenv_t *
 CLASSLMDB_EXPORT lmdbenv_t *
     lmdbenv_new_withlimits (const char *path, size_t max_size, size_t max_dbs);
 
+//  *** Draft method, for development use, may change without warning ***
+//  As new_withlimits, but for programs whose threads share read txns, e.g.
+//  workers taking reset txns from a common pool. Opens with MDB_NOTLS, so
+//  a read txn's reader slot belongs to the txn rather than the thread
+//  that began it: one thread can hold several read txns, and a reset txn
+//  can be renewed, used and destroyed on any thread, one at a time.
+//  Every read txn open at once, reset or not, takes one of max_readers
+//  slots; 0 keeps LMDB's default of 126.
+//  Returns NULL on error.
+CLASSLMDB_EXPORT lmdbenv_t *
+    lmdbenv_new_threaded (const char *path, size_t max_size, size_t max_dbs, unsigned int max_readers);
+
 //  *** Draft method, for development use, may change without warning ***
 //  Destroy the lmdbenv.
 CLASSLMDB_EXPORT void
@@ -48,6 +60,26 @@ CLASSLMDB_EXPORT void
 CLASSLMDB_EXPORT MDB_env *
     lmdbenv_handle (lmdbenv_t *self);
 
+//  *** Draft method, for development use, may change without warning ***
+//  Was this opened with new_threaded?
+CLASSLMDB_EXPORT bool
+    lmdbenv_threaded (lmdbenv_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  How many read txns can be open on the file at once, across all
+//  threads and processes.
+CLASSLMDB_EXPORT unsigned int
+    lmdbenv_max_readers (lmdbenv_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Free the reader slots of processes that exited with read txns open,
+//  which otherwise stop old pages being reused until the file's closed
+//  by everyone. Cheap enough to call every so often from a long lived
+//  writer.
+//  Returns the number of slots freed, or -1 on error.
+CLASSLMDB_EXPORT int
+    lmdbenv_reader_check (lmdbenv_t *self);
+
 //  *** Draft method, for development use, may change without warning ***
 //  Self test of this class.
 CLASSLMDB_EXPORT void
@@ -0,0 +1,101 @@
+/*  =========================================================================
+    lmdbidx - Secondary index over an lmdbdbi, kept up to date by its puts and dels
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+#ifndef LMDBIDX_H_INCLUDED
+#define LMDBIDX_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @warning THE FOLLOWING @INTERFACE BLOCK IS AUTO-GENERATED BY ZPROJECT
+//  @warning Please edit the model at "api/lmdbidx.xml" to make changes.
+//  @interface
+//  This API is a draft, and may change without notice.
+#ifdef CLASSLMDB_BUILD_DRAFT_API
+//  Called with a primary record; calls lmdbidx_emit() once for each index
+//  key the record should be found under (or not at all, to leave it out).
+typedef void (lmdbidx_extract_fn) (
+    lmdbidx_t *self, const void *key, size_t key_size, const void *val, size_t val_size, void *arg);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Create a named index over the primary dbi. From now on every put or
+//  del on the primary also updates the index, in the same txn, using
+//  extract to get each record's index keys.
+//  The index is an LMDB DUPSORT database mapping index keys to primary
+//  keys, so primary keys must be at most 511 bytes.
+//  If the primary already holds records that aren't indexed yet (e.g. the
+//  first time you add an index), call rebuild once.
+//  Destroy the index before the primary.
+//  Returns NULL on failure.
+CLASSLMDB_EXPORT lmdbidx_t *
+    lmdbidx_new (lmdbenv_t *env, lmdbdbi_t *primary, const char *name, lmdbidx_extract_fn extract, void *arg);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Stops the primary maintaining this index.
+CLASSLMDB_EXPORT void
+    lmdbidx_destroy (lmdbidx_t **self_p);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Only call from an extractor: index the record under this key.
+CLASSLMDB_EXPORT void
+    lmdbidx_emit (lmdbidx_t *self, const void *ikey, size_t ikey_size);
+
+//  *** Draft method, for development use, may change without warning ***
+//  As emit, but takes a string as key.
+//  NB counts the terminating NULL as part of the string.
+CLASSLMDB_EXPORT void
+    lmdbidx_emit_str (lmdbidx_t *self, const char *ikey);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Fetch the primary value of the first record (in primary key order)
+//  indexed under ikey. Handy for unique indexes.
+//  Returns nullish lmdbspan if there is none.
+CLASSLMDB_EXPORT lmdbspan
+    lmdbidx_get (lmdbidx_t *self, lmdbtxn_t *txn, const void *ikey, size_t ikey_size);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Number of records indexed under ikey.
+CLASSLMDB_EXPORT size_t
+    lmdbidx_count (lmdbidx_t *self, lmdbtxn_t *txn, const void *ikey, size_t ikey_size);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Clear the index and re-index every record in the primary.
+//  Like the dbi ctrs this runs its own write txn, so don't have one open.
+//  Returns 0 on success, -1 on failure.
+CLASSLMDB_EXPORT int
+    lmdbidx_rebuild (lmdbidx_t *self, lmdbenv_t *env);
+
+//  *** Draft method, for development use, may change without warning ***
+//  The dbi this indexes.
+CLASSLMDB_EXPORT lmdbdbi_t *
+    lmdbidx_primary (lmdbidx_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Return a copy of the underlying DUPSORT MDB_dbi.
+//  BEWARE: this is an escape hatch for people that *really* need it; if you
+//  need more functionality then prefer to extend this library to contain it.
+CLASSLMDB_EXPORT MDB_dbi
+    lmdbidx_handle (lmdbidx_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Self test of this class.
+CLASSLMDB_EXPORT void
+    lmdbidx_test (bool verbose);
+
+#endif // CLASSLMDB_BUILD_DRAFT_API
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
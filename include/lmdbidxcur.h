@@ -0,0 +1,82 @@
+/*  =========================================================================
+    lmdbidxcur - Cursor over the primary records found through an lmdbidx
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+#ifndef LMDBIDXCUR_H_INCLUDED
+#define LMDBIDXCUR_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @warning THE FOLLOWING @INTERFACE BLOCK IS AUTO-GENERATED BY ZPROJECT
+//  @warning Please edit the model at "api/lmdbidxcur.xml" to make changes.
+//  @interface
+//  This API is a draft, and may change without notice.
+#ifdef CLASSLMDB_BUILD_DRAFT_API
+//  *** Draft method, for development use, may change without warning ***
+//  Creates a cursor over every record indexed under ikey, in primary key
+//  order. Check valid() straight away, as there may be none.
+//  Returns NULL on any error.
+CLASSLMDB_EXPORT lmdbidxcur_t *
+    lmdbidxcur_new_fromkey (lmdbidx_t *idx, lmdbtxn_t *txn, const void *ikey, size_t ikey_size);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Creates a cursor over every record indexed under a key in [lo, hi), in
+//  index key then primary key order. Pass NULL for hi to run to the end.
+//  Returns NULL on any error.
+CLASSLMDB_EXPORT lmdbidxcur_t *
+    lmdbidxcur_new_range (lmdbidx_t *idx, lmdbtxn_t *txn, const void *lo, size_t lo_size, const void *hi, size_t hi_size);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Destroy the lmdbidxcur.
+CLASSLMDB_EXPORT void
+    lmdbidxcur_destroy (lmdbidxcur_t **self_p);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Move to the next record.
+//  Returns 0 on success, or -1 if there are no more.
+CLASSLMDB_EXPORT int
+    lmdbidxcur_next (lmdbidxcur_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Is the cursor on a record?
+CLASSLMDB_EXPORT bool
+    lmdbidxcur_valid (lmdbidxcur_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  The index key the cursor is on, or nullish lmdbspan if it's run out.
+CLASSLMDB_EXPORT lmdbspan
+    lmdbidxcur_ikey (lmdbidxcur_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  The primary key of the record the cursor is on.
+CLASSLMDB_EXPORT lmdbspan
+    lmdbidxcur_key (lmdbidxcur_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  The primary value of the record the cursor is on, as lmdbdbi_get()
+//  would return it.
+CLASSLMDB_EXPORT lmdbspan
+    lmdbidxcur_val (lmdbidxcur_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Self test of this class.
+CLASSLMDB_EXPORT void
+    lmdbidxcur_test (bool verbose);
+
+#endif // CLASSLMDB_BUILD_DRAFT_API
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
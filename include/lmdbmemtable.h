@@ -0,0 +1,106 @@
+/*  =========================================================================
+    lmdbmemtable - Write-back table in memory in front of an lmdbdbi, for hot keys
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+#ifndef LMDBMEMTABLE_H_INCLUDED
+#define LMDBMEMTABLE_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @warning THE FOLLOWING @INTERFACE BLOCK IS AUTO-GENERATED BY ZPROJECT
+//  @warning Please edit the model at "api/lmdbmemtable.xml" to make changes.
+//  @interface
+//  This API is a draft, and may change without notice.
+#ifdef CLASSLMDB_BUILD_DRAFT_API
+//  *** Draft method, for development use, may change without warning ***
+//  Put a memtable in front of dbi. Writes through it are held in memory
+//  and written to dbi in one write txn when more than max_dirty_bytes of
+//  them are waiting, and, if max_age_msecs isn't 0, by a thread that
+//  flushes every max_age_msecs, which bounds how much a crash can lose.
+//  Written keys are kept to serve reads until the memtable takes more
+//  than max_bytes, when flushes drop them to get back under half that.
+//  All writes to dbi must go through the memtable while it exists, and
+//  it and the env must outlive it.
+//  Returns NULL if max_dirty_bytes is 0 or more than max_bytes.
+CLASSLMDB_EXPORT lmdbmemtable_t *
+    lmdbmemtable_new (lmdbenv_t *env, lmdbdbi_t *dbi, size_t max_bytes, size_t max_dirty_bytes, int max_age_msecs);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Stop the flushing thread, flush whatever's still waiting, and destroy
+//  the memtable.
+CLASSLMDB_EXPORT void
+    lmdbmemtable_destroy (lmdbmemtable_t **self_p);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Put a key/val pair, to be written to the dbi later.
+//  Writes may flush, so don't call them from a thread with a write txn
+//  open on the env.
+//  Returns 0 on success, -1 if a flush this caused failed; the put is
+//  kept for the next one.
+CLASSLMDB_EXPORT int
+    lmdbmemtable_put (lmdbmemtable_t *self, const void *key, size_t key_size, const void *val, size_t val_size);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Delete a key, to be deleted from the dbi later, if it's there then.
+//  Returns 0 on success, -1 if a flush this caused failed.
+CLASSLMDB_EXPORT int
+    lmdbmemtable_del (lmdbmemtable_t *self, const void *key, size_t key_size);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Get the value for key from the memtable, or failing that from the dbi
+//  through txn. Values from the memtable are copied into txn, so spans
+//  last as long as ones from the dbi do.
+//  Returns nullish lmdbspan if the key doesn't exist.
+CLASSLMDB_EXPORT lmdbspan
+    lmdbmemtable_get (lmdbmemtable_t *self, lmdbtxn_t *txn, const void *key, size_t key_size);
+
+//  *** Draft method, for development use, may change without warning ***
+//  As lmdbdbi_merge, but on the value in the memtable, reading it from the
+//  dbi through txn first if it isn't there. txn must be read-only: the
+//  merge may flush, which opens a write txn of its own.
+//  Returns 0 on success, -1 if txn is a write txn, if the operator
+//  refused the values, if a flush this caused failed, or if txn began
+//  before the memtable last dropped written keys; reset and renew it, and
+//  try again.
+CLASSLMDB_EXPORT int
+    lmdbmemtable_merge (lmdbmemtable_t *self, lmdbtxn_t *txn, const void *key, size_t key_size, int op, const void *operand, size_t operand_size);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Write everything waiting to the dbi, in one write txn, now.
+//  Returns 0 on success, -1 on failure, when it's all kept for the next
+//  flush.
+CLASSLMDB_EXPORT int
+    lmdbmemtable_flush (lmdbmemtable_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Number of keys waiting to be written.
+CLASSLMDB_EXPORT size_t
+    lmdbmemtable_dirty (lmdbmemtable_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Bytes of memory the memtable's keys and values take.
+CLASSLMDB_EXPORT size_t
+    lmdbmemtable_size (lmdbmemtable_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Self test of this class.
+CLASSLMDB_EXPORT void
+    lmdbmemtable_test (bool verbose);
+
+#endif // CLASSLMDB_BUILD_DRAFT_API
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,78 @@
+/*  =========================================================================
+    lmdbrepl - Streams an lmdbdbi's change log to replicas over ZeroMQ
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+#ifndef LMDBREPL_H_INCLUDED
+#define LMDBREPL_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @warning THE FOLLOWING @INTERFACE BLOCK IS AUTO-GENERATED BY ZPROJECT
+//  @warning Please edit the model at "api/lmdbrepl.xml" to make changes.
+//  @interface
+//  This API is a draft, and may change without notice.
+#ifdef CLASSLMDB_BUILD_DRAFT_API
+//  *** Draft method, for development use, may change without warning ***
+//  Serve the change log of dbi, which must have its log enabled, to any
+//  subscribers that connect to endpoint (any ZeroMQ endpoint we can
+//  bind, e.g. "tcp://127.0.0.1:5670", "ipc://..." or "inproc://...").
+//  Runs in its own thread, reading the log in short read-only txns.
+//  Returns NULL on failure, e.g. if the endpoint can't be bound.
+CLASSLMDB_EXPORT lmdbrepl_t *
+    lmdbrepl_new_publisher (lmdbenv_t *env, lmdbdbi_t *dbi, const char *endpoint);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Keep dbi a replica of the publisher's dbi at endpoint. Changes arrive
+//  in batches, each applied in one write txn along with how far we've
+//  got, which is kept in a second DB named after this one with ".repl"
+//  appended; so name must not be NULL. After a restart it carries on from
+//  there, and it reconnects if the publisher goes away.
+//  Start from an empty dbi, as the first change we ask for is the first
+//  one logged. If the publisher has trimmed changes we still need, we
+//  stop and out of sync turns true.
+//  Like the dbi ctrs this runs its own write txn, so don't have one open.
+//  Returns NULL on failure.
+CLASSLMDB_EXPORT lmdbrepl_t *
+    lmdbrepl_new_subscriber (lmdbenv_t *env, lmdbdbi_t *dbi, const char *endpoint);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Stop the thread, waiting for any batch in progress to finish. Don't
+//  destroy the dbi, or the env, before this.
+CLASSLMDB_EXPORT void
+    lmdbrepl_destroy (lmdbrepl_t **self_p);
+
+//  *** Draft method, for development use, may change without warning ***
+//  For a subscriber, the sequence number of the last change applied; for
+//  a publisher, of the last change sent. Compare with lmdbdbi_log_seq()
+//  on the primary to see how far behind a replica is.
+CLASSLMDB_EXPORT uint64_t
+    lmdbrepl_seq (lmdbrepl_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Subscribers only: true if the replica can't be brought up to date
+//  from the log any more, and needs copying afresh from the primary.
+CLASSLMDB_EXPORT bool
+    lmdbrepl_out_of_sync (lmdbrepl_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Self test of this class.
+CLASSLMDB_EXPORT void
+    lmdbrepl_test (bool verbose);
+
+#endif // CLASSLMDB_BUILD_DRAFT_API
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
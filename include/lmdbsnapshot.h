@@ -0,0 +1,119 @@
+/*  =========================================================================
+    lmdbsnapshot - Leased read-only view of an env, for reads spread over many calls
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+#ifndef LMDBSNAPSHOT_H_INCLUDED
+#define LMDBSNAPSHOT_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @warning THE FOLLOWING @INTERFACE BLOCK IS AUTO-GENERATED BY ZPROJECT
+//  @warning Please edit the model at "api/lmdbsnapshot.xml" to make changes.
+//  @interface
+//  This API is a draft, and may change without notice.
+#ifdef CLASSLMDB_BUILD_DRAFT_API
+//  *** Draft method, for development use, may change without warning ***
+//  Open a read txn on env and keep it, so that every read through this
+//  snapshot sees the same data, until the lease runs out: lease_msecs
+//  after it was last used (0 for never). Then the next snapshot call on
+//  the env reaps it, releasing the txn and freeing the snapshot, so an
+//  abandoned snapshot can't keep old pages from being reused for long.
+//  Don't use the snapshot once its lease could have run out: to come back
+//  to it after longer, keep its id and find it again.
+//  Unless env is from lmdbenv_new_threaded, a thread can only have one
+//  read txn open, so only one snapshot, and no other read txns alongside
+//  it; and all snapshot calls must be made from the env's thread. In
+//  threaded envs snapshot calls can come from any thread, as the env
+//  locks its list of them, but like any txn, a snapshot's is used by one
+//  thread at a time.
+//  Returns NULL on failure.
+CLASSLMDB_EXPORT lmdbsnapshot_t *
+    lmdbsnapshot_new (lmdbenv_t *env, int lease_msecs);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Release the txn and free the snapshot, without waiting for its lease
+//  to run out. Don't destroy one that may have been reaped. Snapshots
+//  still around when their env is destroyed are destroyed with it.
+CLASSLMDB_EXPORT void
+    lmdbsnapshot_destroy (lmdbsnapshot_t **self_p);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Look up a snapshot of env by id, for callers that only kept that, e.g.
+//  across an FFI boundary. Counts as using it.
+//  Returns NULL if there's no such snapshot, or it's been reaped. Ids
+//  aren't reused, so a reaped snapshot's id never finds a later one.
+CLASSLMDB_EXPORT lmdbsnapshot_t *
+    lmdbsnapshot_find (lmdbenv_t *env, uint64_t id);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Release and free env's snapshots whose leases have run out. Every
+//  snapshot call on the env does this anyway; call it yourself if you
+//  might not make any for a while.
+//  Returns the number of snapshots reaped.
+CLASSLMDB_EXPORT size_t
+    lmdbsnapshot_reap (lmdbenv_t *env);
+
+//  *** Draft method, for development use, may change without warning ***
+//  The snapshot's read txn, for use with lmdbdbi_get, lmdbcur and so on.
+//  Counts as using it. Don't destroy the txn; do destroy any cursors
+//  opened in it before the lease could run out.
+//  Returns NULL if its lease has run out.
+CLASSLMDB_EXPORT lmdbtxn_t *
+    lmdbsnapshot_txn (lmdbsnapshot_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Has the lease run out? The snapshot is still there to ask until it's
+//  reaped.
+CLASSLMDB_EXPORT bool
+    lmdbsnapshot_expired (lmdbsnapshot_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Identifies the snapshot among all those opened on its env.
+CLASSLMDB_EXPORT uint64_t
+    lmdbsnapshot_id (lmdbsnapshot_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  The id of the txn whose data the snapshot sees. Snapshots opened with
+//  no write committed in between see the same data, and share a txnid.
+CLASSLMDB_EXPORT uint64_t
+    lmdbsnapshot_txnid (lmdbsnapshot_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Write a token to buf to carry on a scan of this snapshot from key,
+//  usually the key of the first record not yet returned. Tokens are
+//  opaque, portable bytes, so they can be handed to clients and back.
+//  Returns the token's size, or 0 if buf_size is too small: it needs 16
+//  bytes more than key's size.
+CLASSLMDB_EXPORT size_t
+    lmdbsnapshot_token (lmdbsnapshot_t *self, lmdbspan key, void *buf, size_t buf_size);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Open a cursor on dbi in the snapshot a token was made in, at the
+//  token's key or the first key after it. Counts as using the snapshot.
+//  Destroy the cursor before the snapshot's lease could run out.
+//  Returns NULL if the token is malformed, or its snapshot is gone.
+CLASSLMDB_EXPORT lmdbcur_t *
+    lmdbsnapshot_resume (lmdbenv_t *env, lmdbdbi_t *dbi, const void *token, size_t token_size);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Self test of this class.
+CLASSLMDB_EXPORT void
+    lmdbsnapshot_test (bool verbose);
+
+#endif // CLASSLMDB_BUILD_DRAFT_API
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,151 @@
+/*  =========================================================================
+    lmdbspace - How the map's pages are used, and compacting it when too many are free
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+#ifndef LMDBSPACE_H_INCLUDED
+#define LMDBSPACE_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @warning THE FOLLOWING @INTERFACE BLOCK IS AUTO-GENERATED BY ZPROJECT
+//  @warning Please edit the model at "api/lmdbspace.xml" to make changes.
+//  @interface
+//  This API is a draft, and may change without notice.
+#ifdef CLASSLMDB_BUILD_DRAFT_API
+//  *** Draft method, for development use, may change without warning ***
+//  Walk env's free list and every database's page counts, in a read txn
+//  of its own, so the report is of one consistent snapshot.
+//  Returns NULL on failure.
+CLASSLMDB_EXPORT lmdbspace_t *
+    lmdbspace_new (lmdbenv_t *env);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Destroy the lmdbspace.
+CLASSLMDB_EXPORT void
+    lmdbspace_destroy (lmdbspace_t **self_p);
+
+//  *** Draft method, for development use, may change without warning ***
+//  The env's page size, in bytes.
+CLASSLMDB_EXPORT size_t
+    lmdbspace_page_size (lmdbspace_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Pages in use in the file, up to and including the last one written.
+CLASSLMDB_EXPORT uint64_t
+    lmdbspace_total_pages (lmdbspace_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Branch, leaf and overflow pages holding the main database, all
+//  named ones and the free list itself.
+CLASSLMDB_EXPORT uint64_t
+    lmdbspace_live_pages (lmdbspace_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Of the live pages, those holding values too big for a leaf.
+CLASSLMDB_EXPORT uint64_t
+    lmdbspace_overflow_pages (lmdbspace_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Pages on the free list, waiting to be reused. Includes any that old
+//  readers still hold, which can't be reused until they finish.
+CLASSLMDB_EXPORT uint64_t
+    lmdbspace_free_pages (lmdbspace_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  How many runs of consecutive page numbers the free pages make.
+CLASSLMDB_EXPORT uint64_t
+    lmdbspace_free_runs (lmdbspace_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  The longest of those runs, which bounds the biggest value that can be
+//  put without growing the file.
+CLASSLMDB_EXPORT uint64_t
+    lmdbspace_largest_free_run (lmdbspace_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Free pages as a fraction of total pages, 0 to 1.
+CLASSLMDB_EXPORT double
+    lmdbspace_free_ratio (lmdbspace_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  How scattered the free pages are: 0 when they make one run, nearing 1
+//  as they break into single pages.
+CLASSLMDB_EXPORT double
+    lmdbspace_fragmentation (lmdbspace_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Whether the free ratio is over max_free_ratio and the fragmentation
+//  over max_fragmentation, so that compacting is worth its copy. Pass 0
+//  for either to ignore it.
+CLASSLMDB_EXPORT bool
+    lmdbspace_needs_compact (lmdbspace_t *self, double max_free_ratio, double max_fragmentation);
+
+//  *** Draft method, for development use, may change without warning ***
+//  How many named databases were found.
+CLASSLMDB_EXPORT size_t
+    lmdbspace_dbis (lmdbspace_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  The index'th named database's name, in key order.
+//  Returns NULL if index is out of range.
+CLASSLMDB_EXPORT const char *
+    lmdbspace_dbi_name (lmdbspace_t *self, size_t index);
+
+//  *** Draft method, for development use, may change without warning ***
+//  The index'th named database's number of entries.
+CLASSLMDB_EXPORT uint64_t
+    lmdbspace_dbi_entries (lmdbspace_t *self, size_t index);
+
+//  *** Draft method, for development use, may change without warning ***
+//  The index'th named database's branch, leaf and overflow pages.
+CLASSLMDB_EXPORT uint64_t
+    lmdbspace_dbi_pages (lmdbspace_t *self, size_t index);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Of those, the index'th named database's overflow pages.
+CLASSLMDB_EXPORT uint64_t
+    lmdbspace_dbi_overflow_pages (lmdbspace_t *self, size_t index);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Write a compacted copy of env to path, with live pages only, packed
+//  from the start of the file. The copy is of a snapshot taken as it
+//  starts, so readers and writers carry on meanwhile, and commits made
+//  after that aren't in it. The copy goes to a temporary file and is
+//  renamed into place, so path is only ever absent, old, or whole.
+//  The copy runs its own read txn, so unless env is threaded, don't have
+//  a txn open on this thread.
+//  Returns 0 on success, -1 on failure.
+CLASSLMDB_EXPORT int
+    lmdbspace_compact (lmdbenv_t *env, const char *path);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Replace the env file at path with the compacted copy at copy_path, in
+//  one rename, and remove the old lock file. Every env on path must be
+//  destroyed first, by all processes, and reopened after; writes made
+//  between compact and swap are lost.
+//  Returns 0 on success, -1 on failure.
+CLASSLMDB_EXPORT int
+    lmdbspace_swap (const char *path, const char *copy_path);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Self test of this class.
+CLASSLMDB_EXPORT void
+    lmdbspace_test (bool verbose);
+
+#endif // CLASSLMDB_BUILD_DRAFT_API
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,58 @@
+/*  =========================================================================
+    lmdbsweeper - Background thread deleting expired keys from an lmdbdbi
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+#ifndef LMDBSWEEPER_H_INCLUDED
+#define LMDBSWEEPER_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @warning THE FOLLOWING @INTERFACE BLOCK IS AUTO-GENERATED BY ZPROJECT
+//  @warning Please edit the model at "api/lmdbsweeper.xml" to make changes.
+//  @interface
+//  This API is a draft, and may change without notice.
+#ifdef CLASSLMDB_BUILD_DRAFT_API
+//  *** Draft method, for development use, may change without warning ***
+//  Start a thread that calls lmdbdbi_expire on dbi every interval_msecs,
+//  deleting up to batch keys each time. While there are more expired keys
+//  than that, it goes again straight away rather than waiting, so each
+//  write txn stays short but a backlog still drains quickly.
+//  The dbi must have TTLs enabled. Don't destroy it, or the env, before
+//  the sweeper.
+//  Returns NULL on failure, or if interval_msecs isn't positive, as
+//  sweeping without a pause would keep other writers waiting.
+CLASSLMDB_EXPORT lmdbsweeper_t *
+    lmdbsweeper_new (lmdbenv_t *env, lmdbdbi_t *dbi, int interval_msecs, size_t batch);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Stop the thread, waiting for any sweep in progress to finish.
+CLASSLMDB_EXPORT void
+    lmdbsweeper_destroy (lmdbsweeper_t **self_p);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Number of keys deleted so far.
+CLASSLMDB_EXPORT uint64_t
+    lmdbsweeper_swept (lmdbsweeper_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Self test of this class.
+CLASSLMDB_EXPORT void
+    lmdbsweeper_test (bool verbose);
+
+#endif // CLASSLMDB_BUILD_DRAFT_API
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -45,11 +45,73 @@ CLASSLMDB_EXPORT void
 CLASSLMDB_EXPORT int
     lmdbtxn_commit (lmdbtxn_t *self);
 
+//  *** Draft method, for development use, may change without warning ***
+//  Write txns only. Hold back puts made through lmdbdbi_put (and the put
+//  calls built on it) in memory, up to budget bytes, and write them sorted
+//  by key, so that many random puts land as sequential page writes. Gets
+//  of staged keys return the staged value. The stage is written when it
+//  fills, at commit, and before anything else that reads the txn: cursors,
+//  dels, merges, index reads, TTL puts, and lmdbtxn_handle(). A budget of 0
+//  writes the stage and stops staging.
+//  Spans of staged values last until the stage is written, and cursors
+//  don't see puts staged after they were opened.
+//  Values in staged puts are checked only when written, so a bad put can
+//  show up as a later call, or the commit, failing; a txn whose stage
+//  failed to write can't be committed.
+//  Flush or commit before destroying a dbi that has puts staged.
+//  Returns 0 on success, -1 on error, or if the txn is read-only.
+CLASSLMDB_EXPORT int
+    lmdbtxn_stage (lmdbtxn_t *self, size_t budget);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Write any staged puts now.
+//  Returns 0 on success, -1 if writing them (now or earlier) failed.
+CLASSLMDB_EXPORT int
+    lmdbtxn_flush (lmdbtxn_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Write txns only. Keep copies of values got or put through lmdbdbi in
+//  this txn, in up to budget bytes, so that getting one of those keys again
+//  doesn't search the tree. Puts, dels and merges keep the copies current,
+//  but writes that bypass lmdbdbi, as lmdbfast's do, aren't seen, so don't
+//  mix the two. Spans got from the cache last until the next put, del or
+//  merge in the txn, as LMDB's own do. DBs with TTLs aren't cached, and
+//  a dbi mustn't be destroyed while the txn is open. A budget of 0 stops
+//  caching.
+//  Returns 0 on success, -1 if the txn is read-only or closed.
+CLASSLMDB_EXPORT int
+    lmdbtxn_cache (lmdbtxn_t *self, size_t budget);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Read-only txns only. Release the txn's snapshot, so the pages it was
+//  reading can be reused, but keep its reader slot for renew to pick up
+//  again. Cheaper than destroying it and opening another, so long lived
+//  readers, like worker threads, keep one and reset it between uses.
+//  Spans got through the txn are invalid once it's reset.
+//  Returns 0 on success, -1 on error.
+CLASSLMDB_EXPORT int
+    lmdbtxn_reset (lmdbtxn_t *self);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Take a fresh snapshot for a txn that was reset, seeing everything
+//  committed since. In envs from lmdbenv_new_threaded this needn't be the
+//  thread that reset it.
+//  Returns 0 on success, -1 on error (including if it wasn't reset).
+CLASSLMDB_EXPORT int
+    lmdbtxn_renew (lmdbtxn_t *self);
+
 //  *** Draft method, for development use, may change without warning ***
 //  Is this a read-only transaction?
 CLASSLMDB_EXPORT bool
     lmdbtxn_rdonly (lmdbtxn_t *self);
 
+//  *** Draft method, for development use, may change without warning ***
+//  An arena owned by the txn, for memory that needs to last as long as
+//  the txn does: it is reset when the txn is committed, reset or
+//  destroyed. Copy spans into an arena of your own to keep them longer.
+CLASSLMDB_EXPORT lmdbarena_t *
+    lmdbtxn_arena (lmdbtxn_t *self);
+
 //  *** Draft method, for development use, may change without warning ***
 //  Return a pointer to the underlying MDB_txn.
 //  BEWARE: this is an escape hatch for people that *really* need it; if you
@@ -25,9 +25,156 @@
 //  Extra headers
 
 //  Opaque class structures to allow forward references
+#ifndef LMDBPACK_T_DEFINED
+typedef struct _lmdbpack_t lmdbpack_t;
+#define LMDBPACK_T_DEFINED
+#endif
+#ifndef LMDBZIP_T_DEFINED
+typedef struct _lmdbzip_t lmdbzip_t;
+#define LMDBZIP_T_DEFINED
+#endif
+#ifndef LMDBBLOOM_T_DEFINED
+typedef struct _lmdbbloom_t lmdbbloom_t;
+#define LMDBBLOOM_T_DEFINED
+#endif
+#ifndef LMDBMERGE_T_DEFINED
+typedef struct _lmdbmerge_t lmdbmerge_t;
+#define LMDBMERGE_T_DEFINED
+#endif
+#ifndef LMDBSTAGE_T_DEFINED
+typedef struct _lmdbstage_t lmdbstage_t;
+#define LMDBSTAGE_T_DEFINED
+#endif
+#ifndef LMDBCACHE_T_DEFINED
+typedef struct _lmdbcache_t lmdbcache_t;
+#define LMDBCACHE_T_DEFINED
+#endif
 
 //  Internal API
 
+#include "lmdbpack.h"
+#include "lmdbzip.h"
+#include "lmdbbloom.h"
+#include "lmdbmerge.h"
+#include "lmdbstage.h"
+#include "lmdbcache.h"
+
+//  Return a buffer of at least size bytes, max-aligned, that stays valid
+//  until the txn is committed or destroyed. For values we have to build
+//  rather than point at in the map. Returns NULL if out of memory.
+CLASSLMDB_PRIVATE void *
+    lmdbtxn_scratch (lmdbtxn_t *self, size_t size);
+
+//  Is the txn staging puts? False while it's flushing them, so that
+//  lmdbdbi_put writes them.
+CLASSLMDB_PRIVATE bool
+    lmdbtxn_staging (lmdbtxn_t *self);
+
+//  Stage a put, flushing the stage if that fills the budget.
+//  Returns 0 on success, -1 if this or an earlier flush failed.
+CLASSLMDB_PRIVATE int
+    lmdbtxn_stage_put (lmdbtxn_t *self, lmdbdbi_t *dbi, const void *key, size_t key_size, const void *val, size_t val_size);
+
+//  The value staged for key in dbi, or nullish if none is.
+CLASSLMDB_PRIVATE lmdbspan
+    lmdbtxn_staged_get (lmdbtxn_t *self, lmdbdbi_t *dbi, const void *key, size_t key_size);
+
+//  While held, lmdbtxn_handle() doesn't flush the stage; for reads of
+//  keys that aren't staged. Returns whether it was held before.
+CLASSLMDB_PRIVATE bool
+    lmdbtxn_hold (lmdbtxn_t *self, bool hold);
+
+//  The txn's cache of values got and put, or NULL if it isn't caching.
+CLASSLMDB_PRIVATE lmdbcache_t *
+    lmdbtxn_read_cache (lmdbtxn_t *self);
+
+//  Note that segment index of dbi's filter, which has segment_count, has
+//  changed, to be written back with lmdbdbi_save_filter() on commit.
+//  Returns 0 on success, -1 if out of memory.
+CLASSLMDB_PRIVATE int
+    lmdbtxn_filter_changed (lmdbtxn_t *self, lmdbdbi_t *dbi, size_t index, size_t segment_count);
+
+//  Turn a value as stored in the map into the value the caller put, for
+//  dbis that transform values on the way in. Spans that need no decoding
+//  are returned as is.
+CLASSLMDB_PRIVATE lmdbspan
+    lmdbdbi_decode (lmdbdbi_t *self, lmdbtxn_t *txn, lmdbspan stored);
+
+//  As lmdbdbi_decode, but decoding into *buf_p, grown through lmdballoc
+//  as needed and *buf_max_p bytes long, so a caller decoding record after
+//  record reuses one buffer rather than growing txn scratch. The span is
+//  valid until the next call with the same buffer.
+CLASSLMDB_PRIVATE lmdbspan
+    lmdbdbi_decode_reusing (lmdbdbi_t *self, lmdbspan stored, void **buf_p, size_t *buf_max_p);
+
+//  Write the filter segments marked in the segments bitmap to the filter
+//  dbi, or the whole filter if it's been resized since it was stored, and
+//  bump its stored generation, returned in *generation_p. Pass that to
+//  lmdbdbi_filter_saved() once the txn commits.
+//  Returns 0 on success, -1 on failure.
+CLASSLMDB_PRIVATE int
+    lmdbdbi_save_filter (lmdbdbi_t *self, lmdbtxn_t *txn, const byte *segments, size_t segment_count, uint64_t *generation_p);
+
+//  The filter saved as generation has been committed, so it's the stored
+//  filter the one in memory holds.
+CLASSLMDB_PRIVATE void
+    lmdbdbi_filter_saved (lmdbdbi_t *self, uint64_t generation);
+
+//  Have the dbi call lmdbidx_update() on every put and del, or stop it.
+CLASSLMDB_PRIVATE void
+    lmdbdbi_attach_index (lmdbdbi_t *self, lmdbidx_t *idx);
+CLASSLMDB_PRIVATE void
+    lmdbdbi_detach_index (lmdbdbi_t *self, lmdbidx_t *idx);
+
+//  Bring an index up to date for a primary record changing from old_val
+//  to new_val, either of which may be nullish for an insert or delete.
+//  Stage copies out the index keys of both; as old_val may point into the
+//  map, stage every index before applying any, and all before writing the
+//  primary. Apply returns 0 on success, -1 on failure.
+CLASSLMDB_PRIVATE void
+    lmdbidx_stage (lmdbidx_t *self, const void *key, size_t key_size, lmdbspan old_val, lmdbspan new_val);
+CLASSLMDB_PRIVATE int
+    lmdbidx_apply (lmdbidx_t *self, lmdbtxn_t *txn, const void *key, size_t key_size);
+
+//  The dbi's merge operators, made if they haven't been yet.
+CLASSLMDB_PRIVATE lmdbmerge_t *
+    lmdbdbi_merge_ops (lmdbdbi_t *self);
+
+//  The name the dbi was opened with, or NULL for the default db.
+CLASSLMDB_PRIVATE const char *
+    lmdbdbi_name (lmdbdbi_t *self);
+
+//  The side dbi holding a dbi's change log, or NULL if it has none. Its
+//  keys are 8 byte big endian sequence numbers.
+CLASSLMDB_PRIVATE lmdbdbi_t *
+    lmdbdbi_log_dbi (lmdbdbi_t *self);
+
+//  Redo one change log entry, as read from another dbi's log, on this dbi.
+//  Returns 0 on success, -1 if the entry is malformed or on failure.
+CLASSLMDB_PRIVATE int
+    lmdbdbi_log_apply (lmdbdbi_t *self, lmdbtxn_t *txn, const void *entry, size_t entry_size);
+
+
+//  Take and release the lock on the env's snapshot list and ids, around
+//  any use of the calls below. It's a spinlock, so hold it briefly.
+CLASSLMDB_PRIVATE void
+    lmdbenv_lock_snapshots (lmdbenv_t *self);
+
+CLASSLMDB_PRIVATE void
+    lmdbenv_unlock_snapshots (lmdbenv_t *self);
+
+//  The env's list of snapshots, which lmdbsnapshot keeps, and the id to
+//  give the next one.
+CLASSLMDB_PRIVATE lmdbsnapshot_t **
+    lmdbenv_snapshots (lmdbenv_t *self);
+
+CLASSLMDB_PRIVATE uint64_t
+    lmdbenv_next_snapshot_id (lmdbenv_t *self);
+
+//  The current free hook and its ctx, or NULL for the C library's free,
+//  for memory freed by callbacks that can run after the hooks change.
+CLASSLMDB_PRIVATE void
+    lmdballoc_free_hook (lmdballoc_free_fn **free_fn_p, void **ctx_p);
 
 //  *** To avoid double-definitions, only define if building without draft ***
 #ifndef CLASSLMDB_BUILD_DRAFT_API
@@ -27,6 +27,15 @@
 void
 classlmdb_private_selftest (bool verbose)
 {
+// Tests for draft private classes:
+#ifdef CLASSLMDB_BUILD_DRAFT_API
+    lmdbpack_test (verbose);
+    lmdbzip_test (verbose);
+    lmdbbloom_test (verbose);
+    lmdbmerge_test (verbose);
+    lmdbstage_test (verbose);
+    lmdbcache_test (verbose);
+#endif // CLASSLMDB_BUILD_DRAFT_API
 }
 /*
 ################################################################################
@@ -32,6 +32,19 @@ all_tests [] = {
     { "lmdbdbi", lmdbdbi_test },
     { "lmdbtxn", lmdbtxn_test },
     { "lmdbcur", lmdbcur_test },
+    { "lmdbidx", lmdbidx_test },
+    { "lmdbidxcur", lmdbidxcur_test },
+    { "lmdbsweeper", lmdbsweeper_test },
+    { "lmdbrepl", lmdbrepl_test },
+    { "lmdbasync", lmdbasync_test },
+    { "lmdbsnapshot", lmdbsnapshot_test },
+    { "lmdbarrow", lmdbarrow_test },
+    { "lmdbarena", lmdbarena_test },
+    { "lmdbmemtable", lmdbmemtable_test },
+    { "lmdbblob", lmdbblob_test },
+    { "lmdbspace", lmdbspace_test },
+    { "lmdbbatch", lmdbbatch_test },
+    { "lmdballoc", lmdballoc_test },
 #endif // CLASSLMDB_BUILD_DRAFT_API
 #ifdef CLASSLMDB_BUILD_DRAFT_API
     { "private_classes", classlmdb_private_selftest },
@@ -93,7 +106,7 @@ main (int argc, char **argv)
         else
         if (streq (argv [argn], "--number")
         ||  streq (argv [argn], "-n")) {
-            puts ("4");
+            puts ("17");
             return 0;
         }
         else
@@ -104,6 +117,19 @@ main (int argc, char **argv)
             puts ("    lmdbdbi\t\t- draft");
             puts ("    lmdbtxn\t\t- draft");
             puts ("    lmdbcur\t\t- draft");
+            puts ("    lmdbidx\t\t- draft");
+            puts ("    lmdbidxcur\t\t- draft");
+            puts ("    lmdbsweeper\t\t- draft");
+            puts ("    lmdbrepl\t\t- draft");
+            puts ("    lmdbasync\t\t- draft");
+            puts ("    lmdbsnapshot\t\t- draft");
+            puts ("    lmdbarrow\t\t- draft");
+            puts ("    lmdbarena\t\t- draft");
+            puts ("    lmdbmemtable\t\t- draft");
+            puts ("    lmdbblob\t\t- draft");
+            puts ("    lmdbspace\t\t- draft");
+            puts ("    lmdbbatch\t\t- draft");
+            puts ("    lmdballoc\t\t- draft");
             puts ("    private_classes\t- draft");
             return 0;
         }
@@ -0,0 +1,351 @@
+/*  =========================================================================
+    lmdballoc - The allocator the library's objects and buffers come from, which can be replaced
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+/*
+@header
+    lmdballoc - The allocator the library's objects and buffers come from, which can be replaced
+@discuss
+    Objects, and the buffers they grow, come from here rather than from
+    czmq's zmalloc and the C library directly, so that a deployment can
+    route them into its own allocator, such as a jemalloc arena or a
+    per-thread pool, and count or time what the library asks for.
+
+    The hooks are library wide, not per env, as arenas and batches are
+    made without one. Memory LMDB allocates inside its own calls, and the
+    map itself, aren't covered, nor are czmq's sockets and threads, or
+    names built with it only for the length of a call.
+@end
+*/
+
+#include "classlmdb_classes.h"
+
+#include "logging.h"
+
+//  The current hooks, all NULL for the C library's
+
+static lmdballoc_malloc_fn *s_malloc_fn;
+static lmdballoc_realloc_fn *s_realloc_fn;
+static lmdballoc_free_fn *s_free_fn;
+static void *s_ctx;
+
+
+//  --------------------------------------------------------------------------
+//  Hooks
+
+void
+lmdballoc_set (lmdballoc_malloc_fn malloc_fn, lmdballoc_realloc_fn realloc_fn,
+               lmdballoc_free_fn free_fn, void *ctx)
+{
+    // All or none, as memory has to go back where it came from
+    assert ((malloc_fn && realloc_fn && free_fn)
+         || (!malloc_fn && !realloc_fn && !free_fn));
+    s_malloc_fn = malloc_fn;
+    s_realloc_fn = realloc_fn;
+    s_free_fn = free_fn;
+    s_ctx = ctx;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Allocating
+
+void *
+lmdballoc_malloc (size_t size)
+{
+    return s_malloc_fn ? s_malloc_fn (size, s_ctx) : malloc (size);
+}
+
+void *
+lmdballoc_zmalloc (size_t size)
+{
+    if (!s_malloc_fn)
+        return calloc (1, size);
+    void *ptr = s_malloc_fn (size, s_ctx);
+    if (ptr)
+        memset (ptr, 0, size);
+    return ptr;
+}
+
+void *
+lmdballoc_realloc (void *ptr, size_t size)
+{
+    return s_realloc_fn ? s_realloc_fn (ptr, size, s_ctx) : realloc (ptr, size);
+}
+
+char *
+lmdballoc_strdup (const char *string)
+{
+    assert (string);
+    size_t size = strlen (string) + 1;
+    char *copy = (char *) lmdballoc_malloc (size);
+    if (copy)
+        memcpy (copy, string, size);
+    return copy;
+}
+
+void
+lmdballoc_free (void *ptr)
+{
+    if (!ptr)
+        return;
+    if (s_free_fn)
+        s_free_fn (ptr, s_ctx);
+    else
+        free (ptr);
+}
+
+void
+lmdballoc_free_hook (lmdballoc_free_fn **free_fn_p, void **ctx_p)
+{
+    assert (free_fn_p);
+    assert (ctx_p);
+    *free_fn_p = s_free_fn;
+    *ctx_p = s_ctx;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+//  Counts what's live, and stamps each block so that memory freed by the
+//  wrong allocator, either way round, is caught
+
+#define s_test_magic 0x6c6d6462616c6c6fULL
+
+typedef struct {
+    size_t allocs;
+    int64_t live;
+} s_test_counts_t;
+
+typedef union {
+    uint64_t magic;
+    long double ld;             // So what follows is max-aligned
+    void *p;
+} s_test_block_t;
+
+static void *
+s_test_malloc (size_t size, void *ctx)
+{
+    s_test_counts_t *counts = (s_test_counts_t *) ctx;
+    s_test_block_t *block = (s_test_block_t *) malloc (sizeof (s_test_block_t) + size);
+    if (!block)
+        return NULL;
+    block->magic = s_test_magic;
+    counts->allocs++;
+    counts->live++;
+    return block + 1;
+}
+
+static void
+s_test_free (void *ptr, void *ctx)
+{
+    s_test_counts_t *counts = (s_test_counts_t *) ctx;
+    s_test_block_t *block = (s_test_block_t *) ptr - 1;
+    assert (block->magic == s_test_magic);
+    block->magic = 0;
+    counts->live--;
+    free (block);
+}
+
+static void *
+s_test_realloc (void *ptr, size_t size, void *ctx)
+{
+    if (!ptr)
+        return s_test_malloc (size, ctx);
+    s_test_block_t *block = (s_test_block_t *) ptr - 1;
+    assert (block->magic == s_test_magic);
+    block = (s_test_block_t *) realloc (block, sizeof (s_test_block_t) + size);
+    return block ? block + 1 : NULL;
+}
+
+// Indexes records by their value's first byte
+static void
+s_test_by_first (lmdbidx_t *idx, const void *key, size_t key_size,
+                 const void *val, size_t val_size, void *arg)
+{
+    if (val_size)
+        lmdbidx_emit (idx, val, 1);
+}
+
+void
+lmdballoc_test (bool verbose)
+{
+    printf (" * lmdballoc: ");
+
+    //  @selftest
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+    assert (SELFTEST_DIR_RW);
+
+    // The C library's, by default
+    char *copy = lmdballoc_strdup ("grebe");
+    assert (copy && streq (copy, "grebe"));
+    lmdballoc_free (copy);
+    lmdballoc_free (NULL);
+
+    s_test_counts_t counts = { 0, 0 };
+    lmdballoc_set (s_test_malloc, s_test_realloc, s_test_free, &counts);
+
+    byte *zeroed = (byte *) lmdballoc_zmalloc (64);
+    assert (zeroed && zeroed [0] == 0 && zeroed [63] == 0);
+    zeroed = (byte *) lmdballoc_realloc (zeroed, 4096);
+    assert (zeroed && zeroed [0] == 0);
+    lmdballoc_free (zeroed);
+    assert (counts.allocs == 1 && counts.live == 0);
+
+    char *test_db_path = zsys_sprintf ("%s/%s", SELFTEST_DIR_RW, "LMDBALLOC_TEST.db");
+    if (zsys_file_exists (test_db_path))
+        zsys_file_delete (test_db_path);
+    lmdbenv_t *env = lmdbenv_new (test_db_path);
+    assert (env);
+    zstr_free (&test_db_path);
+    lmdbdbi_t *dbi = lmdbdbi_new (env, "birds");
+    lmdbdbi_t *dbiik = lmdbdbi_new_intkeys (env, "counts");
+    assert (dbi && dbiik);
+
+    // Objects, scratch and staged puts all come from the hooks
+    lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
+    assert (txn);
+    int rc = lmdbtxn_stage (txn, 0);
+    assert (rc == 0);
+    char key [16];
+    uint32_t i;
+    for (i = 0; i < 1000; i++) {
+        snprintf (key, sizeof (key), "bird%04u", i);
+        rc = lmdbdbi_put_str (dbi, txn, key, "seen", 4);
+        assert (rc == 0);
+    }
+    uint64_t one = 1;
+    for (i = 0; i < 10; i++) {
+        rc = lmdbdbi_merge (dbiik, txn, &i, 4, LMDBDBI_MERGE_ADD_U64, &one, 8);
+        assert (rc == 0);
+    }
+    rc = lmdbtxn_commit (txn);
+    assert (rc == 0);
+    lmdbtxn_destroy (&txn);
+
+    txn = lmdbtxn_new_rdonly (env);
+    assert (txn);
+    lmdbcur_t *cur = lmdbcur_new_overall (dbi, txn);
+    assert (cur);
+    size_t walked = 0;
+    while (lmdbspan_valid (lmdbcur_key (cur))) {
+        walked++;
+        if (lmdbcur_next (cur))
+            break;
+    }
+    assert (walked == 1000);
+    lmdbcur_destroy (&cur);
+    lmdbtxn_destroy (&txn);
+
+    lmdbbatch_t *batch = lmdbbatch_new ();
+    assert (batch);
+    int slot = lmdbbatch_add_dbi (batch, dbi);
+    rc = lmdbbatch_put (batch, slot, "wren", 5, "small", 5);
+    assert (rc == 0);
+    rc = lmdbbatch_del (batch, slot, "bird0000", 9);
+    assert (rc == 0);
+    rc = lmdbbatch_apply (batch, env);
+    assert (rc == 0);
+    lmdbbatch_destroy (&batch);
+
+    lmdbarena_t *arena = lmdbarena_new (0);
+    assert (arena);
+    void *block = lmdbarena_alloc (arena, 100000);
+    assert (block);
+    lmdbarena_destroy (&arena);
+
+    // Packed and compressed dbis, each indexed, with their codecs, index
+    // cursors and an Arrow export
+    lmdbdbi_t *packed = lmdbdbi_new_packed (env, "packed");
+    lmdbdbi_t *zipped = lmdbdbi_new_compressed (env, "zipped", 64);
+    assert (packed);
+#ifdef HAVE_LIBZSTD
+    assert (zipped);
+#endif
+    lmdbidx_t *packed_idx = lmdbidx_new (env, packed, "packed.first", s_test_by_first, NULL);
+    lmdbidx_t *zipped_idx = zipped ? lmdbidx_new (env, zipped, "zipped.first",
+                                                  s_test_by_first, NULL)
+                                   : NULL;
+    assert (packed_idx && (zipped_idx || !zipped));
+
+    txn = lmdbtxn_new_rdrw (env);
+    assert (txn);
+    char val [200];
+    for (i = 0; i < 500; i++) {
+        snprintf (key, sizeof (key), "bird%04u", i);
+        memset (val, 'a' + i % 4, sizeof (val));
+        rc = lmdbdbi_put_str (packed, txn, key, val, 16);
+        assert (rc == 0);
+        if (zipped) {
+            rc = lmdbdbi_put_str (zipped, txn, key, val, sizeof (val));
+            assert (rc == 0);
+        }
+    }
+    rc = lmdbtxn_commit (txn);
+    assert (rc == 0);
+    lmdbtxn_destroy (&txn);
+
+    struct ArrowSchema schema;
+    struct ArrowArray array;
+    txn = lmdbtxn_new_rdonly (env);
+    assert (txn);
+    assert (lmdbspan_size (lmdbdbi_get_str (packed, txn, "bird0007")) == 16);
+    if (zipped)
+        assert (lmdbspan_size (lmdbdbi_get_str (zipped, txn, "bird0007")) == sizeof (val));
+    lmdbidx_t *indexes [] = { packed_idx, zipped_idx };
+    size_t index;
+    for (index = 0; index < 2 && indexes [index]; index++) {
+        lmdbidxcur_t *icur = lmdbidxcur_new_fromkey (indexes [index], txn, "b", 1);
+        assert (icur);
+        walked = 0;
+        while (lmdbidxcur_valid (icur)) {
+            assert (lmdbspan_valid (lmdbidxcur_val (icur)));
+            walked++;
+            if (lmdbidxcur_next (icur))
+                break;
+        }
+        assert (walked == 125);
+        lmdbidxcur_destroy (&icur);
+    }
+    cur = lmdbcur_new_overall (zipped ? zipped : packed, txn);
+    assert (cur);
+    rc = lmdbarrow_export (cur, 100, LMDBARROW_BINARY, 0, LMDBARROW_LARGE_BINARY, 0,
+                           &schema, &array);
+    assert (rc == 0);
+    assert (array.length == 100);
+    lmdbcur_destroy (&cur);
+    lmdbtxn_destroy (&txn);
+
+    lmdbidx_destroy (&zipped_idx);
+    lmdbidx_destroy (&packed_idx);
+    lmdbdbi_destroy (&zipped);
+    lmdbdbi_destroy (&packed);
+
+    assert (counts.allocs > 1 && counts.live > 0);
+    lmdbdbi_destroy (&dbiik);
+    lmdbdbi_destroy (&dbi);
+    lmdbenv_destroy (&env);
+
+    // Everything went back where it came from, bar the export, which
+    // goes back there even once the hooks have changed
+    assert (counts.live > 0);
+    lmdballoc_set (NULL, NULL, NULL, NULL);
+    array.release (&array);
+    schema.release (&schema);
+    assert (counts.live == 0);
+    if (verbose)
+        logg ("Made %zu allocations through the hooks", counts.allocs);
+
+    copy = lmdballoc_strdup ("back to libc");
+    free (copy);
+    //  @end
+    printf ("OK\n");
+}
@@ -0,0 +1,319 @@
+/*  =========================================================================
+    lmdbarena - Bump allocator for copies of spans that must outlive their txn
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+/*
+@header
+    lmdbarena - Bump allocator for copies of spans that must outlive their txn
+@discuss
+    Spans point into the map, and are only valid until their txn closes,
+    so a request handler that wants to close its txn before replying has
+    to copy what it read. Doing that with a malloc per value costs more
+    than the reads; an arena hands out memory from big chunks by moving a
+    pointer, and frees it all at once when the request is done.
+
+    Allocations too big to share a chunk get one to themselves, put behind
+    the chunk being filled so its free space isn't wasted.
+
+    Every txn has an arena of its own, from lmdbtxn_arena(), for buffers
+    that only need to last as long as it does, such as decoded values.
+@end
+*/
+
+#include "classlmdb_classes.h"
+
+#include "logging.h"
+
+#define s_default_chunk_size (64 * 1024)
+
+typedef union {
+    long double ld;
+    void *p;
+    uint64_t u;
+} s_max_align_t;
+
+#define s_align(n) (((n) + sizeof (s_max_align_t) - 1) & ~(sizeof (s_max_align_t) - 1))
+
+typedef struct _s_chunk_t {
+    // The union pads the header out so that data is max-aligned
+    union {
+        struct {
+            struct _s_chunk_t *next;
+            size_t size;
+        } h;
+        s_max_align_t align;
+    } u;
+    byte data [];
+} s_chunk_t;
+
+//  Structure of our class
+
+struct _lmdbarena_t {
+    s_chunk_t *chunks;      // We allocate from the first
+    size_t used;            // Bytes of the first chunk handed out
+    size_t chunk_size;
+    size_t size;
+};
+
+
+//  --------------------------------------------------------------------------
+//  Create a new lmdbarena
+
+lmdbarena_t *
+lmdbarena_new (size_t chunk_size)
+{
+    lmdbarena_t *self = (lmdbarena_t *) lmdballoc_zmalloc (sizeof (lmdbarena_t));
+    assert (self);
+    self->chunk_size = chunk_size ? s_align (chunk_size) : s_default_chunk_size;
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the lmdbarena
+
+void
+lmdbarena_destroy (lmdbarena_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        lmdbarena_t *self = *self_p;
+        while (self->chunks) {
+            s_chunk_t *next = self->chunks->u.h.next;
+            lmdballoc_free (self->chunks);
+            self->chunks = next;
+        }
+        lmdballoc_free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Allocating
+
+static s_chunk_t *
+s_chunk_new (size_t size)
+{
+    s_chunk_t *chunk = (s_chunk_t *) lmdballoc_malloc (sizeof (s_chunk_t) + size);
+    if (chunk) {
+        chunk->u.h.next = NULL;
+        chunk->u.h.size = size;
+    }
+    return chunk;
+}
+
+void *
+lmdbarena_alloc (lmdbarena_t *self, size_t size)
+{
+    assert (self);
+    if (size > SIZE_MAX - sizeof (s_chunk_t) - sizeof (s_max_align_t))
+        return NULL;
+    size = s_align (size);
+
+    if (size > self->chunk_size / 4) {
+        s_chunk_t *big = s_chunk_new (size);
+        if (!big)
+            return NULL;
+        if (self->chunks) {
+            big->u.h.next = self->chunks->u.h.next;
+            self->chunks->u.h.next = big;
+        }
+        else {
+            self->chunks = big;
+            self->used = size;
+        }
+        self->size += size;
+        return big->data;
+    }
+
+    if (!self->chunks || self->used + size > self->chunks->u.h.size) {
+        s_chunk_t *chunk = s_chunk_new (self->chunk_size);
+        if (!chunk)
+            return NULL;
+        chunk->u.h.next = self->chunks;
+        self->chunks = chunk;
+        self->used = 0;
+    }
+    void *data = self->chunks->data + self->used;
+    self->used += size;
+    self->size += size;
+    return data;
+}
+
+lmdbspan
+lmdbarena_copy (lmdbarena_t *self, lmdbspan span)
+{
+    assert (self);
+    if (! lmdbspan_valid (span))
+        return span;
+    void *data = lmdbarena_alloc (self, span.size);
+    if (!data)
+        return lmdbspan_makenull ();
+    memcpy (data, span.data, span.size);
+    return (lmdbspan) { .data = data, .size = span.size };
+}
+
+int
+lmdbarena_copy_spans (lmdbarena_t *self, lmdbspan *spans, size_t count)
+{
+    assert (self);
+    assert (spans || !count);
+
+    // Copies sit end to end, unaligned, as they would in the map
+    size_t total = 0;
+    size_t i;
+    for (i = 0; i < count; i++) {
+        if (! lmdbspan_valid (spans [i]))
+            continue;
+        if (spans [i].size > SIZE_MAX - total)
+            return -1;
+        total += spans [i].size;
+    }
+    byte *data = (byte *) lmdbarena_alloc (self, total);
+    if (!data)
+        return -1;
+
+    for (i = 0; i < count; i++) {
+        if (! lmdbspan_valid (spans [i]))
+            continue;
+        memcpy (data, spans [i].data, spans [i].size);
+        // Spans' fields are const, so overwrite it whole
+        lmdbspan copy = { .data = data, .size = spans [i].size };
+        memcpy (&spans [i], &copy, sizeof (copy));
+        data += copy.size;
+    }
+    return 0;
+}
+
+void
+lmdbarena_reset (lmdbarena_t *self)
+{
+    assert (self);
+    // Keep one ordinary chunk, if there is one
+    s_chunk_t *keep = NULL;
+    while (self->chunks) {
+        s_chunk_t *next = self->chunks->u.h.next;
+        if (!keep && self->chunks->u.h.size == self->chunk_size) {
+            keep = self->chunks;
+            keep->u.h.next = NULL;
+        }
+        else
+            lmdballoc_free (self->chunks);
+        self->chunks = next;
+    }
+    self->chunks = keep;
+    self->used = 0;
+    self->size = 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Accessors
+
+size_t
+lmdbarena_size (lmdbarena_t *self)
+{
+    assert (self);
+    return self->size;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+lmdbarena_test (bool verbose)
+{
+    printf (" * lmdbarena: ");
+
+    //  @selftest
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+    assert (SELFTEST_DIR_RW);
+
+    lmdbarena_t *arena = lmdbarena_new (1024);
+    assert (arena);
+
+    // Aligned, distinct, and big ones get their own chunk
+    byte *a = (byte *) lmdbarena_alloc (arena, 1);
+    byte *b = (byte *) lmdbarena_alloc (arena, 3);
+    byte *big = (byte *) lmdbarena_alloc (arena, 5000);
+    byte *c = (byte *) lmdbarena_alloc (arena, 8);
+    assert (a && b && big && c);
+    assert ((uintptr_t) a % sizeof (s_max_align_t) == 0);
+    assert ((uintptr_t) b % sizeof (s_max_align_t) == 0);
+    assert ((uintptr_t) c % sizeof (s_max_align_t) == 0);
+    assert (b >= a + 1 && c >= b + 3);
+    assert (c - a < 1024);      // Still filling the first chunk
+    memset (big, 'x', 5000);
+    assert (lmdbarena_size (arena) >= 5000 + 12);
+
+    // Fill several chunks, then reset and allocate again
+    int i;
+    for (i = 0; i < 1000; i++) {
+        byte *p = (byte *) lmdbarena_alloc (arena, 100);
+        assert (p);
+        memset (p, i, 100);
+    }
+    lmdbarena_reset (arena);
+    assert (lmdbarena_size (arena) == 0);
+    assert (lmdbarena_alloc (arena, 100));
+
+    // Copy values out of a txn, singly and in a batch, and use them after
+    char *test_db_path = zsys_sprintf ("%s/%s", SELFTEST_DIR_RW, "LMDBARENA_TEST.db");
+    if (zsys_file_exists (test_db_path))
+        zsys_file_delete (test_db_path);
+    lmdbenv_t *env = lmdbenv_new (test_db_path);
+    assert (env);
+    zstr_free (&test_db_path);
+    lmdbdbi_t *dbi = lmdbdbi_new (env, "values");
+    assert (dbi);
+    lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
+    int rc = lmdbdbi_put_strstr (dbi, txn, "one", "first");
+    assert (rc == 0);
+    rc = lmdbdbi_put_strstr (dbi, txn, "two", "second");
+    assert (rc == 0);
+    rc = lmdbtxn_commit (txn);
+    assert (rc == 0);
+    lmdbtxn_destroy (&txn);
+
+    txn = lmdbtxn_new_rdonly (env);
+    lmdbspan one = lmdbarena_copy (arena, lmdbdbi_get_str (dbi, txn, "one"));
+    lmdbspan spans [3] = {
+        lmdbdbi_get_str (dbi, txn, "two"),
+        lmdbdbi_get_str (dbi, txn, "three"),
+        lmdbdbi_get_str (dbi, txn, "one")
+    };
+    rc = lmdbarena_copy_spans (arena, spans, 3);
+    assert (rc == 0);
+    assert (! lmdbspan_valid (lmdbarena_copy (arena, lmdbspan_makenull ())));
+
+    // The txn's own arena lasts until it closes
+    lmdbarena_t *txn_arena = lmdbtxn_arena (txn);
+    assert (txn_arena);
+    assert (lmdbtxn_arena (txn) == txn_arena);
+    assert (lmdbarena_alloc (txn_arena, 10));
+    lmdbtxn_destroy (&txn);
+
+    assert (streq (lmdbspan_asstr (one), "first"));
+    assert (streq (lmdbspan_asstr (spans [0]), "second"));
+    assert (! lmdbspan_valid (spans [1]));
+    assert (streq (lmdbspan_asstr (spans [2]), "first"));
+
+    lmdbdbi_destroy (&dbi);
+    lmdbenv_destroy (&env);
+    lmdbarena_destroy (&arena);
+    assert (!arena);
+
+    if (verbose)
+        log ("Allocated, copied spans out of a txn, and reset");
+    //  @end
+    printf ("OK\n");
+}
@@ -0,0 +1,586 @@
+/*  =========================================================================
+    lmdbasync - Runs reads on a pool of worker threads, for callers that mustn't block
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+/*
+@header
+    lmdbasync - Runs reads on a pool of worker threads, for callers that mustn't block
+@discuss
+    A read that misses the page cache blocks whichever thread touches the
+    map for as long as the disk takes. Here that's a worker: requests wait
+    in a queue on the calling thread, and each goes to a worker only once
+    that worker is idle, over a PUSH socket of its own. Results come back
+    over a PULL socket the caller polls, and each one says its worker is
+    ready for the next request. So a worker stuck on a slow scan or a cold
+    page holds up only the request it's running, rather than a share of
+    everything queued behind it, as round robin would. Only pointers to
+    requests travel, so values are copied once, out of the map into the
+    request, before the worker lets go of its snapshot.
+
+    Each worker keeps one read txn for its whole life, renewing it for
+    each request and resetting it after, which costs much less than
+    opening a new one and doesn't pin old pages while it's idle.
+@end
+*/
+
+#include "classlmdb_classes.h"
+
+#include "logging.h"
+
+typedef struct _s_worker_t s_worker_t;
+
+//  Room for our inproc endpoints, without their bind or connect prefix
+#define s_endpoint_max 96
+
+//  A get or scan, from submission to callback
+
+typedef struct _s_request_t {
+    // Links in the list of requests not yet called back for. Only the
+    // calling thread touches these.
+    struct _s_request_t *prev;
+    struct _s_request_t *next;
+
+    // Next in the queue for an idle worker, and the worker it went to
+    struct _s_request_t *queued;
+    s_worker_t *worker;
+
+    lmdbdbi_t *dbi;
+    lmdbasync_fn *done;
+    void *arg;
+    byte *key;              // NULL for a scan from the first key
+    size_t key_size;
+    size_t max_records;     // 0 for a get
+
+    // Filled in by the worker: each record's key size, value size (or
+    // SIZE_MAX if it's missing), key and value, stored end to end
+    byte *results;
+    size_t results_size;
+    size_t results_alloc;
+} s_request_t;
+
+//  A worker thread, and the socket only its requests go out on
+
+struct _s_worker_t {
+    lmdbasync_t *owner;
+    char requests_endpoint [s_endpoint_max];
+    zsock_t *requests;
+    zactor_t *actor;
+};
+
+//  Structure of our class
+
+struct _lmdbasync_t {
+    lmdbenv_t *env;
+    char results_endpoint [s_endpoint_max];
+
+    zsock_t *results;
+    zpoller_t *poller;
+
+    s_worker_t *workers;
+    size_t worker_count;
+
+    // Workers with no request, and requests waiting for one
+    s_worker_t **idle;
+    size_t idle_count;
+    s_request_t *queue_head;
+    s_request_t *queue_tail;
+    size_t queued;
+
+    s_request_t *outstanding;
+    size_t pending;
+};
+
+
+//  --------------------------------------------------------------------------
+//  Requests
+
+static void
+s_request_destroy (s_request_t **self_p)
+{
+    if (*self_p) {
+        s_request_t *self = *self_p;
+        lmdballoc_free (self->key);
+        lmdballoc_free (self->results);
+        lmdballoc_free (self);
+        *self_p = NULL;
+    }
+}
+
+static void
+s_request_add (s_request_t *self, lmdbspan key, lmdbspan val)
+{
+    size_t val_size = lmdbspan_valid (val) ? val.size : SIZE_MAX;
+    size_t size = 2 * sizeof (size_t) + key.size + (lmdbspan_valid (val) ? val.size : 0);
+    if (self->results_size + size > self->results_alloc) {
+        size_t alloc = self->results_alloc ? self->results_alloc * 2 : 256;
+        while (alloc < self->results_size + size)
+            alloc *= 2;
+        self->results = (byte *) lmdballoc_realloc (self->results, alloc);
+        assert (self->results);
+        self->results_alloc = alloc;
+    }
+    byte *out = self->results + self->results_size;
+    memcpy (out, &key.size, sizeof (size_t));
+    memcpy (out + sizeof (size_t), &val_size, sizeof (size_t));
+    memcpy (out + 2 * sizeof (size_t), key.data, key.size);
+    if (lmdbspan_valid (val))
+        memcpy (out + 2 * sizeof (size_t) + key.size, val.data, val.size);
+    self->results_size += size;
+}
+
+// Runs on a worker. A request it can't read just comes back with fewer
+// results than it might have had.
+static void
+s_request_run (s_request_t *self, lmdbtxn_t *txn)
+{
+    if (self->max_records == 0) {
+        lmdbspan key = { .data = self->key, .size = self->key_size };
+        s_request_add (self, key, lmdbdbi_get (self->dbi, txn, self->key, self->key_size));
+        return;
+    }
+
+    lmdbcur_t *cur = self->key
+                   ? lmdbcur_new_gekey (self->dbi, txn, self->key, self->key_size)
+                   : lmdbcur_new_overall (self->dbi, txn);
+    if (!cur)
+        return;
+    size_t count = 0;
+    while (count < self->max_records) {
+        lmdbspan key = lmdbcur_key (cur);
+        if (! lmdbspan_valid (key))
+            break;
+        s_request_add (self, key, lmdbcur_val (cur));
+        count++;
+        if (lmdbcur_next (cur))
+            break;
+    }
+    lmdbcur_destroy (&cur);
+}
+
+// Runs on the calling thread
+static void
+s_request_deliver (s_request_t *self)
+{
+    size_t offset = 0;
+    while (offset < self->results_size) {
+        size_t key_size, val_size;
+        memcpy (&key_size, self->results + offset, sizeof (size_t));
+        memcpy (&val_size, self->results + offset + sizeof (size_t), sizeof (size_t));
+        offset += 2 * sizeof (size_t);
+        lmdbspan key = { .data = self->results + offset, .size = key_size };
+        offset += key_size;
+        if (val_size == SIZE_MAX)
+            self->done (key, lmdbspan_makenull (), self->arg);
+        else {
+            lmdbspan val = { .data = self->results + offset, .size = val_size };
+            offset += val_size;
+            self->done (key, val, self->arg);
+        }
+    }
+
+    // Gets always answer, even if they couldn't read; scans always end
+    if (self->max_records == 0 && self->results_size == 0) {
+        lmdbspan key = { .data = self->key, .size = self->key_size };
+        self->done (key, lmdbspan_makenull (), self->arg);
+    }
+    else
+    if (self->max_records)
+        self->done (lmdbspan_makenull (), lmdbspan_makenull (), self->arg);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Workers
+
+static void
+s_worker_actor (zsock_t *pipe, void *args)
+{
+    s_worker_t *worker = (s_worker_t *) args;
+    lmdbasync_t *self = worker->owner;
+    char endpoint [s_endpoint_max + 1];
+    snprintf (endpoint, sizeof (endpoint), ">%s", worker->requests_endpoint);
+    zsock_t *requests = zsock_new_pull (endpoint);
+    snprintf (endpoint, sizeof (endpoint), ">%s", self->results_endpoint);
+    zsock_t *results = zsock_new_push (endpoint);
+    assert (requests);
+    assert (results);
+    zpoller_t *poller = zpoller_new (pipe, requests, NULL);
+    assert (poller);
+
+    // Read txns belong to the thread that opens them
+    lmdbtxn_t *txn = lmdbtxn_new_rdonly (self->env);
+    if (txn)
+        lmdbtxn_reset (txn);
+    zsock_signal (pipe, 0);
+
+    while (true) {
+        void *which = zpoller_wait (poller, -1);
+        if (which == pipe) {
+            char *command = zstr_recv (pipe);
+            bool terminated = !command || streq (command, "$TERM");
+            zstr_free (&command);
+            if (terminated)
+                break;
+        }
+        else
+        if (which == requests) {
+            s_request_t *request;
+            if (zsock_recv (requests, "p", &request))
+                continue;
+            if (txn && lmdbtxn_renew (txn) == 0) {
+                s_request_run (request, txn);
+                lmdbtxn_reset (txn);
+            }
+            zsock_send (results, "p", request);
+        }
+        else
+            break;
+    }
+    lmdbtxn_destroy (&txn);
+    zpoller_destroy (&poller);
+    zsock_destroy (&requests);
+    zsock_destroy (&results);
+}
+
+// Hand queued requests to idle workers, oldest first. A request that
+// can't be sent stays at the head of the queue for the next try.
+static void
+s_feed (lmdbasync_t *self)
+{
+    while (self->idle_count && self->queue_head) {
+        s_request_t *request = self->queue_head;
+        s_worker_t *worker = self->idle [self->idle_count - 1];
+        if (zsock_send (worker->requests, "p", request))
+            break;
+        self->idle_count--;
+        request->worker = worker;
+        self->queue_head = request->queued;
+        if (!self->queue_head)
+            self->queue_tail = NULL;
+        request->queued = NULL;
+        self->queued--;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Create a new lmdbasync
+
+lmdbasync_t *
+lmdbasync_new (lmdbenv_t *env, size_t threads)
+{
+    assert (env);
+    if (threads == 0)
+        return NULL;
+
+    lmdbasync_t *self = (lmdbasync_t *) lmdballoc_zmalloc (sizeof (lmdbasync_t));
+    assert (self);
+    self->env = env;
+
+    // All the ends are ours; workers connect to them. Each worker has at
+    // most one request at a time, so neither side ever nears its HWM.
+    char bind_endpoint [s_endpoint_max + 1];
+    snprintf (self->results_endpoint, sizeof (self->results_endpoint),
+              "inproc://lmdbasync-%p-results", (void *) self);
+    snprintf (bind_endpoint, sizeof (bind_endpoint), "@%s", self->results_endpoint);
+    self->results = zsock_new_pull (bind_endpoint);
+    if (!self->results)
+        goto die;
+    self->poller = zpoller_new (self->results, NULL);
+    assert (self->poller);
+
+    self->workers = (s_worker_t *) lmdballoc_zmalloc (threads * sizeof (s_worker_t));
+    self->idle = (s_worker_t **) lmdballoc_zmalloc (threads * sizeof (s_worker_t *));
+    assert (self->workers);
+    assert (self->idle);
+    for (; self->worker_count < threads; self->worker_count++) {
+        s_worker_t *worker = &self->workers [self->worker_count];
+        worker->owner = self;
+        snprintf (worker->requests_endpoint, sizeof (worker->requests_endpoint),
+                  "inproc://lmdbasync-%p-requests-%zu", (void *) self, self->worker_count);
+        snprintf (bind_endpoint, sizeof (bind_endpoint), "@%s", worker->requests_endpoint);
+        worker->requests = zsock_new_push (bind_endpoint);
+        if (!worker->requests)
+            goto die;
+        worker->actor = zactor_new (s_worker_actor, worker);
+        if (!worker->actor) {
+            zsock_destroy (&worker->requests);
+            goto die;
+        }
+        self->idle [self->idle_count++] = worker;
+    }
+    return self;
+
+ die:
+    lmdbasync_destroy (&self);
+    return NULL;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the lmdbasync
+
+void
+lmdbasync_destroy (lmdbasync_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        lmdbasync_t *self = *self_p;
+        size_t i;
+        for (i = 0; i < self->worker_count; i++) {
+            zactor_destroy (&self->workers [i].actor);
+            zsock_destroy (&self->workers [i].requests);
+        }
+        lmdballoc_free (self->workers);
+        lmdballoc_free (self->idle);
+
+        while (self->outstanding) {
+            s_request_t *request = self->outstanding;
+            self->outstanding = request->next;
+            s_request_destroy (&request);
+        }
+        zpoller_destroy (&self->poller);
+        zsock_destroy (&self->results);
+        lmdballoc_free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Submitting requests
+
+static int
+s_submit (lmdbasync_t *self, lmdbdbi_t *dbi, const void *key, size_t key_size,
+          size_t max_records, lmdbasync_fn done, void *arg)
+{
+    s_request_t *request = (s_request_t *) lmdballoc_zmalloc (sizeof (s_request_t));
+    assert (request);
+    request->dbi = dbi;
+    request->done = done;
+    request->arg = arg;
+    request->max_records = max_records;
+    if (key) {
+        // One spare byte, so an empty key still isn't NULL
+        request->key = (byte *) lmdballoc_malloc (key_size + 1);
+        assert (request->key);
+        memcpy (request->key, key, key_size);
+        request->key_size = key_size;
+    }
+
+    if (self->queue_tail)
+        self->queue_tail->queued = request;
+    else
+        self->queue_head = request;
+    self->queue_tail = request;
+    self->queued++;
+    s_feed (self);
+
+    request->next = self->outstanding;
+    if (self->outstanding)
+        self->outstanding->prev = request;
+    self->outstanding = request;
+    self->pending++;
+    return 0;
+}
+
+int
+lmdbasync_get (lmdbasync_t *self, lmdbdbi_t *dbi, const void *key, size_t key_size,
+               lmdbasync_fn done, void *arg)
+{
+    assert (self);
+    assert (dbi);
+    assert (key);
+    assert (done);
+    return s_submit (self, dbi, key, key_size, 0, done, arg);
+}
+
+int
+lmdbasync_scan (lmdbasync_t *self, lmdbdbi_t *dbi, const void *from, size_t from_size,
+                size_t max_records, lmdbasync_fn done, void *arg)
+{
+    assert (self);
+    assert (dbi);
+    assert (done);
+    if (max_records == 0)
+        return -1;
+    return s_submit (self, dbi, from, from_size, max_records, done, arg);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Completions
+
+size_t
+lmdbasync_dispatch (lmdbasync_t *self, int timeout_msecs)
+{
+    assert (self);
+    size_t count = 0;
+    while (self->pending && zpoller_wait (self->poller, timeout_msecs) == self->results) {
+        s_request_t *request;
+        if (zsock_recv (self->results, "p", &request))
+            break;
+
+        // Its worker is free for the next, which can run while we call back
+        self->idle [self->idle_count++] = request->worker;
+        s_feed (self);
+
+        // Unlink first, so callbacks can submit more
+        if (request->prev)
+            request->prev->next = request->next;
+        else
+            self->outstanding = request->next;
+        if (request->next)
+            request->next->prev = request->prev;
+        self->pending--;
+
+        s_request_deliver (request);
+        s_request_destroy (&request);
+        count++;
+        timeout_msecs = 0;
+    }
+    return count;
+}
+
+zsock_t *
+lmdbasync_sock (lmdbasync_t *self)
+{
+    assert (self);
+    return self->results;
+}
+
+size_t
+lmdbasync_pending (lmdbasync_t *self)
+{
+    assert (self);
+    return self->pending;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+typedef struct {
+    size_t found;
+    size_t missing;
+    size_t scanned;
+    size_t ended;
+} s_test_counts_t;
+
+// Values are their uint32_t keys
+static void
+s_test_on_get (lmdbspan key, lmdbspan val, void *arg)
+{
+    s_test_counts_t *counts = (s_test_counts_t *) arg;
+    assert (lmdbspan_size (key) == sizeof (uint32_t));
+    if (lmdbspan_valid (val)) {
+        assert (val.size == key.size && memcmp (val.data, key.data, key.size) == 0);
+        counts->found++;
+    }
+    else
+        counts->missing++;
+}
+
+static void
+s_test_on_scan (lmdbspan key, lmdbspan val, void *arg)
+{
+    s_test_counts_t *counts = (s_test_counts_t *) arg;
+    if (! lmdbspan_valid (key)) {
+        counts->ended++;
+        return;
+    }
+    uint32_t expect = 990 + (uint32_t) counts->scanned;
+    assert (key.size == sizeof (expect) && memcmp (key.data, &expect, sizeof (expect)) == 0);
+    assert (val.size == sizeof (expect) && memcmp (val.data, &expect, sizeof (expect)) == 0);
+    counts->scanned++;
+}
+
+void
+lmdbasync_test (bool verbose)
+{
+    printf (" * lmdbasync: ");
+
+    //  @selftest
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+    assert (SELFTEST_DIR_RW);
+
+    char *test_db_path = zsys_sprintf ("%s/%s", SELFTEST_DIR_RW, "LMDBASYNC_TEST.db");
+    if (zsys_file_exists (test_db_path))
+        zsys_file_delete (test_db_path);
+    lmdbenv_t *env = lmdbenv_new (test_db_path);
+    assert (env);
+    zstr_free (&test_db_path);
+
+    lmdbdbi_t *dbi = lmdbdbi_new_intkeys (env, "nums");
+    assert (dbi);
+    lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
+    assert (txn);
+    uint32_t i;
+    for (i = 0; i < 1000; i++) {
+        int rc = lmdbdbi_put_ui32 (dbi, txn, i, &i, sizeof (i));
+        assert (rc == 0);
+    }
+    int rc = lmdbtxn_commit (txn);
+    assert (rc == 0);
+    lmdbtxn_destroy (&txn);
+
+    lmdbasync_t *async = lmdbasync_new (env, 4);
+    assert (async);
+    assert (lmdbasync_sock (async));
+
+    // 1000 hits and 100 misses, called back only from dispatch
+    s_test_counts_t counts = {0};
+    for (i = 0; i < 1100; i++) {
+        rc = lmdbasync_get (async, dbi, &i, sizeof (i), s_test_on_get, &counts);
+        assert (rc == 0);
+    }
+    rc = lmdbasync_scan (async, dbi, &(uint32_t) {990}, sizeof (uint32_t), 20,
+                         s_test_on_scan, &counts);
+    assert (rc == 0);
+    assert (lmdbasync_pending (async) == 1101);
+    assert (counts.found == 0);
+
+    // Each worker has just one request; the rest wait for whichever is
+    // ready first
+    assert (async->idle_count == 0);
+    assert (async->queued == 1101 - 4);
+
+    size_t dispatched = 0;
+    int64_t deadline = zclock_mono () + 5000;
+    while (lmdbasync_pending (async) && zclock_mono () < deadline)
+        dispatched += lmdbasync_dispatch (async, 100);
+    assert (dispatched == 1101);
+    assert (counts.found == 1000);
+    assert (counts.missing == 100);
+    assert (counts.scanned == 10);
+    assert (counts.ended == 1);
+    assert (async->idle_count == 4);
+    assert (async->queued == 0);
+
+    // Nothing pending, so nothing to wait for
+    assert (lmdbasync_dispatch (async, -1) == 0);
+
+    // Undispatched requests are dropped with the executor
+    rc = lmdbasync_get (async, dbi, &i, sizeof (i), s_test_on_get, &counts);
+    assert (rc == 0);
+    lmdbasync_destroy (&async);
+    assert (async == NULL);
+    assert (counts.missing == 100);
+
+    assert (lmdbasync_new (env, 0) == NULL);
+
+    lmdbdbi_destroy (&dbi);
+    lmdbenv_destroy (&env);
+
+    if (verbose)
+        log ("Gets and scans ran on workers, and called back on dispatch");
+    //  @end
+    printf ("OK\n");
+}
@@ -0,0 +1,564 @@
+/*  =========================================================================
+    lmdbbatch - Puts, dels and merges across DBs, kept in one flat buffer and applied in one write txn
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+/*
+@header
+    lmdbbatch - Puts, dels and merges across DBs, kept in one flat buffer and applied in one write txn
+@discuss
+    Callers in other languages pay for every call into C, so a txn of a
+    thousand puts is a thousand crossings. A batch is instead filled in
+    the caller's own memory, as a flat run of ops in a simple format, and
+    handed over whole: lmdbbatch_new_from copies it in, and one call to
+    lmdbbatch_apply writes it all in a single write txn.
+
+    Ops name their DB by slot, a small number given out by add dbi, so
+    the buffer holds nothing that's only meaningful in this process and
+    can be built elsewhere, saved, or sent.
+
+    Applying sorts the ops by DB and key first, as a staging txn does, so
+    that ops landing on the same pages are written together. Ops on the
+    same key keep their order, so the result is the same as applying them
+    as added.
+@end
+*/
+
+#include "classlmdb_classes.h"
+
+#include "logging.h"
+
+//  Each op's header, as laid out in the buffer; the key and val follow
+
+typedef struct {
+    uint8_t type;
+    uint8_t zero;
+    uint16_t slot;
+    int32_t op;
+    uint32_t key_size;
+    uint32_t val_size;
+} s_header_t;
+
+//  An op found in the buffer, for sorting
+
+typedef struct {
+    lmdbdbi_t *dbi;
+    const byte *key;
+    size_t key_size;
+    const byte *val;
+    size_t val_size;
+    int type;
+    int op;
+    size_t index;               // In the order added
+} s_op_t;
+
+#define s_max_slots 65536
+
+//  Structure of our class
+
+struct _lmdbbatch_t {
+    byte *data;
+    size_t size;
+    size_t max_size;
+    size_t count;
+
+    lmdbdbi_t **dbis;
+    size_t dbi_count;
+    size_t dbi_max;
+
+    // One per op after an apply: 0 applied, -1 failed
+    int8_t *status;
+    size_t status_count;
+};
+
+
+//  --------------------------------------------------------------------------
+//  Reading ops
+
+// Check the ops in data, and count them.
+// Returns 0 if they're well formed, -1 if not.
+static int
+s_validate (const byte *data, size_t size, size_t *count_p)
+{
+    size_t count = 0;
+    size_t offset = 0;
+    while (offset < size) {
+        s_header_t header;
+        if (size - offset < sizeof (header))
+            return -1;
+        memcpy (&header, data + offset, sizeof (header));
+        if (header.type < LMDBBATCH_PUT || header.type > LMDBBATCH_MERGE
+        ||  header.zero
+        ||  (header.type == LMDBBATCH_DEL && header.val_size))
+            return -1;
+        offset += sizeof (header);
+        if (size - offset < (uint64_t) header.key_size + header.val_size)
+            return -1;
+        offset += (size_t) header.key_size + header.val_size;
+        count++;
+    }
+    *count_p = count;
+    return 0;
+}
+
+// By dbi, then key in the dbi's order, then the order added
+static int
+s_compare (const void *a, const void *b)
+{
+    const s_op_t *x = (const s_op_t *) a;
+    const s_op_t *y = (const s_op_t *) b;
+    if (x->dbi != y->dbi)
+        return (uintptr_t) x->dbi < (uintptr_t) y->dbi ? -1 : 1;
+
+    int diff = 0;
+    if (lmdbdbi_intkeys (x->dbi) && x->key_size == y->key_size
+    &&  x->key_size == sizeof (uint64_t)) {
+        uint64_t x_num, y_num;
+        memcpy (&x_num, x->key, sizeof (x_num));
+        memcpy (&y_num, y->key, sizeof (y_num));
+        diff = x_num < y_num ? -1 : x_num > y_num;
+    }
+    else
+    if (lmdbdbi_intkeys (x->dbi) && x->key_size == y->key_size
+    &&  x->key_size == sizeof (uint32_t)) {
+        uint32_t x_num, y_num;
+        memcpy (&x_num, x->key, sizeof (x_num));
+        memcpy (&y_num, y->key, sizeof (y_num));
+        diff = x_num < y_num ? -1 : x_num > y_num;
+    }
+    else {
+        size_t common = x->key_size < y->key_size ? x->key_size : y->key_size;
+        diff = common ? memcmp (x->key, y->key, common) : 0;
+        if (!diff)
+            diff = x->key_size < y->key_size ? -1 : x->key_size > y->key_size;
+    }
+    if (diff)
+        return diff;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+// Find every op in the buffer, with its dbi.
+// Returns the ops, or NULL if an op's slot has no dbi.
+static s_op_t *
+s_ops (lmdbbatch_t *self)
+{
+    s_op_t *ops = (s_op_t *) lmdballoc_malloc ((self->count ? self->count : 1) * sizeof (s_op_t));
+    assert (ops);
+    size_t offset = 0;
+    size_t i;
+    for (i = 0; i < self->count; i++) {
+        s_header_t header;
+        memcpy (&header, self->data + offset, sizeof (header));
+        if (header.slot >= self->dbi_count) {
+            lmdballoc_free (ops);
+            return NULL;
+        }
+        offset += sizeof (header);
+        s_op_t *op = &ops [i];
+        op->dbi = self->dbis [header.slot];
+        op->key = self->data + offset;
+        op->key_size = header.key_size;
+        op->val = op->key + header.key_size;
+        op->val_size = header.val_size;
+        op->type = header.type;
+        op->op = header.op;
+        op->index = i;
+        offset += (size_t) header.key_size + header.val_size;
+    }
+    return ops;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Create a new lmdbbatch
+
+lmdbbatch_t *
+lmdbbatch_new (void)
+{
+    lmdbbatch_t *self = (lmdbbatch_t *) lmdballoc_zmalloc (sizeof (lmdbbatch_t));
+    assert (self);
+    return self;
+}
+
+lmdbbatch_t *
+lmdbbatch_new_from (const void *data, size_t size)
+{
+    assert (data || !size);
+    size_t count;
+    if (s_validate ((const byte *) data, size, &count))
+        return NULL;
+
+    lmdbbatch_t *self = lmdbbatch_new ();
+    if (size) {
+        self->data = (byte *) lmdballoc_malloc (size);
+        assert (self->data);
+        memcpy (self->data, data, size);
+    }
+    self->size = size;
+    self->max_size = size;
+    self->count = count;
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the lmdbbatch
+
+void
+lmdbbatch_destroy (lmdbbatch_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        lmdbbatch_t *self = *self_p;
+        lmdballoc_free (self->data);
+        lmdballoc_free (self->dbis);
+        lmdballoc_free (self->status);
+        lmdballoc_free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Filling
+
+int
+lmdbbatch_add_dbi (lmdbbatch_t *self, lmdbdbi_t *dbi)
+{
+    assert (self);
+    assert (dbi);
+    if (self->dbi_count == s_max_slots)
+        return -1;
+    if (self->dbi_count == self->dbi_max) {
+        self->dbi_max = self->dbi_max ? self->dbi_max * 2 : 4;
+        self->dbis = (lmdbdbi_t **) lmdballoc_realloc (self->dbis, self->dbi_max * sizeof (lmdbdbi_t *));
+        assert (self->dbis);
+    }
+    self->dbis [self->dbi_count] = dbi;
+    return (int) self->dbi_count++;
+}
+
+static int
+s_add (lmdbbatch_t *self, int type, int slot, const void *key, size_t key_size,
+       int op, const void *val, size_t val_size)
+{
+    assert (slot >= 0 && slot < s_max_slots);
+    assert (key || !key_size);
+    assert (val || !val_size);
+    if (key_size > UINT32_MAX || val_size > UINT32_MAX)
+        return -1;
+
+    size_t size = sizeof (s_header_t) + key_size + val_size;
+    if (self->size + size > self->max_size) {
+        size_t max_size = self->max_size ? self->max_size : 4096;
+        while (max_size < self->size + size)
+            max_size *= 2;
+        self->data = (byte *) lmdballoc_realloc (self->data, max_size);
+        assert (self->data);
+        self->max_size = max_size;
+    }
+    s_header_t header = {
+        .type = (uint8_t) type, .slot = (uint16_t) slot, .op = op,
+        .key_size = (uint32_t) key_size, .val_size = (uint32_t) val_size
+    };
+    byte *next = self->data + self->size;
+    memcpy (next, &header, sizeof (header));
+    if (key_size)
+        memcpy (next + sizeof (header), key, key_size);
+    if (val_size)
+        memcpy (next + sizeof (header) + key_size, val, val_size);
+    self->size += size;
+    self->count++;
+    return 0;
+}
+
+int
+lmdbbatch_put (lmdbbatch_t *self, int slot, const void *key, size_t key_size,
+               const void *val, size_t val_size)
+{
+    assert (self);
+    return s_add (self, LMDBBATCH_PUT, slot, key, key_size, 0, val, val_size);
+}
+
+int
+lmdbbatch_del (lmdbbatch_t *self, int slot, const void *key, size_t key_size)
+{
+    assert (self);
+    return s_add (self, LMDBBATCH_DEL, slot, key, key_size, 0, NULL, 0);
+}
+
+int
+lmdbbatch_merge (lmdbbatch_t *self, int slot, const void *key, size_t key_size,
+                 int op, const void *operand, size_t operand_size)
+{
+    assert (self);
+    return s_add (self, LMDBBATCH_MERGE, slot, key, key_size, op, operand, operand_size);
+}
+
+void
+lmdbbatch_reset (lmdbbatch_t *self)
+{
+    assert (self);
+    self->size = 0;
+    self->count = 0;
+    self->status_count = 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Applying
+
+// Would op be refused cleanly, leaving the txn as it was: a del of a key
+// that isn't there, or a merge its operator refuses? Any other failure
+// may leave the op half applied.
+static bool
+s_refused (s_op_t *op, lmdbtxn_t *txn)
+{
+    if (op->type == LMDBBATCH_PUT)
+        return false;
+    lmdbspan old = lmdbdbi_get (op->dbi, txn, op->key, op->key_size);
+    if (op->type == LMDBBATCH_DEL)
+        return ! lmdbspan_valid (old);
+    return lmdbmerge_apply (lmdbdbi_merge_ops (op->dbi), op->op, old.data, old.size,
+                            op->val, op->val_size, NULL, 0) == SIZE_MAX;
+}
+
+int
+lmdbbatch_apply (lmdbbatch_t *self, lmdbenv_t *env)
+{
+    assert (self);
+    assert (env);
+    self->status_count = 0;
+
+    s_op_t *ops = s_ops (self);
+    if (!ops)
+        return -1;
+    qsort (ops, self->count, sizeof (s_op_t), s_compare);
+
+    int8_t *status = (int8_t *) lmdballoc_realloc (self->status, self->count ? self->count : 1);
+    assert (status);
+    self->status = status;
+
+    int failed = -1;
+    lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
+    if (!txn)
+        goto die;
+
+    failed = 0;
+    size_t i;
+    for (i = 0; i < self->count; i++) {
+        s_op_t *op = &ops [i];
+        if (s_refused (op, txn)) {
+            status [op->index] = -1;
+            failed++;
+            continue;
+        }
+        int rc;
+        if (op->type == LMDBBATCH_PUT)
+            rc = lmdbdbi_put (op->dbi, txn, op->key, op->key_size, op->val, op->val_size);
+        else
+        if (op->type == LMDBBATCH_DEL)
+            rc = lmdbdbi_del (op->dbi, txn, op->key, op->key_size);
+        else
+            rc = lmdbdbi_merge (op->dbi, txn, op->key, op->key_size,
+                                op->op, op->val, op->val_size);
+        // Part of the op may be in the txn, so none of it can commit
+        if (rc) {
+            failed = -1;
+            goto die;
+        }
+        status [op->index] = 0;
+    }
+    if (lmdbtxn_commit (txn))
+        failed = -1;
+    else
+        self->status_count = self->count;
+
+die:
+    lmdbtxn_destroy (&txn);
+    lmdballoc_free (ops);
+    return failed;
+}
+
+int
+lmdbbatch_status (lmdbbatch_t *self, size_t index)
+{
+    assert (self);
+    return index < self->status_count ? self->status [index] : -1;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Accessors
+
+const void *
+lmdbbatch_data (lmdbbatch_t *self)
+{
+    assert (self);
+    return self->data;
+}
+
+size_t
+lmdbbatch_size (lmdbbatch_t *self)
+{
+    assert (self);
+    return self->size;
+}
+
+size_t
+lmdbbatch_count (lmdbbatch_t *self)
+{
+    assert (self);
+    return self->count;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+static void
+s_test_by_first_byte (lmdbidx_t *idx, const void *key, size_t key_size,
+                      const void *val, size_t val_size, void *arg)
+{
+    lmdbidx_emit (idx, val, 1);
+}
+
+void
+lmdbbatch_test (bool verbose)
+{
+    printf (" * lmdbbatch: ");
+
+    //  @selftest
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+    assert (SELFTEST_DIR_RW);
+
+    char *test_db_path = zsys_sprintf ("%s/%s", SELFTEST_DIR_RW, "LMDBBATCH_TEST.db");
+    if (zsys_file_exists (test_db_path))
+        zsys_file_delete (test_db_path);
+    lmdbenv_t *env = lmdbenv_new (test_db_path);
+    assert (env);
+    zstr_free (&test_db_path);
+    lmdbdbi_t *dbi = lmdbdbi_new (env, "names");
+    lmdbdbi_t *dbiik = lmdbdbi_new_intkeys (env, "counts");
+    assert (dbi && dbiik);
+
+    // Ops across two dbs, added out of key order, with a del of a key
+    // that isn't there and a merge the operator refuses
+    assert (sizeof (s_header_t) == LMDBBATCH_HEADER_SIZE);
+    lmdbbatch_t *batch = lmdbbatch_new ();
+    assert (batch);
+    int names = lmdbbatch_add_dbi (batch, dbi);
+    int counts = lmdbbatch_add_dbi (batch, dbiik);
+    assert (names == 0 && counts == 1);
+
+    uint64_t one = 1;
+    uint32_t key;
+    for (key = 10; key > 0; key--) {
+        int rc = lmdbbatch_merge (batch, counts, &key, sizeof (key),
+                                  LMDBDBI_MERGE_ADD_U64, &one, sizeof (one));
+        assert (rc == 0);
+    }
+    int rc = lmdbbatch_put (batch, names, "zed", 3, "last", 4);
+    assert (rc == 0);
+    rc = lmdbbatch_put (batch, names, "amy", 3, "first", 5);
+    assert (rc == 0);
+    rc = lmdbbatch_del (batch, names, "nobody", 6);
+    assert (rc == 0);
+    key = 3;
+    rc = lmdbbatch_merge (batch, counts, &key, sizeof (key),
+                          LMDBDBI_MERGE_ADD_U64, "x", 1);
+    assert (rc == 0);
+    // Ops on one key keep their order
+    rc = lmdbbatch_put (batch, names, "amy", 3, "again", 5);
+    assert (rc == 0);
+    assert (lmdbbatch_count (batch) == 15);
+    assert (lmdbbatch_status (batch, 0) == -1);
+
+    assert (lmdbbatch_apply (batch, env) == 2);
+    size_t index;
+    for (index = 0; index < 15; index++)
+        assert (lmdbbatch_status (batch, index) == (index == 12 || index == 13 ? -1 : 0));
+    assert (lmdbbatch_status (batch, 15) == -1);
+
+    lmdbtxn_t *txn = lmdbtxn_new_rdonly (env);
+    assert (txn);
+    lmdbspan zed = lmdbdbi_get (dbi, txn, "zed", 3);
+    assert (zed.size == 4 && memcmp (zed.data, "last", 4) == 0);
+    lmdbspan amy = lmdbdbi_get (dbi, txn, "amy", 3);
+    assert (amy.size == 5 && memcmp (amy.data, "again", 5) == 0);
+    lmdbspan three = lmdbdbi_get_ui32 (dbiik, txn, 3);
+    assert (three.size == 8 && memcmp (three.data, &one, 8) == 0);
+    lmdbtxn_destroy (&txn);
+
+    // The same ops, rebuilt from their bytes, apply the same way
+    lmdbbatch_t *copy = lmdbbatch_new_from (lmdbbatch_data (batch), lmdbbatch_size (batch));
+    assert (copy);
+    assert (lmdbbatch_count (copy) == 15);
+    assert (lmdbbatch_apply (copy, env) == -1);
+    lmdbbatch_add_dbi (copy, dbi);
+    lmdbbatch_add_dbi (copy, dbiik);
+    assert (lmdbbatch_apply (copy, env) == 2);
+
+    txn = lmdbtxn_new_rdonly (env);
+    assert (txn);
+    lmdbspan three_again = lmdbdbi_get_ui32 (dbiik, txn, 3);
+    uint64_t two = 2;
+    assert (three_again.size == 8 && memcmp (three_again.data, &two, 8) == 0);
+    lmdbtxn_destroy (&txn);
+    lmdbbatch_destroy (&copy);
+
+    // Malformed bytes are refused
+    assert (! lmdbbatch_new_from (lmdbbatch_data (batch), lmdbbatch_size (batch) - 1));
+    byte bad [LMDBBATCH_HEADER_SIZE] = { 9 };
+    assert (! lmdbbatch_new_from (bad, sizeof (bad)));
+    copy = lmdbbatch_new_from (NULL, 0);
+    assert (copy);
+    assert (lmdbbatch_apply (copy, env) == 0);
+    lmdbbatch_destroy (&copy);
+
+    // An op failing other than cleanly, as a put to an indexed DB of a key
+    // too long to index does, fails the lot, and none of it commits
+    lmdbdbi_t *dbiix = lmdbdbi_new (env, "people");
+    assert (dbiix);
+    lmdbidx_t *by_first = lmdbidx_new (env, dbiix, "people.first", s_test_by_first_byte, NULL);
+    assert (by_first);
+    lmdbbatch_reset (batch);
+    int people = lmdbbatch_add_dbi (batch, dbiix);
+    assert (people == 2);
+    rc = lmdbbatch_put (batch, people, "ann", 3, "a", 1);
+    assert (rc == 0);
+    char long_key [600];
+    memset (long_key, 'z', sizeof (long_key));
+    rc = lmdbbatch_put (batch, people, long_key, sizeof (long_key), "z", 1);
+    assert (rc == 0);
+    rc = lmdbbatch_apply (batch, env);
+    assert (rc == -1);
+    assert (lmdbbatch_status (batch, 0) == -1);
+    txn = lmdbtxn_new_rdonly (env);
+    assert (txn);
+    assert (! lmdbspan_valid (lmdbdbi_get (dbiix, txn, "ann", 3)));
+    assert (lmdbidx_count (by_first, txn, "a", 1) == 0);
+    lmdbtxn_destroy (&txn);
+    lmdbidx_destroy (&by_first);
+    lmdbdbi_destroy (&dbiix);
+
+    lmdbbatch_reset (batch);
+    assert (lmdbbatch_count (batch) == 0 && lmdbbatch_size (batch) == 0);
+    lmdbbatch_destroy (&batch);
+    assert (!batch);
+
+    lmdbdbi_destroy (&dbiik);
+    lmdbdbi_destroy (&dbi);
+    lmdbenv_destroy (&env);
+
+    if (verbose)
+        log ("Applied batches of ops across dbs");
+    //  @end
+    printf ("OK\n");
+}
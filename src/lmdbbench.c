@@ -0,0 +1,957 @@
+/*  =========================================================================
+    lmdbbench - Benchmarks for classlmdb
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+/*
+@header
+    lmdbbench - Benchmarks for classlmdb
+@discuss
+    Each benchmark builds its own DB files under the data directory (the
+    selftest scratch directory by default), times what it's measuring with
+    the wall clock, and prints one line per variant. Numbers are only
+    comparable between runs on the same machine.
+
+        lmdbbench --list
+        lmdbbench --records 200000 compression
+@end
+*/
+
+#include "classlmdb_classes.h"
+#include "classlmdb_lmdbfast.h"
+
+#include "logging.h"
+
+typedef struct {
+    const char *dir;
+    size_t records;
+    bool verbose;
+} bench_args_t;
+
+typedef struct {
+    const char *name;
+    const char *description;
+    void (*run) (bench_args_t *args);
+} bench_item_t;
+
+
+//  --------------------------------------------------------------------------
+//  Helpers
+
+// Fresh env in the data dir; big enough that no benchmark runs out of map
+static lmdbenv_t *
+s_fresh_env (bench_args_t *args, const char *name)
+{
+    char *path = zsys_sprintf ("%s/%s", args->dir, name);
+    if (zsys_file_exists (path))
+        zsys_file_delete (path);
+    lmdbenv_t *env = lmdbenv_new_withlimits (path, (size_t) 4 << 30, 10);
+    if (!env)
+        zsys_error ("lmdbbench: can't create env at %s", path);
+    zstr_free (&path);
+    return env;
+}
+
+// Bytes of the map actually in use
+static size_t
+s_used_size (lmdbenv_t *env)
+{
+    MDB_envinfo info;
+    MDB_stat stat;
+    mdb_env_info (lmdbenv_handle (env), &info);
+    mdb_env_stat (lmdbenv_handle (env), &stat);
+    return (info.me_last_pgno + 1) * stat.ms_psize;
+}
+
+static double
+s_rate (size_t count, int64_t usecs)
+{
+    return usecs > 0 ? count * 1e6 / usecs : 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Compression: plain vs compressed vs compressed with a trained dictionary
+
+// A JSON-ish record a few hundred bytes long, like the ones we store for real
+static size_t
+s_json_record (char *buf, size_t buf_size, uint32_t i)
+{
+    int n = snprintf (buf, buf_size,
+        "{\"id\": %u, \"type\": \"account\", \"status\": \"%s\", "
+        "\"owner\": {\"name\": \"user%u\", \"email\": \"user%u@example.com\", "
+        "\"created\": \"2017-%02u-%02uT%02u:%02u:00Z\"}, "
+        "\"limits\": {\"daily\": %u, \"monthly\": %u, \"currency\": \"GBP\"}, "
+        "\"flags\": [\"verified\", \"%s\", \"newsletter\"], "
+        "\"address\": {\"line1\": \"%u High Street\", \"city\": \"%s\", "
+        "\"postcode\": \"AB%u %uCD\", \"country\": \"United Kingdom\"}, "
+        "\"notes\": \"Imported from the legacy system; see ticket %u for details.\"}",
+        i, i % 7 ? "active" : "suspended", i, i,
+        i % 12 + 1, i % 28 + 1, i % 24, i % 60,
+        (i * 37) % 5000, (i * 37) % 50000,
+        i % 3 ? "premium" : "basic",
+        i % 300 + 1, i % 2 ? "London" : "Manchester",
+        i % 99, i % 9, i * 13);
+    return n + 1;
+}
+
+static void
+s_compression_variant (bench_args_t *args, const char *label, int mode)
+{
+    lmdbenv_t *env = s_fresh_env (args, "LMDBBENCH_COMPRESSION.db");
+    if (!env)
+        return;
+    lmdbdbi_t *dbi = mode == 0
+                   ? lmdbdbi_new (env, "bench")
+                   : lmdbdbi_new_compressed (env, "bench", 64);
+    if (!dbi) {
+        printf ("%-24s skipped, built without zstd\n", label);
+        lmdbenv_destroy (&env);
+        return;
+    }
+
+    char rec [1024];
+    size_t raw_bytes = 0;
+    uint32_t i = 0;
+
+    // With a dictionary, load a small first slice to train on
+    if (mode == 2) {
+        lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
+        for (; i < args->records / 50 + 100; i++) {
+            size_t size = s_json_record (rec, sizeof (rec), i);
+            lmdbdbi_put_ui32 (dbi, txn, i, rec, size);
+            raw_bytes += size;
+        }
+        lmdbtxn_commit (txn);
+        lmdbtxn_destroy (&txn);
+        if (lmdbdbi_train_dict (dbi, env, 16384))
+            printf ("%-24s dictionary training failed\n", label);
+    }
+
+    int64_t start = zclock_usecs ();
+    lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
+    for (; i < args->records; i++) {
+        size_t size = s_json_record (rec, sizeof (rec), i);
+        if (lmdbdbi_put_ui32 (dbi, txn, i, rec, size)) {
+            zsys_error ("lmdbbench: put failed at record %u", i);
+            break;
+        }
+        raw_bytes += size;
+    }
+    lmdbtxn_commit (txn);
+    lmdbtxn_destroy (&txn);
+    int64_t put_usecs = zclock_usecs () - start;
+    if (args->verbose)
+        zsys_info ("lmdbbench: %s loaded %zu raw bytes", label, raw_bytes);
+
+    start = zclock_usecs ();
+    size_t checked = 0;
+    txn = lmdbtxn_new_rdonly (env);
+    for (i = 0; i < args->records; i++) {
+        lmdbspan val = lmdbdbi_get_ui32 (dbi, txn, i);
+        checked += lmdbspan_valid (val);
+    }
+    lmdbtxn_destroy (&txn);
+    int64_t get_usecs = zclock_usecs () - start;
+    assert (checked == args->records);
+
+    size_t used = s_used_size (env);
+    printf ("%-24s put %10.0f/s  get %10.0f/s  file %8.1f MB  (%.2fx of raw)\n",
+            label, s_rate (args->records, put_usecs), s_rate (args->records, get_usecs),
+            used / 1e6, raw_bytes ? (double) used / raw_bytes : 0);
+
+    lmdbdbi_destroy (&dbi);
+    lmdbenv_destroy (&env);
+}
+
+static void
+s_bench_compression (bench_args_t *args)
+{
+    s_compression_variant (args, "plain", 0);
+    s_compression_variant (args, "zstd", 1);
+    s_compression_variant (args, "zstd + dictionary", 2);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Filter: gets where 80% of keys are absent, with and without a filter
+
+static void
+s_filter_variant (bench_args_t *args, const char *label, bool filtered)
+{
+    lmdbenv_t *env = s_fresh_env (args, "LMDBBENCH_FILTER.db");
+    if (!env)
+        return;
+    lmdbdbi_t *dbi = lmdbdbi_new (env, "bench");
+    if (filtered && lmdbdbi_enable_filter (dbi, env, args->records)) {
+        printf ("%-24s couldn't enable filter\n", label);
+        goto cleanup;
+    }
+
+    // Even keys are present, and we look up five times as many keys as
+    // there are records, so four in five lookups miss
+    lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
+    uint64_t i;
+    for (i = 0; i < args->records; i++) {
+        uint64_t key = i * 2;
+        lmdbdbi_put (dbi, txn, &key, sizeof (key), &i, sizeof (i));
+    }
+    lmdbtxn_commit (txn);
+    lmdbtxn_destroy (&txn);
+
+    int64_t start = zclock_usecs ();
+    size_t found = 0;
+    txn = lmdbtxn_new_rdonly (env);
+    for (i = 0; i < args->records * 5; i++) {
+        uint64_t key = i < args->records ? i * 2 : i * 2 + 1;
+        found += lmdbspan_valid (lmdbdbi_get (dbi, txn, &key, sizeof (key)));
+    }
+    lmdbtxn_destroy (&txn);
+    int64_t get_usecs = zclock_usecs () - start;
+    assert (found == args->records);
+
+    printf ("%-24s get %10.0f/s", label, s_rate (args->records * 5, get_usecs));
+    if (filtered) {
+        uint64_t skips = lmdbdbi_filter_skips (dbi);
+        uint64_t fps = lmdbdbi_filter_false_positives (dbi);
+        printf ("  skipped %.1f%% of misses, false positive rate %.2f%%",
+                100.0 * skips / (skips + fps), 100.0 * fps / (skips + fps));
+    }
+    printf ("\n");
+
+ cleanup:
+    lmdbdbi_destroy (&dbi);
+    lmdbenv_destroy (&env);
+}
+
+static void
+s_bench_filter (bench_args_t *args)
+{
+    s_filter_variant (args, "unfiltered", false);
+    s_filter_variant (args, "bloom filter", true);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Merge: counter increments by get + put, by merge, and by merge batch
+
+#define s_merge_counters 1000
+
+static void
+s_merge_variant (bench_args_t *args, const char *label, int mode)
+{
+    lmdbenv_t *env = s_fresh_env (args, "LMDBBENCH_MERGE.db");
+    if (!env)
+        return;
+    lmdbdbi_t *dbi = lmdbdbi_new (env, "bench");
+
+    // Increments spread over a fixed set of counters, batched as a client
+    // would send them
+    size_t batch = 1000;
+    uint32_t *keys = (uint32_t *) malloc (batch * sizeof (uint32_t));
+    uint64_t *deltas = (uint64_t *) malloc (batch * sizeof (uint64_t));
+    assert (keys && deltas);
+
+    int64_t start = zclock_usecs ();
+    lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
+    size_t done = 0;
+    while (done < args->records) {
+        size_t n = args->records - done < batch ? args->records - done : batch;
+        size_t i;
+        for (i = 0; i < n; i++) {
+            keys [i] = (uint32_t) ((done + i) * 7919 % s_merge_counters);
+            deltas [i] = 1;
+        }
+        if (mode == 2)
+            lmdbdbi_merge_batch (dbi, txn, LMDBDBI_MERGE_ADD_U64,
+                                 keys, sizeof (uint32_t), deltas, 8, n);
+        else
+        if (mode == 1)
+            for (i = 0; i < n; i++)
+                lmdbdbi_merge (dbi, txn, &keys [i], sizeof (uint32_t),
+                               LMDBDBI_MERGE_ADD_U64, &deltas [i], 8);
+        else
+            for (i = 0; i < n; i++) {
+                uint64_t count = 0;
+                lmdbspan old = lmdbdbi_get (dbi, txn, &keys [i], sizeof (uint32_t));
+                if (lmdbspan_valid (old))
+                    memcpy (&count, old.data, 8);
+                count += deltas [i];
+                lmdbdbi_put (dbi, txn, &keys [i], sizeof (uint32_t), &count, 8);
+            }
+        done += n;
+    }
+    lmdbtxn_commit (txn);
+    lmdbtxn_destroy (&txn);
+    int64_t usecs = zclock_usecs () - start;
+
+    // Every increment landed
+    uint64_t total = 0;
+    txn = lmdbtxn_new_rdonly (env);
+    uint32_t key;
+    for (key = 0; key < s_merge_counters; key++) {
+        lmdbspan val = lmdbdbi_get (dbi, txn, &key, sizeof (key));
+        uint64_t count = 0;
+        if (lmdbspan_valid (val))
+            memcpy (&count, val.data, 8);
+        total += count;
+    }
+    lmdbtxn_destroy (&txn);
+    assert (total == args->records);
+
+    printf ("%-24s %10.0f increments/s\n", label, s_rate (args->records, usecs));
+
+    free (keys);
+    free (deltas);
+    lmdbdbi_destroy (&dbi);
+    lmdbenv_destroy (&env);
+}
+
+static void
+s_bench_merge (bench_args_t *args)
+{
+    s_merge_variant (args, "get + put", 0);
+    s_merge_variant (args, "merge", 1);
+    s_merge_variant (args, "merge batch", 2);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Columns: reading an intkeys dbi of doubles row by row vs into columns
+
+#define s_column_batch 4096
+
+static void
+s_bench_columns (bench_args_t *args)
+{
+    lmdbenv_t *env = s_fresh_env (args, "LMDBBENCH_COLUMNS.db");
+    if (!env)
+        return;
+    lmdbdbi_t *dbi = lmdbdbi_new_intkeys (env, "bench");
+    lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
+    uint32_t i;
+    for (i = 0; i < args->records; i++) {
+        double val = i * 0.25;
+        lmdbdbi_put_ui32 (dbi, txn, i, &val, sizeof (val));
+    }
+    lmdbtxn_commit (txn);
+    lmdbtxn_destroy (&txn);
+
+    uint64_t *keys = (uint64_t *) malloc (s_column_batch * sizeof (uint64_t));
+    double *vals = (double *) malloc (s_column_batch * sizeof (double));
+    assert (keys && vals);
+    txn = lmdbtxn_new_rdonly (env);
+
+    // What a caller filling arrays a row at a time does
+    int64_t start = zclock_usecs ();
+    double sum = 0;
+    size_t rows = 0;
+    lmdbcur_t *cur = lmdbcur_new_overall (dbi, txn);
+    do {
+        lmdbspan key = lmdbcur_key (cur);
+        if (! lmdbspan_valid (key))
+            break;
+        keys [rows % s_column_batch] = lmdbspan_asui32 (key);
+        vals [rows % s_column_batch] = lmdbspan_asdouble (lmdbcur_val (cur));
+        sum += vals [rows % s_column_batch];
+        rows++;
+    } while (lmdbcur_next (cur) == 0);
+    lmdbcur_destroy (&cur);
+    int64_t row_usecs = zclock_usecs () - start;
+    assert (rows == args->records);
+    printf ("%-24s read %10.0f/s\n", "row by row", s_rate (rows, row_usecs));
+
+    start = zclock_usecs ();
+    double column_sum = 0;
+    rows = 0;
+    cur = lmdbcur_new_overall (dbi, txn);
+    size_t batch;
+    while ((batch = lmdbcur_columns (cur, s_column_batch,
+                                     keys, sizeof (uint32_t), LMDBCUR_COLUMN_U32_U64,
+                                     vals, sizeof (double), LMDBCUR_COLUMN_COPY))) {
+        size_t j;
+        for (j = 0; j < batch; j++)
+            column_sum += vals [j];
+        rows += batch;
+    }
+    lmdbcur_destroy (&cur);
+    int64_t column_usecs = zclock_usecs () - start;
+    assert (rows == args->records);
+    assert (column_sum == sum);
+    printf ("%-24s read %10.0f/s\n", "columns", s_rate (rows, column_usecs));
+
+    lmdbtxn_destroy (&txn);
+    free (keys);
+    free (vals);
+    lmdbdbi_destroy (&dbi);
+    lmdbenv_destroy (&env);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Intkeys: 64 bit keys compared as numbers vs big endian, byte by byte
+
+static void
+s_intkeys_variant (bench_args_t *args, const char *label, bool intkeys)
+{
+    lmdbenv_t *env = s_fresh_env (args, "LMDBBENCH_INTKEYS.db");
+    if (!env)
+        return;
+    lmdbdbi_t *dbi = intkeys
+                   ? lmdbdbi_new_intkeys (env, "bench")
+                   : lmdbdbi_new (env, "bench");
+
+    // Random keys, as ids hashed or handed out by many writers are; the
+    // same sequence for both variants
+    uint64_t seed = 88172645463325252ULL;
+    byte key [8];
+    lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
+    int64_t start = zclock_usecs ();
+    size_t i;
+    for (i = 0; i < args->records; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        if (intkeys)
+            lmdbdbi_put_ui64 (dbi, txn, seed, &i, sizeof (i));
+        else {
+            int shift;
+            for (shift = 0; shift < 8; shift++)
+                key [shift] = (byte) (seed >> (56 - 8 * shift));
+            lmdbdbi_put (dbi, txn, key, sizeof (key), &i, sizeof (i));
+        }
+    }
+    lmdbtxn_commit (txn);
+    lmdbtxn_destroy (&txn);
+    int64_t put_usecs = zclock_usecs () - start;
+
+    seed = 88172645463325252ULL;
+    size_t found = 0;
+    txn = lmdbtxn_new_rdonly (env);
+    start = zclock_usecs ();
+    for (i = 0; i < args->records; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        if (intkeys)
+            found += lmdbspan_valid (lmdbdbi_get_ui64 (dbi, txn, seed));
+        else {
+            int shift;
+            for (shift = 0; shift < 8; shift++)
+                key [shift] = (byte) (seed >> (56 - 8 * shift));
+            found += lmdbspan_valid (lmdbdbi_get (dbi, txn, key, sizeof (key)));
+        }
+    }
+    int64_t get_usecs = zclock_usecs () - start;
+    lmdbtxn_destroy (&txn);
+    assert (found == args->records);
+
+    printf ("%-24s put %10.0f/s  get %10.0f/s\n", label,
+            s_rate (args->records, put_usecs), s_rate (args->records, get_usecs));
+    lmdbdbi_destroy (&dbi);
+    lmdbenv_destroy (&env);
+}
+
+static void
+s_bench_intkeys (bench_args_t *args)
+{
+    s_intkeys_variant (args, "big endian bytes", false);
+    if (sizeof (size_t) == sizeof (uint64_t))
+        s_intkeys_variant (args, "intkeys", true);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Staging: random order puts written as they come vs staged and sorted
+
+static void
+s_staging_variant (bench_args_t *args, const char *label, size_t budget)
+{
+    lmdbenv_t *env = s_fresh_env (args, "LMDBBENCH_STAGING.db");
+    if (!env)
+        return;
+    lmdbdbi_t *dbi = lmdbdbi_new (env, "bench");
+    char val [100];
+    memset (val, 'x', sizeof (val));
+
+    uint64_t seed = 88172645463325252ULL;
+    int64_t start = zclock_usecs ();
+    lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
+    if (budget)
+        lmdbtxn_stage (txn, budget);
+    size_t i;
+    for (i = 0; i < args->records; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        lmdbdbi_put (dbi, txn, &seed, sizeof (seed), val, sizeof (val));
+    }
+    int rc = lmdbtxn_commit (txn);
+    assert (rc == 0);
+    lmdbtxn_destroy (&txn);
+    int64_t usecs = zclock_usecs () - start;
+
+    printf ("%-24s put %10.0f/s\n", label, s_rate (args->records, usecs));
+    lmdbdbi_destroy (&dbi);
+    lmdbenv_destroy (&env);
+}
+
+static void
+s_bench_staging (bench_args_t *args)
+{
+    s_staging_variant (args, "direct", 0);
+    s_staging_variant (args, "staged, 16MB budget", 16 << 20);
+    s_staging_variant (args, "staged, 256MB budget", 256 << 20);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Read cache: gets of a hot set of keys just put, in one write txn,
+//  searching the tree each time vs from the txn's cache
+
+#define CACHE_HOT_KEYS 1024
+
+static void
+s_readcache_variant (bench_args_t *args, const char *label, size_t budget)
+{
+    lmdbenv_t *env = s_fresh_env (args, "LMDBBENCH_READCACHE.db");
+    if (!env)
+        return;
+    lmdbdbi_t *dbi = lmdbdbi_new (env, "bench");
+    char val [100];
+    memset (val, 'x', sizeof (val));
+
+    lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
+    if (budget)
+        lmdbtxn_cache (txn, budget);
+    uint64_t seed = 88172645463325252ULL;
+    size_t i;
+    for (i = 0; i < args->records; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        uint64_t key = seed % args->records;
+        lmdbdbi_put (dbi, txn, &key, sizeof (key), val, sizeof (val));
+    }
+
+    size_t found = 0;
+    int64_t start = zclock_usecs ();
+    for (i = 0; i < args->records; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        uint64_t key = seed % args->records % CACHE_HOT_KEYS;
+        found += lmdbspan_valid (lmdbdbi_get (dbi, txn, &key, sizeof (key)));
+    }
+    int64_t usecs = zclock_usecs () - start;
+    int rc = lmdbtxn_commit (txn);
+    assert (rc == 0);
+    lmdbtxn_destroy (&txn);
+
+    printf ("%-24s get %10.0f/s  (%zu found)\n", label,
+            s_rate (args->records, usecs), found);
+    lmdbdbi_destroy (&dbi);
+    lmdbenv_destroy (&env);
+}
+
+static void
+s_bench_readcache (bench_args_t *args)
+{
+    s_readcache_variant (args, "uncached", 0);
+    s_readcache_variant (args, "cached, 1MB budget", 1 << 20);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Fast path: string key gets and cursor walks through the library calls
+//  vs the lmdbfast inline functions, on a plain dbi
+
+#define FAST_KEY_SIZE 12        // "key" + 8 digits + NULL
+
+static void
+s_fastpath_gets (bench_args_t *args, const char *label, int mode,
+                 lmdbenv_t *env, lmdbdbi_t *dbi, const char *keys)
+{
+    lmdbtxn_t *txn = lmdbtxn_new_rdonly (env);
+    MDB_txn *mtxn = lmdbtxn_handle (txn);
+    MDB_dbi mdbi = lmdbdbi_handle (dbi);
+    uint64_t seed = 88172645463325252ULL;
+    size_t found = 0;
+    int64_t start = zclock_usecs ();
+    size_t i;
+    for (i = 0; i < args->records; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        const char *key = keys + (seed % args->records) * FAST_KEY_SIZE;
+        if (mode == 0)
+            found += lmdbspan_valid (lmdbdbi_get_str (dbi, txn, key));
+        else
+        if (mode == 1)
+            found += lmdbspan_valid (lmdbdbi_get_strn (dbi, txn, key, FAST_KEY_SIZE - 1));
+        else
+            found += lmdbspan_valid (lmdbfast_get_strn (mtxn, mdbi, key, FAST_KEY_SIZE - 1));
+    }
+    int64_t usecs = zclock_usecs () - start;
+    lmdbtxn_destroy (&txn);
+    assert (found == args->records);
+    printf ("%-24s get %10.0f/s\n", label, s_rate (args->records, usecs));
+}
+
+static void
+s_fastpath_walk (bench_args_t *args, const char *label, bool fast,
+                 lmdbenv_t *env, lmdbdbi_t *dbi)
+{
+    lmdbtxn_t *txn = lmdbtxn_new_rdonly (env);
+    lmdbcur_t *cur = lmdbcur_new_overall (dbi, txn);
+    size_t count = 0;
+    size_t bytes = 0;
+    int64_t start = zclock_usecs ();
+    lmdbspan val = lmdbcur_val (cur);
+    if (lmdbspan_valid (val)) {
+        count++;
+        bytes += lmdbspan_size (val);
+        if (fast) {
+            MDB_cursor *mcur = lmdbcur_handle (cur);
+            MDB_val mkey, mval;
+            while (lmdbfast_next (mcur, &mkey, &mval) == 0) {
+                count++;
+                bytes += mval.mv_size;
+            }
+        }
+        else
+            while (lmdbcur_next (cur) == 0) {
+                count++;
+                bytes += lmdbspan_size (lmdbcur_val (cur));
+            }
+    }
+    int64_t usecs = zclock_usecs () - start;
+    lmdbcur_destroy (&cur);
+    lmdbtxn_destroy (&txn);
+    assert (count == args->records);
+    assert (bytes == args->records * sizeof (size_t));
+    printf ("%-24s walk %10.0f/s\n", label, s_rate (count, usecs));
+}
+
+static int
+s_fastpath_visit (const void *key, size_t key_size, const void *val, size_t val_size, void *arg)
+{
+    size_t *bytes = (size_t *) arg;
+    *bytes += val_size;
+    return 0;
+}
+
+static void
+s_fastpath_foreach (bench_args_t *args, const char *label,
+                    lmdbenv_t *env, lmdbdbi_t *dbi)
+{
+    lmdbtxn_t *txn = lmdbtxn_new_rdonly (env);
+    size_t bytes = 0;
+    int64_t start = zclock_usecs ();
+    int rc = lmdbdbi_foreach_range (dbi, txn, NULL, 0, NULL, 0, s_fastpath_visit, &bytes);
+    int64_t usecs = zclock_usecs () - start;
+    lmdbtxn_destroy (&txn);
+    assert (rc == 0);
+    assert (bytes == args->records * sizeof (size_t));
+    printf ("%-24s walk %10.0f/s\n", label, s_rate (args->records, usecs));
+}
+
+static void
+s_bench_fastpath (bench_args_t *args)
+{
+    lmdbenv_t *env = s_fresh_env (args, "LMDBBENCH_FASTPATH.db");
+    if (!env)
+        return;
+    lmdbdbi_t *dbi = lmdbdbi_new (env, "bench");
+    assert (lmdbdbi_plain (dbi));
+
+    char *keys = (char *) malloc (args->records * FAST_KEY_SIZE);
+    assert (keys);
+    lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
+    size_t i;
+    for (i = 0; i < args->records; i++) {
+        char *key = keys + i * FAST_KEY_SIZE;
+        snprintf (key, FAST_KEY_SIZE, "key%08u", (unsigned) (i % 100000000));
+        lmdbdbi_put_strn (dbi, txn, key, FAST_KEY_SIZE - 1, &i, sizeof (i));
+    }
+    lmdbtxn_commit (txn);
+    lmdbtxn_destroy (&txn);
+
+    s_fastpath_gets (args, "get_str", 0, env, dbi, keys);
+    s_fastpath_gets (args, "get_strn", 1, env, dbi, keys);
+    s_fastpath_gets (args, "lmdbfast_get_strn", 2, env, dbi, keys);
+    s_fastpath_walk (args, "lmdbcur_next", false, env, dbi);
+    s_fastpath_walk (args, "lmdbfast_next", true, env, dbi);
+    s_fastpath_foreach (args, "foreach_range", env, dbi);
+
+    free (keys);
+    lmdbdbi_destroy (&dbi);
+    lmdbenv_destroy (&env);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Memtable: increments to a few thousand hot counters, each committed on
+//  its own vs absorbed by a memtable
+
+static void
+s_bench_memtable (bench_args_t *args)
+{
+    int mode;
+    for (mode = 0; mode < 2; mode++) {
+        lmdbenv_t *env = s_fresh_env (args, "LMDBBENCH_MEMTABLE.db");
+        if (!env)
+            return;
+        lmdbdbi_t *dbi = lmdbdbi_new (env, "bench");
+        lmdbmemtable_t *memtable = mode
+                                 ? lmdbmemtable_new (env, dbi, 64 << 20, 16 << 20, 100)
+                                 : NULL;
+        lmdbtxn_t *reader = lmdbtxn_new_rdonly (env);
+        uint64_t seed = 88172645463325252ULL;
+        uint64_t one = 1;
+        int64_t start = zclock_usecs ();
+        size_t i;
+        for (i = 0; i < args->records; i++) {
+            seed ^= seed << 13;
+            seed ^= seed >> 7;
+            seed ^= seed << 17;
+            uint32_t key = seed % 4096;
+            if (memtable)
+                lmdbmemtable_merge (memtable, reader, &key, sizeof (key),
+                                    LMDBDBI_MERGE_ADD_U64, &one, sizeof (one));
+            else {
+                lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
+                lmdbdbi_merge (dbi, txn, &key, sizeof (key),
+                               LMDBDBI_MERGE_ADD_U64, &one, sizeof (one));
+                lmdbtxn_commit (txn);
+                lmdbtxn_destroy (&txn);
+            }
+        }
+        lmdbmemtable_destroy (&memtable);
+        int64_t usecs = zclock_usecs () - start;
+        lmdbtxn_destroy (&reader);
+
+        printf ("%-24s merge %10.0f/s\n", mode ? "memtable" : "txn per increment",
+                s_rate (args->records, usecs));
+        lmdbdbi_destroy (&dbi);
+        lmdbenv_destroy (&env);
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Readers: get throughput as reader threads are added, up to one per core
+
+typedef struct {
+    lmdbenv_t *env;
+    lmdbdbi_t *dbi;
+    size_t records;
+    size_t found;
+} s_reader_t;
+
+// Gets random keys, renewing its txn every thousand, as a request handling
+// thread would. Waits for "GO" so that all readers start together.
+static void
+s_reader_actor (zsock_t *pipe, void *args)
+{
+    s_reader_t *reader = (s_reader_t *) args;
+    zsock_signal (pipe, 0);
+    char *command = zstr_recv (pipe);
+    if (command && streq (command, "GO")) {
+        lmdbtxn_t *txn = lmdbtxn_new_rdonly (reader->env);
+        uint64_t seed = (uintptr_t) reader | 1;
+        size_t i;
+        for (i = 0; txn && i < reader->records; i++) {
+            if (i % 1000 == 999) {
+                lmdbtxn_reset (txn);
+                lmdbtxn_renew (txn);
+            }
+            // xorshift64
+            seed ^= seed << 13;
+            seed ^= seed >> 7;
+            seed ^= seed << 17;
+            uint64_t key = seed % reader->records;
+            reader->found += lmdbspan_valid (lmdbdbi_get (reader->dbi, txn, &key, sizeof (key)));
+        }
+        lmdbtxn_destroy (&txn);
+        zsock_signal (pipe, 0);
+
+        // Then wait for $TERM
+        zstr_free (&command);
+        command = zstr_recv (pipe);
+    }
+    zstr_free (&command);
+}
+
+static void
+s_readers_variant (bench_args_t *args, lmdbenv_t *env, lmdbdbi_t *dbi,
+                   size_t threads, double *single_rate)
+{
+    s_reader_t *readers = (s_reader_t *) zmalloc (threads * sizeof (s_reader_t));
+    zactor_t **actors = (zactor_t **) zmalloc (threads * sizeof (zactor_t *));
+    assert (readers && actors);
+    size_t i;
+    for (i = 0; i < threads; i++) {
+        readers [i] = (s_reader_t) { .env = env, .dbi = dbi, .records = args->records };
+        actors [i] = zactor_new (s_reader_actor, &readers [i]);
+        assert (actors [i]);
+    }
+
+    // Every thread does the same number of gets, so perfect scaling
+    // multiplies the total rate by the thread count
+    int64_t start = zclock_usecs ();
+    for (i = 0; i < threads; i++)
+        zstr_send (actors [i], "GO");
+    for (i = 0; i < threads; i++)
+        zsock_wait (actors [i]);
+    int64_t usecs = zclock_usecs () - start;
+
+    for (i = 0; i < threads; i++) {
+        assert (readers [i].found == args->records);
+        zactor_destroy (&actors [i]);
+    }
+    double rate = s_rate (threads * args->records, usecs);
+    if (threads == 1)
+        *single_rate = rate;
+    char label [32];
+    snprintf (label, sizeof (label), "%zu thread%s", threads, threads == 1 ? "" : "s");
+    printf ("%-24s get %10.0f/s  x%.2f\n",
+            label, rate, *single_rate > 0 ? rate / *single_rate : 0);
+    free (actors);
+    free (readers);
+}
+
+static void
+s_bench_readers (bench_args_t *args)
+{
+    long cores = sysconf (_SC_NPROCESSORS_ONLN);
+    if (cores < 1)
+        cores = 1;
+
+    char *path = zsys_sprintf ("%s/%s", args->dir, "LMDBBENCH_READERS.db");
+    if (zsys_file_exists (path))
+        zsys_file_delete (path);
+    lmdbenv_t *env = lmdbenv_new_threaded (path, (size_t) 4 << 30, 10, (unsigned int) cores + 1);
+    zstr_free (&path);
+    if (!env) {
+        zsys_error ("lmdbbench: can't create env");
+        return;
+    }
+    lmdbdbi_t *dbi = lmdbdbi_new (env, "bench");
+
+    lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
+    char val [100];
+    memset (val, 'v', sizeof (val));
+    uint64_t i;
+    for (i = 0; i < args->records; i++)
+        lmdbdbi_put (dbi, txn, &i, sizeof (i), val, sizeof (val));
+    lmdbtxn_commit (txn);
+    lmdbtxn_destroy (&txn);
+
+    double single_rate = 0;
+    size_t threads;
+    for (threads = 1; threads < (size_t) cores; threads *= 2)
+        s_readers_variant (args, env, dbi, threads, &single_rate);
+    s_readers_variant (args, env, dbi, (size_t) cores, &single_rate);
+
+    lmdbdbi_destroy (&dbi);
+    lmdbenv_destroy (&env);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Table of benchmarks
+
+static bench_item_t
+all_benches [] = {
+    { "compression", "put/get throughput and file size with compressed values",
+      s_bench_compression },
+    { "filter", "get throughput with mostly absent keys, with and without a filter",
+      s_bench_filter },
+    { "merge", "counter increments by get + put vs merge operators",
+      s_bench_merge },
+    { "columns", "intkeys read throughput row by row vs into columns",
+      s_bench_columns },
+    { "intkeys", "put/get throughput of 64 bit keys as intkeys vs big endian bytes",
+      s_bench_intkeys },
+    { "staging", "random order put throughput direct vs staged in the txn",
+      s_bench_staging },
+    { "readcache", "hot key gets in a write txn, uncached vs from the txn's cache",
+      s_bench_readcache },
+    { "fastpath", "string key gets and walks, library calls vs lmdbfast inlines vs foreach",
+      s_bench_fastpath },
+    { "memtable", "hot counter increments, a txn each vs through a memtable",
+      s_bench_memtable },
+    { "readers", "get throughput from 1 reader thread up to one per core",
+      s_bench_readers },
+    {0, 0, 0}       //  Sentinel
+};
+
+int
+main (int argc, char **argv)
+{
+    bench_args_t args = { .dir = "src/selftest-rw", .records = 100000 };
+    const char *only = NULL;
+    bench_item_t *item;
+    int argn;
+    for (argn = 1; argn < argc; argn++) {
+        if (streq (argv [argn], "--help")
+        ||  streq (argv [argn], "-h")) {
+            puts ("lmdbbench [options] [name]");
+            puts ("  --verbose / -v         verbose output");
+            puts ("  --list / -l            list all benchmarks");
+            puts ("  --records / -r [n]     records per benchmark (default 100000)");
+            puts ("  --dir / -d [path]      where to create DB files (default src/selftest-rw)");
+            return 0;
+        }
+        else
+        if (streq (argv [argn], "--verbose")
+        ||  streq (argv [argn], "-v"))
+            args.verbose = true;
+        else
+        if (streq (argv [argn], "--list")
+        ||  streq (argv [argn], "-l")) {
+            for (item = all_benches; item->run; item++)
+                printf ("    %-16s %s\n", item->name, item->description);
+            return 0;
+        }
+        else
+        if ((streq (argv [argn], "--records")
+        ||   streq (argv [argn], "-r")) && argn + 1 < argc)
+            args.records = strtoul (argv [++argn], NULL, 10);
+        else
+        if ((streq (argv [argn], "--dir")
+        ||   streq (argv [argn], "-d")) && argn + 1 < argc)
+            args.dir = argv [++argn];
+        else
+        if (argv [argn][0] != '-')
+            only = argv [argn];
+        else {
+            printf ("Unknown option: %s\n", argv [argn]);
+            return 1;
+        }
+    }
+
+    zsys_init ();
+    zsys_dir_create (args.dir);
+
+    bool found = false;
+    for (item = all_benches; item->run; item++) {
+        if (only && !streq (only, item->name))
+            continue;
+        found = true;
+        printf ("== %s (%zu records)\n", item->name, args.records);
+        item->run (&args);
+    }
+    if (!found) {
+        printf ("Unknown benchmark: %s\n", only);
+        return 1;
+    }
+    return 0;
+}
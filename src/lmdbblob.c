@@ -0,0 +1,500 @@
+/*  =========================================================================
+    lmdbblob - Large values stored as chunks, written and read as streams
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+/*
+@header
+    lmdbblob - Large values stored as chunks, written and read as streams
+@discuss
+    A value of tens of megabytes put in one go needs a buffer that big on
+    the way in, and a run of free pages that long in the map, which gets
+    harder to find as the file's free list fragments. Here it's split
+    into chunks, each its own pair, keyed by the blob's key followed by
+    the chunk's number, 8 bytes big endian, so a blob's chunks sort
+    together and in order. Number 0 is the header, holding the blob's
+    size and chunk size, and is written last, so a blob whose writer
+    didn't finish reads as missing.
+
+    The default chunk size fills 16 pages exactly, once LMDB's page header
+    is taken off, so chunks waste no space in their overflow pages and
+    only ever need short runs of free ones.
+
+    Readers fetch only the chunks a read touches, and hand back spans
+    into the map, so serving part of a blob costs neither a copy of it
+    nor the memory to hold one.
+@end
+*/
+
+#include "classlmdb_classes.h"
+
+#include "logging.h"
+
+#define s_number_size 8
+#define s_default_pages 16
+#define s_page_header 16
+
+typedef struct {
+    uint64_t size;
+    uint64_t chunk_size;
+} s_header_t;
+
+//  Structure of our class
+
+struct _lmdbblob_t {
+    lmdbdbi_t *dbi;
+    lmdbtxn_t *txn;
+    bool is_writer;
+
+    // The blob's key, with room after it for a chunk number
+    byte *key;
+    size_t key_size;
+
+    uint64_t size;              // Of the blob, or written so far
+    size_t chunk_size;
+
+    // Writers: the last chunk until it's full, the next chunk's number,
+    // and how many chunks the blob being replaced had
+    byte *buf;
+    size_t buf_used;
+    uint64_t next_chunk;
+    uint64_t old_chunks;
+    bool is_finished;
+
+    // Readers: the chunk read last
+    uint64_t cur_chunk;
+    const byte *cur_data;
+    size_t cur_size;
+};
+
+
+//  --------------------------------------------------------------------------
+//  Keys and headers
+
+// Set the chunk number after the key, and return the whole key's size
+static size_t
+s_chunk_key (byte *key, size_t key_size, uint64_t number)
+{
+    int i;
+    for (i = 0; i < s_number_size; i++)
+        key [key_size + i] = (byte) (number >> (8 * (s_number_size - 1 - i)));
+    return key_size + s_number_size;
+}
+
+static uint64_t
+s_chunk_count (uint64_t size, size_t chunk_size)
+{
+    return (size + chunk_size - 1) / chunk_size;
+}
+
+// Read the header of the blob at key, which has room for a number.
+// Returns 0 if there's a well formed one, -1 if not.
+static int
+s_header (lmdbdbi_t *dbi, lmdbtxn_t *txn, byte *key, size_t key_size,
+          s_header_t *header)
+{
+    lmdbspan found = lmdbdbi_get (dbi, txn, key, s_chunk_key (key, key_size, 0));
+    if (lmdbspan_size (found) != sizeof (s_header_t))
+        return -1;
+    memcpy (header, found.data, sizeof (s_header_t));
+    return header->chunk_size ? 0 : -1;
+}
+
+static lmdbblob_t *
+s_new (lmdbdbi_t *dbi, lmdbtxn_t *txn, const void *key, size_t key_size)
+{
+    lmdbblob_t *self = (lmdbblob_t *) lmdballoc_zmalloc (sizeof (lmdbblob_t));
+    assert (self);
+    self->dbi = dbi;
+    self->txn = txn;
+    self->key = (byte *) lmdballoc_malloc (key_size + s_number_size);
+    assert (self->key);
+    memcpy (self->key, key, key_size);
+    self->key_size = key_size;
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Create a new lmdbblob
+
+lmdbblob_t *
+lmdbblob_new_writer (lmdbdbi_t *dbi, lmdbtxn_t *txn, const void *key, size_t key_size,
+                     size_t chunk_size)
+{
+    assert (dbi);
+    assert (txn);
+    assert (key);
+    if (lmdbdbi_intkeys (dbi) || ! lmdbdbi_plain (dbi))
+        return NULL;
+
+    if (chunk_size == 0) {
+        MDB_stat stat;
+        if (mdb_stat (lmdbtxn_handle (txn), lmdbdbi_handle (dbi), &stat))
+            return NULL;
+        chunk_size = s_default_pages * stat.ms_psize - s_page_header;
+    }
+
+    lmdbblob_t *self = s_new (dbi, txn, key, key_size);
+    self->is_writer = true;
+    self->chunk_size = chunk_size;
+    self->next_chunk = 1;
+    self->buf = (byte *) lmdballoc_malloc (chunk_size);
+    assert (self->buf);
+
+    // Replacing a blob: it goes missing until we're finished, and we
+    // delete any chunks of it we don't overwrite then
+    s_header_t old;
+    if (s_header (dbi, txn, self->key, key_size, &old) == 0) {
+        self->old_chunks = s_chunk_count (old.size, old.chunk_size);
+        if (lmdbdbi_del (dbi, txn, self->key, s_chunk_key (self->key, key_size, 0)))
+            lmdbblob_destroy (&self);
+    }
+    return self;
+}
+
+lmdbblob_t *
+lmdbblob_new_reader (lmdbdbi_t *dbi, lmdbtxn_t *txn, const void *key, size_t key_size)
+{
+    assert (dbi);
+    assert (txn);
+    assert (key);
+
+    lmdbblob_t *self = s_new (dbi, txn, key, key_size);
+    s_header_t header;
+    if (s_header (dbi, txn, self->key, key_size, &header)) {
+        lmdbblob_destroy (&self);
+        return NULL;
+    }
+    self->size = header.size;
+    self->chunk_size = header.chunk_size;
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the lmdbblob
+
+void
+lmdbblob_destroy (lmdbblob_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        lmdbblob_t *self = *self_p;
+        lmdballoc_free (self->key);
+        lmdballoc_free (self->buf);
+        lmdballoc_free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Writing
+
+static int
+s_put_chunk (lmdbblob_t *self, const void *data, size_t size)
+{
+    size_t key_size = s_chunk_key (self->key, self->key_size, self->next_chunk++);
+    return lmdbdbi_put (self->dbi, self->txn, self->key, key_size, data, size);
+}
+
+int
+lmdbblob_write (lmdbblob_t *self, const void *data, size_t size)
+{
+    assert (self);
+    assert (self->is_writer);
+    assert (data || !size);
+    if (self->is_finished)
+        return -1;
+
+    const byte *next = (const byte *) data;
+    while (size) {
+        // Whole chunks go straight in, without a copy through our buffer
+        if (self->buf_used == 0 && size >= self->chunk_size) {
+            if (s_put_chunk (self, next, self->chunk_size))
+                return -1;
+            next += self->chunk_size;
+            size -= self->chunk_size;
+            self->size += self->chunk_size;
+            continue;
+        }
+        size_t take = self->chunk_size - self->buf_used;
+        if (take > size)
+            take = size;
+        memcpy (self->buf + self->buf_used, next, take);
+        self->buf_used += take;
+        next += take;
+        size -= take;
+        self->size += take;
+        if (self->buf_used == self->chunk_size) {
+            if (s_put_chunk (self, self->buf, self->buf_used))
+                return -1;
+            self->buf_used = 0;
+        }
+    }
+    return 0;
+}
+
+int
+lmdbblob_finish (lmdbblob_t *self)
+{
+    assert (self);
+    assert (self->is_writer);
+    if (self->is_finished)
+        return -1;
+    self->is_finished = true;
+
+    if (self->buf_used && s_put_chunk (self, self->buf, self->buf_used))
+        return -1;
+    self->buf_used = 0;
+
+    uint64_t number;
+    for (number = self->next_chunk; number <= self->old_chunks; number++) {
+        size_t key_size = s_chunk_key (self->key, self->key_size, number);
+        if (lmdbdbi_del (self->dbi, self->txn, self->key, key_size))
+            return -1;
+    }
+
+    s_header_t header = { .size = self->size, .chunk_size = self->chunk_size };
+    size_t key_size = s_chunk_key (self->key, self->key_size, 0);
+    return lmdbdbi_put (self->dbi, self->txn, self->key, key_size,
+                        &header, sizeof (header));
+}
+
+
+//  --------------------------------------------------------------------------
+//  Reading
+
+lmdbspan
+lmdbblob_chunk (lmdbblob_t *self, uint64_t offset)
+{
+    assert (self);
+    assert (!self->is_writer);
+    if (offset >= self->size)
+        return lmdbspan_makenull ();
+
+    uint64_t number = offset / self->chunk_size + 1;
+    if (number != self->cur_chunk) {
+        size_t key_size = s_chunk_key (self->key, self->key_size, number);
+        lmdbspan found = lmdbdbi_get (self->dbi, self->txn, self->key, key_size);
+
+        // Every chunk but the last is full
+        uint64_t start = (number - 1) * self->chunk_size;
+        uint64_t left = self->size - start;
+        size_t expected = left < self->chunk_size ? (size_t) left : self->chunk_size;
+        if (! lmdbspan_valid (found) || found.size != expected)
+            return lmdbspan_makenull ();
+        self->cur_chunk = number;
+        self->cur_data = (const byte *) found.data;
+        self->cur_size = found.size;
+    }
+    size_t skip = (size_t) (offset % self->chunk_size);
+    return (lmdbspan) { .data = self->cur_data + skip, .size = self->cur_size - skip };
+}
+
+size_t
+lmdbblob_read (lmdbblob_t *self, uint64_t offset, void *buf, size_t size)
+{
+    assert (self);
+    assert (!self->is_writer);
+    assert (buf || !size);
+
+    size_t done = 0;
+    while (done < size) {
+        lmdbspan chunk = lmdbblob_chunk (self, offset + done);
+        if (! lmdbspan_valid (chunk))
+            break;
+        size_t take = size - done < chunk.size ? size - done : chunk.size;
+        memcpy ((byte *) buf + done, chunk.data, take);
+        done += take;
+    }
+    return done;
+}
+
+uint64_t
+lmdbblob_size (lmdbblob_t *self)
+{
+    assert (self);
+    return self->size;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Deleting
+
+int
+lmdbblob_del (lmdbdbi_t *dbi, lmdbtxn_t *txn, const void *key, size_t key_size)
+{
+    assert (dbi);
+    assert (txn);
+    assert (key);
+
+    byte *chunk_key = (byte *) lmdballoc_malloc (key_size + s_number_size);
+    assert (chunk_key);
+    memcpy (chunk_key, key, key_size);
+    int rc = -1;
+    s_header_t header;
+    if (s_header (dbi, txn, chunk_key, key_size, &header))
+        goto die;
+
+    uint64_t count = s_chunk_count (header.size, header.chunk_size);
+    uint64_t number;
+    for (number = 0; number <= count; number++)
+        if (lmdbdbi_del (dbi, txn, chunk_key, s_chunk_key (chunk_key, key_size, number)))
+            goto die;
+    rc = 0;
+
+ die:
+    lmdballoc_free (chunk_key);
+    return rc;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+lmdbblob_test (bool verbose)
+{
+    printf (" * lmdbblob: ");
+
+    //  @selftest
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+    assert (SELFTEST_DIR_RW);
+
+    char *test_db_path = zsys_sprintf ("%s/%s", SELFTEST_DIR_RW, "LMDBBLOB_TEST.db");
+    if (zsys_file_exists (test_db_path))
+        zsys_file_delete (test_db_path);
+    lmdbenv_t *env = lmdbenv_new (test_db_path);
+    assert (env);
+    zstr_free (&test_db_path);
+    lmdbdbi_t *dbi = lmdbdbi_new (env, "blobs");
+    lmdbdbi_t *dbipk = lmdbdbi_new_packed (env, "packed");
+    assert (dbi && dbipk);
+
+    lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
+    assert (txn);
+    assert (! lmdbblob_new_writer (dbipk, txn, "big", 3, 0));
+    assert (! lmdbblob_new_reader (dbi, txn, "big", 3));
+
+    // A megabyte and a bit, written in uneven pieces, some bigger than a
+    // chunk; the default chunk size fills whole pages
+    size_t blob_size = (1 << 20) + 12345;
+    byte *blob = (byte *) malloc (blob_size);
+    assert (blob);
+    size_t i;
+    for (i = 0; i < blob_size; i++)
+        blob [i] = (byte) (i * 31 + i / 7);
+
+    lmdbblob_t *writer = lmdbblob_new_writer (dbi, txn, "big", 3, 0);
+    assert (writer);
+    size_t written = 0;
+    size_t piece = 1;
+    while (written < blob_size) {
+        size_t take = blob_size - written < piece ? blob_size - written : piece;
+        int rc = lmdbblob_write (writer, blob + written, take);
+        assert (rc == 0);
+        written += take;
+        piece = piece * 3 + 17;
+    }
+    assert (lmdbblob_size (writer) == blob_size);
+
+    // Not there until it's finished
+    assert (! lmdbblob_new_reader (dbi, txn, "big", 3));
+    int rc = lmdbblob_finish (writer);
+    assert (rc == 0);
+    assert (lmdbblob_finish (writer) == -1);
+    assert (lmdbblob_write (writer, "x", 1) == -1);
+    lmdbblob_destroy (&writer);
+    assert (!writer);
+    rc = lmdbtxn_commit (txn);
+    assert (rc == 0);
+    lmdbtxn_destroy (&txn);
+
+    // Ranged reads, across chunks, and spans straight from the map
+    txn = lmdbtxn_new_rdonly (env);
+    assert (txn);
+    lmdbblob_t *reader = lmdbblob_new_reader (dbi, txn, "big", 3);
+    assert (reader);
+    assert (lmdbblob_size (reader) == blob_size);
+    byte *buf = (byte *) malloc (1 << 20);
+    assert (buf);
+    assert (lmdbblob_read (reader, 1 << 20, buf, 1 << 20) == 12345);
+    assert (memcmp (buf, blob + (1 << 20), 12345) == 0);
+    assert (lmdbblob_read (reader, 65000, buf, 200000) == 200000);
+    assert (memcmp (buf, blob + 65000, 200000) == 0);
+    assert (lmdbblob_read (reader, blob_size, buf, 10) == 0);
+
+    uint64_t offset = 0;
+    size_t chunks = 0;
+    while (offset < blob_size) {
+        lmdbspan chunk = lmdbblob_chunk (reader, offset);
+        assert (lmdbspan_valid (chunk));
+        assert (memcmp (chunk.data, blob + offset, chunk.size) == 0);
+        offset += chunk.size;
+        chunks++;
+    }
+    assert (chunks == (blob_size + 65519) / 65520);
+    assert (! lmdbspan_valid (lmdbblob_chunk (reader, blob_size)));
+    lmdbblob_destroy (&reader);
+    lmdbtxn_destroy (&txn);
+
+    // Replacing with a shorter blob leaves none of the old one's chunks,
+    // and deleting leaves nothing at all
+    txn = lmdbtxn_new_rdrw (env);
+    assert (txn);
+    writer = lmdbblob_new_writer (dbi, txn, "big", 3, 1000);
+    assert (writer);
+    rc = lmdbblob_write (writer, blob, 2500);
+    assert (rc == 0);
+    rc = lmdbblob_finish (writer);
+    assert (rc == 0);
+    lmdbblob_destroy (&writer);
+
+    reader = lmdbblob_new_reader (dbi, txn, "big", 3);
+    assert (reader);
+    assert (lmdbblob_size (reader) == 2500);
+    assert (lmdbblob_read (reader, 0, buf, 5000) == 2500);
+    assert (memcmp (buf, blob, 2500) == 0);
+    lmdbblob_destroy (&reader);
+
+    writer = lmdbblob_new_writer (dbi, txn, "empty", 5, 0);
+    assert (writer);
+    rc = lmdbblob_finish (writer);
+    assert (rc == 0);
+    lmdbblob_destroy (&writer);
+    reader = lmdbblob_new_reader (dbi, txn, "empty", 5);
+    assert (reader);
+    assert (lmdbblob_size (reader) == 0);
+    assert (! lmdbspan_valid (lmdbblob_chunk (reader, 0)));
+    lmdbblob_destroy (&reader);
+
+    rc = lmdbblob_del (dbi, txn, "big", 3);
+    assert (rc == 0);
+    assert (lmdbblob_del (dbi, txn, "big", 3) == -1);
+    rc = lmdbblob_del (dbi, txn, "empty", 5);
+    assert (rc == 0);
+    lmdbcur_t *cur = lmdbcur_new_overall (dbi, txn);
+    assert (cur);
+    assert (! lmdbspan_valid (lmdbcur_key (cur)));
+    lmdbcur_destroy (&cur);
+    lmdbtxn_destroy (&txn);
+
+    free (buf);
+    free (blob);
+    lmdbdbi_destroy (&dbipk);
+    lmdbdbi_destroy (&dbi);
+    lmdbenv_destroy (&env);
+
+    if (verbose)
+        log ("Wrote, read, replaced and deleted chunked blobs");
+    //  @end
+    printf ("OK\n");
+}
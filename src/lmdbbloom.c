@@ -0,0 +1,314 @@
+/*  =========================================================================
+    lmdbbloom - Blocked bloom filter used to skip lookups of absent keys in lmdbdbi's
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+/*
+@header
+    lmdbbloom - Blocked bloom filter used to skip lookups of absent keys in lmdbdbi's
+@discuss
+    Each key hashes to one 64 byte block (a cache line), and sets 7 bits
+    within it, so a lookup costs one hash and one cache miss however big
+    the filter is. At 10 bits per key that gives roughly a 1% false
+    positive rate.
+
+    Adding keys only ever sets bits, so a filter that has seen keys
+    from a txn that later aborted just has a few more false positives; it
+    can never say a stored key is absent.
+
+    The words are atomics (with relaxed ordering, which costs nothing on
+    mainstream CPUs) so that read txns can test keys while the write txn
+    is adding them.
+@end
+*/
+
+#include "classlmdb_classes.h"
+
+#include "logging.h"
+
+#include <stdatomic.h>
+
+#define s_block_words 8         // 512 bit blocks
+#define s_bits_per_key 10
+#define s_probes 7              // 7 x 9 bit positions fit in one 64 bit hash
+
+//  Structure of our class
+
+struct _lmdbbloom_t {
+    _Atomic uint64_t *words;
+    size_t block_count;
+};
+
+
+//  --------------------------------------------------------------------------
+//  Hashing
+
+// MurmurHash64A, by Austin Appleby (public domain)
+static uint64_t
+s_hash (const void *key, size_t size)
+{
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    uint64_t h = 0x5bd1e9955bd1e995ULL ^ (size * m);
+
+    const byte *data = (const byte *) key;
+    const byte *end = data + (size & ~(size_t) 7);
+    while (data != end) {
+        uint64_t k;
+        memcpy (&k, data, sizeof (k));
+        data += 8;
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+
+    switch (size & 7) {
+        case 7: h ^= (uint64_t) data [6] << 48;  // fallthrough
+        case 6: h ^= (uint64_t) data [5] << 40;  // fallthrough
+        case 5: h ^= (uint64_t) data [4] << 32;  // fallthrough
+        case 4: h ^= (uint64_t) data [3] << 24;  // fallthrough
+        case 3: h ^= (uint64_t) data [2] << 16;  // fallthrough
+        case 2: h ^= (uint64_t) data [1] << 8;   // fallthrough
+        case 1: h ^= (uint64_t) data [0];
+                h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+// A second, independent hash from the first, for the bit positions
+static uint64_t
+s_rehash (uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static size_t
+s_block_of (lmdbbloom_t *self, uint64_t h)
+{
+    // Maps the top 32 bits onto [0, block_count) without a division
+    return (size_t) (((h >> 32) * (uint64_t) self->block_count) >> 32);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Create a new lmdbbloom
+
+lmdbbloom_t *
+lmdbbloom_new (size_t expected_keys)
+{
+    size_t size = (expected_keys * s_bits_per_key + 7) / 8;
+    size = (size / LMDBBLOOM_SEGMENT_SIZE + 1) * LMDBBLOOM_SEGMENT_SIZE;
+    return lmdbbloom_new_withsize (size);
+}
+
+lmdbbloom_t *
+lmdbbloom_new_withsize (size_t size)
+{
+    if (size == 0 || size % LMDBBLOOM_SEGMENT_SIZE
+    ||  size / (s_block_words * 8) > UINT32_MAX)
+        return NULL;
+
+    lmdbbloom_t *self = (lmdbbloom_t *) lmdballoc_zmalloc (sizeof (lmdbbloom_t));
+    assert (self);
+    self->block_count = size / (s_block_words * 8);
+    self->words = (_Atomic uint64_t *) lmdballoc_zmalloc (
+        self->block_count * s_block_words * sizeof (uint64_t));
+    if (!self->words)
+        lmdbbloom_destroy (&self);
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the lmdbbloom
+
+void
+lmdbbloom_destroy (lmdbbloom_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        lmdbbloom_t *self = *self_p;
+        lmdballoc_free ((void *) self->words);
+        lmdballoc_free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Membership
+
+size_t
+lmdbbloom_add (lmdbbloom_t *self, const void *key, size_t key_size)
+{
+    assert (self);
+    assert (key || !key_size);
+
+    uint64_t h = s_hash (key, key_size);
+    size_t block = s_block_of (self, h);
+    _Atomic uint64_t *words = self->words + block * s_block_words;
+
+    uint64_t bits = s_rehash (h);
+    int i;
+    for (i = 0; i < s_probes; i++) {
+        unsigned pos = (unsigned) (bits >> (9 * i)) & 511;
+        atomic_fetch_or_explicit (&words [pos >> 6], (uint64_t) 1 << (pos & 63),
+                                  memory_order_relaxed);
+    }
+    return block * s_block_words * 8 / LMDBBLOOM_SEGMENT_SIZE;
+}
+
+bool
+lmdbbloom_maybe (lmdbbloom_t *self, const void *key, size_t key_size)
+{
+    assert (self);
+    assert (key || !key_size);
+
+    uint64_t h = s_hash (key, key_size);
+    _Atomic uint64_t *words = self->words + s_block_of (self, h) * s_block_words;
+
+    uint64_t bits = s_rehash (h);
+    int i;
+    for (i = 0; i < s_probes; i++) {
+        unsigned pos = (unsigned) (bits >> (9 * i)) & 511;
+        uint64_t word = atomic_load_explicit (&words [pos >> 6], memory_order_relaxed);
+        if (!(word & ((uint64_t) 1 << (pos & 63))))
+            return false;
+    }
+    return true;
+}
+
+void
+lmdbbloom_clear (lmdbbloom_t *self)
+{
+    assert (self);
+    size_t i;
+    for (i = 0; i < self->block_count * s_block_words; i++)
+        atomic_store_explicit (&self->words [i], 0, memory_order_relaxed);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Persistence
+
+size_t
+lmdbbloom_size (lmdbbloom_t *self)
+{
+    assert (self);
+    return self->block_count * s_block_words * 8;
+}
+
+size_t
+lmdbbloom_segment_count (lmdbbloom_t *self)
+{
+    assert (self);
+    return lmdbbloom_size (self) / LMDBBLOOM_SEGMENT_SIZE;
+}
+
+lmdbspan
+lmdbbloom_segment (lmdbbloom_t *self, size_t index)
+{
+    assert (self);
+    assert (index < lmdbbloom_segment_count (self));
+    const byte *data = (const byte *) self->words;
+    return (lmdbspan) { .data = data + index * LMDBBLOOM_SEGMENT_SIZE,
+                        .size = LMDBBLOOM_SEGMENT_SIZE };
+}
+
+int
+lmdbbloom_load_segment (lmdbbloom_t *self, size_t index, const void *data, size_t size)
+{
+    assert (self);
+    assert (data);
+    if (index >= lmdbbloom_segment_count (self) || size != LMDBBLOOM_SEGMENT_SIZE)
+        return -1;
+
+    // Word by word, so concurrent readers never see a torn word
+    size_t first = index * LMDBBLOOM_SEGMENT_SIZE / 8;
+    size_t i;
+    for (i = 0; i < LMDBBLOOM_SEGMENT_SIZE / 8; i++) {
+        uint64_t word;
+        memcpy (&word, (const byte *) data + i * 8, sizeof (word));
+        atomic_store_explicit (&self->words [first + i], word, memory_order_relaxed);
+    }
+    return 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+lmdbbloom_test (bool verbose)
+{
+    printf (" * lmdbbloom: ");
+
+    //  @selftest
+    assert (! lmdbbloom_new_withsize (0));
+    assert (! lmdbbloom_new_withsize (LMDBBLOOM_SEGMENT_SIZE + 1));
+
+    lmdbbloom_t *bloom = lmdbbloom_new (10000);
+    assert (bloom);
+    assert (lmdbbloom_size (bloom) >= 10000 * s_bits_per_key / 8);
+    assert (lmdbbloom_size (bloom) % LMDBBLOOM_SEGMENT_SIZE == 0);
+
+    // No false negatives
+    uint32_t i;
+    for (i = 0; i < 10000; i++) {
+        size_t seg = lmdbbloom_add (bloom, &i, sizeof (i));
+        assert (seg < lmdbbloom_segment_count (bloom));
+    }
+    for (i = 0; i < 10000; i++)
+        assert (lmdbbloom_maybe (bloom, &i, sizeof (i)));
+
+    // About 1% false positives at the designed load
+    size_t false_positives = 0;
+    for (i = 10000; i < 110000; i++)
+        false_positives += lmdbbloom_maybe (bloom, &i, sizeof (i));
+    assert (false_positives < 100000 / 50);
+    if (verbose)
+        logg ("False positive rate %.2f%%", false_positives / 1000.0);
+
+    // Odd sized keys hash all their bytes
+    lmdbbloom_add (bloom, "abcdefghijk", 11);
+    assert (lmdbbloom_maybe (bloom, "abcdefghijk", 11));
+
+    // Segments round trip into a fresh filter of the same size
+    lmdbbloom_t *copy = lmdbbloom_new_withsize (lmdbbloom_size (bloom));
+    assert (copy);
+    size_t seg;
+    for (seg = 0; seg < lmdbbloom_segment_count (bloom); seg++) {
+        lmdbspan data = lmdbbloom_segment (bloom, seg);
+        int rc = lmdbbloom_load_segment (copy, seg, data.data, data.size);
+        assert (rc == 0);
+    }
+    for (i = 0; i < 10000; i++)
+        assert (lmdbbloom_maybe (copy, &i, sizeof (i)));
+    assert (lmdbbloom_load_segment (copy, seg, "", 1) == -1);
+
+    lmdbbloom_clear (copy);
+    assert (! lmdbbloom_maybe (copy, "abcdefghijk", 11));
+
+    lmdbbloom_destroy (&copy);
+    lmdbbloom_destroy (&bloom);
+
+    //  @end
+    printf ("OK\n");
+}
@@ -0,0 +1,97 @@
+/*  =========================================================================
+    lmdbbloom - Blocked bloom filter used to skip lookups of absent keys in lmdbdbi's
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+#ifndef LMDBBLOOM_H_INCLUDED
+#define LMDBBLOOM_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Filters are stored and rewritten in segments of this many bytes
+#define LMDBBLOOM_SEGMENT_SIZE 1024
+
+//  @warning THE FOLLOWING @INTERFACE BLOCK IS AUTO-GENERATED BY ZPROJECT
+//  @warning Please edit the model at "api/lmdbbloom.xml" to make changes.
+//  @interface
+//  This API is a draft, and may change without notice.
+#ifdef CLASSLMDB_BUILD_DRAFT_API
+//  *** Draft method, defined for internal use only ***
+//  Create an empty filter sized for the expected number of keys, at about
+//  a 1% false positive rate.
+CLASSLMDB_PRIVATE lmdbbloom_t *
+    lmdbbloom_new (size_t expected_keys);
+
+//  *** Draft method, defined for internal use only ***
+//  Create an empty filter of exactly size bytes, which must be a multiple
+//  of LMDBBLOOM_SEGMENT_SIZE. Used when reloading a stored filter.
+CLASSLMDB_PRIVATE lmdbbloom_t *
+    lmdbbloom_new_withsize (size_t size);
+
+//  *** Draft method, defined for internal use only ***
+//  Destroy the lmdbbloom.
+CLASSLMDB_PRIVATE void
+    lmdbbloom_destroy (lmdbbloom_t **self_p);
+
+//  *** Draft method, defined for internal use only ***
+//  Add a key to the filter.
+//  Returns the index of the segment that changed, so the caller can
+//  persist just that.
+CLASSLMDB_PRIVATE size_t
+    lmdbbloom_add (lmdbbloom_t *self, const void *key, size_t key_size);
+
+//  *** Draft method, defined for internal use only ***
+//  Returns false if the key was definitely never added, true if it might
+//  have been. Safe to call from several threads at once, and alongside
+//  add.
+CLASSLMDB_PRIVATE bool
+    lmdbbloom_maybe (lmdbbloom_t *self, const void *key, size_t key_size);
+
+//  *** Draft method, defined for internal use only ***
+//  Remove every key.
+CLASSLMDB_PRIVATE void
+    lmdbbloom_clear (lmdbbloom_t *self);
+
+//  *** Draft method, defined for internal use only ***
+//  Size of the filter in bytes.
+CLASSLMDB_PRIVATE size_t
+    lmdbbloom_size (lmdbbloom_t *self);
+
+//  *** Draft method, defined for internal use only ***
+//  Number of LMDBBLOOM_SEGMENT_SIZE byte segments in the filter.
+CLASSLMDB_PRIVATE size_t
+    lmdbbloom_segment_count (lmdbbloom_t *self);
+
+//  *** Draft method, defined for internal use only ***
+//  Return the bytes of the index'th segment, valid until the filter is
+//  destroyed.
+CLASSLMDB_PRIVATE lmdbspan
+    lmdbbloom_segment (lmdbbloom_t *self, size_t index);
+
+//  *** Draft method, defined for internal use only ***
+//  Overwrite the index'th segment with previously stored bytes.
+//  Returns 0 on success, -1 if index or size is wrong.
+CLASSLMDB_PRIVATE int
+    lmdbbloom_load_segment (lmdbbloom_t *self, size_t index, const void *data, size_t size);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+CLASSLMDB_PRIVATE void
+    lmdbbloom_test (bool verbose);
+
+#endif // CLASSLMDB_BUILD_DRAFT_API
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,389 @@
+/*  =========================================================================
+    lmdbcache - Copies of values a write lmdbtxn recently got or put, for gets of the same keys
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+/*
+@header
+    lmdbcache - Copies of values a write lmdbtxn recently got or put, for gets of the same keys
+@discuss
+    A get in a write txn searches the tree from the root through pages
+    the txn has dirtied; code that reads back what it just wrote pays
+    that every time. The cache keeps copies of recent values in a hash
+    table of (dbi, key), in buckets of two slots: a third key hashed to
+    the same bucket pushes out the older of the two there.
+
+    Copies go in an arena, so a span got from the cache stays put while
+    other keys are cached and pushed out; memory is only reclaimed, all
+    at once, when a write finds the budget spent. That's safe, as LMDB's
+    own spans in a write txn don't outlive the next write either. A write
+    to a cached key overwrites its copy in place when the new value fits.
+@end
+*/
+
+#include "classlmdb_classes.h"
+
+#include "logging.h"
+
+#define s_table_min 16
+#define s_bytes_per_slot 64     // Budget per slot in the table
+#define s_val_share 16          // No value over 1/16 of the budget is cached
+#define s_align(n) (((n) + 7) & ~(size_t) 7)
+
+// An entry is this header, the key and room for the value, 8 byte aligned
+typedef struct {
+    lmdbdbi_t *dbi;
+    uint64_t hash;
+    size_t key_size;
+    size_t val_size;
+    size_t val_max;             // So later writes can overwrite in place
+} s_entry_t;
+
+#define s_entry_key(e) ((byte *) (e) + s_align (sizeof (s_entry_t)))
+#define s_entry_val(e) (s_entry_key (e) + s_align ((e)->key_size))
+
+//  Structure of our class
+
+struct _lmdbcache_t {
+    lmdbarena_t *arena;         // Entries, pushed out ones too
+    s_entry_t **table;          // Buckets of two slots, newer first
+    size_t table_size;          // Slots, a power of two
+    size_t budget;
+    size_t hits;
+    size_t misses;
+};
+
+
+//  --------------------------------------------------------------------------
+//  Create a new lmdbcache
+
+lmdbcache_t *
+lmdbcache_new (size_t budget)
+{
+    assert (budget);
+    lmdbcache_t *self = (lmdbcache_t *) lmdballoc_zmalloc (sizeof (lmdbcache_t));
+    assert (self);
+    self->budget = budget;
+    self->table_size = s_table_min;
+    while (self->table_size * 2 * s_bytes_per_slot <= budget)
+        self->table_size *= 2;
+    self->table = (s_entry_t **) lmdballoc_zmalloc (self->table_size * sizeof (s_entry_t *));
+    assert (self->table);
+    self->arena = lmdbarena_new (0);
+    assert (self->arena);
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the lmdbcache
+
+void
+lmdbcache_destroy (lmdbcache_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        lmdbcache_t *self = *self_p;
+        lmdbarena_destroy (&self->arena);
+        lmdballoc_free (self->table);
+        lmdballoc_free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Hashing
+
+// FNV-1a over the key, mixed with the dbi, as the stage does
+static uint64_t
+s_hash (lmdbdbi_t *dbi, const void *key, size_t key_size)
+{
+    uint64_t h = 0xcbf29ce484222325ULL ^ ((uint64_t) (uintptr_t) dbi * 0x9e3779b97f4a7c15ULL);
+    const byte *data = (const byte *) key;
+    size_t i;
+    for (i = 0; i < key_size; i++) {
+        h ^= data [i];
+        h *= 0x100000001b3ULL;
+    }
+    return h ^ (h >> 29);
+}
+
+static bool
+s_matches (s_entry_t *entry, lmdbdbi_t *dbi, uint64_t hash,
+           const void *key, size_t key_size)
+{
+    return entry && entry->hash == hash && entry->dbi == dbi
+        && entry->key_size == key_size
+        && memcmp (s_entry_key (entry), key, key_size) == 0;
+}
+
+static size_t
+s_entry_size (size_t key_size, size_t val_size)
+{
+    return s_align (sizeof (s_entry_t)) + s_align (key_size) + s_align (val_size);
+}
+
+// The slot holding key, or SIZE_MAX if it isn't cached
+static size_t
+s_find (lmdbcache_t *self, lmdbdbi_t *dbi, uint64_t hash,
+        const void *key, size_t key_size)
+{
+    size_t slot = hash & (self->table_size - 2);
+    if (s_matches (self->table [slot], dbi, hash, key, key_size))
+        return slot;
+    if (s_matches (self->table [slot + 1], dbi, hash, key, key_size))
+        return slot + 1;
+    return SIZE_MAX;
+}
+
+// Copy into a new entry at the front of the key's bucket, pushing out the
+// older entry there, if the arena gives us room
+static void
+s_store (lmdbcache_t *self, lmdbdbi_t *dbi, uint64_t hash,
+         const void *key, size_t key_size, const void *val, size_t val_size)
+{
+    size_t slot = hash & (self->table_size - 2);
+    if (self->table [slot])
+        self->table [slot + 1] = self->table [slot];
+    s_entry_t *entry = (s_entry_t *) lmdbarena_alloc (self->arena,
+                                                      s_entry_size (key_size, val_size));
+    self->table [slot] = entry;
+    if (!entry)
+        return;
+    *entry = (s_entry_t) {
+        .dbi = dbi,
+        .hash = hash,
+        .key_size = key_size,
+        .val_size = val_size,
+        .val_max = s_align (val_size)
+    };
+    memcpy (s_entry_key (entry), key, key_size);
+    if (val_size)
+        memcpy (s_entry_val (entry), val, val_size);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Caching
+
+lmdbspan
+lmdbcache_get (lmdbcache_t *self, lmdbdbi_t *dbi, const void *key, size_t key_size)
+{
+    assert (self);
+    assert (dbi);
+    assert (key);
+
+    uint64_t hash = s_hash (dbi, key, key_size);
+    size_t slot = s_find (self, dbi, hash, key, key_size);
+    if (slot == SIZE_MAX) {
+        self->misses++;
+        return lmdbspan_makenull ();
+    }
+    self->hits++;
+    s_entry_t *entry = self->table [slot];
+    return (lmdbspan) { .data = s_entry_val (entry), .size = entry->val_size };
+}
+
+void
+lmdbcache_fill (lmdbcache_t *self, lmdbdbi_t *dbi,
+                const void *key, size_t key_size,
+                const void *val, size_t val_size)
+{
+    assert (self);
+    assert (dbi);
+    assert (key);
+    assert (val || !val_size);
+
+    // Spans from earlier gets have to stay valid, so we can't make room
+    if (val_size > self->budget / s_val_share
+    ||  lmdbarena_size (self->arena) + s_entry_size (key_size, val_size) > self->budget)
+        return;
+    s_store (self, dbi, s_hash (dbi, key, key_size), key, key_size, val, val_size);
+}
+
+void
+lmdbcache_update (lmdbcache_t *self, lmdbdbi_t *dbi,
+                  const void *key, size_t key_size,
+                  const void *val, size_t val_size)
+{
+    assert (self);
+    assert (dbi);
+    assert (key);
+    assert (val || !val_size);
+
+    uint64_t hash = s_hash (dbi, key, key_size);
+    size_t slot = s_find (self, dbi, hash, key, key_size);
+    if (slot != SIZE_MAX) {
+        s_entry_t *entry = self->table [slot];
+        if (val_size <= entry->val_max) {
+            if (val_size)
+                memmove (s_entry_val (entry), val, val_size);
+            entry->val_size = val_size;
+            return;
+        }
+        self->table [slot] = NULL;
+    }
+    if (val_size > self->budget / s_val_share)
+        return;
+
+    // A write ends the life of spans got before it, so we can start over.
+    // Not with this value, which may be one of those spans.
+    if (lmdbarena_size (self->arena) + s_entry_size (key_size, val_size) > self->budget) {
+        lmdbcache_clear (self);
+        return;
+    }
+    s_store (self, dbi, hash, key, key_size, val, val_size);
+}
+
+void
+lmdbcache_drop (lmdbcache_t *self, lmdbdbi_t *dbi, const void *key, size_t key_size)
+{
+    assert (self);
+    assert (dbi);
+    assert (key);
+
+    size_t slot = s_find (self, dbi, s_hash (dbi, key, key_size), key, key_size);
+    if (slot != SIZE_MAX)
+        self->table [slot] = NULL;
+}
+
+void
+lmdbcache_clear (lmdbcache_t *self)
+{
+    assert (self);
+    memset (self->table, 0, self->table_size * sizeof (s_entry_t *));
+    lmdbarena_reset (self->arena);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Accessors
+
+size_t
+lmdbcache_hits (lmdbcache_t *self)
+{
+    assert (self);
+    return self->hits;
+}
+
+size_t
+lmdbcache_misses (lmdbcache_t *self)
+{
+    assert (self);
+    return self->misses;
+}
+
+size_t
+lmdbcache_size (lmdbcache_t *self)
+{
+    assert (self);
+    return lmdbarena_size (self->arena);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+lmdbcache_test (bool verbose)
+{
+    printf (" * lmdbcache: ");
+
+    //  @selftest
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+    assert (SELFTEST_DIR_RW);
+
+    char *test_db_path = zsys_sprintf ("%s/%s", SELFTEST_DIR_RW, "LMDBCACHE_TEST.db");
+    if (zsys_file_exists (test_db_path))
+        zsys_file_delete (test_db_path);
+    lmdbenv_t *env = lmdbenv_new (test_db_path);
+    assert (env);
+    zstr_free (&test_db_path);
+    lmdbdbi_t *dbi = lmdbdbi_new (env, "bytes");
+    lmdbdbi_t *dbiik = lmdbdbi_new_intkeys (env, "numbers");
+    assert (dbi && dbiik);
+
+    lmdbcache_t *cache = lmdbcache_new (64 * 1024);
+    assert (cache);
+    assert (! lmdbspan_valid (lmdbcache_get (cache, dbi, "a", 1)));
+    assert (lmdbcache_misses (cache) == 1);
+
+    // Keys are per dbi, and empty values are still values
+    lmdbcache_fill (cache, dbi, "a", 1, "first", 5);
+    lmdbcache_fill (cache, dbiik, "a", 1, "other", 5);
+    lmdbcache_update (cache, dbi, "b", 1, "", 0);
+    lmdbspan a = lmdbcache_get (cache, dbi, "a", 1);
+    assert (a.size == 5 && memcmp (a.data, "first", 5) == 0);
+    lmdbspan other = lmdbcache_get (cache, dbiik, "a", 1);
+    assert (other.size == 5 && memcmp (other.data, "other", 5) == 0);
+    lmdbspan empty = lmdbcache_get (cache, dbi, "b", 1);
+    assert (lmdbspan_valid (empty) && empty.size == 0);
+    assert (lmdbcache_hits (cache) == 3);
+
+    // Writes that fit go in place; longer ones take a new entry
+    lmdbcache_update (cache, dbi, "a", 1, "1st", 3);
+    lmdbspan shorter = lmdbcache_get (cache, dbi, "a", 1);
+    assert (shorter.data == a.data && shorter.size == 3);
+    size_t size = lmdbcache_size (cache);
+    lmdbcache_update (cache, dbi, "a", 1, "the very first", 14);
+    lmdbspan longer = lmdbcache_get (cache, dbi, "a", 1);
+    assert (longer.size == 14 && memcmp (longer.data, "the very first", 14) == 0);
+    assert (lmdbcache_size (cache) > size);
+
+    lmdbcache_drop (cache, dbi, "a", 1);
+    assert (! lmdbspan_valid (lmdbcache_get (cache, dbi, "a", 1)));
+    lmdbcache_drop (cache, dbi, "zz", 2);
+    assert (lmdbspan_valid (lmdbcache_get (cache, dbiik, "a", 1)));
+
+    // Values too big for the budget aren't cached, and writing one drops
+    // the old copy
+    byte big [8192] = { 0 };
+    lmdbcache_fill (cache, dbi, "big", 3, big, sizeof (big));
+    assert (! lmdbspan_valid (lmdbcache_get (cache, dbi, "big", 3)));
+    lmdbcache_update (cache, dbiik, "a", 1, big, sizeof (big));
+    assert (! lmdbspan_valid (lmdbcache_get (cache, dbiik, "a", 1)));
+
+    // Filling stops at the budget, keeping what's cached; writing starts
+    // over
+    uint64_t i;
+    for (i = 0; i < 10000; i++)
+        lmdbcache_fill (cache, dbiik, &i, sizeof (i), &i, sizeof (i));
+    assert (lmdbcache_size (cache) <= 64 * 1024);
+    size_t found = 0;
+    for (i = 0; i < 10000; i++) {
+        lmdbspan val = lmdbcache_get (cache, dbiik, &i, sizeof (i));
+        if (lmdbspan_valid (val)) {
+            assert (val.size == sizeof (i) && memcmp (val.data, &i, sizeof (i)) == 0);
+            found++;
+        }
+    }
+    assert (found > 0 && found < 10000);
+    uint64_t last = 10000;
+    lmdbcache_update (cache, dbiik, &last, sizeof (last), &last, sizeof (last));
+    assert (lmdbcache_size (cache) == 0);
+    lmdbcache_update (cache, dbiik, &last, sizeof (last), &last, sizeof (last));
+    lmdbspan val = lmdbcache_get (cache, dbiik, &last, sizeof (last));
+    assert (val.size == sizeof (last) && memcmp (val.data, &last, sizeof (last)) == 0);
+
+    lmdbcache_clear (cache);
+    assert (lmdbcache_size (cache) == 0);
+    assert (! lmdbspan_valid (lmdbcache_get (cache, dbiik, &last, sizeof (last))));
+    lmdbcache_destroy (&cache);
+    assert (!cache);
+
+    lmdbdbi_destroy (&dbiik);
+    lmdbdbi_destroy (&dbi);
+    lmdbenv_destroy (&env);
+
+    if (verbose)
+        log ("Cached, updated and dropped values");
+    //  @end
+    printf ("OK\n");
+}
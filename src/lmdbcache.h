@@ -0,0 +1,91 @@
+/*  =========================================================================
+    lmdbcache - Copies of values a write lmdbtxn recently got or put, for gets of the same keys
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+#ifndef LMDBCACHE_H_INCLUDED
+#define LMDBCACHE_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @warning THE FOLLOWING @INTERFACE BLOCK IS AUTO-GENERATED BY ZPROJECT
+//  @warning Please edit the model at "api/lmdbcache.xml" to make changes.
+//  @interface
+//  This API is a draft, and may change without notice.
+#ifdef CLASSLMDB_BUILD_DRAFT_API
+//  *** Draft method, defined for internal use only ***
+//  Create an empty cache, which copies values into at most budget bytes.
+CLASSLMDB_PRIVATE lmdbcache_t *
+    lmdbcache_new (size_t budget);
+
+//  *** Draft method, defined for internal use only ***
+//  Destroy the lmdbcache.
+CLASSLMDB_PRIVATE void
+    lmdbcache_destroy (lmdbcache_t **self_p);
+
+//  *** Draft method, defined for internal use only ***
+//  The value cached for key in dbi, valid until the next update, drop or
+//  clear, or nullish if there's none.
+CLASSLMDB_PRIVATE lmdbspan
+    lmdbcache_get (lmdbcache_t *self, lmdbdbi_t *dbi, const void *key, size_t key_size);
+
+//  *** Draft method, defined for internal use only ***
+//  Cache a copy of the value a get just found for key in dbi, if it's
+//  small enough and the budget has room. Values got from the cache stay
+//  valid.
+CLASSLMDB_PRIVATE void
+    lmdbcache_fill (lmdbcache_t *self, lmdbdbi_t *dbi, const void *key, size_t key_size, const void *val, size_t val_size);
+
+//  *** Draft method, defined for internal use only ***
+//  Cache a copy of the value just written under key in dbi, replacing any
+//  cached for it. If the budget is spent, everything else is dropped to
+//  make room, so values got from the cache are no longer valid.
+CLASSLMDB_PRIVATE void
+    lmdbcache_update (lmdbcache_t *self, lmdbdbi_t *dbi, const void *key, size_t key_size, const void *val, size_t val_size);
+
+//  *** Draft method, defined for internal use only ***
+//  Forget any value cached for key in dbi, as it's been deleted.
+CLASSLMDB_PRIVATE void
+    lmdbcache_drop (lmdbcache_t *self, lmdbdbi_t *dbi, const void *key, size_t key_size);
+
+//  *** Draft method, defined for internal use only ***
+//  Forget everything cached.
+CLASSLMDB_PRIVATE void
+    lmdbcache_clear (lmdbcache_t *self);
+
+//  *** Draft method, defined for internal use only ***
+//  Number of gets answered from the cache.
+CLASSLMDB_PRIVATE size_t
+    lmdbcache_hits (lmdbcache_t *self);
+
+//  *** Draft method, defined for internal use only ***
+//  Number of gets that weren't.
+CLASSLMDB_PRIVATE size_t
+    lmdbcache_misses (lmdbcache_t *self);
+
+//  *** Draft method, defined for internal use only ***
+//  Bytes of the budget the cached copies take.
+CLASSLMDB_PRIVATE size_t
+    lmdbcache_size (lmdbcache_t *self);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+CLASSLMDB_PRIVATE void
+    lmdbcache_test (bool verbose);
+
+#endif // CLASSLMDB_BUILD_DRAFT_API
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
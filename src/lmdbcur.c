@@ -35,9 +35,86 @@ struct _lmdbcur_t {
     // When we fetched the first k/v pair during construction, did we find one?
     // We need this to check whether the _fromkey() ctr matched.
     bool did_first_exist;
+
+    // Packed dbis only: the block we're in, our position in it, and
+    // storage for the reassembled key (mkey points here)
+    bool is_packed;
+    MDB_val mblock;
+    size_t block_pos;
+    char keybuf [LMDBPACK_MAX_KEY];
+
+    // Compressed dbis only: the dbi that decodes values, the decoded
+    // copy of the current one, if we've made it yet, and the buffer it's
+    // in, reused for each record so a scan doesn't grow the txn's scratch
+    lmdbdbi_t *dbi;
+    MDB_val mdecoded;
+    void *decodebuf;
+    size_t decodebuf_max;
 };
 
 
+//  --------------------------------------------------------------------------
+//  Packed dbi helpers
+
+// Point mkey/mval at the entry at block_pos in the current block
+static void
+s_packed_load_entry (lmdbcur_t *self)
+{
+    size_t key_size = 0;
+    lmdbspan val = lmdbpack_block_entry (self->mblock.mv_data, self->block_pos,
+                                         self->keybuf, &key_size);
+    self->mkey.mv_data = self->keybuf;
+    self->mkey.mv_size = key_size;
+    self->mval.mv_data = (void *) val.data;
+    self->mval.mv_size = val.size;
+}
+
+// Position on the first entry matching cop (MDB_FIRST, MDB_SET or
+// MDB_SET_RANGE) within the block that would hold it
+static int
+s_packed_first (lmdbcur_t *self, const void *key, size_t key_size,
+                MDB_cursor_op cop)
+{
+    MDB_val mblockkey = self->mkey;
+    int err = mdb_cursor_get (self->handle, &mblockkey, &self->mblock,
+                              cop == MDB_FIRST ? MDB_FIRST : MDB_SET_RANGE);
+    if (err)
+        return err;
+
+    self->block_pos = 0;
+    if (cop != MDB_FIRST) {
+        // Blocks are keyed by their max key, so the entry is in this block
+        bool exact = false;
+        self->block_pos = lmdbpack_block_search (self->mblock.mv_data,
+                                                 key, key_size, &exact);
+        if (cop == MDB_SET && !exact)
+            return MDB_NOTFOUND;
+    }
+    s_packed_load_entry (self);
+    return 0;
+}
+
+static int
+s_packed_next (lmdbcur_t *self)
+{
+    if (!self->mblock.mv_data)
+        return MDB_NOTFOUND;
+
+    self->block_pos++;
+    if (self->block_pos >= lmdbpack_block_count (self->mblock.mv_data)) {
+        MDB_val mblockkey;
+        int err = mdb_cursor_get (self->handle, &mblockkey, &self->mblock, MDB_NEXT);
+        if (err) {
+            self->mblock = (MDB_val) {0};
+            return err;
+        }
+        self->block_pos = 0;
+    }
+    s_packed_load_entry (self);
+    return 0;
+}
+
+
 //  --------------------------------------------------------------------------
 //  Create a new lmdbcur
 
@@ -50,7 +127,7 @@ s_new_withcop (lmdbdbi_t *dbi, lmdbtxn_t *txn,
     assert (dbi);
     assert (txn);
 
-    lmdbcur_t *self = (lmdbcur_t *) zmalloc (sizeof (lmdbcur_t));
+    lmdbcur_t *self = (lmdbcur_t *) lmdballoc_zmalloc (sizeof (lmdbcur_t));
     assert (self);
 
     // We are temporarily pointing to data the caller owns; fixed below.
@@ -65,6 +142,22 @@ s_new_withcop (lmdbdbi_t *dbi, lmdbtxn_t *txn,
     if (err)
         goto fail;
 
+    if (lmdbdbi_compressed (dbi))
+        self->dbi = dbi;
+
+    if (lmdbdbi_packed (dbi)) {
+        self->is_packed = true;
+        err = s_packed_first (self, key, key_size, cop);
+        if (err == MDB_NOTFOUND)
+            goto no_match;
+        else
+        if (err)
+            goto fail;
+
+        self->did_first_exist = true;
+        return self;
+    }
+
     // We die on any error except not finding a first item
     err = mdb_cursor_get (self->handle, &self->mkey, &self->mval, cop);
     if (err == MDB_NOTFOUND)
@@ -121,6 +214,18 @@ lmdbcur_new_gekey (lmdbdbi_t *dbi, lmdbtxn_t *txn,
     return s_new_withcop (dbi, txn, key, key_size, MDB_SET_RANGE);
 }
 
+lmdbcur_t *
+lmdbcur_new_fromkey_ui64 (lmdbdbi_t *dbi, lmdbtxn_t *txn, uint64_t key)
+{
+    return lmdbcur_new_fromkey (dbi, txn, &key, sizeof (key));
+}
+
+lmdbcur_t *
+lmdbcur_new_gekey_ui64 (lmdbdbi_t *dbi, lmdbtxn_t *txn, uint64_t key)
+{
+    return lmdbcur_new_gekey (dbi, txn, &key, sizeof (key));
+}
+
 
 //  --------------------------------------------------------------------------
 //  Check a valid key was found
@@ -145,8 +250,9 @@ lmdbcur_destroy (lmdbcur_t **self_p)
         lmdbcur_t *self = *self_p;
         //  free class properties here
         mdb_cursor_close (self->handle);
+        lmdballoc_free (self->decodebuf);
         //  Free object itself
-        free (self);
+        lmdballoc_free (self);
         *self_p = NULL;
     }
 }
@@ -163,10 +269,16 @@ lmdbcur_next (lmdbcur_t *self)
         assert (lmdbcur_matched (self));
 
     int err = 1;
+    self->mdecoded = (MDB_val) {0};
+    if (self->is_packed) {
+        err = s_packed_next (self);
+        if (err)
+            goto die;
+        return 0;
+    }
+
+    // MDB_NEXT fills in the new key and val itself
     err = mdb_cursor_get (self->handle, &self->mkey, &self->mval, MDB_NEXT);
-    if (err)
-        goto die;
-    err = mdb_cursor_get (self->handle, &self->mkey, &self->mval, MDB_GET_CURRENT);
     if (err)
         goto die;
 
@@ -200,8 +312,132 @@ lmdbcur_val (lmdbcur_t *self)
     assert (self);
     if (self->is_fromkey)
         assert (lmdbcur_matched (self));
-    
-    return (lmdbspan){ .data = self->mval.mv_data, .size = self->mval.mv_size };
+
+    lmdbspan stored = { .data = self->mval.mv_data, .size = self->mval.mv_size };
+    if (!self->dbi || !stored.data)
+        return stored;
+
+    if (!self->mdecoded.mv_data) {
+        lmdbspan val = lmdbdbi_decode_reusing (self->dbi, stored,
+                                               &self->decodebuf, &self->decodebuf_max);
+        self->mdecoded.mv_data = (void *) val.data;
+        self->mdecoded.mv_size = val.size;
+    }
+    return (lmdbspan){ .data = self->mdecoded.mv_data, .size = self->mdecoded.mv_size };
+}
+
+
+//  --------------------------------------------------------------------------
+//  Bulk reads
+
+// Bytes per element of a column
+static size_t
+s_column_width (int type, size_t size)
+{
+    if (type == LMDBCUR_COLUMN_COPY)
+        return size;
+    assert (size == 4 && "column conversions widen 4 byte numbers");
+    return 8;
+}
+
+static void
+s_column_store (void *column, size_t width, size_t row,
+                const void *src, size_t size, int type)
+{
+    byte *out = (byte *) column + row * width;
+    switch (type) {
+        case LMDBCUR_COLUMN_U32_U64: {
+            uint32_t in;
+            memcpy (&in, src, sizeof (in));
+            uint64_t wide = in;
+            memcpy (out, &wide, sizeof (wide));
+            break;
+        }
+        case LMDBCUR_COLUMN_I32_I64: {
+            int32_t in;
+            memcpy (&in, src, sizeof (in));
+            int64_t wide = in;
+            memcpy (out, &wide, sizeof (wide));
+            break;
+        }
+        case LMDBCUR_COLUMN_F32_F64: {
+            float in;
+            memcpy (&in, src, sizeof (in));
+            double wide = in;
+            memcpy (out, &wide, sizeof (wide));
+            break;
+        }
+        default:
+            memcpy (out, src, size);
+    }
+}
+
+size_t
+lmdbcur_columns (lmdbcur_t *self, size_t max_rows,
+                 void *keys, size_t key_size, int key_type,
+                 void *vals, size_t val_size, int val_type)
+{
+    assert (self);
+    assert (key_type >= LMDBCUR_COLUMN_COPY && key_type <= LMDBCUR_COLUMN_F32_F64);
+    assert (val_type >= LMDBCUR_COLUMN_COPY && val_type <= LMDBCUR_COLUMN_F32_F64);
+    if (self->is_fromkey)
+        assert (lmdbcur_matched (self));
+    size_t key_width = s_column_width (key_type, key_size);
+    size_t val_width = s_column_width (val_type, val_size);
+    size_t rows = 0;
+
+    // Packed and compressed dbis need their values decoding, so go the
+    // long way round
+    if (self->is_packed || self->dbi) {
+        while (rows < max_rows) {
+            lmdbspan key = lmdbcur_key (self);
+            if (!key.data || key.size != key_size)
+                break;
+            lmdbspan val = lmdbcur_val (self);
+            if (!val.data || val.size != val_size)
+                break;
+            if (keys)
+                s_column_store (keys, key_width, rows, key.data, key_size, key_type);
+            if (vals)
+                s_column_store (vals, val_width, rows, val.data, val_size, val_type);
+            rows++;
+            if (lmdbcur_next (self))
+                break;
+        }
+        return rows;
+    }
+
+    // Otherwise copy straight out of the map, stepping the LMDB cursor
+    // ourselves with the key and val kept in locals
+    MDB_val mkey = self->mkey;
+    MDB_val mval = self->mval;
+    while (rows < max_rows && mkey.mv_data) {
+        if (mkey.mv_size != key_size || mval.mv_size != val_size)
+            break;
+        if (keys)
+            s_column_store (keys, key_width, rows, mkey.mv_data, key_size, key_type);
+        if (vals)
+            s_column_store (vals, val_width, rows, mval.mv_data, val_size, val_type);
+        rows++;
+        if (mdb_cursor_get (self->handle, &mkey, &mval, MDB_NEXT)) {
+            mkey = (MDB_val) {0};
+            mval = (MDB_val) {0};
+        }
+    }
+    self->mkey = mkey;
+    self->mval = mval;
+    return rows;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Accessors
+
+MDB_cursor *
+lmdbcur_handle (lmdbcur_t *self)
+{
+    assert (self);
+    return self->handle;
 }
 
 
@@ -430,6 +666,164 @@ lmdbcur_test (bool verbose)
     if (verbose)
         log ("Intkey key ordering was correct")
 
+    // -- And for 64 bit intkeys, seeking by number
+    if (sizeof (size_t) == sizeof (uint64_t)) {
+        lmdbdbi_t *dbiik = lmdbdbi_new_intkeys (env, "ik64_db");
+        assert (dbiik);
+        lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
+        assert (txn);
+
+        // Byte order would put 256 before 1, and 1 << 40 before both
+        uint64_t keys [] = { (uint64_t) 1 << 40, 256, 1 };
+        int i;
+        for (i = 0; i < 3; i++) {
+            int rc = lmdbdbi_put_ui64 (dbiik, txn, keys [i], &keys [i], sizeof (keys [i]));
+            assert (!rc);
+        }
+        assert (lmdbspan_asui64 (lmdbdbi_get_ui64 (dbiik, txn, 256)) == 256);
+
+        lmdbcur_t *cur = lmdbcur_new_gekey_ui64 (dbiik, txn, 2);
+        assert (cur);
+        assert (lmdbspan_asui64 (lmdbcur_key (cur)) == 256);
+        int rc = lmdbcur_next (cur);
+        assert (!rc);
+        assert (lmdbspan_asui64 (lmdbcur_val (cur)) == (uint64_t) 1 << 40);
+        lmdbcur_destroy (&cur);
+
+        cur = lmdbcur_new_fromkey_ui64 (dbiik, txn, 1);
+        assert (cur && lmdbcur_matched (cur));
+        assert (lmdbspan_asui64 (lmdbcur_key (cur)) == 1);
+        lmdbcur_destroy (&cur);
+        cur = lmdbcur_new_fromkey_ui64 (dbiik, txn, 2);
+        assert (cur && ! lmdbcur_matched (cur));
+        lmdbcur_destroy (&cur);
+
+        lmdbtxn_destroy (&txn);
+        lmdbdbi_destroy (&dbiik);
+    }
+    if (verbose)
+        log ("64 bit intkeys seek numerically");
+
+    // -- Packed dbis traverse the same way
+    {
+        lmdbdbi_t *dbipk = lmdbdbi_new_packed (env, "pk_db");
+        assert (dbipk);
+        lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
+        assert (txn);
+
+        int rc = 1;
+        uint32_t i;
+        for (i = 0; i < 1000; i++) {
+            char key [32];
+            snprintf (key, sizeof (key), "key:%04u", i);
+            rc = lmdbdbi_put (dbipk, txn, key, strlen (key) + 1, &i, sizeof (i));
+            assert (!rc);
+        }
+
+        lmdbcur_t *cur = lmdbcur_new_overall (dbipk, txn);
+        assert (cur);
+        for (i = 0; i < 1000; i++) {
+            char key [32];
+            snprintf (key, sizeof (key), "key:%04u", i);
+            assert (s_span_is_str (lmdbcur_key (cur), key));
+            assert (lmdbspan_asui32 (lmdbcur_val (cur)) == i);
+            rc = lmdbcur_next (cur);
+            assert (rc == (i == 999 ? -1 : 0));
+        }
+        rc = lmdbcur_next (cur);
+        assert (rc == -1);
+        lmdbcur_destroy (&cur);
+
+        cur = lmdbcur_new_fromkey (dbipk, txn, "key:0500", 9);
+        assert (cur);
+        assert (lmdbcur_matched (cur));
+        assert (lmdbspan_asui32 (lmdbcur_val (cur)) == 500);
+        rc = lmdbcur_next (cur);
+        assert (!rc);
+        assert (s_span_is_str (lmdbcur_key (cur), "key:0501"));
+        lmdbcur_destroy (&cur);
+
+        cur = lmdbcur_new_fromkey (dbipk, txn, "key:05", 7);
+        assert (cur);
+        assert (! lmdbcur_matched (cur));
+        lmdbcur_destroy (&cur);
+
+        cur = lmdbcur_new_gekey (dbipk, txn, "key:05", 7);
+        assert (cur);
+        assert (s_span_is_str (lmdbcur_key (cur), "key:0500"));
+        lmdbcur_destroy (&cur);
+
+        cur = lmdbcur_new_gekey (dbipk, txn, "key:9", 6);
+        assert (cur);
+        assert (! lmdbspan_valid (lmdbcur_key (cur)));
+        rc = lmdbcur_next (cur);
+        assert (rc == -1);
+        lmdbcur_destroy (&cur);
+
+        lmdbtxn_destroy (&txn);
+        lmdbdbi_destroy (&dbipk);
+    }
+    if (verbose)
+        log ("Packed db traversal was correct")
+
+    // -- Bulk reads into columns, widening as they go
+    {
+        lmdbdbi_t *dbiik = lmdbdbi_new_intkeys (env, "cols_db");
+        assert (dbiik);
+        lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
+        assert (txn);
+
+        int rc = 1;
+        uint32_t i;
+        for (i = 0; i < 1000; i++) {
+            float val = i * 0.5f;
+            rc = lmdbdbi_put_ui32 (dbiik, txn, i, &val, sizeof (val));
+            assert (!rc);
+        }
+
+        uint64_t keys [300];
+        double vals [300];
+        lmdbcur_t *cur = lmdbcur_new_overall (dbiik, txn);
+        assert (cur);
+        size_t total = 0;
+        size_t rows;
+        while ((rows = lmdbcur_columns (cur, 300,
+                                        keys, sizeof (uint32_t), LMDBCUR_COLUMN_U32_U64,
+                                        vals, sizeof (float), LMDBCUR_COLUMN_F32_F64))) {
+            assert (rows == (total < 900 ? 300 : 100));
+            for (i = 0; i < rows; i++) {
+                assert (keys [i] == total + i);
+                assert (vals [i] == (total + i) * 0.5);
+            }
+            total += rows;
+        }
+        assert (total == 1000);
+        assert (! lmdbspan_valid (lmdbcur_key (cur)));
+        lmdbcur_destroy (&cur);
+
+        // Copying as stored, keys only; stops at a value of the wrong size,
+        // leaving the cursor there
+        double odd = 1.0;
+        rc = lmdbdbi_put_ui32 (dbiik, txn, 500, &odd, sizeof (odd));
+        assert (!rc);
+        uint32_t raw_keys [300];
+        cur = lmdbcur_new_gekey (dbiik, txn, &(uint32_t) {400}, sizeof (uint32_t));
+        assert (cur);
+        rows = lmdbcur_columns (cur, 300, raw_keys, sizeof (uint32_t), LMDBCUR_COLUMN_COPY,
+                                NULL, sizeof (float), LMDBCUR_COLUMN_COPY);
+        assert (rows == 100);
+        assert (raw_keys [0] == 400 && raw_keys [99] == 499);
+        assert (lmdbspan_asui32 (lmdbcur_key (cur)) == 500);
+        assert (lmdbcur_columns (cur, 300, raw_keys, sizeof (uint32_t), LMDBCUR_COLUMN_COPY,
+                                 NULL, sizeof (float), LMDBCUR_COLUMN_COPY) == 0);
+        lmdbcur_destroy (&cur);
+
+        lmdbtxn_destroy (&txn);
+        lmdbdbi_destroy (&dbiik);
+    }
+    if (verbose)
+        log ("Column reads were correct")
+
     // Ends
 
     lmdbdbi_destroy (&dbi);
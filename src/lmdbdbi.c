@@ -17,17 +17,137 @@
 */
 
 #include "classlmdb_classes.h"
+#include "classlmdb_lmdbfast.h"
 
 #include "logging.h"
 
+#include <stdatomic.h>
+
 //  Structure of our class
 
 struct _lmdbdbi_t {
     MDB_dbi handle;
+    char   *name;        // NULL for the unnamed db
     bool    is_intkeys;  // Was opened with intkeys?
+    bool    is_packed;   // Was opened with packed?
+    bool    is_compressed;  // Was opened with compressed?
+
+    // Packed dbis only: reused for every block rewrite. Only write txns
+    // touch it, and LMDB only allows one of those at a time.
+    lmdbpack_t *pack;
+
+    // Compressed dbis only: the codec, the smallest value worth
+    // compressing, and the side dbi holding trained dictionaries
+    lmdbzip_t *zip;
+    size_t zip_threshold;
+    lmdbdbi_t *zip_dicts;
+
+    // With a filter enabled: the filter, the side dbi it's stored in, and
+    // how it's been doing. Counters are bumped from any reading thread.
+    // Rebuilding or reloading swaps the filter; the old one is kept until
+    // no get can be probing it, which is when none are in flight.
+    lmdbbloom_t *_Atomic filter;
+    lmdbdbi_t *filter_dbi;
+    atomic_size_t filter_readers;
+    lmdbbloom_t **retired_filters;
+    size_t retired_filter_count;
+    atomic_flag filter_lock;    // Held to swap the filter or retire one
+
+    // The stored filter's generation that the one in memory holds, the
+    // newest read txn seen at that generation, and the write txn that
+    // last checked it. Commits through other handles bump the stored
+    // generation, and the filter is reloaded to take in their keys.
+    atomic_uint_fast64_t filter_generation;
+    atomic_size_t filter_txnid;
+    size_t filter_write_txnid;
+    atomic_uint_fast64_t filter_checks;
+    atomic_uint_fast64_t filter_skips;
+    atomic_uint_fast64_t filter_false_positives;
+
+    // Secondary indexes to maintain on puts and dels
+    lmdbidx_t **indexes;
+    size_t index_count;
+
+    // Merge operators, made on first use, and where merges copy old
+    // values to. Only write txns touch the buffer.
+    lmdbmerge_t *merge;
+    byte *merge_buf;
+    size_t merge_buf_size;
+
+    // With TTLs enabled: the side dbi holding expiry times
+    lmdbdbi_t *ttl_dbi;
+
+    // With the change log enabled: the side dbi recording each change
+    lmdbdbi_t *log_dbi;
 };
 
 
+//  --------------------------------------------------------------------------
+//  Constants used for packed dbis
+
+// LMDB moves values bigger than about half a page out to overflow pages.
+// Keeping blocks to a quarter page leaves room for a max-size key alongside
+// them on 4KB pages, and still amortises per-node overhead over dozens of
+// small records.
+static size_t
+s_packed_block_target = 1024;
+
+
+//  --------------------------------------------------------------------------
+//  Constants used for compressed dbis
+
+// Key in the dictionary dbi holding the id of the dictionary to encode
+// with; every other key there is a uint32_t dictionary id
+#define s_zip_current_key "current"
+
+// zstd wants around 100x the dictionary size in samples to train well
+#define s_zip_sample_factor 100
+
+
+//  --------------------------------------------------------------------------
+//  Constants used for filters
+
+// Keys in the filter dbi holding the filter's size in bytes and its
+// generation, bumped by every commit that stores it, as uint64_ts; every
+// other key there is a uint32_t segment index
+#define s_filter_size_key "size"
+#define s_filter_generation_key "generation"
+
+static void
+    s_filter_reclaim (lmdbdbi_t *self, bool force);
+
+
+//  --------------------------------------------------------------------------
+//  Constants used for expiring keys
+
+// The TTL dbi holds two entries per expiring key: 'e' + expiry + key, so
+// that a cursor walks them soonest first, and 'k' + key -> expiry, so
+// that we can check or clear a key's expiry. Expiry times are msecs since
+// the epoch, big endian so they sort numerically.
+#define s_ttl_by_time 'e'
+#define s_ttl_by_key 'k'
+#define s_ttl_max_key (LMDBPACK_MAX_KEY - 1 - 8)
+
+
+//  --------------------------------------------------------------------------
+//  Constants used for the change log
+
+// Log entries are keyed by a big endian sequence number, counting from 1.
+// Values are an op, the key size as 4 big endian bytes, the key, and for
+// puts the value.
+#define s_log_put 'p'
+#define s_log_del 'd'
+#define s_log_header 5
+
+
+//  --------------------------------------------------------------------------
+//  Constants used for counting
+
+// Approximate counts walk this many LMDB entries before estimating, so
+// that short ranges, like a page of results, still count exactly
+#define s_count_walk 256
+
+
 //  --------------------------------------------------------------------------
 //  Create a new lmdbdbi
 
@@ -36,8 +156,10 @@ s_makedbi_withflags (lmdbenv_t *env, const char *name, unsigned int flags)
 {
     assert (env);
 
-    lmdbdbi_t *self = (lmdbdbi_t *) zmalloc (sizeof (lmdbdbi_t));
+    lmdbdbi_t *self = (lmdbdbi_t *) lmdballoc_zmalloc (sizeof (lmdbdbi_t));
     assert (self);
+    if (name)
+        self->name = lmdballoc_strdup (name);
 
     // We need a txn to create the db, but can close it after
     lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
@@ -81,6 +203,86 @@ lmdbdbi_new_intkeys (lmdbenv_t *env, const char *name)
     return self;
 }
 
+lmdbdbi_t *
+lmdbdbi_new_packed (lmdbenv_t *env, const char *name)
+{
+    assert (env);
+    lmdbdbi_t *self = s_makedbi_withflags (env, name, MDB_CREATE);
+    if (self) {
+        self->is_packed = true;
+        self->pack = lmdbpack_new ();
+    }
+    return self;
+}
+
+
+// Load every dictionary the dbi has been trained with, finishing with the
+// one that's current, so that it's the one used to encode
+static int
+s_compressed_load_dicts (lmdbdbi_t *self, lmdbenv_t *env)
+{
+    lmdbtxn_t *txn = lmdbtxn_new_rdonly (env);
+    if (!txn)
+        return -1;
+
+    int rc = -1;
+    uint32_t current = 0;
+    lmdbspan cur_span = lmdbdbi_get_str (self->zip_dicts, txn, s_zip_current_key);
+    if (lmdbspan_valid (cur_span))
+        current = lmdbspan_asui32 (cur_span);
+
+    lmdbcur_t *cur = lmdbcur_new_overall (self->zip_dicts, txn);
+    if (!cur)
+        goto cleanup_ret;
+    do {
+        lmdbspan key = lmdbcur_key (cur);
+        if (! lmdbspan_valid (key))
+            break;
+        if (key.size == sizeof (uint32_t) && lmdbspan_asui32 (key) != current) {
+            lmdbspan dict = lmdbcur_val (cur);
+            if (! lmdbzip_add_dict (self->zip, dict.data, dict.size))
+                goto cleanup_ret;
+        }
+    } while (lmdbcur_next (cur) == 0);
+
+    if (current) {
+        lmdbspan dict = lmdbdbi_get_ui32 (self->zip_dicts, txn, current);
+        if (! lmdbspan_valid (dict)
+        ||  lmdbzip_add_dict (self->zip, dict.data, dict.size) != current)
+            goto cleanup_ret;
+    }
+    rc = 0;
+
+ cleanup_ret:
+    lmdbcur_destroy (&cur);
+    lmdbtxn_destroy (&txn);
+    return rc;
+}
+
+lmdbdbi_t *
+lmdbdbi_new_compressed (lmdbenv_t *env, const char *name, size_t threshold)
+{
+    assert (env);
+    if (!name)
+        return NULL;    // we need a name to derive the dictionary dbi's
+
+    lmdbdbi_t *self = s_makedbi_withflags (env, name, MDB_CREATE);
+    if (!self)
+        return NULL;
+    self->is_compressed = true;
+    self->zip_threshold = threshold;
+
+    char *dicts_name = zsys_sprintf ("%s.zdict", name);
+    self->zip_dicts = lmdbdbi_new (env, dicts_name);
+    zstr_free (&dicts_name);
+
+    self->zip = lmdbzip_new ();
+    if (!self->zip || !self->zip_dicts
+    ||  s_compressed_load_dicts (self, env))
+        lmdbdbi_destroy (&self);
+    return self;
+}
+
 
 //  --------------------------------------------------------------------------
 //  Destroy the lmdbdbi
@@ -93,208 +295,2274 @@ lmdbdbi_destroy (lmdbdbi_t **self_p)
         lmdbdbi_t *self = *self_p;
 
         // No need to close handle
-
-        free (self);
+        lmdbpack_destroy (&self->pack);
+        lmdbzip_destroy (&self->zip);
+        lmdbdbi_destroy (&self->zip_dicts);
+        lmdbbloom_t *filter = atomic_load (&self->filter);
+        lmdbbloom_destroy (&filter);
+        s_filter_reclaim (self, true);
+        lmdbdbi_destroy (&self->filter_dbi);
+        lmdbdbi_destroy (&self->ttl_dbi);
+        lmdbdbi_destroy (&self->log_dbi);
+        assert (self->index_count == 0 && "destroy indexes before their primary");
+        lmdballoc_free (self->indexes);
+        lmdbmerge_destroy (&self->merge);
+        lmdballoc_free (self->merge_buf);
+        lmdballoc_free (self->name);
+
+        lmdballoc_free (self);
         *self_p = NULL;
     }
 }
 
 
 //  --------------------------------------------------------------------------
-//  GET functions
+//  Packed dbi storage
+//    Each LMDB value is an lmdbpack block, stored under the largest key it
+//    holds, so the block that may contain a key is the first one whose
+//    LMDB key is >= it.
 
-lmdbspan
-lmdbdbi_get_str (lmdbdbi_t *self, lmdbtxn_t *txn, const char *key)
+static lmdbspan
+s_packed_get (lmdbdbi_t *self, lmdbtxn_t *txn, const void *key, size_t key_size)
 {
-    assert (! lmdbdbi_intkeys (self) && "get str key not valid for intkeys dbi");
-    assert (self);
-    assert (txn);
-    assert (key);
+    MDB_cursor *cur = NULL;
+    int err = mdb_cursor_open (lmdbtxn_handle (txn), self->handle, &cur);
+    if (err)
+        return lmdbspan_makenull ();
 
-    size_t key_size = strlen (key) + 1;
-    return lmdbdbi_get (self, txn, key, key_size);
+    // LMDB api requires us to cast away const here, but doesn't mutate
+    MDB_val mkey = {.mv_data = (void *) key, .mv_size = key_size};
+    MDB_val mblock;
+    err = mdb_cursor_get (cur, &mkey, &mblock, MDB_SET_RANGE);
+    mdb_cursor_close (cur);
+
+    assert (err == 0 || err == MDB_NOTFOUND);
+    if (err)
+        return lmdbspan_makenull ();
+
+    bool exact = false;
+    size_t pos = lmdbpack_block_search (mblock.mv_data, key, key_size, &exact);
+    if (!exact)
+        return lmdbspan_makenull ();
+    return lmdbpack_block_entry (mblock.mv_data, pos, NULL, NULL);
 }
 
-lmdbspan
-lmdbdbi_get_ui32 (lmdbdbi_t *self, lmdbtxn_t *txn, uint32_t key)
+// Load the block that key belongs in into self->pack, and copy the key it's
+// stored under into old_key (*old_key_size is 0 if there's no such block).
+// Sets *is_last if key is beyond every block's range.
+static int
+s_packed_load (lmdbdbi_t *self, lmdbtxn_t *txn,
+               const void *key, size_t key_size,
+               char *old_key, size_t *old_key_size, bool *is_last)
 {
-    assert (self);
-    assert (txn);
+    MDB_cursor *cur = NULL;
+    int err = mdb_cursor_open (lmdbtxn_handle (txn), self->handle, &cur);
+    if (err)
+        return -1;
 
-    return lmdbdbi_get (self, txn, &key, sizeof (key));
+    MDB_val mkey = {.mv_data = (void *) key, .mv_size = key_size};
+    MDB_val mblock;
+    *is_last = false;
+    err = mdb_cursor_get (cur, &mkey, &mblock, MDB_SET_RANGE);
+    if (err == MDB_NOTFOUND) {
+        *is_last = true;
+        err = mdb_cursor_get (cur, &mkey, &mblock, MDB_LAST);
+    }
+    mdb_cursor_close (cur);
+
+    *old_key_size = 0;
+    if (err == MDB_NOTFOUND) {
+        lmdbpack_reset (self->pack);
+        return 0;
+    }
+    if (err)
+        return -1;
+
+    assert (mkey.mv_size <= LMDBPACK_MAX_KEY);
+    memcpy (old_key, mkey.mv_data, mkey.mv_size);
+    *old_key_size = mkey.mv_size;
+    return lmdbpack_load (self->pack, mblock.mv_data, mblock.mv_size);
 }
 
-lmdbspan
-lmdbdbi_get_i32 (lmdbdbi_t *self, lmdbtxn_t *txn, int32_t key)
+// Write self->pack back as one or more blocks, replacing the block stored
+// under old_key. Appends fill blocks up before starting a new one; anything
+// else splits evenly, so random inserts don't leave runs of tiny blocks.
+static int
+s_packed_store (lmdbdbi_t *self, lmdbtxn_t *txn,
+                const char *old_key, size_t old_key_size, bool is_append)
 {
-    assert (! lmdbdbi_intkeys (self) && "get i32 key not valid for intkeys dbi");
-    assert (self);
-    assert (txn);
+    size_t target = s_packed_block_target;
+    if (!is_append) {
+        size_t total = lmdbpack_encoded_size (self->pack);
+        size_t pieces = (total + target - 1) / target;
+        if (pieces > 1)
+            target = total / pieces + 1;
+    }
 
-    return lmdbdbi_get (self, txn, &key, sizeof (key));
+    // Everything is encoded before we write, as the loaded entries point
+    // into the old block, which LMDB may move or overwrite
+    size_t pieces = lmdbpack_encode (self->pack, target);
+
+    bool reuses_old_key = false;
+    size_t i;
+    for (i = 0; i < pieces; i++) {
+        lmdbspan maxkey = lmdbpack_piece_maxkey (self->pack, i);
+        if (maxkey.size == old_key_size
+        &&  memcmp (maxkey.data, old_key, old_key_size) == 0)
+            reuses_old_key = true;
+    }
+
+    int err = 0;
+    if (old_key_size && !reuses_old_key) {
+        MDB_val mkey = {.mv_data = (void *) old_key, .mv_size = old_key_size};
+        err = mdb_del (lmdbtxn_handle (txn), self->handle, &mkey, NULL);
+        if (err)
+            return -1;
+    }
+
+    for (i = 0; i < pieces; i++) {
+        lmdbspan maxkey = lmdbpack_piece_maxkey (self->pack, i);
+        lmdbspan block = lmdbpack_piece (self->pack, i);
+        MDB_val mkey = {.mv_data = (void *) maxkey.data, .mv_size = maxkey.size};
+        MDB_val mval = {.mv_data = (void *) block.data, .mv_size = block.size};
+        err = mdb_put (lmdbtxn_handle (txn), self->handle, &mkey, &mval, 0);
+        if (err)
+            return -1;
+    }
+    return 0;
 }
 
-lmdbspan
-lmdbdbi_get (lmdbdbi_t *self, lmdbtxn_t *txn, const void *key, size_t key_size)
+static int
+s_packed_put (lmdbdbi_t *self, lmdbtxn_t *txn,
+              const void *key, size_t key_size,
+              const void *val, size_t val_size)
 {
-    // TODO can we put a useful assert here to catch some inadvertant non-uint
-    // keys being used for intkey dbis?
-    assert (self);
-    assert (txn);
-    assert (key);
+    if (key_size == 0 || key_size > LMDBPACK_MAX_KEY
+    ||  val_size > LMDBPACK_MAX_VALUE)
+        return -1;
 
-    MDB_val mkey, mval;
-    // LMDB api requires us to cast away const here, but doesn't mutate
-    mkey.mv_data = (void *) key;
-    mkey.mv_size = key_size;
+    char old_key [LMDBPACK_MAX_KEY];
+    size_t old_key_size = 0;
+    bool is_last = false;
+    int rc = s_packed_load (self, txn, key, key_size,
+                            old_key, &old_key_size, &is_last);
+    if (rc)
+        return -1;
 
-    int err = mdb_get (lmdbtxn_handle (txn), self->handle, &mkey, &mval);
-    
-    assert (err == 0 || err == MDB_NOTFOUND);
-    if (err)
-        return lmdbspan_makenull ();
-    else
-        return (lmdbspan){ .data = mval.mv_data, .size = mval.mv_size };
+    lmdbpack_insert (self->pack, key, key_size, val, val_size);
+    return s_packed_store (self, txn, old_key, old_key_size, is_last);
+}
+
+static int
+s_packed_del (lmdbdbi_t *self, lmdbtxn_t *txn, const void *key, size_t key_size)
+{
+    if (key_size == 0 || key_size > LMDBPACK_MAX_KEY)
+        return -1;
+
+    char old_key [LMDBPACK_MAX_KEY];
+    size_t old_key_size = 0;
+    bool is_last = false;
+    int rc = s_packed_load (self, txn, key, key_size,
+                            old_key, &old_key_size, &is_last);
+    if (rc || is_last || ! lmdbpack_remove (self->pack, key, key_size))
+        return -1;
+
+    if (lmdbpack_count (self->pack) > 0)
+        return s_packed_store (self, txn, old_key, old_key_size, false);
+
+    MDB_val mkey = {.mv_data = (void *) old_key, .mv_size = old_key_size};
+    return mdb_del (lmdbtxn_handle (txn), self->handle, &mkey, NULL) ? -1 : 0;
 }
 
 
 //  --------------------------------------------------------------------------
-//  PUT functions
+//  Compressed dbi storage
+//    Each LMDB value is an lmdbzip encoded value. Ones stored raw are
+//    handed out in place; the rest are decoded into txn scratch space,
+//    or for cursors, into a buffer each reuses from record to record.
 
-int
-lmdbdbi_put_str (lmdbdbi_t *self, lmdbtxn_t *txn,
-                 const char *key,
-                 const void *val, size_t val_size)
+lmdbspan
+lmdbdbi_decode (lmdbdbi_t *self, lmdbtxn_t *txn, lmdbspan stored)
 {
-    assert (! lmdbdbi_intkeys (self) && "put str key not valid for intkeys dbi");
     assert (self);
     assert (txn);
-    assert (key);
-    assert (val);
-    
-    size_t key_size = strlen (key) + 1;  // include null term
-    return lmdbdbi_put (self, txn, key, key_size, val, val_size);
+    if (!self->is_compressed || !lmdbspan_valid (stored))
+        return stored;
+
+    lmdbspan raw = lmdbzip_raw (stored.data, stored.size);
+    if (lmdbspan_valid (raw))
+        return raw;
+
+    size_t size = lmdbzip_decoded_size (stored.data, stored.size);
+    if (size == SIZE_MAX)
+        return lmdbspan_makenull ();
+    void *buf = lmdbtxn_scratch (txn, size);
+    if (!buf
+    ||  lmdbzip_decode (self->zip, stored.data, stored.size, buf, size))
+        return lmdbspan_makenull ();
+    return (lmdbspan) { .data = buf, .size = size };
 }
 
-int
-lmdbdbi_put_strstr (lmdbdbi_t *self, lmdbtxn_t *txn,
-                    const char *key, const char *val)
+lmdbspan
+lmdbdbi_decode_reusing (lmdbdbi_t *self, lmdbspan stored,
+                        void **buf_p, size_t *buf_max_p)
 {
-    assert (! lmdbdbi_intkeys (self) && "put str key not valid for intkeys dbi");
     assert (self);
-    assert (txn);
-    assert (key);
-    assert (val);
-    
-    size_t key_size = strlen (key) + 1;  // inc null term
-    size_t val_size = strlen (val) + 1;  // inc null term
-    return lmdbdbi_put (self, txn, key, key_size, val, val_size);
+    assert (buf_p);
+    assert (buf_max_p);
+    if (!self->is_compressed || !lmdbspan_valid (stored))
+        return stored;
+
+    lmdbspan raw = lmdbzip_raw (stored.data, stored.size);
+    if (lmdbspan_valid (raw))
+        return raw;
+
+    size_t size = lmdbzip_decoded_size (stored.data, stored.size);
+    if (size == SIZE_MAX)
+        return lmdbspan_makenull ();
+    if (!*buf_p || size > *buf_max_p) {
+        void *grown = lmdballoc_realloc (*buf_p, size ? size : 1);
+        if (!grown)
+            return lmdbspan_makenull ();
+        *buf_p = grown;
+        *buf_max_p = size;
+    }
+    if (lmdbzip_decode (self->zip, stored.data, stored.size, *buf_p, size))
+        return lmdbspan_makenull ();
+    return (lmdbspan) { .data = *buf_p, .size = size };
 }
 
-int
-lmdbdbi_put_ui32 (lmdbdbi_t *self, lmdbtxn_t *txn,
-                  uint32_t key,
+static int
+s_compressed_put (lmdbdbi_t *self, lmdbtxn_t *txn,
+                  const void *key, size_t key_size,
                   const void *val, size_t val_size)
 {
-    assert (self);
-    assert (txn);
-    return lmdbdbi_put (self, txn, &key, sizeof (key), val, val_size);
-}
+    lmdbspan stored = lmdbzip_encode (self->zip, val, val_size, self->zip_threshold);
+    if (! lmdbspan_valid (stored))
+        return -1;
 
-int
-lmdbdbi_put_i32 (lmdbdbi_t *self, lmdbtxn_t *txn,
-                 int32_t key,
-                 const void *val, size_t val_size)
-{
-    assert (! lmdbdbi_intkeys (self) && "put i32 key not valid for intkeys dbi");
-    assert (self);
-    assert (txn);
-    return lmdbdbi_put (self, txn, &key, sizeof (key), val, val_size);
+    MDB_val mkey = {.mv_data = (void *) key, .mv_size = key_size};
+    MDB_val mval = {.mv_data = (void *) stored.data, .mv_size = stored.size};
+    int err = mdb_put (lmdbtxn_handle (txn), self->handle, &mkey, &mval, 0);
+    return err ? -1 : 0;
 }
 
 int
-lmdbdbi_put (lmdbdbi_t *self, lmdbtxn_t *txn,
-             const void *key, size_t key_size,
-             const void *val, size_t val_size)
+lmdbdbi_train_dict (lmdbdbi_t *self, lmdbenv_t *env, size_t dict_size)
 {
-    // TODO as in GET, can we have some kind of assert check to catch some non-
-    // uint key uses for intkey dbis?
     assert (self);
-    assert (txn);
-    assert (key);
-    assert (val);
-
-    // LMDB api reqs casting away const, but doesn't mutate
-    MDB_val mkey = {.mv_data = (void *) key, .mv_size = key_size};
-    MDB_val mval = {.mv_data = (void *) val, .mv_size = val_size};
+    assert (env);
+    assert (self->is_compressed && "only compressed dbis can train a dict");
 
-    int err = mdb_put (lmdbtxn_handle (txn), self->handle,
-                       &mkey, &mval, 0);  // 0 is flags
-    if (err)
+    lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
+    if (!txn)
         return -1;
-    else
-        return 0;
+
+    int rc = -1;
+    size_t samples_max = dict_size * s_zip_sample_factor;
+    byte *samples = (byte *) lmdballoc_malloc (samples_max);
+    size_t samples_size = 0;
+    size_t *sample_sizes = NULL;
+    size_t sample_count = 0;
+    size_t sample_sizes_max = 0;
+    void *dict = lmdballoc_malloc (dict_size);
+    lmdbcur_t *cur = NULL;
+    if (!samples || !dict)
+        goto cleanup_ret;
+
+    // Sample values in key order, which is as good as any for a first cut
+    cur = lmdbcur_new_overall (self, txn);
+    if (!cur)
+        goto cleanup_ret;
+    do {
+        lmdbspan val = lmdbcur_val (cur);
+        if (! lmdbspan_valid (val) || samples_size + val.size > samples_max)
+            break;
+        if (sample_count == sample_sizes_max) {
+            sample_sizes_max = sample_sizes_max ? sample_sizes_max * 2 : 256;
+            size_t *grown = (size_t *) lmdballoc_realloc (sample_sizes,
+                                                          sample_sizes_max * sizeof (size_t));
+            if (!grown)
+                goto cleanup_ret;
+            sample_sizes = grown;
+        }
+        memcpy (samples + samples_size, val.data, val.size);
+        samples_size += val.size;
+        sample_sizes [sample_count++] = val.size;
+    } while (lmdbcur_next (cur) == 0);
+
+    size_t size = sample_count
+                ? lmdbzip_train (samples, sample_sizes, sample_count, dict, dict_size)
+                : 0;
+    if (!size)
+        goto cleanup_ret;
+
+    // Store the dictionary and only switch to it once that's committed, so
+    // we never write a value that a later reopen couldn't decode
+    uint32_t id = lmdbzip_dict_id_of (dict, size);
+    if (!id
+    ||  lmdbdbi_put_ui32 (self->zip_dicts, txn, id, dict, size)
+    ||  lmdbdbi_put_str (self->zip_dicts, txn, s_zip_current_key, &id, sizeof (id)))
+        goto cleanup_ret;
+
+    lmdbcur_destroy (&cur);
+    if (lmdbtxn_commit (txn))
+        goto cleanup_ret;
+    if (lmdbzip_add_dict (self->zip, dict, size) != id)
+        goto cleanup_ret;
+    rc = 0;
+
+ cleanup_ret:
+    lmdbcur_destroy (&cur);
+    lmdbtxn_destroy (&txn);
+    lmdballoc_free (samples);
+    lmdballoc_free (sample_sizes);
+    lmdballoc_free (dict);
+    return rc;
 }
 
 
 //  --------------------------------------------------------------------------
-//  Accessors
+//  Membership filter
+//    The filter is kept in memory for lookups, and mirrored segment by
+//    segment into a side dbi: each write txn writes the segments its puts
+//    changed once, as it commits, and bumps the stored generation so
+//    other handles on the dbi know to reload it.
+
+static void
+s_filter_lock (lmdbdbi_t *self)
+{
+    while (atomic_flag_test_and_set_explicit (&self->filter_lock, memory_order_acquire))
+        ;
+}
 
-bool
-lmdbdbi_intkeys (lmdbdbi_t *self)
+static void
+s_filter_unlock (lmdbdbi_t *self)
 {
-    assert (self);
-    return self->is_intkeys;
+    atomic_flag_clear_explicit (&self->filter_lock, memory_order_release);
 }
 
-MDB_dbi
-lmdbdbi_handle (lmdbdbi_t *self)
+// Read a uint64_t kept under key in the filter dbi; 0 if there isn't one.
+// Straight from LMDB, as this can run while the stage is flushing.
+static uint64_t
+s_filter_read_u64 (lmdbdbi_t *self, lmdbtxn_t *txn, const char *key)
 {
-    assert (self);
-    return self->handle;
+    MDB_val mkey = {.mv_data = (void *) key, .mv_size = strlen (key) + 1};
+    MDB_val mval;
+    uint64_t value = 0;
+    if (mdb_get (lmdbtxn_handle (txn), lmdbdbi_handle (self->filter_dbi), &mkey, &mval) == 0
+    &&  mval.mv_size == sizeof (value))
+        memcpy (&value, mval.mv_data, sizeof (value));
+    return value;
 }
 
+static int
+s_filter_write_u64 (lmdbdbi_t *self, lmdbtxn_t *txn, const char *key, uint64_t value)
+{
+    MDB_val mkey = {.mv_data = (void *) key, .mv_size = strlen (key) + 1};
+    MDB_val mval = {.mv_data = &value, .mv_size = sizeof (value)};
+    return mdb_put (lmdbtxn_handle (txn), lmdbdbi_handle (self->filter_dbi),
+                    &mkey, &mval, 0) ? -1 : 0;
+}
 
-//  --------------------------------------------------------------------------
-//  Self test of this class
+// Bump the stored generation, for a txn storing the filter; the new one
+// is only ours once the txn commits
+static int
+s_filter_stamp (lmdbdbi_t *self, lmdbtxn_t *txn, uint64_t *generation_p)
+{
+    *generation_p = s_filter_read_u64 (self, txn, s_filter_generation_key) + 1;
+    return s_filter_write_u64 (self, txn, s_filter_generation_key, *generation_p);
+}
 
-void
-lmdbdbi_test (bool verbose)
+// Load a stored filter; returns NULL if there isn't one
+static lmdbbloom_t *
+s_filter_load (lmdbdbi_t *self, lmdbtxn_t *txn)
 {
-    printf (" * lmdbdbi: ");
+    uint64_t size = s_filter_read_u64 (self, txn, s_filter_size_key);
+    if (!size)
+        return NULL;
+
+    lmdbbloom_t *filter = lmdbbloom_new_withsize ((size_t) size);
+    if (!filter)
+        return NULL;
+    size_t index;
+    for (index = 0; index < lmdbbloom_segment_count (filter); index++) {
+        uint32_t key = (uint32_t) index;
+        MDB_val mkey = {.mv_data = &key, .mv_size = sizeof (key)};
+        MDB_val mval;
+        if (mdb_get (lmdbtxn_handle (txn), lmdbdbi_handle (self->filter_dbi), &mkey, &mval)
+        ||  lmdbbloom_load_segment (filter, index, mval.mv_data, mval.mv_size)) {
+            lmdbbloom_destroy (&filter);
+            break;
+        }
+    }
+    return filter;
+}
 
-    //  @selftest
-    //  Simple create/destroy test
+// Free filters swapped out, if no get can still hold one: any that loaded
+// one was counted in before the swap. With force, free them anyway, as
+// the dbi is going.
+static void
+s_filter_reclaim (lmdbdbi_t *self, bool force)
+{
+    if (!force && atomic_load (&self->filter_readers))
+        return;
+    size_t i;
+    for (i = 0; i < self->retired_filter_count; i++)
+        lmdbbloom_destroy (&self->retired_filters [i]);
+    lmdballoc_free (self->retired_filters);
+    self->retired_filters = NULL;
+    self->retired_filter_count = 0;
+}
 
-    // Note: If your selftest reads SCMed fixture data, please keep it in
-    // src/selftest-ro; if your test creates filesystem objects, please
-    // do so under src/selftest-rw. They are defined below along with a
-    // usecase for the variables (assert) to make compilers happy.
-    const char *SELFTEST_DIR_RO = "src/selftest-ro";
-    const char *SELFTEST_DIR_RW = "src/selftest-rw";
-    assert (SELFTEST_DIR_RO);
-    assert (SELFTEST_DIR_RW);
-    // The following pattern is suggested for C selftest code:
-    //    char *filename = NULL;
-    //    filename = zsys_sprintf ("%s/%s", SELFTEST_DIR_RO, "mytemplate.file");
-    //    assert (filename);
-    //    ... use the filename for I/O ...
-    //    zstr_free (&filename);
-    // This way the same filename variable can be reused for many subtests.
-    //
-    // Uncomment these to use C++ strings in C++ selftest code:
-    //std::string str_SELFTEST_DIR_RO = std::string(SELFTEST_DIR_RO);
-    //std::string str_SELFTEST_DIR_RW = std::string(SELFTEST_DIR_RW);
-    //assert ( (str_SELFTEST_DIR_RO != "") );
-    //assert ( (str_SELFTEST_DIR_RW != "") );
-    // NOTE that for "char*" context you need (str_SELFTEST_DIR_RO + "/myfilename").c_str()
+// Install filter in place of the live one, which is retired rather than
+// freed, as gets in other threads may still be probing it. Call with the
+// filter lock held. Returns -1 if out of memory, leaving the live one.
+static int
+s_filter_swap (lmdbdbi_t *self, lmdbbloom_t *filter)
+{
+    lmdbbloom_t **grown = (lmdbbloom_t **) lmdballoc_realloc (
+        self->retired_filters, (self->retired_filter_count + 1) * sizeof (lmdbbloom_t *));
+    if (!grown)
+        return -1;
+    self->retired_filters = grown;
+    self->retired_filters [self->retired_filter_count++] = atomic_load (&self->filter);
+    atomic_store (&self->filter, filter);
+    s_filter_reclaim (self, false);
+    return 0;
+}
 
-    zsys_init ();
-    int rc = 1;
+// Take in keys put through other handles on the dbi, in this process or
+// another: reload the stored filter if txn sees a newer generation of it
+// than ours. A read txn's view never changes, so each txnid needs checking
+// once; so does a write txn's, as nothing else can commit until it ends.
+// Returns 0 on success, -1 if a newer filter couldn't be loaded.
+static int
+s_filter_refresh (lmdbdbi_t *self, lmdbtxn_t *txn)
+{
+    bool rdonly = lmdbtxn_rdonly (txn);
+    size_t txnid = mdb_txn_id (lmdbtxn_handle (txn));
+    if (rdonly? txnid <= atomic_load (&self->filter_txnid):
+                txnid == self->filter_write_txnid)
+        return 0;
 
-    char *test_db_path = zsys_sprintf ("%s/%s", SELFTEST_DIR_RW, "LMDBDBI_TEST_DB.db");
-    if (zsys_file_exists (test_db_path))
-        zsys_file_delete (test_db_path);
+    uint64_t generation = s_filter_read_u64 (self, txn, s_filter_generation_key);
+    if (generation > atomic_load (&self->filter_generation)) {
+        lmdbbloom_t *filter = s_filter_load (self, txn);
+        if (!filter)
+            return -1;
+        int rc = 0;
+        s_filter_lock (self);
+        if (generation <= atomic_load (&self->filter_generation))
+            lmdbbloom_destroy (&filter);    // Another thread got there first
+        else
+        if (s_filter_swap (self, filter) == 0)
+            atomic_store (&self->filter_generation, generation);
+        else {
+            lmdbbloom_destroy (&filter);
+            rc = -1;
+        }
+        s_filter_unlock (self);
+        if (rc)
+            return -1;
+    }
+
+    if (rdonly) {
+        size_t seen = atomic_load (&self->filter_txnid);
+        while (txnid > seen
+           && !atomic_compare_exchange_weak (&self->filter_txnid, &seen, txnid))
+            ;
+    }
+    else
+        self->filter_write_txnid = txnid;
+    return 0;
+}
+
+// Should a lookup of key in txn skip the tree? Counts the answer either way.
+static bool
+s_filter_excludes (lmdbdbi_t *self, lmdbtxn_t *txn, const void *key, size_t key_size)
+{
+    if (!atomic_load_explicit (&self->filter, memory_order_relaxed))
+        return false;
+    // A filter we couldn't bring up to date may be missing keys
+    if (s_filter_refresh (self, txn))
+        return false;
+
+    // Counted in, so a swap doesn't free the filter under us
+    atomic_fetch_add (&self->filter_readers, 1);
+    bool maybe = lmdbbloom_maybe (atomic_load (&self->filter), key, key_size);
+    atomic_fetch_sub (&self->filter_readers, 1);
+
+    atomic_fetch_add_explicit (&self->filter_checks, 1, memory_order_relaxed);
+    if (maybe)
+        return false;
+    atomic_fetch_add_explicit (&self->filter_skips, 1, memory_order_relaxed);
+    return true;
+}
+
+static int
+s_filter_store_segment (lmdbdbi_t *self, lmdbtxn_t *txn,
+                        lmdbbloom_t *filter, size_t index)
+{
+    // Straight to LMDB, as this runs after the stage's last flush
+    uint32_t key = (uint32_t) index;
+    lmdbspan data = lmdbbloom_segment (filter, index);
+    MDB_val mkey = {.mv_data = &key, .mv_size = sizeof (key)};
+    MDB_val mval = {.mv_data = (void *) data.data, .mv_size = data.size};
+    return mdb_put (lmdbtxn_handle (txn), lmdbdbi_handle (self->filter_dbi),
+                    &mkey, &mval, 0) ? -1 : 0;
+}
+
+static int
+s_filter_add (lmdbdbi_t *self, lmdbtxn_t *txn, const void *key, size_t key_size)
+{
+    // Catch up first, or the segments we store would drop other handles'
+    // keys. After that the stored filter can't change while we hold the
+    // write txn, so no other thread swaps ours under us.
+    if (s_filter_refresh (self, txn))
+        return -1;
+    lmdbbloom_t *filter = atomic_load (&self->filter);
+    size_t index = lmdbbloom_add (filter, key, key_size);
+    return lmdbtxn_filter_changed (txn, self, index, lmdbbloom_segment_count (filter));
+}
+
+// Store all of filter in place of whatever's in the filter dbi
+static int
+s_filter_store (lmdbdbi_t *self, lmdbtxn_t *txn, lmdbbloom_t *filter)
+{
+    if (s_filter_write_u64 (self, txn, s_filter_size_key, lmdbbloom_size (filter)))
+        return -1;
+    size_t index;
+    for (index = 0; index < lmdbbloom_segment_count (filter); index++)
+        if (s_filter_store_segment (self, txn, filter, index))
+            return -1;
+
+    // Drop segments left over from a bigger filter
+    MDB_txn *handle = lmdbtxn_handle (txn);
+    MDB_dbi filter_handle = lmdbdbi_handle (self->filter_dbi);
+    MDB_cursor *mcur = NULL;
+    if (mdb_cursor_open (handle, filter_handle, &mcur))
+        return -1;
+    uint32_t first_stale = (uint32_t) index;
+    MDB_val mkey, mval;
+    int err = mdb_cursor_get (mcur, &mkey, &mval, MDB_FIRST);
+    while (err == 0) {
+        uint32_t seg;
+        if (mkey.mv_size == sizeof (seg)) {
+            memcpy (&seg, mkey.mv_data, sizeof (seg));
+            if (seg >= first_stale && mdb_cursor_del (mcur, 0))
+                break;
+        }
+        err = mdb_cursor_get (mcur, &mkey, &mval, MDB_NEXT);
+    }
+    mdb_cursor_close (mcur);
+    return err == MDB_NOTFOUND ? 0 : -1;
+}
+
+// Build a filter of the given size from every key in the dbi, and store
+// it in place of whatever's in the filter dbi
+static lmdbbloom_t *
+s_filter_build (lmdbdbi_t *self, lmdbtxn_t *txn, size_t size)
+{
+    lmdbbloom_t *filter = lmdbbloom_new_withsize (size);
+    if (!filter)
+        return NULL;
+
+    lmdbcur_t *cur = lmdbcur_new_overall (self, txn);
+    if (!cur)
+        goto die;
+    do {
+        lmdbspan key = lmdbcur_key (cur);
+        if (! lmdbspan_valid (key))
+            break;
+        lmdbbloom_add (filter, key.data, key.size);
+    } while (lmdbcur_next (cur) == 0);
+    lmdbcur_destroy (&cur);
+
+    if (s_filter_store (self, txn, filter))
+        goto die;
+    return filter;
+
+ die:
+    lmdbcur_destroy (&cur);
+    lmdbbloom_destroy (&filter);
+    return NULL;
+}
+
+int
+lmdbdbi_save_filter (lmdbdbi_t *self, lmdbtxn_t *txn,
+                     const byte *segments, size_t segment_count,
+                     uint64_t *generation_p)
+{
+    assert (self);
+    assert (txn);
+    assert (segments);
+    assert (generation_p);
+    lmdbbloom_t *filter = atomic_load (&self->filter);
+    assert (filter);
+
+    if (s_filter_stamp (self, txn, generation_p))
+        return -1;
+
+    // A resize whose commit failed left the stored filter at its old size,
+    // which the segments don't fit
+    if (s_filter_read_u64 (self, txn, s_filter_size_key) != lmdbbloom_size (filter)
+    ||  segment_count != lmdbbloom_segment_count (filter))
+        return s_filter_store (self, txn, filter);
+
+    size_t index;
+    for (index = 0; index < segment_count; index++)
+        if ((segments [index / 8] & (1 << (index % 8)))
+        &&  s_filter_store_segment (self, txn, filter, index))
+            return -1;
+    return 0;
+}
+
+void
+lmdbdbi_filter_saved (lmdbdbi_t *self, uint64_t generation)
+{
+    assert (self);
+    atomic_store (&self->filter_generation, generation);
+}
+
+int
+lmdbdbi_enable_filter (lmdbdbi_t *self, lmdbenv_t *env, size_t expected_keys)
+{
+    assert (self);
+    assert (env);
+    if (!self->name || self->filter)
+        return -1;
+
+    char *filter_name = zsys_sprintf ("%s.bloom", self->name);
+    self->filter_dbi = lmdbdbi_new (env, filter_name);
+    zstr_free (&filter_name);
+    if (!self->filter_dbi)
+        return -1;
+    atomic_flag_clear (&self->filter_lock);
+
+    lmdbtxn_t *txn = lmdbtxn_new_rdonly (env);
+    if (!txn)
+        goto die;
+    lmdbbloom_t *filter = s_filter_load (self, txn);
+    uint64_t generation = s_filter_read_u64 (self, txn, s_filter_generation_key);
+    atomic_store (&self->filter_txnid, mdb_txn_id (lmdbtxn_handle (txn)));
+    lmdbtxn_destroy (&txn);
+
+    if (!filter) {
+        // First time, or the stored copy is damaged: build from scratch
+        lmdbbloom_t *sizer = lmdbbloom_new (expected_keys);
+        if (!sizer)
+            goto die;
+        size_t size = lmdbbloom_size (sizer);
+        lmdbbloom_destroy (&sizer);
+
+        txn = lmdbtxn_new_rdrw (env);
+        if (!txn)
+            goto die;
+        filter = s_filter_build (self, txn, size);
+        if (!filter
+        ||  s_filter_stamp (self, txn, &generation)
+        ||  lmdbtxn_commit (txn)) {
+            lmdbbloom_destroy (&filter);
+            lmdbtxn_destroy (&txn);
+            goto die;
+        }
+        lmdbtxn_destroy (&txn);
+    }
+
+    atomic_store (&self->filter_generation, generation);
+    atomic_store (&self->filter, filter);
+    return 0;
+
+ die:
+    lmdbdbi_destroy (&self->filter_dbi);
+    return -1;
+}
+
+int
+lmdbdbi_rebuild_filter (lmdbdbi_t *self, lmdbenv_t *env, size_t expected_keys)
+{
+    assert (self);
+    assert (env);
+    lmdbbloom_t *live = atomic_load (&self->filter);
+    assert (live && "enable the filter before rebuilding it");
+
+    size_t size = lmdbbloom_size (live);
+    if (expected_keys) {
+        lmdbbloom_t *sizer = lmdbbloom_new (expected_keys);
+        if (!sizer)
+            return -1;
+        size = lmdbbloom_size (sizer);
+        lmdbbloom_destroy (&sizer);
+    }
+
+    lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
+    if (!txn)
+        return -1;
+    uint64_t generation;
+    lmdbbloom_t *filter = s_filter_build (self, txn, size);
+    if (!filter || s_filter_stamp (self, txn, &generation)) {
+        lmdbbloom_destroy (&filter);
+        lmdbtxn_destroy (&txn);
+        return -1;
+    }
+
+    // Installed while we hold the write txn, so no writer can add a key
+    // between the build and the install. Should the commit then fail, the
+    // filter still holds every committed key, and the next commit that
+    // changes it stores it whole.
+    s_filter_lock (self);
+    int rc = s_filter_swap (self, filter);
+    s_filter_unlock (self);
+    if (rc) {
+        lmdbbloom_destroy (&filter);
+        lmdbtxn_destroy (&txn);
+        return -1;
+    }
+
+    rc = lmdbtxn_commit (txn);
+    lmdbtxn_destroy (&txn);
+    if (rc)
+        return -1;
+    atomic_store (&self->filter_generation, generation);
+    return 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Expiring keys
+
+static void
+s_put_be64 (byte *buf, uint64_t value)
+{
+    int i;
+    for (i = 7; i >= 0; i--, value >>= 8)
+        buf [i] = (byte) value;
+}
+
+static uint64_t
+s_get_be64 (const byte *buf)
+{
+    uint64_t value = 0;
+    int i;
+    for (i = 0; i < 8; i++)
+        value = (value << 8) | buf [i];
+    return value;
+}
+
+// Where key expires, in *expiry. Returns 0 if it does, 1 if it doesn't
+// (or has no TTL dbi), -1 on failure.
+static int
+s_ttl_expiry (lmdbdbi_t *self, lmdbtxn_t *txn,
+              const void *key, size_t key_size, uint64_t *expiry)
+{
+    if (!self->ttl_dbi || key_size > s_ttl_max_key)
+        return 1;
+
+    byte ttl_key [1 + s_ttl_max_key];
+    ttl_key [0] = s_ttl_by_key;
+    memcpy (ttl_key + 1, key, key_size);
+    lmdbspan val = lmdbdbi_get (self->ttl_dbi, txn, ttl_key, 1 + key_size);
+    if (! lmdbspan_valid (val))
+        return 1;
+    if (val.size != 8)
+        return -1;
+    *expiry = s_get_be64 ((const byte *) val.data);
+    return 0;
+}
+
+static bool
+s_ttl_expired (lmdbdbi_t *self, lmdbtxn_t *txn, const void *key, size_t key_size)
+{
+    uint64_t expiry;
+    return s_ttl_expiry (self, txn, key, key_size, &expiry) == 0
+        && expiry <= (uint64_t) zclock_time ();
+}
+
+// Forget key's expiry, if it has one
+static int
+s_ttl_clear (lmdbdbi_t *self, lmdbtxn_t *txn, const void *key, size_t key_size)
+{
+    uint64_t expiry;
+    int rc = s_ttl_expiry (self, txn, key, key_size, &expiry);
+    if (rc)
+        return rc == 1 ? 0 : -1;
+
+    byte ttl_key [1 + 8 + s_ttl_max_key];
+    ttl_key [0] = s_ttl_by_time;
+    s_put_be64 (ttl_key + 1, expiry);
+    memcpy (ttl_key + 9, key, key_size);
+    if (lmdbdbi_del (self->ttl_dbi, txn, ttl_key, 9 + key_size))
+        return -1;
+
+    ttl_key [0] = s_ttl_by_key;
+    memcpy (ttl_key + 1, key, key_size);
+    return lmdbdbi_del (self->ttl_dbi, txn, ttl_key, 1 + key_size);
+}
+
+static int
+s_ttl_set (lmdbdbi_t *self, lmdbtxn_t *txn,
+           const void *key, size_t key_size, uint64_t expiry)
+{
+    if (key_size > s_ttl_max_key || s_ttl_clear (self, txn, key, key_size))
+        return -1;
+
+    byte ttl_key [1 + 8 + s_ttl_max_key];
+    ttl_key [0] = s_ttl_by_time;
+    s_put_be64 (ttl_key + 1, expiry);
+    memcpy (ttl_key + 9, key, key_size);
+    if (lmdbdbi_put (self->ttl_dbi, txn, ttl_key, 9 + key_size, "", 0))
+        return -1;
+
+    byte when [8];
+    s_put_be64 (when, expiry);
+    ttl_key [0] = s_ttl_by_key;
+    memcpy (ttl_key + 1, key, key_size);
+    return lmdbdbi_put (self->ttl_dbi, txn, ttl_key, 1 + key_size, when, 8);
+}
+
+int
+lmdbdbi_enable_ttl (lmdbdbi_t *self, lmdbenv_t *env)
+{
+    assert (self);
+    assert (env);
+    if (!self->name || self->ttl_dbi)
+        return -1;
+
+    char *ttl_name = zsys_sprintf ("%s.ttl", self->name);
+    self->ttl_dbi = lmdbdbi_new (env, ttl_name);
+    zstr_free (&ttl_name);
+    return self->ttl_dbi ? 0 : -1;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Change log
+
+// Sequence number of the newest log entry, or 0 if there are none
+static int
+s_log_last (lmdbdbi_t *self, MDB_cursor *cur, uint64_t *seq)
+{
+    MDB_val mkey, mval;
+    int err = mdb_cursor_get (cur, &mkey, &mval, MDB_LAST);
+    if (err == MDB_NOTFOUND) {
+        *seq = 0;
+        return 0;
+    }
+    if (err || mkey.mv_size != 8)
+        return -1;
+    *seq = s_get_be64 ((const byte *) mkey.mv_data);
+    return 0;
+}
+
+static int
+s_log_append (lmdbdbi_t *self, lmdbtxn_t *txn, char op,
+              const void *key, size_t key_size,
+              const void *val, size_t val_size)
+{
+    MDB_cursor *cur;
+    if (mdb_cursor_open (lmdbtxn_handle (txn), lmdbdbi_handle (self->log_dbi), &cur))
+        return -1;
+
+    uint64_t seq;
+    int rc = s_log_last (self, cur, &seq);
+    if (rc == 0) {
+        byte seq_key [8];
+        s_put_be64 (seq_key, seq + 1);
+        MDB_val mkey = {.mv_data = seq_key, .mv_size = 8};
+        MDB_val mval = {.mv_data = NULL, .mv_size = s_log_header + key_size + val_size};
+        rc = mdb_cursor_put (cur, &mkey, &mval, MDB_APPEND | MDB_RESERVE) ? -1 : 0;
+        if (rc == 0) {
+            byte *entry = (byte *) mval.mv_data;
+            entry [0] = (byte) op;
+            entry [1] = (byte) (key_size >> 24);
+            entry [2] = (byte) (key_size >> 16);
+            entry [3] = (byte) (key_size >> 8);
+            entry [4] = (byte) key_size;
+            memcpy (entry + s_log_header, key, key_size);
+            if (val_size)
+                memcpy (entry + s_log_header + key_size, val, val_size);
+        }
+    }
+    mdb_cursor_close (cur);
+    return rc;
+}
+
+int
+lmdbdbi_enable_log (lmdbdbi_t *self, lmdbenv_t *env)
+{
+    assert (self);
+    assert (env);
+    if (!self->name || self->log_dbi)
+        return -1;
+
+    char *log_name = zsys_sprintf ("%s.log", self->name);
+    self->log_dbi = lmdbdbi_new (env, log_name);
+    zstr_free (&log_name);
+    return self->log_dbi ? 0 : -1;
+}
+
+uint64_t
+lmdbdbi_log_seq (lmdbdbi_t *self, lmdbtxn_t *txn)
+{
+    assert (self);
+    assert (txn);
+    if (!self->log_dbi)
+        return 0;
+
+    MDB_cursor *cur;
+    if (mdb_cursor_open (lmdbtxn_handle (txn), lmdbdbi_handle (self->log_dbi), &cur))
+        return 0;
+    uint64_t seq;
+    if (s_log_last (self, cur, &seq))
+        seq = 0;
+    mdb_cursor_close (cur);
+    return seq;
+}
+
+int
+lmdbdbi_trim_log (lmdbdbi_t *self, lmdbenv_t *env, uint64_t before_seq)
+{
+    assert (self);
+    assert (env);
+    assert (self->log_dbi && "enable the log before trimming it");
+
+    lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
+    if (!txn)
+        return -1;
+
+    MDB_cursor *cur = NULL;
+    if (mdb_cursor_open (lmdbtxn_handle (txn), lmdbdbi_handle (self->log_dbi), &cur))
+        goto die;
+
+    // Always keep the newest entry, so numbering carries on from it
+    uint64_t last;
+    if (s_log_last (self, cur, &last))
+        goto die;
+    if (before_seq > last)
+        before_seq = last;
+
+    // Oldest first, so whatever's left first is next. Any key that isn't
+    // a sequence number means the log dbi isn't ours, so touch nothing.
+    int count = 0;
+    MDB_val mkey, mval;
+    int err;
+    while ((err = mdb_cursor_get (cur, &mkey, &mval, MDB_FIRST)) == 0) {
+        if (mkey.mv_size != 8)
+            goto die;
+        if (s_get_be64 ((const byte *) mkey.mv_data) >= before_seq)
+            break;
+        if (mdb_cursor_del (cur, 0))
+            goto die;
+        count++;
+    }
+    if (err && err != MDB_NOTFOUND)
+        goto die;
+    mdb_cursor_close (cur);
+    cur = NULL;
+
+    if (lmdbtxn_commit (txn))
+        goto die;
+    lmdbtxn_destroy (&txn);
+    return count;
+
+ die:
+    if (cur)
+        mdb_cursor_close (cur);
+    lmdbtxn_destroy (&txn);
+    return -1;
+}
+
+lmdbdbi_t *
+lmdbdbi_log_dbi (lmdbdbi_t *self)
+{
+    assert (self);
+    return self->log_dbi;
+}
+
+int
+lmdbdbi_log_apply (lmdbdbi_t *self, lmdbtxn_t *txn, const void *entry, size_t entry_size)
+{
+    assert (self);
+    assert (txn);
+    assert (entry);
+    if (entry_size < s_log_header)
+        return -1;
+
+    const byte *bytes = (const byte *) entry;
+    size_t key_size = ((size_t) bytes [1] << 24) | ((size_t) bytes [2] << 16)
+                    | ((size_t) bytes [3] << 8) | bytes [4];
+    if (key_size > entry_size - s_log_header)
+        return -1;
+    const byte *key = bytes + s_log_header;
+
+    if (bytes [0] == s_log_put)
+        return lmdbdbi_put (self, txn, key, key_size,
+                            key + key_size, entry_size - s_log_header - key_size);
+    else
+    if (bytes [0] == s_log_del) {
+        // The key may never have reached us, e.g. if we started from a copy
+        lmdbdbi_del (self, txn, key, key_size);
+        return 0;
+    }
+    else
+        return -1;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Secondary indexes
+
+void
+lmdbdbi_attach_index (lmdbdbi_t *self, lmdbidx_t *idx)
+{
+    assert (self);
+    assert (idx);
+    lmdbidx_t **indexes = (lmdbidx_t **) lmdballoc_realloc (self->indexes,
+                            (self->index_count + 1) * sizeof (lmdbidx_t *));
+    assert (indexes);
+    self->indexes = indexes;
+    self->indexes [self->index_count++] = idx;
+}
+
+void
+lmdbdbi_detach_index (lmdbdbi_t *self, lmdbidx_t *idx)
+{
+    assert (self);
+    size_t i;
+    for (i = 0; i < self->index_count; i++)
+        if (self->indexes [i] == idx) {
+            self->indexes [i] = self->indexes [--self->index_count];
+            return;
+        }
+}
+
+static int
+s_update_indexes (lmdbdbi_t *self, lmdbtxn_t *txn, const void *key, size_t key_size,
+                  lmdbspan old_val, lmdbspan new_val)
+{
+    size_t i;
+    for (i = 0; i < self->index_count; i++)
+        lmdbidx_stage (self->indexes [i], key, key_size, old_val, new_val);
+    for (i = 0; i < self->index_count; i++)
+        if (lmdbidx_apply (self->indexes [i], txn, key, key_size))
+            return -1;
+    return 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  GET functions
+
+lmdbspan
+lmdbdbi_get_str (lmdbdbi_t *self, lmdbtxn_t *txn, const char *key)
+{
+    assert (! lmdbdbi_intkeys (self) && "get str key not valid for intkeys dbi");
+    assert (self);
+    assert (txn);
+    assert (key);
+
+    size_t key_size = strlen (key) + 1;
+    return lmdbdbi_get (self, txn, key, key_size);
+}
+
+lmdbspan
+lmdbdbi_get_strn (lmdbdbi_t *self, lmdbtxn_t *txn, const char *key, size_t len)
+{
+    assert (! lmdbdbi_intkeys (self) && "get strn key not valid for intkeys dbi");
+    assert (self);
+    assert (txn);
+    assert (key);
+    assert (key [len] == 0);
+
+    return lmdbdbi_get (self, txn, key, len + 1);
+}
+
+lmdbspan
+lmdbdbi_get_ui32 (lmdbdbi_t *self, lmdbtxn_t *txn, uint32_t key)
+{
+    assert (self);
+    assert (txn);
+
+    return lmdbdbi_get (self, txn, &key, sizeof (key));
+}
+
+lmdbspan
+lmdbdbi_get_i32 (lmdbdbi_t *self, lmdbtxn_t *txn, int32_t key)
+{
+    assert (! lmdbdbi_intkeys (self) && "get i32 key not valid for intkeys dbi");
+    assert (self);
+    assert (txn);
+
+    return lmdbdbi_get (self, txn, &key, sizeof (key));
+}
+
+lmdbspan
+lmdbdbi_get_ui64 (lmdbdbi_t *self, lmdbtxn_t *txn, uint64_t key)
+{
+    assert ((! lmdbdbi_intkeys (self) || sizeof (size_t) == sizeof (uint64_t))
+            && "get ui64 key not valid for intkeys dbi without 64 bit size_t");
+    assert (self);
+    assert (txn);
+
+    return lmdbdbi_get (self, txn, &key, sizeof (key));
+}
+
+// Fetch from whichever storage the dbi uses, ignoring any filter
+static lmdbspan
+s_get (lmdbdbi_t *self, lmdbtxn_t *txn, const void *key, size_t key_size)
+{
+    if (self->is_packed)
+        return s_packed_get (self, txn, key, key_size);
+
+    MDB_val mkey, mval;
+    // LMDB api requires us to cast away const here, but doesn't mutate
+    mkey.mv_data = (void *) key;
+    mkey.mv_size = key_size;
+
+    int err = mdb_get (lmdbtxn_handle (txn), self->handle, &mkey, &mval);
+    
+    assert (err == 0 || err == MDB_NOTFOUND);
+    if (err)
+        return lmdbspan_makenull ();
+
+    lmdbspan stored = { .data = mval.mv_data, .size = mval.mv_size };
+    if (self->is_compressed)
+        return lmdbdbi_decode (self, txn, stored);
+    return stored;
+}
+
+// Fetch through the filter, skipping expired keys
+static lmdbspan
+s_lookup (lmdbdbi_t *self, lmdbtxn_t *txn, const void *key, size_t key_size)
+{
+    if (s_filter_excludes (self, txn, key, key_size))
+        return lmdbspan_makenull ();
+
+    lmdbspan val = s_get (self, txn, key, key_size);
+    if (self->filter && ! lmdbspan_valid (val))
+        atomic_fetch_add_explicit (&self->filter_false_positives, 1, memory_order_relaxed);
+    if (self->ttl_dbi && lmdbspan_valid (val) && s_ttl_expired (self, txn, key, key_size))
+        return lmdbspan_makenull ();
+    return val;
+}
+
+// Fetch through the txn's cache, if it has one, filling it on a miss.
+// Whether a key has expired depends on the clock, so TTL dbis skip it.
+static lmdbspan
+s_lookup_cached (lmdbdbi_t *self, lmdbtxn_t *txn, const void *key, size_t key_size)
+{
+    lmdbcache_t *cache = self->ttl_dbi ? NULL : lmdbtxn_read_cache (txn);
+    if (!cache)
+        return s_lookup (self, txn, key, key_size);
+
+    lmdbspan cached = lmdbcache_get (cache, self, key, key_size);
+    if (lmdbspan_valid (cached))
+        return cached;
+    lmdbspan val = s_lookup (self, txn, key, key_size);
+    if (lmdbspan_valid (val))
+        lmdbcache_fill (cache, self, key, key_size, val.data, val.size);
+    return val;
+}
+
+// Keep the txn's cache, if it has one, in step with a write of val, or
+// with a del or failed write if val is NULL
+static void
+s_cache_written (lmdbdbi_t *self, lmdbtxn_t *txn, const void *key, size_t key_size,
+                 const void *val, size_t val_size)
+{
+    lmdbcache_t *cache = lmdbtxn_read_cache (txn);
+    if (!cache || self->ttl_dbi)
+        return;
+    if (val)
+        lmdbcache_update (cache, self, key, key_size, val, val_size);
+    else
+        lmdbcache_drop (cache, self, key, key_size);
+}
+
+lmdbspan
+lmdbdbi_get (lmdbdbi_t *self, lmdbtxn_t *txn, const void *key, size_t key_size)
+{
+    // TODO can we put a useful assert here to catch some inadvertant non-uint
+    // keys being used for intkey dbis?
+    assert (self);
+    assert (txn);
+    assert (key);
+
+    if (! lmdbtxn_staging (txn))
+        return s_lookup_cached (self, txn, key, key_size);
+
+    // A staged put is the latest value; any other key reads the same
+    // whether or not the stage is flushed, so don't flush it
+    lmdbspan staged = lmdbtxn_staged_get (txn, self, key, key_size);
+    if (lmdbspan_valid (staged))
+        return staged;
+    bool was_holding = lmdbtxn_hold (txn, true);
+    lmdbspan val = s_lookup_cached (self, txn, key, key_size);
+    lmdbtxn_hold (txn, was_holding);
+    return val;
+}
+
+lmdbspan
+lmdbdbi_get_into (lmdbdbi_t *self, lmdbtxn_t *txn,
+                  const void *key, size_t key_size,
+                  void *buf, size_t buf_size)
+{
+    assert (self);
+    assert (txn);
+    assert (key);
+    assert (buf || !buf_size);
+
+    if (!self->is_compressed
+    ||  lmdbspan_valid (lmdbtxn_staged_get (txn, self, key, key_size))) {
+        lmdbspan val = lmdbdbi_get (self, txn, key, key_size);
+        if (! lmdbspan_valid (val) || val.size > buf_size)
+            return lmdbspan_makenull ();
+        memcpy (buf, val.data, val.size);
+        return (lmdbspan) { .data = buf, .size = val.size };
+    }
+
+    // Decode straight into the caller's buffer, skipping the scratch copy
+    if (s_filter_excludes (self, txn, key, key_size))
+        return lmdbspan_makenull ();
+
+    MDB_val mkey = {.mv_data = (void *) key, .mv_size = key_size};
+    MDB_val mval;
+    bool was_holding = lmdbtxn_hold (txn, true);
+    int err = mdb_get (lmdbtxn_handle (txn), self->handle, &mkey, &mval);
+    assert (err == 0 || err == MDB_NOTFOUND);
+    bool expired = !err && self->ttl_dbi && s_ttl_expired (self, txn, key, key_size);
+    lmdbtxn_hold (txn, was_holding);
+    if (err) {
+        if (self->filter)
+            atomic_fetch_add_explicit (&self->filter_false_positives, 1,
+                                       memory_order_relaxed);
+        return lmdbspan_makenull ();
+    }
+    if (expired)
+        return lmdbspan_makenull ();
+
+    size_t size = lmdbzip_decoded_size (mval.mv_data, mval.mv_size);
+    if (size == SIZE_MAX || size > buf_size
+    ||  lmdbzip_decode (self->zip, mval.mv_data, mval.mv_size, buf, buf_size))
+        return lmdbspan_makenull ();
+    return (lmdbspan) { .data = buf, .size = size };
+}
+
+
+//  --------------------------------------------------------------------------
+//  PUT functions
+
+int
+lmdbdbi_put_str (lmdbdbi_t *self, lmdbtxn_t *txn,
+                 const char *key,
+                 const void *val, size_t val_size)
+{
+    assert (! lmdbdbi_intkeys (self) && "put str key not valid for intkeys dbi");
+    assert (self);
+    assert (txn);
+    assert (key);
+    assert (val);
+    
+    size_t key_size = strlen (key) + 1;  // include null term
+    return lmdbdbi_put (self, txn, key, key_size, val, val_size);
+}
+
+int
+lmdbdbi_put_strn (lmdbdbi_t *self, lmdbtxn_t *txn,
+                  const char *key, size_t len,
+                  const void *val, size_t val_size)
+{
+    assert (! lmdbdbi_intkeys (self) && "put strn key not valid for intkeys dbi");
+    assert (self);
+    assert (txn);
+    assert (key);
+    assert (key [len] == 0);
+    assert (val);
+    return lmdbdbi_put (self, txn, key, len + 1, val, val_size);
+}
+
+int
+lmdbdbi_put_strstr (lmdbdbi_t *self, lmdbtxn_t *txn,
+                    const char *key, const char *val)
+{
+    assert (! lmdbdbi_intkeys (self) && "put str key not valid for intkeys dbi");
+    assert (self);
+    assert (txn);
+    assert (key);
+    assert (val);
+    
+    size_t key_size = strlen (key) + 1;  // inc null term
+    size_t val_size = strlen (val) + 1;  // inc null term
+    return lmdbdbi_put (self, txn, key, key_size, val, val_size);
+}
+
+int
+lmdbdbi_put_ui32 (lmdbdbi_t *self, lmdbtxn_t *txn,
+                  uint32_t key,
+                  const void *val, size_t val_size)
+{
+    assert (self);
+    assert (txn);
+    return lmdbdbi_put (self, txn, &key, sizeof (key), val, val_size);
+}
+
+int
+lmdbdbi_put_i32 (lmdbdbi_t *self, lmdbtxn_t *txn,
+                 int32_t key,
+                 const void *val, size_t val_size)
+{
+    assert (! lmdbdbi_intkeys (self) && "put i32 key not valid for intkeys dbi");
+    assert (self);
+    assert (txn);
+    return lmdbdbi_put (self, txn, &key, sizeof (key), val, val_size);
+}
+
+int
+lmdbdbi_put_ui64 (lmdbdbi_t *self, lmdbtxn_t *txn,
+                  uint64_t key,
+                  const void *val, size_t val_size)
+{
+    assert ((! lmdbdbi_intkeys (self) || sizeof (size_t) == sizeof (uint64_t))
+            && "put ui64 key not valid for intkeys dbi without 64 bit size_t");
+    assert (self);
+    assert (txn);
+    return lmdbdbi_put (self, txn, &key, sizeof (key), val, val_size);
+}
+
+// Store in whichever storage the dbi uses, ignoring any filter
+static int
+s_put (lmdbdbi_t *self, lmdbtxn_t *txn,
+       const void *key, size_t key_size,
+       const void *val, size_t val_size)
+{
+    int rc;
+    if (self->is_packed)
+        rc = s_packed_put (self, txn, key, key_size, val, val_size);
+    else
+    if (self->is_compressed)
+        rc = s_compressed_put (self, txn, key, key_size, val, val_size);
+    else {
+        // LMDB api reqs casting away const, but doesn't mutate
+        MDB_val mkey = {.mv_data = (void *) key, .mv_size = key_size};
+        MDB_val mval = {.mv_data = (void *) val, .mv_size = val_size};
+
+        int err = mdb_put (lmdbtxn_handle (txn), self->handle,
+                           &mkey, &mval, 0);  // 0 is flags
+        rc = err ? -1 : 0;
+    }
+    s_cache_written (self, txn, key, key_size, rc ? NULL : val, val_size);
+    return rc;
+}
+
+// Store, and update indexes and filter, leaving any expiry alone
+static int
+s_put_record (lmdbdbi_t *self, lmdbtxn_t *txn,
+              const void *key, size_t key_size,
+              const void *val, size_t val_size)
+{
+    // Indexes go first, while the old value is still there to read
+    if (self->index_count) {
+        lmdbspan old_val = s_get (self, txn, key, key_size);
+        lmdbspan new_val = { .data = val, .size = val_size };
+        if (s_update_indexes (self, txn, key, key_size, old_val, new_val))
+            return -1;
+    }
+
+    int rc = s_put (self, txn, key, key_size, val, val_size);
+    if (rc == 0 && self->filter)
+        rc = s_filter_add (self, txn, key, key_size);
+    if (rc == 0 && self->log_dbi)
+        rc = s_log_append (self, txn, s_log_put, key, key_size, val, val_size);
+    return rc;
+}
+
+int
+lmdbdbi_put (lmdbdbi_t *self, lmdbtxn_t *txn,
+             const void *key, size_t key_size,
+             const void *val, size_t val_size)
+{
+    // TODO as in GET, can we have some kind of assert check to catch some non-
+    // uint key uses for intkey dbis?
+    assert (self);
+    assert (txn);
+    assert (key);
+    assert (val);
+
+    if (lmdbtxn_staging (txn))
+        return lmdbtxn_stage_put (txn, self, key, key_size, val, val_size);
+
+    int rc = s_put_record (self, txn, key, key_size, val, val_size);
+    if (rc == 0 && self->ttl_dbi)
+        rc = s_ttl_clear (self, txn, key, key_size);
+    return rc;
+}
+
+int
+lmdbdbi_put_ttl (lmdbdbi_t *self, lmdbtxn_t *txn,
+                 const void *key, size_t key_size,
+                 const void *val, size_t val_size,
+                 uint64_t ttl_msecs)
+{
+    assert (self);
+    assert (txn);
+    assert (key);
+    assert (val);
+    assert (self->ttl_dbi && "enable ttl before putting with one");
+
+    uint64_t expiry = (uint64_t) zclock_time () + ttl_msecs;
+    if (key_size > s_ttl_max_key || expiry < ttl_msecs)
+        return -1;
+
+    int rc = s_put_record (self, txn, key, key_size, val, val_size);
+    if (rc == 0)
+        rc = s_ttl_set (self, txn, key, key_size, expiry);
+    return rc;
+}
+
+
+//  --------------------------------------------------------------------------
+//  DEL functions
+
+int
+lmdbdbi_del (lmdbdbi_t *self, lmdbtxn_t *txn, const void *key, size_t key_size)
+{
+    assert (self);
+    assert (txn);
+    assert (key);
+
+    // Staged keys aren't in the filter yet
+    if (lmdbtxn_staging (txn) && lmdbtxn_flush (txn))
+        return -1;
+
+    // The filter can't forget keys; they just become false positives
+    // until it's rebuilt
+    if (s_filter_excludes (self, txn, key, key_size))
+        return -1;
+
+    if (self->index_count) {
+        lmdbspan old_val = s_get (self, txn, key, key_size);
+        if (! lmdbspan_valid (old_val))
+            return -1;
+        if (s_update_indexes (self, txn, key, key_size, old_val, lmdbspan_makenull ()))
+            return -1;
+    }
+
+    s_cache_written (self, txn, key, key_size, NULL, 0);
+    int rc;
+    if (self->is_packed)
+        rc = s_packed_del (self, txn, key, key_size);
+    else {
+        MDB_val mkey = {.mv_data = (void *) key, .mv_size = key_size};
+        rc = mdb_del (lmdbtxn_handle (txn), self->handle, &mkey, NULL) ? -1 : 0;
+    }
+    if (rc == 0 && self->ttl_dbi)
+        rc = s_ttl_clear (self, txn, key, key_size);
+    if (rc == 0 && self->log_dbi)
+        rc = s_log_append (self, txn, s_log_del, key, key_size, NULL, 0);
+    return rc;
+}
+
+int
+lmdbdbi_del_str (lmdbdbi_t *self, lmdbtxn_t *txn, const char *key)
+{
+    assert (! lmdbdbi_intkeys (self) && "del str key not valid for intkeys dbi");
+    assert (self);
+    assert (txn);
+    assert (key);
+    return lmdbdbi_del (self, txn, key, strlen (key) + 1);
+}
+
+int
+lmdbdbi_expire (lmdbdbi_t *self, lmdbenv_t *env, size_t max_keys)
+{
+    assert (self);
+    assert (env);
+    assert (self->ttl_dbi && "enable ttl before expiring keys");
+
+    lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
+    if (!txn)
+        return -1;
+
+    MDB_cursor *cur = NULL;
+    if (mdb_cursor_open (lmdbtxn_handle (txn), lmdbdbi_handle (self->ttl_dbi), &cur))
+        goto die;
+
+    uint64_t now = (uint64_t) zclock_time ();
+    int count = 0;
+    while ((size_t) count < max_keys) {
+        // We just deleted the soonest entry, so look for the new soonest
+        char by_time = s_ttl_by_time;
+        MDB_val mkey = {.mv_data = &by_time, .mv_size = 1};
+        MDB_val mval;
+        int err = mdb_cursor_get (cur, &mkey, &mval, MDB_SET_RANGE);
+        if (err == MDB_NOTFOUND)
+            break;
+        if (err)
+            goto die;
+
+        const byte *ttl_key = (const byte *) mkey.mv_data;
+        if (mkey.mv_size < 9 || ttl_key [0] != s_ttl_by_time
+        ||  s_get_be64 (ttl_key + 1) > now)
+            break;
+
+        // Copied out, as deleting may move it
+        byte key [s_ttl_max_key];
+        size_t key_size = mkey.mv_size - 9;
+        memcpy (key, ttl_key + 9, key_size);
+
+        // If the record's gone some other way, just drop its expiry
+        if (lmdbdbi_del (self, txn, key, key_size)
+        &&  s_ttl_clear (self, txn, key, key_size))
+            goto die;
+        count++;
+    }
+    mdb_cursor_close (cur);
+    cur = NULL;
+
+    if (lmdbtxn_commit (txn))
+        goto die;
+    lmdbtxn_destroy (&txn);
+    return count;
+
+ die:
+    if (cur)
+        mdb_cursor_close (cur);
+    lmdbtxn_destroy (&txn);
+    return -1;
+}
+
+
+//  --------------------------------------------------------------------------
+//  MERGE functions
+
+static lmdbmerge_t *
+s_merge_ops (lmdbdbi_t *self)
+{
+    if (!self->merge)
+        self->merge = lmdbmerge_new ();
+    return self->merge;
+}
+
+lmdbmerge_t *
+lmdbdbi_merge_ops (lmdbdbi_t *self)
+{
+    assert (self);
+    return s_merge_ops (self);
+}
+
+static byte *
+s_merge_buf (lmdbdbi_t *self, size_t size)
+{
+    if (size == 0)
+        size = 1;
+    if (size > self->merge_buf_size) {
+        byte *buf = (byte *) lmdballoc_realloc (self->merge_buf, size);
+        if (!buf)
+            return NULL;
+        self->merge_buf = buf;
+        self->merge_buf_size = size;
+    }
+    return self->merge_buf;
+}
+
+// Plain dbis: one search finds the old value, and the result is written
+// straight into space reserved for it at the cursor
+static int
+s_merge_plain (lmdbdbi_t *self, lmdbtxn_t *txn, MDB_cursor *cur,
+               const void *key, size_t key_size,
+               int op, const void *operand, size_t operand_size)
+{
+    MDB_val mkey = {.mv_data = (void *) key, .mv_size = key_size};
+    MDB_val mold = {0};
+    int err = mdb_cursor_get (cur, &mkey, &mold, MDB_SET);
+    if (err && err != MDB_NOTFOUND)
+        return -1;
+    bool exists = err == 0;
+
+    // Reserving may move or overwrite the old value, so merge from a copy
+    const byte *old = NULL;
+    if (exists) {
+        byte *copy = s_merge_buf (self, mold.mv_size);
+        if (!copy)
+            return -1;
+        memcpy (copy, mold.mv_data, mold.mv_size);
+        old = copy;
+    }
+
+    lmdbmerge_t *ops = s_merge_ops (self);
+    size_t size = lmdbmerge_apply (ops, op, old, mold.mv_size,
+                                   operand, operand_size, NULL, 0);
+    if (size == SIZE_MAX)
+        return -1;
+
+    MDB_val mnew = {.mv_data = NULL, .mv_size = size};
+    err = mdb_cursor_put (cur, &mkey, &mnew,
+                          exists ? MDB_CURRENT | MDB_RESERVE : MDB_RESERVE);
+    if (err)
+        return -1;
+    lmdbmerge_apply (ops, op, old, mold.mv_size,
+                     operand, operand_size, mnew.mv_data, size);
+    s_cache_written (self, txn, key, key_size, mnew.mv_data, size);
+
+    if (!exists && self->filter)
+        return s_filter_add (self, txn, key, key_size);
+    return 0;
+}
+
+// Everything else goes through get and put, which know how the values are
+// stored, and keep indexes, filters and the log up to date. Merges leave
+// a key's expiry as it was.
+static int
+s_merge_via_put (lmdbdbi_t *self, lmdbtxn_t *txn,
+                 const void *key, size_t key_size,
+                 int op, const void *operand, size_t operand_size)
+{
+    lmdbspan found = s_get (self, txn, key, key_size);
+
+    // Merging into an expired key starts afresh, with no expiry
+    bool expired = self->ttl_dbi && lmdbspan_valid (found)
+                && s_ttl_expired (self, txn, key, key_size);
+    if (expired && s_ttl_clear (self, txn, key, key_size))
+        return -1;
+    lmdbspan old = expired ? lmdbspan_makenull () : found;
+
+    lmdbmerge_t *ops = s_merge_ops (self);
+    size_t size = lmdbmerge_apply (ops, op, old.data, old.size,
+                                   operand, operand_size, NULL, 0);
+    if (size == SIZE_MAX)
+        return -1;
+
+    byte *merged = s_merge_buf (self, size);
+    if (!merged)
+        return -1;
+    lmdbmerge_apply (ops, op, old.data, old.size,
+                     operand, operand_size, merged, size);
+    return s_put_record (self, txn, key, key_size, merged, size);
+}
+
+int
+lmdbdbi_merge (lmdbdbi_t *self, lmdbtxn_t *txn,
+               const void *key, size_t key_size,
+               int op, const void *operand, size_t operand_size)
+{
+    return lmdbdbi_merge_batch (self, txn, op, key, key_size,
+                                operand, operand_size, 1);
+}
+
+int
+lmdbdbi_merge_batch (lmdbdbi_t *self, lmdbtxn_t *txn, int op,
+                     const void *keys, size_t key_size,
+                     const void *operands, size_t operand_size,
+                     size_t count)
+{
+    assert (self);
+    assert (txn);
+    assert (keys || !count);
+    assert (operands || !operand_size);
+
+    const byte *key = (const byte *) keys;
+    const byte *operand = (const byte *) operands;
+    size_t i;
+
+    if (self->is_packed || self->is_compressed || self->index_count
+    ||  self->ttl_dbi || self->log_dbi) {
+        for (i = 0; i < count; i++, key += key_size, operand += operand_size)
+            if (s_merge_via_put (self, txn, key, key_size, op, operand, operand_size))
+                return -1;
+        return 0;
+    }
+
+    MDB_cursor *cur = NULL;
+    if (mdb_cursor_open (lmdbtxn_handle (txn), self->handle, &cur))
+        return -1;
+    int rc = 0;
+    for (i = 0; i < count && rc == 0; i++, key += key_size, operand += operand_size)
+        rc = s_merge_plain (self, txn, cur, key, key_size, op, operand, operand_size);
+    mdb_cursor_close (cur);
+    return rc;
+}
+
+int
+lmdbdbi_add_merge_op (lmdbdbi_t *self, lmdbdbi_merge_fn fn, void *arg)
+{
+    assert (self);
+    assert (fn);
+    return lmdbmerge_add (s_merge_ops (self), fn, arg);
+}
+
+
+//  --------------------------------------------------------------------------
+//  COUNT functions
+
+// A key as a number, for placing it between two others: intkeys as they
+// are, other keys as 8 big endian bytes from offset, zero past the end
+static double
+s_key_number (lmdbdbi_t *self, const MDB_val *key, size_t offset)
+{
+    if (self->is_intkeys) {
+        if (key->mv_size == sizeof (uint32_t)) {
+            uint32_t number;
+            memcpy (&number, key->mv_data, sizeof (number));
+            return number;
+        }
+        uint64_t number;
+        memcpy (&number, key->mv_data, sizeof (number));
+        return (double) number;
+    }
+    uint64_t number = 0;
+    size_t i;
+    for (i = offset; i < offset + 8; i++)
+        number = (number << 8) | (i < key->mv_size ? ((const byte *) key->mv_data) [i] : 0);
+    return (double) number;
+}
+
+// How many leading bytes first and last share; none for intkeys
+static size_t
+s_key_prefix (lmdbdbi_t *self, const MDB_val *first, const MDB_val *last)
+{
+    size_t prefix = 0;
+    if (! self->is_intkeys) {
+        const byte *f = (const byte *) first->mv_data;
+        const byte *l = (const byte *) last->mv_data;
+        while (prefix < first->mv_size && prefix < last->mv_size
+           &&  f [prefix] == l [prefix])
+            prefix++;
+    }
+    return prefix;
+}
+
+// Where key falls between first and last, from 0 to 1. Keys between
+// them share whatever prefix they do, so only the bytes after it count.
+static double
+s_key_fraction (lmdbdbi_t *self, MDB_txn *txn, const MDB_val *key,
+                const MDB_val *first, const MDB_val *last)
+{
+    if (mdb_cmp (txn, self->handle, key, first) <= 0)
+        return 0;
+    if (mdb_cmp (txn, self->handle, key, last) >= 0)
+        return 1;
+    size_t prefix = s_key_prefix (self, first, last);
+    double lo = s_key_number (self, first, prefix);
+    double hi = s_key_number (self, last, prefix);
+    return hi > lo ? (s_key_number (self, key, prefix) - lo) / (hi - lo) : 0;
+}
+
+// Estimate the LMDB entries from key up to hi (or the end), key included,
+// given walked of them before it held count pairs. Moves the cursor.
+static uint64_t
+s_count_estimate (lmdbdbi_t *self, MDB_txn *txn, MDB_cursor *cur,
+                  const MDB_val *key, const MDB_val *hi,
+                  uint64_t count, size_t walked)
+{
+    MDB_stat stat;
+    MDB_val first, last, val;
+    if (mdb_stat (txn, self->handle, &stat)
+    ||  mdb_cursor_get (cur, &first, &val, MDB_FIRST)
+    ||  mdb_cursor_get (cur, &last, &val, MDB_LAST))
+        return 0;
+
+    double to = hi ? s_key_fraction (self, txn, hi, &first, &last) : 1;
+    double from = s_key_fraction (self, txn, key, &first, &last);
+    double entries = 1 + (to - from) * (double) (stat.ms_entries - 1);
+    if (entries < 1)
+        entries = 1;
+    if (stat.ms_entries > walked && entries > stat.ms_entries - walked)
+        entries = (double) (stat.ms_entries - walked);
+
+    // Packed entries are blocks; assume the rest hold as many pairs as
+    // those walked did
+    double per_entry = self->is_packed ? (double) count / walked : 1;
+    return (uint64_t) (entries * per_entry + 0.5);
+}
+
+uint64_t
+lmdbdbi_count (lmdbdbi_t *self, lmdbtxn_t *txn)
+{
+    assert (self);
+    assert (txn);
+    if (self->is_packed)
+        return lmdbdbi_count_range (self, txn, NULL, 0, NULL, 0, false);
+
+    MDB_stat stat;
+    if (mdb_stat (lmdbtxn_handle (txn), self->handle, &stat))
+        return 0;
+    return stat.ms_entries;
+}
+
+uint64_t
+lmdbdbi_count_range (lmdbdbi_t *self, lmdbtxn_t *txn,
+                     const void *lo, size_t lo_size,
+                     const void *hi, size_t hi_size, bool approximate)
+{
+    assert (self);
+    assert (txn);
+
+    // Taking the handle writes any staged puts, so they're counted
+    MDB_txn *handle = lmdbtxn_handle (txn);
+    MDB_cursor *cur;
+    if (mdb_cursor_open (handle, self->handle, &cur))
+        return 0;
+
+    MDB_val mhi = { .mv_size = hi_size, .mv_data = (void *) hi };
+    MDB_val key = { .mv_size = lo_size, .mv_data = (void *) lo };
+    MDB_val val;
+    int err = mdb_cursor_get (cur, &key, &val, lo ? MDB_SET_RANGE : MDB_FIRST);
+
+    // Packed blocks are keyed by their largest key, so the first block
+    // can start below lo, and the last end at or above hi
+    bool exact;
+    size_t skip = 0;
+    if (!err && lo && self->is_packed)
+        skip = lmdbpack_block_search (val.mv_data, lo, lo_size, &exact);
+
+    uint64_t count = 0;
+    size_t walked = 0;
+    while (!err) {
+        bool is_last = hi && mdb_cmp (handle, self->handle, &key, &mhi) >= 0;
+        if (is_last && !self->is_packed)
+            break;
+        if (approximate && walked == s_count_walk) {
+            count += s_count_estimate (self, handle, cur, &key, hi ? &mhi : NULL,
+                                       count, walked);
+            break;
+        }
+        size_t pairs = 1;
+        if (self->is_packed)
+            pairs = is_last ? lmdbpack_block_search (val.mv_data, hi, hi_size, &exact)
+                            : lmdbpack_block_count (val.mv_data);
+        count += pairs > skip ? pairs - skip : 0;
+        skip = 0;
+        walked++;
+        if (is_last)
+            break;
+        err = mdb_cursor_get (cur, &key, &val, MDB_NEXT);
+    }
+    mdb_cursor_close (cur);
+    return err && err != MDB_NOTFOUND ? 0 : count;
+}
+
+
+//  --------------------------------------------------------------------------
+//  SAMPLE functions
+
+// The key a fraction of the way from first to last, as s_key_number sees
+// them, written to probe, which holds LMDBPACK_MAX_KEY bytes.
+// Returns the probe's size.
+static size_t
+s_key_probe (lmdbdbi_t *self, const MDB_val *first, const MDB_val *last,
+             size_t prefix, double fraction, byte *probe)
+{
+    double lo = s_key_number (self, first, prefix);
+    double hi = s_key_number (self, last, prefix);
+    uint64_t number = (uint64_t) (lo + fraction * (hi - lo));
+    if (self->is_intkeys) {
+        if (first->mv_size == sizeof (uint32_t)) {
+            uint32_t number32 = (uint32_t) number;
+            memcpy (probe, &number32, sizeof (number32));
+        }
+        else
+            memcpy (probe, &number, sizeof (number));
+        return first->mv_size;
+    }
+    memcpy (probe, first->mv_data, prefix);
+    size_t size = prefix;
+    int shift;
+    for (shift = 56; shift >= 0 && size < LMDBPACK_MAX_KEY; shift -= 8)
+        probe [size++] = (byte) (number >> shift);
+    return size;
+}
+
+// Find the first key at or after probe, or the last key if there's none.
+// Packed keys are reassembled into scratch memory that lasts as long as
+// the txn; other keys point into the map.
+// Returns 0 on success, -1 on failure.
+static int
+s_key_near (lmdbdbi_t *self, lmdbtxn_t *txn, MDB_cursor *cur,
+            const byte *probe, size_t probe_size, lmdbspan *key_p)
+{
+    MDB_val key = { .mv_size = probe_size, .mv_data = (void *) probe };
+    MDB_val val;
+    int err = mdb_cursor_get (cur, &key, &val, MDB_SET_RANGE);
+    bool is_past_last = err == MDB_NOTFOUND;
+    if (is_past_last)
+        err = mdb_cursor_get (cur, &key, &val, MDB_LAST);
+    if (err)
+        return -1;
+    if (! self->is_packed) {
+        lmdbspan found = { .data = key.mv_data, .size = key.mv_size };
+        memcpy (key_p, &found, sizeof (found));
+        return 0;
+    }
+
+    bool exact;
+    size_t count = lmdbpack_block_count (val.mv_data);
+    size_t index = is_past_last ? count
+                 : lmdbpack_block_search (val.mv_data, probe, probe_size, &exact);
+    if (index == count)
+        index = count - 1;
+    byte keybuf [LMDBPACK_MAX_KEY];
+    size_t key_size;
+    lmdbpack_block_entry (val.mv_data, index, keybuf, &key_size);
+    byte *copy = (byte *) lmdbtxn_scratch (txn, key_size);
+    if (!copy)
+        return -1;
+    memcpy (copy, keybuf, key_size);
+    lmdbspan found = { .data = copy, .size = key_size };
+    memcpy (key_p, &found, sizeof (found));
+    return 0;
+}
+
+// Find the keys at each of count fractions of the way through the DB,
+// skipping repeats if skip_repeats. Returns how many keys were found.
+static size_t
+s_keys_at (lmdbdbi_t *self, lmdbtxn_t *txn, const double *fractions, size_t count,
+           bool skip_repeats, lmdbspan *keys)
+{
+    MDB_txn *handle = lmdbtxn_handle (txn);
+    MDB_cursor *cur;
+    if (mdb_cursor_open (handle, self->handle, &cur))
+        return 0;
+
+    size_t found = 0;
+    MDB_val first, last, val;
+    if (mdb_cursor_get (cur, &first, &val, MDB_FIRST)
+    ||  mdb_cursor_get (cur, &last, &val, MDB_LAST))
+        goto done;
+    size_t prefix = s_key_prefix (self, &first, &last);
+
+    byte probe [LMDBPACK_MAX_KEY];
+    size_t i;
+    for (i = 0; i < count; i++) {
+        size_t probe_size = s_key_probe (self, &first, &last, prefix,
+                                         fractions [i], probe);
+        lmdbspan key = lmdbspan_makenull ();
+        if (s_key_near (self, txn, cur, probe, probe_size, &key))
+            break;
+        if (skip_repeats && found
+        &&  key.size == keys [found - 1].size
+        &&  memcmp (key.data, keys [found - 1].data, key.size) == 0)
+            continue;
+        memcpy (&keys [found++], &key, sizeof (key));
+    }
+
+done:
+    mdb_cursor_close (cur);
+    return found;
+}
+
+size_t
+lmdbdbi_sample_keys (lmdbdbi_t *self, lmdbtxn_t *txn, size_t count,
+                     uint64_t seed, lmdbspan *keys)
+{
+    assert (self);
+    assert (txn);
+    assert (keys || !count);
+    if (count == 0)
+        return 0;
+    if (seed == 0)
+        seed = 88172645463325252ULL;
+
+    double *fractions = (double *) lmdballoc_malloc (count * sizeof (double));
+    assert (fractions);
+    size_t i;
+    for (i = 0; i < count; i++) {
+        // xorshift64, top 53 bits as a fraction in [0, 1)
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        fractions [i] = (double) (seed >> 11) / (double) (1ULL << 53);
+    }
+    size_t found = s_keys_at (self, txn, fractions, count, false, keys);
+    lmdballoc_free (fractions);
+    return found;
+}
+
+size_t
+lmdbdbi_split_points (lmdbdbi_t *self, lmdbtxn_t *txn, size_t parts, lmdbspan *keys)
+{
+    assert (self);
+    assert (txn);
+    assert (keys || parts < 2);
+    if (parts < 2)
+        return 0;
+
+    double *fractions = (double *) lmdballoc_malloc ((parts - 1) * sizeof (double));
+    assert (fractions);
+    size_t i;
+    for (i = 1; i < parts; i++)
+        fractions [i - 1] = (double) i / (double) parts;
+    size_t found = s_keys_at (self, txn, fractions, parts - 1, true, keys);
+    lmdballoc_free (fractions);
+    return found;
+}
+
+
+//  --------------------------------------------------------------------------
+//  FOREACH functions
+
+// Packed and compressed records need decoding, which the cursor class
+// does; values are only decoded for records the filter lets through
+static int
+s_foreach_decoded (lmdbdbi_t *self, lmdbtxn_t *txn,
+                   const void *lo, size_t lo_size, const MDB_val *hi,
+                   lmdbdbi_filter_fn filter, void *filter_arg,
+                   lmdbdbi_visit_fn visit, void *arg)
+{
+    lmdbcur_t *cur = lo ? lmdbcur_new_gekey (self, txn, lo, lo_size)
+                        : lmdbcur_new_overall (self, txn);
+    if (!cur)
+        return -1;
+    MDB_txn *handle = lmdbtxn_handle (txn);
+    int rc = 0;
+    while (true) {
+        lmdbspan key = lmdbcur_key (cur);
+        if (! lmdbspan_valid (key))
+            break;
+        MDB_val mkey = { .mv_size = key.size, .mv_data = (void *) key.data };
+        if (hi && mdb_cmp (handle, self->handle, &mkey, hi) >= 0)
+            break;
+        if (!filter || filter (key.data, key.size, filter_arg)) {
+            lmdbspan val = lmdbcur_val (cur);
+            if (! lmdbspan_valid (val)) {
+                rc = -1;
+                break;
+            }
+            rc = visit (key.data, key.size, val.data, val.size, arg);
+            if (rc)
+                break;
+        }
+        if (lmdbcur_next (cur))
+            break;
+    }
+    lmdbcur_destroy (&cur);
+    return rc;
+}
+
+int
+lmdbdbi_foreach_range_filtered (lmdbdbi_t *self, lmdbtxn_t *txn,
+                                const void *lo, size_t lo_size,
+                                const void *hi, size_t hi_size,
+                                lmdbdbi_filter_fn filter, void *filter_arg,
+                                lmdbdbi_visit_fn visit, void *arg)
+{
+    assert (self);
+    assert (txn);
+    assert (visit);
+    MDB_val mhi = { .mv_size = hi_size, .mv_data = (void *) hi };
+    if (self->is_packed || self->is_compressed)
+        return s_foreach_decoded (self, txn, lo, lo_size, hi ? &mhi : NULL,
+                                  filter, filter_arg, visit, arg);
+
+    // Taking the handle writes any staged puts, so they're visited
+    MDB_txn *handle = lmdbtxn_handle (txn);
+    MDB_cursor *cur;
+    if (mdb_cursor_open (handle, self->handle, &cur))
+        return -1;
+
+    // With a filter, move by key alone, as reading a value can mean
+    // touching its overflow pages, and only read values filter wants
+    MDB_val key = { .mv_size = lo_size, .mv_data = (void *) lo };
+    MDB_val val;
+    MDB_val *move_val = filter ? NULL : &val;
+    int err = mdb_cursor_get (cur, &key, move_val, lo ? MDB_SET_RANGE : MDB_FIRST);
+    int rc = 0;
+    while (!err) {
+        if (hi && mdb_cmp (handle, self->handle, &key, &mhi) >= 0)
+            break;
+        if (filter) {
+            if (filter (key.mv_data, key.mv_size, filter_arg)
+            &&  (err = mdb_cursor_get (cur, &key, &val, MDB_GET_CURRENT)) == 0)
+                rc = visit (key.mv_data, key.mv_size, val.mv_data, val.mv_size, arg);
+        }
+        else
+            rc = visit (key.mv_data, key.mv_size, val.mv_data, val.mv_size, arg);
+        if (rc || err)
+            break;
+        err = mdb_cursor_get (cur, &key, move_val, MDB_NEXT);
+    }
+    mdb_cursor_close (cur);
+    if (err && err != MDB_NOTFOUND)
+        return -1;
+    return rc;
+}
+
+int
+lmdbdbi_foreach_range (lmdbdbi_t *self, lmdbtxn_t *txn,
+                       const void *lo, size_t lo_size,
+                       const void *hi, size_t hi_size,
+                       lmdbdbi_visit_fn visit, void *arg)
+{
+    return lmdbdbi_foreach_range_filtered (self, txn, lo, lo_size, hi, hi_size,
+                                           NULL, NULL, visit, arg);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Accessors
+
+bool
+lmdbdbi_intkeys (lmdbdbi_t *self)
+{
+    assert (self);
+    return self->is_intkeys;
+}
+
+bool
+lmdbdbi_packed (lmdbdbi_t *self)
+{
+    assert (self);
+    return self->is_packed;
+}
+
+const char *
+lmdbdbi_name (lmdbdbi_t *self)
+{
+    assert (self);
+    return self->name;
+}
+
+bool
+lmdbdbi_compressed (lmdbdbi_t *self)
+{
+    assert (self);
+    return self->is_compressed;
+}
+
+bool
+lmdbdbi_plain (lmdbdbi_t *self)
+{
+    assert (self);
+    return !self->is_packed && !self->is_compressed && !self->filter
+        && !self->ttl_dbi && !self->log_dbi && !self->index_count;
+}
+
+bool
+lmdbdbi_filtered (lmdbdbi_t *self)
+{
+    assert (self);
+    return atomic_load (&self->filter) != NULL;
+}
+
+uint64_t
+lmdbdbi_filter_checks (lmdbdbi_t *self)
+{
+    assert (self);
+    return atomic_load_explicit (&self->filter_checks, memory_order_relaxed);
+}
+
+uint64_t
+lmdbdbi_filter_skips (lmdbdbi_t *self)
+{
+    assert (self);
+    return atomic_load_explicit (&self->filter_skips, memory_order_relaxed);
+}
+
+uint64_t
+lmdbdbi_filter_false_positives (lmdbdbi_t *self)
+{
+    assert (self);
+    return atomic_load_explicit (&self->filter_false_positives, memory_order_relaxed);
+}
+
+MDB_dbi
+lmdbdbi_handle (lmdbdbi_t *self)
+{
+    assert (self);
+    return self->handle;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+// Sum intkeys, stopping at the limit in arg if there is one
+typedef struct {
+    uint64_t sum;
+    size_t visits;
+    size_t limit;
+} s_test_visits_t;
+
+static int
+s_test_visit (const void *key, size_t key_size, const void *val, size_t val_size, void *arg)
+{
+    s_test_visits_t *visits = (s_test_visits_t *) arg;
+    uint32_t number;
+    assert (key_size == sizeof (number) && val_size == sizeof (number));
+    memcpy (&number, key, sizeof (number));
+    assert (memcmp (val, &number, sizeof (number)) == 0);
+    visits->sum += number;
+    visits->visits++;
+    return visits->limit && visits->visits == visits->limit ? 7 : 0;
+}
+
+static bool
+s_test_even (const void *key, size_t key_size, void *arg)
+{
+    uint32_t number;
+    memcpy (&number, key, sizeof (number));
+    return number % 2 == 0;
+}
+
+static int
+s_test_count (const void *key, size_t key_size, const void *val, size_t val_size, void *arg)
+{
+    (*(size_t *) arg)++;
+    return 0;
+}
+
+// Merge operator keeping the longer of the old value and the operand
+static size_t
+s_test_merge_max_len (const void *old_val, size_t old_size,
+                      const void *operand, size_t operand_size,
+                      void *out, size_t out_size, void *arg)
+{
+    if (old_val && old_size >= operand_size) {
+        operand = old_val;
+        operand_size = old_size;
+    }
+    if (out_size >= operand_size)
+        memcpy (out, operand, operand_size);
+    return operand_size;
+}
+
+void
+lmdbdbi_test (bool verbose)
+{
+    printf (" * lmdbdbi: ");
+
+    //  @selftest
+    //  Simple create/destroy test
+
+    // Note: If your selftest reads SCMed fixture data, please keep it in
+    // src/selftest-ro; if your test creates filesystem objects, please
+    // do so under src/selftest-rw. They are defined below along with a
+    // usecase for the variables (assert) to make compilers happy.
+    const char *SELFTEST_DIR_RO = "src/selftest-ro";
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+    assert (SELFTEST_DIR_RO);
+    assert (SELFTEST_DIR_RW);
+    // The following pattern is suggested for C selftest code:
+    //    char *filename = NULL;
+    //    filename = zsys_sprintf ("%s/%s", SELFTEST_DIR_RO, "mytemplate.file");
+    //    assert (filename);
+    //    ... use the filename for I/O ...
+    //    zstr_free (&filename);
+    // This way the same filename variable can be reused for many subtests.
+    //
+    // Uncomment these to use C++ strings in C++ selftest code:
+    //std::string str_SELFTEST_DIR_RO = std::string(SELFTEST_DIR_RO);
+    //std::string str_SELFTEST_DIR_RW = std::string(SELFTEST_DIR_RW);
+    //assert ( (str_SELFTEST_DIR_RO != "") );
+    //assert ( (str_SELFTEST_DIR_RW != "") );
+    // NOTE that for "char*" context you need (str_SELFTEST_DIR_RO + "/myfilename").c_str()
+
+    zsys_init ();
+    int rc = 1;
+
+    char *test_db_path = zsys_sprintf ("%s/%s", SELFTEST_DIR_RW, "LMDBDBI_TEST_DB.db");
+    if (zsys_file_exists (test_db_path))
+        zsys_file_delete (test_db_path);
 
     lmdbenv_t *env = lmdbenv_new (test_db_path);
     assert (env);
@@ -310,6 +2578,23 @@ lmdbdbi_test (bool verbose)
     assert (dbiik);
     assert (lmdbdbi_intkeys (dbiik) == true);
 
+    // Packed db
+    lmdbdbi_t *dbipk = lmdbdbi_new_packed (env, "packed_db");
+    assert (dbipk);
+    assert (lmdbdbi_packed (dbipk) == true);
+    assert (lmdbdbi_packed (dbisim) == false);
+
+    // Compressed db
+    lmdbdbi_t *dbizs = lmdbdbi_new_compressed (env, "compressed_db", 64);
+#ifdef HAVE_LIBZSTD
+    assert (dbizs);
+    assert (lmdbdbi_compressed (dbizs) == true);
+    assert (lmdbdbi_compressed (dbisim) == false);
+#else
+    assert (!dbizs);
+#endif
+    assert (! lmdbdbi_new_compressed (env, NULL, 64));
+
     lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
     assert (txn);
 
@@ -337,6 +2622,30 @@ lmdbdbi_test (bool verbose)
     lmdbspan r3 = lmdbdbi_get_i32 (dbisim, txn, -789);
     assert (lmdbspan_asdouble (r3) == dubkey);
 
+    rc = lmdbdbi_put_ui64 (dbisim, txn, (uint64_t) 1 << 40, &dubkey, sizeof (dubkey));
+    assert (!rc);
+
+    lmdbspan r3b = lmdbdbi_get_ui64 (dbisim, txn, (uint64_t) 1 << 40);
+    assert (lmdbspan_asdouble (r3b) == dubkey);
+    assert (! lmdbspan_valid (lmdbdbi_get_ui64 (dbisim, txn, 123)));
+
+    // Lengthed strings and the inline fast path agree with get_str
+    rc = lmdbdbi_put_strn (dbisim, txn, "dog", 3, "rex", 4);
+    assert (!rc);
+    assert (streq (lmdbspan_asstr (lmdbdbi_get_str (dbisim, txn, "dog")), "rex"));
+    assert (streq (lmdbspan_asstr (lmdbdbi_get_strn (dbisim, txn, "cat", 3)), "felix"));
+    assert (! lmdbspan_valid (lmdbdbi_get_strn (dbisim, txn, "cow", 3)));
+
+    assert (lmdbdbi_plain (dbisim));
+    assert (! lmdbdbi_plain (dbipk));
+    MDB_txn *mtxn = lmdbtxn_handle (txn);
+    MDB_dbi mdbi = lmdbdbi_handle (dbisim);
+    assert (streq (lmdbspan_asstr (lmdbfast_get_strn (mtxn, mdbi, "cat", 3)), "felix"));
+    assert (! lmdbspan_valid (lmdbfast_get_strn (mtxn, mdbi, "cow", 3)));
+    rc = lmdbfast_put (mtxn, mdbi, "cow", 4, "daisy", 6);
+    assert (!rc);
+    assert (streq (lmdbspan_asstr (lmdbdbi_get_str (dbisim, txn, "cow")), "daisy"));
+
     if (verbose)
         log ("Simple db tests passed");
 
@@ -353,11 +2662,621 @@ lmdbdbi_test (bool verbose)
         log ("Intkey db tests passed");
 
 
-    // -- Ends
+    // -- And the packed db
+
+    rc = lmdbdbi_put_strstr (dbipk, txn, "cat", "felix");
+    assert (!rc);
+    lmdbspan r5 = lmdbdbi_get_str (dbipk, txn, "cat");
+    assert (streq (lmdbspan_asstr (r5), "felix"));
+    rc = lmdbdbi_put_strstr (dbipk, txn, "cat", "tom");
+    assert (!rc);
+    lmdbspan r6 = lmdbdbi_get_str (dbipk, txn, "cat");
+    assert (streq (lmdbspan_asstr (r6), "tom"));
+    assert (! lmdbspan_valid (lmdbdbi_get_str (dbipk, txn, "dog")));
+
+    // Enough descending keys to force block splits away from the end
+    uint32_t pki;
+    for (pki = 2000; pki > 0; pki--) {
+        char key [32];
+        snprintf (key, sizeof (key), "k%05u", pki);
+        rc = lmdbdbi_put_ui32 (dbipk, txn, pki, key, strlen (key) + 1);
+        assert (!rc);
+    }
+    for (pki = 1; pki <= 2000; pki++) {
+        char key [32];
+        snprintf (key, sizeof (key), "k%05u", pki);
+        lmdbspan r7 = lmdbdbi_get_ui32 (dbipk, txn, pki);
+        assert (streq (lmdbspan_asstr (r7), key));
+    }
+    lmdbspan r8 = lmdbdbi_get_str (dbipk, txn, "cat");
+    assert (streq (lmdbspan_asstr (r8), "tom"));
+
+    // Packed storage uses far fewer LMDB entries than records
+    MDB_stat pkstat;
+    rc = mdb_stat (lmdbtxn_handle (txn), lmdbdbi_handle (dbipk), &pkstat);
+    assert (!rc);
+    assert (pkstat.ms_entries < 2001 / 10);
+
+    if (verbose)
+        log ("Packed db tests passed");
+
+
+    // -- Counting, exact and approximate
+
+    // Estimates assume keys are spread evenly, so lose the odd one out
+    uint32_t cnti = 88;
+    rc = lmdbdbi_del (dbiik, txn, &cnti, sizeof (cnti));
+    assert (!rc);
+    for (cnti = 1000; cnti < 11000; cnti++) {
+        rc = lmdbdbi_put_ui32 (dbiik, txn, cnti, &cnti, sizeof (cnti));
+        assert (!rc);
+    }
+    assert (lmdbdbi_count (dbiik, txn) == 10000);
+    assert (lmdbdbi_count_range (dbiik, txn, NULL, 0, NULL, 0, false) == 10000);
+    uint32_t cntlo = 2000, cnthi = 10000;
+    assert (lmdbdbi_count_range (dbiik, txn, &cntlo, 4, &cnthi, 4, false) == 8000);
+    assert (lmdbdbi_count_range (dbiik, txn, &cnthi, 4, &cntlo, 4, false) == 0);
+    uint64_t approx = lmdbdbi_count_range (dbiik, txn, &cntlo, 4, &cnthi, 4, true);
+    assert (approx > 7900 && approx < 8100);
+    approx = lmdbdbi_count_range (dbiik, txn, &cntlo, 4, NULL, 0, true);
+    assert (approx > 8900 && approx < 9100);
+
+    // Short ranges are exact either way
+    cnthi = 1100;
+    assert (lmdbdbi_count_range (dbiik, txn, NULL, 0, &cnthi, 4, true) == 100);
+
+    // Packed dbs count blocks' pairs, including where lo and hi split them;
+    // the keys compare byte by byte, so check against doing that by hand
+    assert (lmdbdbi_count (dbipk, txn) == 2001);
+    uint32_t pklo = 300, pkhi = 1700;
+    uint64_t pkexpect = 0;
+    for (pki = 1; pki <= 2000; pki++)
+        if (memcmp (&pki, &pklo, 4) >= 0 && memcmp (&pki, &pkhi, 4) < 0)
+            pkexpect++;
+    if (memcmp ("cat", &pklo, 3) > 0 && memcmp ("cat", &pkhi, 3) < 0)
+        pkexpect++;
+    assert (lmdbdbi_count_range (dbipk, txn, &pklo, 4, &pkhi, 4, false) == pkexpect);
+    approx = lmdbdbi_count_range (dbipk, txn, &pklo, 4, &pkhi, 4, true);
+    assert (approx > pkexpect / 2 && approx < pkexpect * 2);
+    assert (lmdbdbi_count_range (dbipk, txn, "cat", 3, "cat", 3, false) == 0);
+    assert (lmdbdbi_count_range (dbipk, txn, "cat", 3, "cau", 3, false) == 1);
+
+    if (verbose)
+        log ("Count tests passed");
+
+
+    // -- Sampling and splitting
+
+    lmdbspan samples [100], again [100];
+    assert (lmdbdbi_sample_keys (dbiik, txn, 100, 7, samples) == 100);
+    assert (lmdbdbi_sample_keys (dbiik, txn, 100, 7, again) == 100);
+    size_t spi;
+    for (spi = 0; spi < 100; spi++) {
+        uint32_t sample = lmdbspan_asui32 (samples [spi]);
+        assert (sample >= 1000 && sample < 11000);
+        assert (sample == lmdbspan_asui32 (again [spi]));
+    }
+
+    lmdbspan splits [9];
+    assert (lmdbdbi_split_points (dbiik, txn, 1, splits) == 0);
+    assert (lmdbdbi_split_points (dbiik, txn, 4, splits) == 3);
+    for (spi = 0; spi < 3; spi++) {
+        uint32_t split = lmdbspan_asui32 (splits [spi]);
+        uint32_t even = 1000 + (uint32_t) (9999 * (spi + 1) / 4);
+        assert (split + 2 >= even && split <= even + 2);
+    }
+
+    // Packed keys are reassembled, and are real keys
+    size_t pksplits = lmdbdbi_split_points (dbipk, txn, 10, splits);
+    assert (pksplits > 0 && pksplits <= 9);
+    for (spi = 0; spi < pksplits; spi++) {
+        assert (lmdbspan_valid (lmdbdbi_get (dbipk, txn, splits [spi].data, splits [spi].size)));
+        if (spi) {
+            lmdbspan prev = splits [spi - 1];
+            size_t common = prev.size < splits [spi].size ? prev.size : splits [spi].size;
+            int cmp = memcmp (prev.data, splits [spi].data, common);
+            assert (cmp < 0 || (cmp == 0 && prev.size < splits [spi].size));
+        }
+    }
+
+    // Both go by key values, not rank, so one key far past the rest pulls
+    // samples, splits and estimates towards it
+    uint32_t outlier = 1000000000;
+    rc = lmdbdbi_put_ui32 (dbiik, txn, outlier, &outlier, sizeof (outlier));
+    assert (!rc);
+    assert (lmdbdbi_sample_keys (dbiik, txn, 100, 7, samples) == 100);
+    size_t outlying = 0;
+    for (spi = 0; spi < 100; spi++)
+        if (lmdbspan_asui32 (samples [spi]) == outlier)
+            outlying++;
+    assert (outlying > 90);
+    assert (lmdbdbi_split_points (dbiik, txn, 4, splits) == 1);
+    assert (lmdbspan_asui32 (splits [0]) == outlier);
+    cntlo = 2000;
+    cnthi = 10000;
+    approx = lmdbdbi_count_range (dbiik, txn, &cntlo, 4, &cnthi, 4, true);
+    assert (approx < 1000);
+    rc = lmdbdbi_del (dbiik, txn, &outlier, sizeof (outlier));
+    assert (!rc);
+
+    if (verbose)
+        log ("Sampling tests passed");
+
+
+    // -- Visiting ranges
+
+    s_test_visits_t visits = { 0, 0, 0 };
+    uint32_t velo = 2000, vehi = 2100;
+    rc = lmdbdbi_foreach_range (dbiik, txn, &velo, 4, &vehi, 4, s_test_visit, &visits);
+    assert (rc == 0);
+    assert (visits.visits == 100 && visits.sum == (2000 + 2099) * 50);
+
+    // The visitor can stop early, and its return comes back
+    visits = (s_test_visits_t) { 0, 0, 10 };
+    rc = lmdbdbi_foreach_range (dbiik, txn, NULL, 0, NULL, 0, s_test_visit, &visits);
+    assert (rc == 7 && visits.visits == 10);
+
+    // Filtered records are skipped before the visitor
+    visits = (s_test_visits_t) { 0, 0, 0 };
+    rc = lmdbdbi_foreach_range_filtered (dbiik, txn, &velo, 4, &vehi, 4,
+                                         s_test_even, NULL, s_test_visit, &visits);
+    assert (rc == 0);
+    assert (visits.visits == 50 && visits.sum == (2000 + 2098) * 25);
+
+    // Packed records are visited whole, agreeing with counting them
+    size_t pkvisits = 0;
+    rc = lmdbdbi_foreach_range (dbipk, txn, &pklo, 4, &pkhi, 4, s_test_count, &pkvisits);
+    assert (rc == 0 && pkvisits == pkexpect);
+    pkvisits = 0;
+    rc = lmdbdbi_foreach_range (dbipk, txn, NULL, 0, NULL, 0, s_test_count, &pkvisits);
+    assert (rc == 0 && pkvisits == 2001);
+
+    if (verbose)
+        log ("Foreach tests passed");
+
+
+    // -- And the compressed db
+
+    char getbuf [2048];
+    lmdbspan r9 = lmdbdbi_get_into (dbisim, txn, "cat", 4, getbuf, sizeof (getbuf));
+    assert (r9.data == getbuf && streq (getbuf, "felix"));
+    assert (! lmdbspan_valid (lmdbdbi_get_into (dbisim, txn, "cat", 4, getbuf, 3)));
+
+#ifdef HAVE_LIBZSTD
+    char zval [1024];
+    for (pki = 0; pki < sizeof (zval) - 1; pki++)
+        zval [pki] = "{\"name\": \"lmdb\", \"count\": 12}" [pki % 29];
+    zval [sizeof (zval) - 1] = 0;
+
+    rc = lmdbdbi_put_strstr (dbizs, txn, "small", "tiny");
+    assert (!rc);
+    rc = lmdbdbi_put_str (dbizs, txn, "big", zval, sizeof (zval));
+    assert (!rc);
+
+    lmdbspan r10 = lmdbdbi_get_str (dbizs, txn, "small");
+    assert (streq (lmdbspan_asstr (r10), "tiny"));
+    lmdbspan r11 = lmdbdbi_get_str (dbizs, txn, "big");
+    assert (r11.size == sizeof (zval) && streq (lmdbspan_asstr (r11), zval));
+    lmdbspan r12 = lmdbdbi_get_into (dbizs, txn, "big", 4, getbuf, sizeof (getbuf));
+    assert (r12.data == getbuf && streq (getbuf, zval));
+    assert (! lmdbspan_valid (lmdbdbi_get_into (dbizs, txn, "big", 4, getbuf, 100)));
+
+    // The big value is stored in far fewer bytes than it holds
+    MDB_val zkey = {.mv_data = "big", .mv_size = 4};
+    MDB_val zstored;
+    rc = mdb_get (lmdbtxn_handle (txn), lmdbdbi_handle (dbizs), &zkey, &zstored);
+    assert (!rc && zstored.mv_size < sizeof (zval) / 4);
+
+    // Cursors decode too
+    lmdbcur_t *zcur = lmdbcur_new_overall (dbizs, txn);
+    assert (zcur);
+    assert (streq (lmdbspan_asstr (lmdbcur_val (zcur)), zval));
+    lmdbcur_next (zcur);
+    assert (streq (lmdbspan_asstr (lmdbcur_val (zcur)), "tiny"));
+    lmdbcur_destroy (&zcur);
+
+    // Scanning decodes each value into the cursor's own buffer, so the
+    // txn's scratch doesn't grow with the number of records
+    for (pki = 0; pki < 1000; pki++) {
+        char zkeybuf [16];
+        snprintf (zkeybuf, sizeof (zkeybuf), "scan%04u", pki);
+        rc = lmdbdbi_put_str (dbizs, txn, zkeybuf, zval, sizeof (zval));
+        assert (!rc);
+    }
+    size_t zscratch = lmdbarena_size (lmdbtxn_arena (txn));
+    size_t zscanned = 0;
+    zcur = lmdbcur_new_overall (dbizs, txn);
+    assert (zcur);
+    do {
+        lmdbspan zscan = lmdbcur_val (zcur);
+        assert (lmdbspan_valid (zscan));
+        zscanned += zscan.size == sizeof (zval);
+    } while (lmdbcur_next (zcur) == 0);
+    lmdbcur_destroy (&zcur);
+    assert (zscanned == 1001);
+    rc = lmdbdbi_foreach_range (dbizs, txn, "scan", 5, NULL, 0, s_test_count, &zscanned);
+    assert (!rc && zscanned == 1001 + 1000 + 1);     // And "small"
+    assert (lmdbarena_size (lmdbtxn_arena (txn)) == zscratch);
+
+    // Train a dictionary on enough similar records, then check values
+    // from before and after it read back, including after a reopen
+    for (pki = 0; pki < 500; pki++) {
+        char rec [128];
+        snprintf (rec, sizeof (rec),
+                  "{\"id\": %u, \"kind\": \"record\", \"tags\": [\"a\", \"b\"]}",
+                  pki * 7919);
+        rc = lmdbdbi_put_ui32 (dbizs, txn, pki, rec, strlen (rec) + 1);
+        assert (!rc);
+    }
+    rc = lmdbtxn_commit (txn);
+    assert (!rc);
+    lmdbtxn_destroy (&txn);
+
+    rc = lmdbdbi_train_dict (dbizs, env, 1024);
+    if (rc == 0) {
+        txn = lmdbtxn_new_rdrw (env);
+        rc = lmdbdbi_put_str (dbizs, txn, "after", zval, sizeof (zval));
+        assert (!rc);
+        rc = lmdbtxn_commit (txn);
+        assert (!rc);
+        lmdbtxn_destroy (&txn);
+
+        lmdbdbi_destroy (&dbizs);
+        dbizs = lmdbdbi_new_compressed (env, "compressed_db", 64);
+        assert (dbizs);
+    }
+    txn = lmdbtxn_new_rdonly (env);
+    assert (txn);
+    lmdbspan r13 = lmdbdbi_get_str (dbizs, txn, "big");
+    assert (streq (lmdbspan_asstr (r13), zval));
+    if (rc == 0) {
+        lmdbspan r14 = lmdbdbi_get_str (dbizs, txn, "after");
+        assert (streq (lmdbspan_asstr (r14), zval));
+    }
+    lmdbspan r15 = lmdbdbi_get_ui32 (dbizs, txn, 3);
+    assert (strstr (lmdbspan_asstr (r15), "\"id\": 23757,"));
+
+    if (verbose)
+        log ("Compressed db tests passed");
+#endif
+
+
+    // -- And a filtered db, which needs its own env as we're out of dbis
+
+    lmdbtxn_destroy (&txn);
+    test_db_path = zsys_sprintf ("%s/%s", SELFTEST_DIR_RW, "LMDBDBI_TEST_FILTER.db");
+    if (zsys_file_exists (test_db_path))
+        zsys_file_delete (test_db_path);
+    lmdbenv_t *fenv = lmdbenv_new (test_db_path);
+    assert (fenv);
+
+    lmdbdbi_t *dbifl = lmdbdbi_new (fenv, "filtered_db");
+    assert (dbifl);
+    assert (! lmdbdbi_filtered (dbifl));
+
+    // Keys put before the filter is enabled get picked up when it's built
+    txn = lmdbtxn_new_rdrw (fenv);
+    rc = lmdbdbi_put_strstr (dbifl, txn, "before", "1");
+    assert (!rc);
+    rc = lmdbtxn_commit (txn);
+    assert (!rc);
+    lmdbtxn_destroy (&txn);
+
+    rc = lmdbdbi_enable_filter (dbifl, fenv, 1000);
+    assert (!rc);
+    assert (lmdbdbi_filtered (dbifl));
+    assert (lmdbdbi_enable_filter (dbifl, fenv, 1000) == -1);
+
+    txn = lmdbtxn_new_rdrw (fenv);
+    for (pki = 0; pki < 1000; pki += 2) {
+        rc = lmdbdbi_put_ui32 (dbifl, txn, pki, &dubkey, sizeof (dubkey));
+        assert (!rc);
+    }
+    rc = lmdbtxn_commit (txn);
+    assert (!rc);
+    lmdbtxn_destroy (&txn);
+
+    // Every stored key is found, most absent ones skip the tree
+    txn = lmdbtxn_new_rdonly (fenv);
+    assert (streq (lmdbspan_asstr (lmdbdbi_get_str (dbifl, txn, "before")), "1"));
+    for (pki = 0; pki < 1000; pki++) {
+        lmdbspan r16 = lmdbdbi_get_ui32 (dbifl, txn, pki);
+        assert (lmdbspan_valid (r16) == (pki % 2 == 0));
+    }
+    assert (lmdbdbi_filter_checks (dbifl) == 1001);
+    assert (lmdbdbi_filter_skips (dbifl) + lmdbdbi_filter_false_positives (dbifl) == 500);
+    assert (lmdbdbi_filter_false_positives (dbifl) < 25);
+    lmdbtxn_destroy (&txn);
+
+    // The filter is reloaded, not rebuilt, on reopen
+    lmdbdbi_destroy (&dbifl);
+    dbifl = lmdbdbi_new (fenv, "filtered_db");
+    rc = lmdbdbi_enable_filter (dbifl, fenv, 1);
+    assert (!rc);
+    txn = lmdbtxn_new_rdonly (fenv);
+    for (pki = 0; pki < 1000; pki += 2)
+        assert (lmdbspan_valid (lmdbdbi_get_ui32 (dbifl, txn, pki)));
+    lmdbtxn_destroy (&txn);
+
+    // Rebuilding smaller still finds everything
+    rc = lmdbdbi_rebuild_filter (dbifl, fenv, 600);
+    assert (!rc);
+    rc = lmdbdbi_rebuild_filter (dbifl, fenv, 0);
+    assert (!rc);
+    txn = lmdbtxn_new_rdonly (fenv);
+    for (pki = 0; pki < 1000; pki += 2)
+        assert (lmdbspan_valid (lmdbdbi_get_ui32 (dbifl, txn, pki)));
+    lmdbtxn_destroy (&txn);
+
+    // Puts change the stored segments once, on commit, not each time
+    lmdbbloom_t *flive = atomic_load (&dbifl->filter);
+    size_t fseg, fsegs = lmdbbloom_segment_count (flive);
+    txn = lmdbtxn_new_rdrw (fenv);
+    for (pki = 1000; pki < 1200; pki++) {
+        rc = lmdbdbi_put_ui32 (dbifl, txn, pki, &dubkey, sizeof (dubkey));
+        assert (!rc);
+    }
+    size_t fstale = 0;
+    for (fseg = 0; fseg < fsegs; fseg++) {
+        lmdbspan fstored = lmdbdbi_get_ui32 (dbifl->filter_dbi, txn, (uint32_t) fseg);
+        fstale += memcmp (fstored.data, lmdbbloom_segment (flive, fseg).data, fstored.size) != 0;
+    }
+    assert (fstale > 0);
+    rc = lmdbtxn_commit (txn);
+    assert (!rc);
+    lmdbtxn_destroy (&txn);
+    txn = lmdbtxn_new_rdonly (fenv);
+    for (fseg = 0; fseg < fsegs; fseg++) {
+        lmdbspan fstored = lmdbdbi_get_ui32 (dbifl->filter_dbi, txn, (uint32_t) fseg);
+        assert (memcmp (fstored.data, lmdbbloom_segment (flive, fseg).data, fstored.size) == 0);
+    }
+    lmdbtxn_destroy (&txn);
+
+    // As if a resize's commit had failed, leaving the old size stored:
+    // the next commit stores the filter whole, so a reload finds it all
+    size_t flive_size = lmdbbloom_size (flive);
+    rc = lmdbdbi_rebuild_filter (dbifl, fenv, 5000);
+    assert (!rc);
+    assert (dbifl->retired_filter_count == 0);
+    txn = lmdbtxn_new_rdrw (fenv);
+    uint64_t fold_size = flive_size;
+    rc = lmdbdbi_put_str (dbifl->filter_dbi, txn, s_filter_size_key,
+                          &fold_size, sizeof (fold_size));
+    assert (!rc);
+    rc = lmdbdbi_put_ui32 (dbifl, txn, 5000, &dubkey, sizeof (dubkey));
+    assert (!rc);
+    rc = lmdbtxn_commit (txn);
+    assert (!rc);
+    lmdbtxn_destroy (&txn);
+    lmdbdbi_destroy (&dbifl);
+    dbifl = lmdbdbi_new (fenv, "filtered_db");
+    rc = lmdbdbi_enable_filter (dbifl, fenv, 1);
+    assert (!rc);
+    assert (lmdbbloom_size (atomic_load (&dbifl->filter)) > flive_size);
+    txn = lmdbtxn_new_rdonly (fenv);
+    for (pki = 0; pki < 1000; pki += 2)
+        assert (lmdbspan_valid (lmdbdbi_get_ui32 (dbifl, txn, pki)));
+    for (pki = 1000; pki < 1200; pki++)
+        assert (lmdbspan_valid (lmdbdbi_get_ui32 (dbifl, txn, pki)));
+    assert (lmdbspan_valid (lmdbdbi_get_ui32 (dbifl, txn, 5000)));
+    lmdbtxn_destroy (&txn);
+
+    // Keys committed through another handle on the dbi are found, and
+    // storing either handle's filter keeps the other's keys
+    lmdbdbi_t *dbifl2 = lmdbdbi_new (fenv, "filtered_db");
+    assert (dbifl2);
+    rc = lmdbdbi_enable_filter (dbifl2, fenv, 1);
+    assert (!rc);
+    txn = lmdbtxn_new_rdrw (fenv);
+    for (pki = 6000; pki < 6100; pki++) {
+        rc = lmdbdbi_put_ui32 (dbifl2, txn, pki, &dubkey, sizeof (dubkey));
+        assert (!rc);
+    }
+    rc = lmdbtxn_commit (txn);
+    assert (!rc);
+    lmdbtxn_destroy (&txn);
+    txn = lmdbtxn_new_rdrw (fenv);
+    rc = lmdbdbi_put_ui32 (dbifl, txn, 7000, &dubkey, sizeof (dubkey));
+    assert (!rc);
+    rc = lmdbtxn_commit (txn);
+    assert (!rc);
+    lmdbtxn_destroy (&txn);
+    txn = lmdbtxn_new_rdonly (fenv);
+    for (pki = 6000; pki < 6100; pki++)
+        assert (lmdbspan_valid (lmdbdbi_get_ui32 (dbifl, txn, pki)));
+    assert (lmdbspan_valid (lmdbdbi_get_ui32 (dbifl2, txn, 7000)));
+    lmdbtxn_destroy (&txn);
+    lmdbdbi_destroy (&dbifl2);
+    dbifl2 = lmdbdbi_new (fenv, "filtered_db");
+    rc = lmdbdbi_enable_filter (dbifl2, fenv, 1);
+    assert (!rc);
+    txn = lmdbtxn_new_rdonly (fenv);
+    for (pki = 6000; pki < 6100; pki++)
+        assert (lmdbspan_valid (lmdbdbi_get_ui32 (dbifl2, txn, pki)));
+    assert (lmdbspan_valid (lmdbdbi_get_ui32 (dbifl2, txn, 7000)));
+    lmdbtxn_destroy (&txn);
+    lmdbdbi_destroy (&dbifl2);
+
+    // A rebuild at the same size still swaps the filter, leaving the old
+    // one alone while a get may be probing it
+    atomic_fetch_add (&dbifl->filter_readers, 1);
+    flive = atomic_load (&dbifl->filter);
+    rc = lmdbdbi_rebuild_filter (dbifl, fenv, 0);
+    assert (!rc);
+    assert (atomic_load (&dbifl->filter) != flive);
+    assert (dbifl->retired_filter_count == 1 && dbifl->retired_filters [0] == flive);
+    atomic_fetch_sub (&dbifl->filter_readers, 1);
+    txn = lmdbtxn_new_rdonly (fenv);
+    assert (lmdbspan_valid (lmdbdbi_get_ui32 (dbifl, txn, 7000)));
+    lmdbtxn_destroy (&txn);
+
+    lmdbdbi_destroy (&dbifl);
+    lmdbenv_destroy (&fenv);
+    zstr_free (&test_db_path);
+
+    if (verbose)
+        log ("Filtered db tests passed");
+
+
+    // -- And merges, again in their own env
+
+    test_db_path = zsys_sprintf ("%s/%s", SELFTEST_DIR_RW, "LMDBDBI_TEST_MERGE.db");
+    if (zsys_file_exists (test_db_path))
+        zsys_file_delete (test_db_path);
+    lmdbenv_t *menv = lmdbenv_new (test_db_path);
+    assert (menv);
+    zstr_free (&test_db_path);
+
+    lmdbdbi_t *dbimg = lmdbdbi_new (menv, "merge_db");
+    assert (dbimg);
+    lmdbdbi_t *dbimp = lmdbdbi_new_packed (menv, "merge_packed_db");
+    assert (dbimp);
+    int mop = lmdbdbi_add_merge_op (dbimg, s_test_merge_max_len, NULL);
+    assert (mop == LMDBDBI_MERGE_USER);
+
+    txn = lmdbtxn_new_rdrw (menv);
+    int64_t mnum = 5;
+    rc = lmdbdbi_merge (dbimg, txn, "hits", 5, LMDBDBI_MERGE_ADD_I64, &mnum, 8);
+    assert (!rc);
+    mnum = -2;
+    rc = lmdbdbi_merge (dbimg, txn, "hits", 5, LMDBDBI_MERGE_ADD_I64, &mnum, 8);
+    assert (!rc);
+    lmdbspan r17 = lmdbdbi_get_str (dbimg, txn, "hits");
+    assert (r17.size == 8 && memcmp (r17.data, &(int64_t) {3}, 8) == 0);
+
+    // Operators refuse values they don't understand, changing nothing
+    rc = lmdbdbi_put_strstr (dbimg, txn, "name", "abc");
+    assert (!rc);
+    assert (lmdbdbi_merge (dbimg, txn, "name", 5, LMDBDBI_MERGE_ADD_I64, &mnum, 8) == -1);
+    assert (lmdbdbi_merge (dbimg, txn, "name", 5, 999, "x", 1) == -1);
+    rc = lmdbdbi_merge (dbimg, txn, "log", 4, LMDBDBI_MERGE_APPEND, "ab", 2);
+    assert (!rc);
+    rc = lmdbdbi_merge (dbimg, txn, "log", 4, LMDBDBI_MERGE_APPEND, "cde", 4);
+    assert (!rc);
+    assert (streq (lmdbspan_asstr (lmdbdbi_get_str (dbimg, txn, "log")), "abcde"));
+    rc = lmdbdbi_merge (dbimg, txn, "name", 5, mop, "defgh", 6);
+    assert (!rc);
+    assert (streq (lmdbspan_asstr (lmdbdbi_get_str (dbimg, txn, "name")), "defgh"));
+
+    // A batch of increments over a few keys, on plain and packed dbs
+    uint32_t mkeys [1000];
+    uint64_t mdeltas [1000];
+    for (pki = 0; pki < 1000; pki++) {
+        mkeys [pki] = pki % 10;
+        mdeltas [pki] = pki;
+    }
+    rc = lmdbdbi_merge_batch (dbimg, txn, LMDBDBI_MERGE_ADD_U64,
+                              mkeys, sizeof (uint32_t), mdeltas, 8, 1000);
+    assert (!rc);
+    rc = lmdbdbi_merge_batch (dbimp, txn, LMDBDBI_MERGE_ADD_U64,
+                              mkeys, sizeof (uint32_t), mdeltas, 8, 1000);
+    assert (!rc);
+    for (pki = 0; pki < 10; pki++) {
+        // Key k gets k + (k + 10) + ... + (k + 990)
+        uint64_t expect = 100 * pki + 10 * 99 * 100 / 2;
+        lmdbspan r18 = lmdbdbi_get (dbimg, txn, &pki, sizeof (pki));
+        assert (r18.size == 8 && memcmp (r18.data, &expect, 8) == 0);
+        lmdbspan r19 = lmdbdbi_get (dbimp, txn, &pki, sizeof (pki));
+        assert (r19.size == 8 && memcmp (r19.data, &expect, 8) == 0);
+    }
+    rc = lmdbtxn_commit (txn);
+    assert (!rc);
+    lmdbtxn_destroy (&txn);
 
+    lmdbdbi_destroy (&dbimp);
+    lmdbdbi_destroy (&dbimg);
+    lmdbenv_destroy (&menv);
+
+    if (verbose)
+        log ("Merge tests passed");
+
+
+    // -- And expiring keys, in their own env too
+
+    test_db_path = zsys_sprintf ("%s/%s", SELFTEST_DIR_RW, "LMDBDBI_TEST_TTL.db");
+    if (zsys_file_exists (test_db_path))
+        zsys_file_delete (test_db_path);
+    lmdbenv_t *tenv = lmdbenv_new (test_db_path);
+    assert (tenv);
+    zstr_free (&test_db_path);
+
+    lmdbdbi_t *dbit = lmdbdbi_new (tenv, "ttl_db");
+    assert (dbit);
+    rc = lmdbdbi_enable_ttl (dbit, tenv);
+    assert (!rc);
+    assert (lmdbdbi_enable_ttl (dbit, tenv) == -1);
+
+    // Keys k0..k9 expire at once, l0..l9 in an hour, and "perm" never
+    txn = lmdbtxn_new_rdrw (tenv);
+    for (pki = 0; pki < 10; pki++) {
+        char tkey [4];
+        snprintf (tkey, sizeof (tkey), "k%u", pki);
+        rc = lmdbdbi_put_ttl (dbit, txn, tkey, 3, "gone", 5, 0);
+        assert (!rc);
+        tkey [0] = 'l';
+        rc = lmdbdbi_put_ttl (dbit, txn, tkey, 3, "here", 5, 3600 * 1000);
+        assert (!rc);
+    }
+    rc = lmdbdbi_put_ttl (dbit, txn, "perm", 5, "old", 4, 0);
+    assert (!rc);
+    rc = lmdbdbi_put_str (dbit, txn, "perm", "new", 4);
+    assert (!rc);
+    rc = lmdbtxn_commit (txn);
+    assert (!rc);
+    lmdbtxn_destroy (&txn);
+
+    // Expired keys read as missing before they're swept
+    txn = lmdbtxn_new_rdonly (tenv);
+    assert (! lmdbspan_valid (lmdbdbi_get_str (dbit, txn, "k3")));
+    assert (streq (lmdbspan_asstr (lmdbdbi_get_str (dbit, txn, "l3")), "here"));
+    assert (streq (lmdbspan_asstr (lmdbdbi_get_str (dbit, txn, "perm")), "new"));
+    lmdbtxn_destroy (&txn);
+
+    // Sweeping is bounded, and leaves unexpired keys alone
+    rc = lmdbdbi_expire (dbit, tenv, 4);
+    assert (rc == 4);
+    rc = lmdbdbi_expire (dbit, tenv, 100);
+    assert (rc == 6);
+    rc = lmdbdbi_expire (dbit, tenv, 100);
+    assert (rc == 0);
+
+    txn = lmdbtxn_new_rdonly (tenv);
+    lmdbcur_t *tcur = lmdbcur_new_overall (dbit, txn);
+    assert (tcur);
+    size_t tcount = 0;
+    do {
+        assert (((const char *) lmdbcur_key (tcur).data) [0] != 'k');
+        tcount++;
+    } while (lmdbcur_next (tcur) == 0);
+    assert (tcount == 11);
+    lmdbcur_destroy (&tcur);
+    lmdbtxn_destroy (&txn);
+
+    // Deleting a key drops its expiry with it
+    txn = lmdbtxn_new_rdrw (tenv);
+    rc = lmdbdbi_del_str (dbit, txn, "l0");
+    assert (!rc);
+    rc = lmdbdbi_put_ttl (dbit, txn, "l1", 3, "soon", 5, 0);
+    assert (!rc);
+    rc = lmdbtxn_commit (txn);
+    assert (!rc);
     lmdbtxn_destroy (&txn);
+    rc = lmdbdbi_expire (dbit, tenv, 100);
+    assert (rc == 1);
+
+    lmdbdbi_destroy (&dbit);
+    lmdbenv_destroy (&tenv);
+
+    if (verbose)
+        log ("TTL tests passed");
+
+
+    // -- Ends
+
     lmdbdbi_destroy (&dbisim);
     lmdbdbi_destroy (&dbiik);
+    lmdbdbi_destroy (&dbipk);
+    lmdbdbi_destroy (&dbizs);
     lmdbenv_destroy (&env);
 
     
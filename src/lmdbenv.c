@@ -13,6 +13,11 @@
 @header
     lmdbenv - Manager for an LMDB Environment, the in-memory interface to an LMDB file on disk
 @discuss
+    By default LMDB keeps each thread's read txn in thread local storage, so
+    a thread can have only one, and must end it itself. Envs opened with
+    lmdbenv_new_threaded use MDB_NOTLS instead, tying the reader slot to
+    the txn, so read txns can be handed between threads, e.g. by a pool of
+    workers reusing reset txns.
 @end
 */
 
@@ -20,10 +25,20 @@
 
 #include "logging.h"
 
+#include <stdatomic.h>
+
 //  Structure of our class
 
 struct _lmdbenv_t {
     MDB_env *handle;
+    bool is_threaded;
+
+    // Snapshots opened on us, most recent first, and the next one's id,
+    // both guarded by the lock, as threaded envs take snapshot calls from
+    // any thread
+    lmdbsnapshot_t *snapshots;
+    uint64_t snapshot_seq;
+    atomic_flag snapshot_lock;
 };
 
 
@@ -46,18 +61,14 @@ s_default_max_dbs = 10;
 //  --------------------------------------------------------------------------
 //  Create a new lmdbenv
 
-lmdbenv_t *
-lmdbenv_new (const char *path)
-{
-    assert (path);
-    return lmdbenv_new_withlimits (path, s_default_mapsize, s_default_max_dbs);
-}
-
-lmdbenv_t *
-lmdbenv_new_withlimits (const char *path, size_t max_size, size_t max_dbs)
+// max_readers of 0 leaves LMDB's default
+static lmdbenv_t *
+s_new (const char *path, size_t max_size, size_t max_dbs,
+       unsigned int max_readers, bool threaded)
 {
-    lmdbenv_t *self = (lmdbenv_t *) zmalloc (sizeof (lmdbenv_t));
+    lmdbenv_t *self = (lmdbenv_t *) lmdballoc_zmalloc (sizeof (lmdbenv_t));
     assert (self);
+    atomic_flag_clear (&self->snapshot_lock);
     int err = 0;
 
     err = mdb_env_create (&self->handle);
@@ -73,8 +84,15 @@ lmdbenv_new_withlimits (const char *path, size_t max_size, size_t max_dbs)
     if (err)
         goto die;
 
-    err = mdb_env_open (self->handle, path,
-                        s_default_open_flags, s_default_open_mode);
+    if (max_readers) {
+        err = mdb_env_set_maxreaders (self->handle, max_readers);
+        if (err)
+            goto die;
+    }
+
+    self->is_threaded = threaded;
+    unsigned int flags = s_default_open_flags | (threaded ? MDB_NOTLS : 0);
+    err = mdb_env_open (self->handle, path, flags, s_default_open_mode);
     if (err)
         goto die;
 
@@ -87,6 +105,28 @@ lmdbenv_new_withlimits (const char *path, size_t max_size, size_t max_dbs)
     return self;
 }
 
+lmdbenv_t *
+lmdbenv_new (const char *path)
+{
+    assert (path);
+    return lmdbenv_new_withlimits (path, s_default_mapsize, s_default_max_dbs);
+}
+
+lmdbenv_t *
+lmdbenv_new_withlimits (const char *path, size_t max_size, size_t max_dbs)
+{
+    assert (path);
+    return s_new (path, max_size, max_dbs, 0, false);
+}
+
+lmdbenv_t *
+lmdbenv_new_threaded (const char *path, size_t max_size, size_t max_dbs,
+                      unsigned int max_readers)
+{
+    assert (path);
+    return s_new (path, max_size, max_dbs, max_readers, true);
+}
+
 
 //  --------------------------------------------------------------------------
 //  Destroy the lmdbenv
@@ -98,9 +138,13 @@ lmdbenv_destroy (lmdbenv_t **self_p)
     if (*self_p) {
         lmdbenv_t *self = *self_p;
 
+        while (self->snapshots) {
+            lmdbsnapshot_t *snapshot = self->snapshots;
+            lmdbsnapshot_destroy (&snapshot);
+        }
         mdb_env_close (self->handle);
 
-        free (self);
+        lmdballoc_free (self);
         *self_p = NULL;
     }
 }
@@ -116,6 +160,66 @@ lmdbenv_handle (lmdbenv_t *self)
     return self->handle;
 }
 
+bool
+lmdbenv_threaded (lmdbenv_t *self)
+{
+    assert (self);
+    return self->is_threaded;
+}
+
+unsigned int
+lmdbenv_max_readers (lmdbenv_t *self)
+{
+    assert (self);
+    unsigned int readers = 0;
+    mdb_env_get_maxreaders (self->handle, &readers);
+    return readers;
+}
+
+
+void
+lmdbenv_lock_snapshots (lmdbenv_t *self)
+{
+    assert (self);
+    while (atomic_flag_test_and_set_explicit (&self->snapshot_lock, memory_order_acquire))
+        ;
+}
+
+void
+lmdbenv_unlock_snapshots (lmdbenv_t *self)
+{
+    assert (self);
+    atomic_flag_clear_explicit (&self->snapshot_lock, memory_order_release);
+}
+
+lmdbsnapshot_t **
+lmdbenv_snapshots (lmdbenv_t *self)
+{
+    assert (self);
+    return &self->snapshots;
+}
+
+uint64_t
+lmdbenv_next_snapshot_id (lmdbenv_t *self)
+{
+    assert (self);
+    return ++self->snapshot_seq;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Reader slots
+
+int
+lmdbenv_reader_check (lmdbenv_t *self)
+{
+    assert (self);
+    int dead = 0;
+    if (mdb_reader_check (self->handle, &dead))
+        return -1;
+    return dead;
+}
+
 
 //  --------------------------------------------------------------------------
 //  Self test of this class
@@ -158,6 +262,39 @@ lmdbenv_test (bool verbose)
     lmdbenv_t *env = lmdbenv_new (test_db_path);
     assert (env);
 
+    lmdbenv_destroy (&env);
+
+    //  Threaded envs let one thread hold several read txns, up to the
+    //  reader slot limit; reset txns keep their slots
+    zsys_file_delete (test_db_path);
+    env = lmdbenv_new_threaded (test_db_path, 1 << 20, 10, 4);
+    assert (env);
+    assert (lmdbenv_threaded (env));
+    assert (lmdbenv_max_readers (env) == 4);
+    assert (lmdbenv_reader_check (env) == 0);
+
+    lmdbtxn_t *readers [4];
+    int i;
+    for (i = 0; i < 4; i++) {
+        readers [i] = lmdbtxn_new_rdonly (env);
+        assert (readers [i]);
+    }
+    int rc = lmdbtxn_reset (readers [0]);
+    assert (rc == 0);
+    lmdbtxn_t *txn = lmdbtxn_new_rdonly (env);
+    assert (txn == NULL);
+    lmdbtxn_destroy (&readers [0]);
+    txn = lmdbtxn_new_rdonly (env);
+    assert (txn);
+    lmdbtxn_destroy (&txn);
+    for (i = 1; i < 4; i++)
+        lmdbtxn_destroy (&readers [i]);
+    lmdbenv_destroy (&env);
+
+    zsys_file_delete (test_db_path);
+    env = lmdbenv_new (test_db_path);
+    assert (env);
+    assert (!lmdbenv_threaded (env));
     lmdbenv_destroy (&env);
     zstr_free (&test_db_path);
 
@@ -0,0 +1,536 @@
+/*  =========================================================================
+    lmdbidx - Secondary index over an lmdbdbi, kept up to date by its puts and dels
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+/*
+@header
+    lmdbidx - Secondary index over an lmdbdbi, kept up to date by its puts and dels
+@discuss
+    The index is a DUPSORT database of (index key, primary key) pairs. On
+    every put or del the primary hands us the record's old and new values;
+    we run the extractor over both and only touch the pairs that differ,
+    so rewriting a record without changing its index keys costs two
+    extractor calls and no index writes.
+
+    As the index is written in the same txn as the primary, the two can
+    never disagree once committed.
+@end
+*/
+
+#include "classlmdb_classes.h"
+
+#include "logging.h"
+
+// LMDB's limit on DUPSORT values, which is what primary keys are here
+#define s_max_pkey 511
+
+//  Index keys emitted for one record, stored end to end
+
+typedef struct {
+    byte *data;
+    size_t size;
+    size_t alloc;
+    size_t *ends;       // ends [i] is where key i stops in data
+    size_t count;
+    size_t max_count;
+} s_keyset_t;
+
+//  Structure of our class
+
+struct _lmdbidx_t {
+    MDB_dbi handle;
+    lmdbdbi_t *primary;
+    lmdbidx_extract_fn *extract;
+    void *arg;
+
+    // Reused for every update. Only write txns touch them, and LMDB only
+    // allows one of those at a time.
+    s_keyset_t old_keys;
+    s_keyset_t new_keys;
+    s_keyset_t *emitting;   // Where emit() goes; NULL outside an extractor
+};
+
+
+//  --------------------------------------------------------------------------
+//  Keysets
+
+static void
+s_keyset_add (s_keyset_t *self, const void *key, size_t key_size)
+{
+    if (self->size + key_size > self->alloc) {
+        size_t alloc = self->alloc ? self->alloc * 2 : 256;
+        while (alloc < self->size + key_size)
+            alloc *= 2;
+        self->data = (byte *) lmdballoc_realloc (self->data, alloc);
+        assert (self->data);
+        self->alloc = alloc;
+    }
+    if (self->count == self->max_count) {
+        self->max_count = self->max_count ? self->max_count * 2 : 8;
+        self->ends = (size_t *) lmdballoc_realloc (self->ends, self->max_count * sizeof (size_t));
+        assert (self->ends);
+    }
+    memcpy (self->data + self->size, key, key_size);
+    self->size += key_size;
+    self->ends [self->count++] = self->size;
+}
+
+static MDB_val
+s_keyset_key (s_keyset_t *self, size_t index)
+{
+    size_t start = index ? self->ends [index - 1] : 0;
+    return (MDB_val) { .mv_data = self->data + start,
+                       .mv_size = self->ends [index] - start };
+}
+
+static bool
+s_keyset_has (s_keyset_t *self, MDB_val key)
+{
+    size_t i;
+    for (i = 0; i < self->count; i++) {
+        MDB_val other = s_keyset_key (self, i);
+        if (other.mv_size == key.mv_size
+        &&  memcmp (other.mv_data, key.mv_data, key.mv_size) == 0)
+            return true;
+    }
+    return false;
+}
+
+static void
+s_keyset_free (s_keyset_t *self)
+{
+    lmdballoc_free (self->data);
+    lmdballoc_free (self->ends);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Create a new lmdbidx
+
+lmdbidx_t *
+lmdbidx_new (lmdbenv_t *env, lmdbdbi_t *primary, const char *name,
+             lmdbidx_extract_fn extract, void *arg)
+{
+    assert (env);
+    assert (primary);
+    assert (extract);
+    if (!name)
+        return NULL;
+
+    lmdbidx_t *self = (lmdbidx_t *) lmdballoc_zmalloc (sizeof (lmdbidx_t));
+    assert (self);
+    self->extract = extract;
+    self->arg = arg;
+
+    // We need a txn to create the db, but can close it after
+    lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
+    if (!txn)
+        goto die;
+
+    int rc = mdb_dbi_open (lmdbtxn_handle (txn), name,
+                           MDB_CREATE | MDB_DUPSORT, &self->handle);
+    if (rc)
+        goto die;
+
+    rc = lmdbtxn_commit (txn);
+    if (rc)
+        goto die;
+
+    self->primary = primary;
+    lmdbdbi_attach_index (primary, self);
+    goto cleanup_ret;
+
+ die:
+    lmdbidx_destroy (&self);
+
+ cleanup_ret:
+    lmdbtxn_destroy (&txn);
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the lmdbidx
+
+void
+lmdbidx_destroy (lmdbidx_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        lmdbidx_t *self = *self_p;
+        if (self->primary)
+            lmdbdbi_detach_index (self->primary, self);
+        s_keyset_free (&self->old_keys);
+        s_keyset_free (&self->new_keys);
+        lmdballoc_free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Extraction
+
+void
+lmdbidx_emit (lmdbidx_t *self, const void *ikey, size_t ikey_size)
+{
+    assert (self);
+    assert (ikey);
+    assert (self->emitting && "only call emit from an extractor");
+    s_keyset_add (self->emitting, ikey, ikey_size);
+}
+
+void
+lmdbidx_emit_str (lmdbidx_t *self, const char *ikey)
+{
+    assert (ikey);
+    lmdbidx_emit (self, ikey, strlen (ikey) + 1);
+}
+
+static void
+s_extract (lmdbidx_t *self, s_keyset_t *keys,
+           const void *key, size_t key_size, lmdbspan val)
+{
+    keys->size = 0;
+    keys->count = 0;
+    if (!lmdbspan_valid (val))
+        return;
+    self->emitting = keys;
+    self->extract (self, key, key_size, val.data, val.size, self->arg);
+    self->emitting = NULL;
+}
+
+void
+lmdbidx_stage (lmdbidx_t *self, const void *key, size_t key_size,
+               lmdbspan old_val, lmdbspan new_val)
+{
+    assert (self);
+    s_extract (self, &self->old_keys, key, key_size, old_val);
+    s_extract (self, &self->new_keys, key, key_size, new_val);
+}
+
+int
+lmdbidx_apply (lmdbidx_t *self, lmdbtxn_t *txn, const void *key, size_t key_size)
+{
+    assert (self);
+    assert (txn);
+    if (key_size > s_max_pkey)
+        return -1;
+
+    MDB_txn *mtxn = lmdbtxn_handle (txn);
+    MDB_val mpkey = {.mv_data = (void *) key, .mv_size = key_size};
+    size_t i;
+    for (i = 0; i < self->old_keys.count; i++) {
+        MDB_val mikey = s_keyset_key (&self->old_keys, i);
+        if (s_keyset_has (&self->new_keys, mikey))
+            continue;
+        int err = mdb_del (mtxn, self->handle, &mikey, &mpkey);
+        if (err && err != MDB_NOTFOUND)
+            return -1;
+    }
+    for (i = 0; i < self->new_keys.count; i++) {
+        MDB_val mikey = s_keyset_key (&self->new_keys, i);
+        if (s_keyset_has (&self->old_keys, mikey))
+            continue;
+        int err = mdb_put (mtxn, self->handle, &mikey, &mpkey, MDB_NODUPDATA);
+        if (err && err != MDB_KEYEXIST)
+            return -1;
+    }
+    return 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Lookups
+
+lmdbspan
+lmdbidx_get (lmdbidx_t *self, lmdbtxn_t *txn, const void *ikey, size_t ikey_size)
+{
+    assert (self);
+    assert (txn);
+    assert (ikey);
+
+    // On a DUPSORT db this finds the first primary key
+    MDB_val mikey = {.mv_data = (void *) ikey, .mv_size = ikey_size};
+    MDB_val mpkey;
+    int err = mdb_get (lmdbtxn_handle (txn), self->handle, &mikey, &mpkey);
+    if (err)
+        return lmdbspan_makenull ();
+    return lmdbdbi_get (self->primary, txn, mpkey.mv_data, mpkey.mv_size);
+}
+
+size_t
+lmdbidx_count (lmdbidx_t *self, lmdbtxn_t *txn, const void *ikey, size_t ikey_size)
+{
+    assert (self);
+    assert (txn);
+    assert (ikey);
+
+    MDB_cursor *cur = NULL;
+    if (mdb_cursor_open (lmdbtxn_handle (txn), self->handle, &cur))
+        return 0;
+
+    MDB_val mikey = {.mv_data = (void *) ikey, .mv_size = ikey_size};
+    MDB_val mpkey;
+    size_t count = 0;
+    if (mdb_cursor_get (cur, &mikey, &mpkey, MDB_SET) == 0
+    &&  mdb_cursor_count (cur, &count))
+        count = 0;
+    mdb_cursor_close (cur);
+    return count;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Rebuilding
+
+int
+lmdbidx_rebuild (lmdbidx_t *self, lmdbenv_t *env)
+{
+    assert (self);
+    assert (env);
+
+    lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
+    if (!txn)
+        return -1;
+
+    lmdbcur_t *cur = NULL;
+    if (mdb_drop (lmdbtxn_handle (txn), self->handle, 0))
+        goto die;
+
+    cur = lmdbcur_new_overall (self->primary, txn);
+    if (!cur)
+        goto die;
+    do {
+        lmdbspan key = lmdbcur_key (cur);
+        if (!lmdbspan_valid (key))
+            break;
+        lmdbidx_stage (self, key.data, key.size,
+                       lmdbspan_makenull (), lmdbcur_val (cur));
+        if (lmdbidx_apply (self, txn, key.data, key.size))
+            goto die;
+    } while (lmdbcur_next (cur) == 0);
+    lmdbcur_destroy (&cur);
+
+    if (lmdbtxn_commit (txn))
+        goto die;
+    lmdbtxn_destroy (&txn);
+    return 0;
+
+ die:
+    lmdbcur_destroy (&cur);
+    lmdbtxn_destroy (&txn);
+    return -1;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Accessors
+
+lmdbdbi_t *
+lmdbidx_primary (lmdbidx_t *self)
+{
+    assert (self);
+    return self->primary;
+}
+
+MDB_dbi
+lmdbidx_handle (lmdbidx_t *self)
+{
+    assert (self);
+    return self->handle;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+// Test records are "name|city|tag,tag,..." strings; index them by city
+static void
+s_test_by_city (lmdbidx_t *idx, const void *key, size_t key_size,
+                const void *val, size_t val_size, void *arg)
+{
+    const char *rec = (const char *) val;
+    const char *city = memchr (rec, '|', val_size);
+    if (!city)
+        return;
+    city++;
+    const char *end = memchr (city, '|', val_size - (city - rec));
+    if (end && end > city)
+        lmdbidx_emit (idx, city, end - city);
+}
+
+// ... and by each of their tags
+static void
+s_test_by_tag (lmdbidx_t *idx, const void *key, size_t key_size,
+               const void *val, size_t val_size, void *arg)
+{
+    int *calls = (int *) arg;
+    (*calls)++;
+    const char *rec = (const char *) val;
+    const char *end = rec + val_size - 1;   // The terminating NULL
+    const char *tags = end;
+    while (tags > rec && *tags != '|')
+        tags--;
+    if (*tags != '|')
+        return;
+    while (++tags < end) {
+        const char *comma = memchr (tags, ',', end - tags);
+        const char *tag_end = comma ? comma : end;
+        if (tag_end > tags)
+            lmdbidx_emit (idx, tags, tag_end - tags);
+        tags = tag_end;
+    }
+}
+
+void
+lmdbidx_test (bool verbose)
+{
+    printf (" * lmdbidx: ");
+
+    //  @selftest
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+    assert (SELFTEST_DIR_RW);
+
+    char *test_db_path = zsys_sprintf ("%s/%s", SELFTEST_DIR_RW, "LMDBIDX_TEST.db");
+    if (zsys_file_exists (test_db_path))
+        zsys_file_delete (test_db_path);
+    lmdbenv_t *env = lmdbenv_new (test_db_path);
+    assert (env);
+    zstr_free (&test_db_path);
+
+    lmdbdbi_t *people = lmdbdbi_new (env, "people");
+    assert (people);
+
+    // Records put before the index exists need a rebuild
+    lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
+    assert (txn);
+    int rc = lmdbdbi_put_strstr (people, txn, "ann", "Ann|Leeds|admin,dev");
+    assert (rc == 0);
+    rc = lmdbtxn_commit (txn);
+    assert (rc == 0);
+    lmdbtxn_destroy (&txn);
+
+    lmdbidx_t *by_city = lmdbidx_new (env, people, "people.city", s_test_by_city, NULL);
+    assert (by_city);
+    assert (lmdbidx_primary (by_city) == people);
+    int tag_calls = 0;
+    lmdbidx_t *by_tag = lmdbidx_new (env, people, "people.tag", s_test_by_tag, &tag_calls);
+    assert (by_tag);
+    assert (! lmdbidx_new (env, people, NULL, s_test_by_city, NULL));
+
+    txn = lmdbtxn_new_rdonly (env);
+    assert (lmdbidx_count (by_city, txn, "Leeds", 5) == 0);
+    lmdbtxn_destroy (&txn);
+
+    rc = lmdbidx_rebuild (by_city, env);
+    assert (rc == 0);
+    rc = lmdbidx_rebuild (by_tag, env);
+    assert (rc == 0);
+
+    // Puts and dels keep the indexes current
+    txn = lmdbtxn_new_rdrw (env);
+    assert (txn);
+    rc = lmdbdbi_put_strstr (people, txn, "bob", "Bob|York|dev");
+    assert (rc == 0);
+    rc = lmdbdbi_put_strstr (people, txn, "cat", "Cat|Leeds|ops,dev");
+    assert (rc == 0);
+    rc = lmdbdbi_put_strstr (people, txn, "dan", "Dan||");
+    assert (rc == 0);
+
+    assert (lmdbidx_count (by_city, txn, "Leeds", 5) == 2);
+    assert (lmdbidx_count (by_city, txn, "York", 4) == 1);
+    assert (lmdbidx_count (by_tag, txn, "dev", 3) == 3);
+    assert (lmdbidx_count (by_tag, txn, "nope", 4) == 0);
+    lmdbspan val = lmdbidx_get (by_city, txn, "York", 4);
+    assert (lmdbspan_valid (val));
+    assert (streq (lmdbspan_asstr (val), "Bob|York|dev"));
+    assert (! lmdbspan_valid (lmdbidx_get (by_city, txn, "Hull", 4)));
+
+    // Bob moves; his tag is unchanged, so only the city index is written
+    rc = lmdbdbi_put_strstr (people, txn, "bob", "Bob|Leeds|dev,ops");
+    assert (rc == 0);
+    assert (lmdbidx_count (by_city, txn, "York", 4) == 0);
+    assert (lmdbidx_count (by_city, txn, "Leeds", 5) == 3);
+    assert (lmdbidx_count (by_tag, txn, "dev", 3) == 3);
+    assert (lmdbidx_count (by_tag, txn, "ops", 3) == 2);
+
+    // Deleting drops all the record's entries
+    rc = lmdbdbi_del_str (people, txn, "cat");
+    assert (rc == 0);
+    assert (lmdbdbi_del_str (people, txn, "cat") == -1);
+    assert (lmdbidx_count (by_city, txn, "Leeds", 5) == 2);
+    assert (lmdbidx_count (by_tag, txn, "ops", 3) == 1);
+    assert (tag_calls > 0);
+
+    rc = lmdbtxn_commit (txn);
+    assert (rc == 0);
+    lmdbtxn_destroy (&txn);
+
+    // An aborted txn leaves the indexes as they were
+    txn = lmdbtxn_new_rdrw (env);
+    rc = lmdbdbi_put_strstr (people, txn, "eve", "Eve|Hull|dev");
+    assert (rc == 0);
+    lmdbtxn_destroy (&txn);
+    txn = lmdbtxn_new_rdonly (env);
+    assert (lmdbidx_count (by_city, txn, "Hull", 4) == 0);
+    assert (lmdbidx_count (by_tag, txn, "dev", 3) == 2);
+    lmdbtxn_destroy (&txn);
+
+    // Rebuilding gives the same answers
+    rc = lmdbidx_rebuild (by_tag, env);
+    assert (rc == 0);
+    txn = lmdbtxn_new_rdonly (env);
+    assert (lmdbidx_count (by_tag, txn, "dev", 3) == 2);
+    assert (lmdbidx_count (by_tag, txn, "admin", 5) == 1);
+    lmdbtxn_destroy (&txn);
+
+    // Once destroyed, an index is no longer maintained
+    lmdbidx_destroy (&by_tag);
+    txn = lmdbtxn_new_rdrw (env);
+    rc = lmdbdbi_put_strstr (people, txn, "fay", "Fay|Leeds|dev");
+    assert (rc == 0);
+    assert (lmdbidx_count (by_city, txn, "Leeds", 5) == 3);
+    rc = lmdbtxn_commit (txn);
+    assert (rc == 0);
+    lmdbtxn_destroy (&txn);
+
+    // Packed primaries work the same way
+    lmdbdbi_t *packed = lmdbdbi_new_packed (env, "people.packed");
+    assert (packed);
+    lmdbidx_t *packed_by_city = lmdbidx_new (env, packed, "people.packed.city",
+                                             s_test_by_city, NULL);
+    assert (packed_by_city);
+    txn = lmdbtxn_new_rdrw (env);
+    rc = lmdbdbi_put_strstr (packed, txn, "ann", "Ann|Leeds|");
+    assert (rc == 0);
+    rc = lmdbdbi_put_strstr (packed, txn, "bob", "Bob|Leeds|");
+    assert (rc == 0);
+    rc = lmdbdbi_del_str (packed, txn, "ann");
+    assert (rc == 0);
+    assert (lmdbidx_count (packed_by_city, txn, "Leeds", 5) == 1);
+    lmdbspan packed_val = lmdbidx_get (packed_by_city, txn, "Leeds", 5);
+    assert (streq (lmdbspan_asstr (packed_val), "Bob|Leeds|"));
+    rc = lmdbdbi_del_str (packed, txn, "bob");
+    assert (rc == 0);
+    assert (! lmdbspan_valid (lmdbdbi_get_str (packed, txn, "bob")));
+    lmdbtxn_destroy (&txn);
+
+    lmdbidx_destroy (&packed_by_city);
+    lmdbidx_destroy (&by_city);
+    lmdbdbi_destroy (&packed);
+    lmdbdbi_destroy (&people);
+    lmdbenv_destroy (&env);
+
+    if (verbose)
+        log ("Indexes kept in step with puts, dels and aborts");
+    //  @end
+    printf ("OK\n");
+}
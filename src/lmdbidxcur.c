@@ -0,0 +1,326 @@
+/*  =========================================================================
+    lmdbidxcur - Cursor over the primary records found through an lmdbidx
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+/*
+@header
+    lmdbidxcur - Cursor over the primary records found through an lmdbidx
+@discuss
+    Walks (index key, primary key) pairs in the index, fetching primary
+    values only when asked for, so counting or collecting keys never
+    touches the primary.
+@end
+*/
+
+#include "classlmdb_classes.h"
+
+#include "logging.h"
+
+//  Structure of our class
+
+struct _lmdbidxcur_t {
+    MDB_cursor *handle;
+    lmdbidx_t *idx;
+    lmdbtxn_t *txn;
+
+    // Changed on cursor move; both zeroed once we run out
+    MDB_val mikey;
+    MDB_val mpkey;
+
+    // Was this cur created in the _fromkey() ctr?
+    bool is_fromkey;
+
+    // Range cursors only: where to stop, if anywhere (our own copy)
+    MDB_val mhi;
+};
+
+
+//  --------------------------------------------------------------------------
+//  Create a new lmdbidxcur
+
+// Stop if we've gone past the range
+static void
+s_check_bound (lmdbidxcur_t *self)
+{
+    if (self->mhi.mv_data
+    &&  mdb_cmp (lmdbtxn_handle (self->txn), lmdbidx_handle (self->idx),
+                 &self->mikey, &self->mhi) >= 0) {
+        self->mikey = (MDB_val) {0};
+        self->mpkey = (MDB_val) {0};
+    }
+}
+
+static lmdbidxcur_t *
+s_new_withcop (lmdbidx_t *idx, lmdbtxn_t *txn,
+               const void *key, size_t key_size, MDB_cursor_op cop)
+{
+    assert (idx);
+    assert (txn);
+    assert (key);
+
+    lmdbidxcur_t *self = (lmdbidxcur_t *) lmdballoc_zmalloc (sizeof (lmdbidxcur_t));
+    assert (self);
+    self->idx = idx;
+    self->txn = txn;
+
+    int err = mdb_cursor_open (lmdbtxn_handle (txn), lmdbidx_handle (idx),
+                               &self->handle);
+    if (err)
+        goto fail;
+
+    // LMDB api requires us to cast away const here, but doesn't mutate
+    self->mikey.mv_data = (void *) key;
+    self->mikey.mv_size = key_size;
+    err = mdb_cursor_get (self->handle, &self->mikey, &self->mpkey, cop);
+    if (err == MDB_NOTFOUND) {
+        self->mikey = (MDB_val) {0};
+        self->mpkey = (MDB_val) {0};
+    }
+    else
+    if (err)
+        goto fail;
+
+    // MDB_SET doesn't point mikey into the map, so fetch it from there
+    if (!err)
+        err = mdb_cursor_get (self->handle, &self->mikey, &self->mpkey, MDB_GET_CURRENT);
+    if (err && err != MDB_NOTFOUND)
+        goto fail;
+    return self;
+
+ fail:
+    lmdbidxcur_destroy (&self);
+    return NULL;
+}
+
+lmdbidxcur_t *
+lmdbidxcur_new_fromkey (lmdbidx_t *idx, lmdbtxn_t *txn,
+                        const void *ikey, size_t ikey_size)
+{
+    lmdbidxcur_t *self = s_new_withcop (idx, txn, ikey, ikey_size, MDB_SET);
+    if (self)
+        self->is_fromkey = true;
+    return self;
+}
+
+lmdbidxcur_t *
+lmdbidxcur_new_range (lmdbidx_t *idx, lmdbtxn_t *txn,
+                      const void *lo, size_t lo_size,
+                      const void *hi, size_t hi_size)
+{
+    lmdbidxcur_t *self = s_new_withcop (idx, txn, lo, lo_size, MDB_SET_RANGE);
+    if (self && hi) {
+        // One spare byte, so an empty hi still isn't NULL and counts as a bound
+        self->mhi.mv_data = lmdballoc_zmalloc (hi_size + 1);
+        assert (self->mhi.mv_data);
+        memcpy (self->mhi.mv_data, hi, hi_size);
+        self->mhi.mv_size = hi_size;
+        if (self->mikey.mv_data)
+            s_check_bound (self);
+    }
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the lmdbidxcur
+
+void
+lmdbidxcur_destroy (lmdbidxcur_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        lmdbidxcur_t *self = *self_p;
+        if (self->handle)
+            mdb_cursor_close (self->handle);
+        lmdballoc_free (self->mhi.mv_data);
+        lmdballoc_free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Moving the cursor
+
+int
+lmdbidxcur_next (lmdbidxcur_t *self)
+{
+    assert (self);
+    if (!self->mikey.mv_data)
+        return -1;
+
+    MDB_cursor_op cop = self->is_fromkey ? MDB_NEXT_DUP : MDB_NEXT;
+    int err = mdb_cursor_get (self->handle, &self->mikey, &self->mpkey, cop);
+    if (err) {
+        self->mikey = (MDB_val) {0};
+        self->mpkey = (MDB_val) {0};
+        return -1;
+    }
+    s_check_bound (self);
+    return self->mikey.mv_data ? 0 : -1;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Accessing the record the cursor is on
+
+bool
+lmdbidxcur_valid (lmdbidxcur_t *self)
+{
+    assert (self);
+    return self->mikey.mv_data != NULL;
+}
+
+lmdbspan
+lmdbidxcur_ikey (lmdbidxcur_t *self)
+{
+    assert (self);
+    return (lmdbspan){ .data = self->mikey.mv_data, .size = self->mikey.mv_size };
+}
+
+lmdbspan
+lmdbidxcur_key (lmdbidxcur_t *self)
+{
+    assert (self);
+    return (lmdbspan){ .data = self->mpkey.mv_data, .size = self->mpkey.mv_size };
+}
+
+lmdbspan
+lmdbidxcur_val (lmdbidxcur_t *self)
+{
+    assert (self);
+    if (!self->mpkey.mv_data)
+        return lmdbspan_makenull ();
+    return lmdbdbi_get (lmdbidx_primary (self->idx), self->txn,
+                        self->mpkey.mv_data, self->mpkey.mv_size);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+// Index uint32_t values by their low byte
+static void
+s_test_by_low_byte (lmdbidx_t *idx, const void *key, size_t key_size,
+                    const void *val, size_t val_size, void *arg)
+{
+    uint32_t num;
+    assert (val_size == sizeof (num));
+    memcpy (&num, val, sizeof (num));
+    byte low = num & 0xff;
+    lmdbidx_emit (idx, &low, 1);
+}
+
+void
+lmdbidxcur_test (bool verbose)
+{
+    printf (" * lmdbidxcur: ");
+
+    //  @selftest
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+    assert (SELFTEST_DIR_RW);
+
+    char *test_db_path = zsys_sprintf ("%s/%s", SELFTEST_DIR_RW, "LMDBIDXCUR_TEST.db");
+    if (zsys_file_exists (test_db_path))
+        zsys_file_delete (test_db_path);
+    lmdbenv_t *env = lmdbenv_new (test_db_path);
+    assert (env);
+    zstr_free (&test_db_path);
+
+    lmdbdbi_t *nums = lmdbdbi_new (env, "nums");
+    assert (nums);
+    lmdbidx_t *by_low = lmdbidx_new (env, nums, "nums.low", s_test_by_low_byte, NULL);
+    assert (by_low);
+
+    // Keys are "kNNN", values 0x100 * i + i % 4, so each low byte 0..3
+    // indexes 25 records
+    lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
+    assert (txn);
+    uint32_t i;
+    for (i = 0; i < 100; i++) {
+        char key [8];
+        snprintf (key, sizeof (key), "k%03u", i);
+        uint32_t val = 0x100 * i + i % 4;
+        int rc = lmdbdbi_put_str (nums, txn, key, &val, sizeof (val));
+        assert (rc == 0);
+    }
+    int rc = lmdbtxn_commit (txn);
+    assert (rc == 0);
+    lmdbtxn_destroy (&txn);
+
+    txn = lmdbtxn_new_rdonly (env);
+    assert (txn);
+
+    // One index key, in primary key order
+    byte low = 2;
+    lmdbidxcur_t *cur = lmdbidxcur_new_fromkey (by_low, txn, &low, 1);
+    assert (cur);
+    size_t count = 0;
+    do {
+        if (!lmdbidxcur_valid (cur))
+            break;
+        char expect [8];
+        snprintf (expect, sizeof (expect), "k%03zu", count * 4 + 2);
+        assert (streq (lmdbspan_asstr (lmdbidxcur_key (cur)), expect));
+        assert (*(const byte *) lmdbidxcur_ikey (cur).data == 2);
+        lmdbspan val = lmdbidxcur_val (cur);
+        assert (lmdbspan_size (val) == sizeof (uint32_t));
+        uint32_t num;
+        memcpy (&num, val.data, sizeof (num));
+        assert (num == 0x100 * (count * 4 + 2) + 2);
+        count++;
+    } while (lmdbidxcur_next (cur) == 0);
+    assert (count == 25);
+    assert (! lmdbidxcur_valid (cur));
+    assert (lmdbidxcur_next (cur) == -1);
+    assert (! lmdbspan_valid (lmdbidxcur_val (cur)));
+    lmdbidxcur_destroy (&cur);
+
+    // Missing key
+    low = 9;
+    cur = lmdbidxcur_new_fromkey (by_low, txn, &low, 1);
+    assert (cur);
+    assert (! lmdbidxcur_valid (cur));
+    lmdbidxcur_destroy (&cur);
+
+    // Ranges are half open, and run to the end without hi
+    byte lo = 1, hi = 3;
+    cur = lmdbidxcur_new_range (by_low, txn, &lo, 1, &hi, 1);
+    assert (cur);
+    for (count = 0; lmdbidxcur_valid (cur); lmdbidxcur_next (cur)) {
+        byte ikey = *(const byte *) lmdbidxcur_ikey (cur).data;
+        assert (ikey == 1 || ikey == 2);
+        count++;
+    }
+    assert (count == 50);
+    lmdbidxcur_destroy (&cur);
+
+    cur = lmdbidxcur_new_range (by_low, txn, &lo, 1, NULL, 0);
+    assert (cur);
+    for (count = 0; lmdbidxcur_valid (cur); lmdbidxcur_next (cur))
+        count++;
+    assert (count == 75);
+    lmdbidxcur_destroy (&cur);
+
+    cur = lmdbidxcur_new_range (by_low, txn, &hi, 1, &lo, 1);
+    assert (cur);
+    assert (! lmdbidxcur_valid (cur));
+    lmdbidxcur_destroy (&cur);
+
+    lmdbtxn_destroy (&txn);
+    lmdbidx_destroy (&by_low);
+    lmdbdbi_destroy (&nums);
+    lmdbenv_destroy (&env);
+
+    if (verbose)
+        log ("Walked index keys and ranges");
+    //  @end
+    printf ("OK\n");
+}
@@ -0,0 +1,828 @@
+/*  =========================================================================
+    lmdbmemtable - Write-back table in memory in front of an lmdbdbi, for hot keys
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+/*
+@header
+    lmdbmemtable - Write-back table in memory in front of an lmdbdbi, for hot keys
+@discuss
+    Every LMDB write copies the pages on the path to the key, so a key
+    updated a thousand times a second costs a thousand page copies. Here
+    puts, dels and merges land in a hash table in memory instead, and
+    only the latest value of each key is written, by one write txn that
+    puts them in key order (through an lmdbstage) every so often.
+
+    The table is split into shards by hash, each behind its own spinlock,
+    so threads working on different keys rarely wait for each other, and
+    no lock is held while LMDB is written: a flush copies the dirty
+    entries out, marks them clean, and writes the copies. Entries written
+    again meanwhile just become dirty again; if the write fails, the ones
+    that weren't are marked dirty again for the next flush.
+
+    Entries stay in the table once written, so hot keys are read and
+    merged without going to LMDB at all. When the table outgrows its
+    budget, a flush evicts clean entries. A read txn that began before
+    that eviction can't see the latest value of an evicted key, which
+    doesn't matter for gets (it's what the txn's snapshot holds) but would
+    lose updates if merged into, so merges refuse such txns.
+@end
+*/
+
+#include "classlmdb_classes.h"
+
+#include <stdatomic.h>
+
+#include "logging.h"
+
+#define s_shard_count 16
+#define s_table_min 64
+
+typedef struct {
+    uint64_t hash;
+    size_t key_size;
+    byte *val;
+    size_t val_size;
+    size_t val_alloc;
+    bool is_deleted;            // A del, written or not
+    bool is_dirty;              // Changed since last written
+    bool is_flushing;           // In the flush being written
+    // Then the key
+} s_entry_t;
+
+#define s_entry_key(e) ((byte *) ((e) + 1))
+
+typedef struct {
+    atomic_flag lock;
+    s_entry_t **table;          // Open addressed
+    size_t table_size;          // A power of two, or 0
+    size_t count;
+
+    // Merges build the new value here, as it may depend on the old one
+    byte *merge_buf;
+    size_t merge_buf_size;
+} s_shard_t;
+
+//  Structure of our class
+
+struct _lmdbmemtable_t {
+    lmdbenv_t *env;
+    lmdbdbi_t *dbi;
+    lmdbmerge_t *merge;
+    size_t max_bytes;
+    size_t max_dirty_bytes;
+    int max_age_msecs;
+
+    s_shard_t shards [s_shard_count];
+    atomic_size_t bytes;
+    atomic_size_t dirty_bytes;
+    atomic_size_t dirty_count;
+
+    // One flush at a time, and the id of the write txn before which
+    // entries were last evicted
+    atomic_flag flushing;
+    atomic_size_t evicted_txnid;
+
+    zactor_t *actor;
+};
+
+
+//  --------------------------------------------------------------------------
+//  The flushing thread
+
+static int
+    s_flush (lmdbmemtable_t *self);
+
+static void
+s_flusher_actor (zsock_t *pipe, void *args)
+{
+    lmdbmemtable_t *self = (lmdbmemtable_t *) args;
+    zpoller_t *poller = zpoller_new (pipe, NULL);
+    assert (poller);
+    zsock_signal (pipe, 0);
+
+    while (true) {
+        void *which = zpoller_wait (poller, self->max_age_msecs);
+        if (which == pipe) {
+            char *command = zstr_recv (pipe);
+            bool terminated = !command || streq (command, "$TERM");
+            zstr_free (&command);
+            if (terminated)
+                break;
+        }
+        else
+        if (zpoller_terminated (poller))
+            break;
+        else
+        if (atomic_load (&self->dirty_count) && s_flush (self))
+            zsys_warning ("lmdbmemtable: flush failed, will retry");
+    }
+    zpoller_destroy (&poller);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Create a new lmdbmemtable
+
+lmdbmemtable_t *
+lmdbmemtable_new (lmdbenv_t *env, lmdbdbi_t *dbi, size_t max_bytes,
+                  size_t max_dirty_bytes, int max_age_msecs)
+{
+    assert (env);
+    assert (dbi);
+    if (max_dirty_bytes == 0 || max_bytes < max_dirty_bytes || max_age_msecs < 0)
+        return NULL;
+
+    lmdbmemtable_t *self = (lmdbmemtable_t *) lmdballoc_zmalloc (sizeof (lmdbmemtable_t));
+    assert (self);
+    self->env = env;
+    self->dbi = dbi;
+    self->merge = lmdbdbi_merge_ops (dbi);
+    self->max_bytes = max_bytes;
+    self->max_dirty_bytes = max_dirty_bytes;
+    self->max_age_msecs = max_age_msecs;
+
+    size_t i;
+    for (i = 0; i < s_shard_count; i++)
+        atomic_flag_clear (&self->shards [i].lock);
+    atomic_init (&self->bytes, 0);
+    atomic_init (&self->dirty_bytes, 0);
+    atomic_init (&self->dirty_count, 0);
+    atomic_flag_clear (&self->flushing);
+    atomic_init (&self->evicted_txnid, 0);
+
+    if (max_age_msecs > 0) {
+        self->actor = zactor_new (s_flusher_actor, self);
+        if (!self->actor)
+            lmdbmemtable_destroy (&self);
+    }
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the lmdbmemtable
+
+void
+lmdbmemtable_destroy (lmdbmemtable_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        lmdbmemtable_t *self = *self_p;
+        zactor_destroy (&self->actor);
+        if (atomic_load (&self->dirty_count) && s_flush (self))
+            zsys_error ("lmdbmemtable: final flush failed, updates lost");
+
+        size_t i, j;
+        for (i = 0; i < s_shard_count; i++) {
+            s_shard_t *shard = &self->shards [i];
+            for (j = 0; j < shard->table_size; j++)
+                if (shard->table [j]) {
+                    lmdballoc_free (shard->table [j]->val);
+                    lmdballoc_free (shard->table [j]);
+                }
+            lmdballoc_free (shard->table);
+            lmdballoc_free (shard->merge_buf);
+        }
+        lmdballoc_free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Shards
+
+static void
+s_lock (s_shard_t *shard)
+{
+    while (atomic_flag_test_and_set_explicit (&shard->lock, memory_order_acquire))
+        ;
+}
+
+static void
+s_unlock (s_shard_t *shard)
+{
+    atomic_flag_clear_explicit (&shard->lock, memory_order_release);
+}
+
+// FNV-1a over the key; the top bits pick the shard, the bottom the slot
+static uint64_t
+s_hash (const void *key, size_t key_size)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    const byte *data = (const byte *) key;
+    size_t i;
+    for (i = 0; i < key_size; i++) {
+        h ^= data [i];
+        h *= 0x100000001b3ULL;
+    }
+    return h ^ (h >> 29);
+}
+
+static s_shard_t *
+s_shard (lmdbmemtable_t *self, uint64_t hash)
+{
+    return &self->shards [hash >> 60];
+}
+
+// The slot holding key, or the empty one it would go in
+static size_t
+s_slot (s_shard_t *shard, uint64_t hash, const void *key, size_t key_size)
+{
+    size_t mask = shard->table_size - 1;
+    size_t slot = hash & mask;
+    while (shard->table [slot]) {
+        s_entry_t *entry = shard->table [slot];
+        if (entry->hash == hash && entry->key_size == key_size
+        &&  memcmp (s_entry_key (entry), key, key_size) == 0)
+            break;
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static s_entry_t *
+s_find (s_shard_t *shard, uint64_t hash, const void *key, size_t key_size)
+{
+    if (!shard->count)
+        return NULL;
+    return shard->table [s_slot (shard, hash, key, key_size)];
+}
+
+// Rehash into a table of table_size slots, dropping entries that don't
+// pass keep, if given. Returns the bytes dropped.
+static size_t
+s_rebuild (s_shard_t *shard, size_t table_size, bool (*keep) (s_entry_t *))
+{
+    s_entry_t **old_table = shard->table;
+    size_t old_size = shard->table_size;
+    shard->table = (s_entry_t **) lmdballoc_zmalloc (table_size * sizeof (s_entry_t *));
+    assert (shard->table);
+    shard->table_size = table_size;
+    shard->count = 0;
+
+    size_t dropped = 0;
+    size_t mask = table_size - 1;
+    size_t i;
+    for (i = 0; i < old_size; i++) {
+        s_entry_t *entry = old_table [i];
+        if (!entry)
+            continue;
+        if (keep && !keep (entry)) {
+            dropped += sizeof (s_entry_t) + entry->key_size + entry->val_alloc;
+            lmdballoc_free (entry->val);
+            lmdballoc_free (entry);
+            continue;
+        }
+        size_t slot = entry->hash & mask;
+        while (shard->table [slot])
+            slot = (slot + 1) & mask;
+        shard->table [slot] = entry;
+        shard->count++;
+    }
+    lmdballoc_free (old_table);
+    return dropped;
+}
+
+// The entry for key, added empty if it isn't there
+static s_entry_t *
+s_find_or_add (lmdbmemtable_t *self, s_shard_t *shard, uint64_t hash,
+               const void *key, size_t key_size)
+{
+    if ((shard->count + 1) * 2 > shard->table_size)
+        s_rebuild (shard, shard->table_size ? shard->table_size * 2 : s_table_min, NULL);
+    size_t slot = s_slot (shard, hash, key, key_size);
+    if (!shard->table [slot]) {
+        s_entry_t *entry = (s_entry_t *) lmdballoc_zmalloc (sizeof (s_entry_t) + key_size);
+        assert (entry);
+        entry->hash = hash;
+        entry->key_size = key_size;
+        entry->is_deleted = true;
+        memcpy (s_entry_key (entry), key, key_size);
+        shard->table [slot] = entry;
+        shard->count++;
+        atomic_fetch_add (&self->bytes, sizeof (s_entry_t) + key_size);
+    }
+    return shard->table [slot];
+}
+
+// Give an entry a new value, or none for a del, and mark it dirty
+static void
+s_set (lmdbmemtable_t *self, s_entry_t *entry, const void *val, size_t val_size,
+       bool is_deleted)
+{
+    size_t old_alloc = entry->val_alloc;
+    if (!is_deleted && val_size > entry->val_alloc) {
+        size_t val_alloc = val_size < 8 ? 8 : val_size;
+        byte *buf = (byte *) lmdballoc_realloc (entry->val, val_alloc);
+        assert (buf);
+        entry->val = buf;
+        entry->val_alloc = val_alloc;
+        atomic_fetch_add (&self->bytes, val_alloc - old_alloc);
+    }
+    if (!is_deleted && val_size)
+        memcpy (entry->val, val, val_size);
+    entry->val_size = is_deleted ? 0 : val_size;
+    entry->is_deleted = is_deleted;
+
+    size_t entry_bytes = sizeof (s_entry_t) + entry->key_size + entry->val_alloc;
+    if (entry->is_dirty)
+        atomic_fetch_add (&self->dirty_bytes, entry->val_alloc - old_alloc);
+    else {
+        entry->is_dirty = true;
+        atomic_fetch_add (&self->dirty_bytes, entry_bytes);
+        atomic_fetch_add (&self->dirty_count, 1);
+    }
+}
+
+// Writes made through the memtable can outgrow its dirty budget; the
+// writer pays for the flush
+static int
+s_after_write (lmdbmemtable_t *self)
+{
+    if (atomic_load (&self->dirty_bytes) > self->max_dirty_bytes)
+        return s_flush (self);
+    return 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Reads and writes
+
+int
+lmdbmemtable_put (lmdbmemtable_t *self, const void *key, size_t key_size,
+                  const void *val, size_t val_size)
+{
+    assert (self);
+    assert (key);
+    assert (val || !val_size);
+
+    uint64_t hash = s_hash (key, key_size);
+    s_shard_t *shard = s_shard (self, hash);
+    s_lock (shard);
+    s_entry_t *entry = s_find_or_add (self, shard, hash, key, key_size);
+    s_set (self, entry, val, val_size, false);
+    s_unlock (shard);
+    return s_after_write (self);
+}
+
+int
+lmdbmemtable_del (lmdbmemtable_t *self, const void *key, size_t key_size)
+{
+    assert (self);
+    assert (key);
+
+    uint64_t hash = s_hash (key, key_size);
+    s_shard_t *shard = s_shard (self, hash);
+    s_lock (shard);
+    s_entry_t *entry = s_find_or_add (self, shard, hash, key, key_size);
+    s_set (self, entry, NULL, 0, true);
+    s_unlock (shard);
+    return s_after_write (self);
+}
+
+lmdbspan
+lmdbmemtable_get (lmdbmemtable_t *self, lmdbtxn_t *txn, const void *key, size_t key_size)
+{
+    assert (self);
+    assert (txn);
+    assert (key);
+
+    uint64_t hash = s_hash (key, key_size);
+    s_shard_t *shard = s_shard (self, hash);
+    s_lock (shard);
+    s_entry_t *entry = s_find (shard, hash, key, key_size);
+    if (entry) {
+        // Copied out, as the entry can change as soon as we let go
+        byte *copy = NULL;
+        size_t size = entry->val_size;
+        if (!entry->is_deleted) {
+            copy = (byte *) lmdbtxn_scratch (txn, size);
+            if (copy)
+                memcpy (copy, entry->val, size);
+        }
+        s_unlock (shard);
+        if (!copy)
+            return lmdbspan_makenull ();
+        return (lmdbspan) { .data = copy, .size = size };
+    }
+    s_unlock (shard);
+    return lmdbdbi_get (self->dbi, txn, key, key_size);
+}
+
+int
+lmdbmemtable_merge (lmdbmemtable_t *self, lmdbtxn_t *txn,
+                    const void *key, size_t key_size,
+                    int op, const void *operand, size_t operand_size)
+{
+    assert (self);
+    assert (txn);
+    assert (key);
+    assert (operand || !operand_size);
+
+    // Any merge may flush, which needs the write txn a caller's write txn
+    // would be holding; refuse it rather than wait on ourselves
+    if (! lmdbtxn_rdonly (txn))
+        return -1;
+
+    uint64_t hash = s_hash (key, key_size);
+    s_shard_t *shard = s_shard (self, hash);
+    int rc = -1;
+    s_lock (shard);
+
+    // Without an entry, the old value comes from txn, which must be able
+    // to see everything we've evicted
+    const void *old = NULL;
+    size_t old_size = 0;
+    s_entry_t *entry = s_find (shard, hash, key, key_size);
+    if (entry) {
+        if (!entry->is_deleted) {
+            old = entry->val;
+            old_size = entry->val_size;
+        }
+    }
+    else {
+        if (mdb_txn_id (lmdbtxn_handle (txn)) < atomic_load (&self->evicted_txnid))
+            goto done;
+        lmdbspan found = lmdbdbi_get (self->dbi, txn, key, key_size);
+        old = found.data;
+        old_size = found.size;
+    }
+
+    size_t size = lmdbmerge_apply (self->merge, op, old, old_size,
+                                   operand, operand_size, NULL, 0);
+    if (size == SIZE_MAX)
+        goto done;
+    if (size > shard->merge_buf_size) {
+        byte *buf = (byte *) lmdballoc_realloc (shard->merge_buf, size);
+        assert (buf);
+        shard->merge_buf = buf;
+        shard->merge_buf_size = size;
+    }
+    lmdbmerge_apply (self->merge, op, old, old_size,
+                     operand, operand_size, shard->merge_buf, size);
+    if (!entry)
+        entry = s_find_or_add (self, shard, hash, key, key_size);
+    s_set (self, entry, shard->merge_buf, size, false);
+    rc = 0;
+
+ done:
+    s_unlock (shard);
+    return rc ? rc : s_after_write (self);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Flushing
+
+static bool
+s_not_clean (s_entry_t *entry)
+{
+    return entry->is_dirty || entry->is_flushing;
+}
+
+// Drop clean entries until we're at half the budget, so the next few
+// flushes don't have to do this again
+static void
+s_evict (lmdbmemtable_t *self, size_t txnid)
+{
+    // Raise the bar before any entry goes, so that a merge that finds no
+    // entry knows which txns might not have seen its value
+    atomic_store (&self->evicted_txnid, txnid);
+
+    size_t i;
+    for (i = 0; i < s_shard_count && atomic_load (&self->bytes) > self->max_bytes / 2; i++) {
+        s_shard_t *shard = &self->shards [i];
+        s_lock (shard);
+        if (shard->count) {
+            size_t dropped = s_rebuild (shard, shard->table_size, s_not_clean);
+            atomic_fetch_sub (&self->bytes, dropped);
+        }
+        s_unlock (shard);
+    }
+}
+
+static int
+s_flush (lmdbmemtable_t *self)
+{
+    while (atomic_flag_test_and_set (&self->flushing))
+        zclock_sleep (1);
+
+    // Copy the dirty entries out, marking them clean
+    lmdbstage_t *stage = lmdbstage_new ();
+    size_t i, j;
+    for (i = 0; i < s_shard_count; i++) {
+        s_shard_t *shard = &self->shards [i];
+        s_lock (shard);
+        for (j = 0; j < shard->table_size; j++) {
+            s_entry_t *entry = shard->table [j];
+            if (!entry || !entry->is_dirty)
+                continue;
+            if (entry->is_deleted)
+                lmdbstage_del (stage, self->dbi, s_entry_key (entry), entry->key_size);
+            else
+                lmdbstage_put (stage, self->dbi, s_entry_key (entry), entry->key_size,
+                               entry->val, entry->val_size);
+            entry->is_dirty = false;
+            entry->is_flushing = true;
+            atomic_fetch_sub (&self->dirty_bytes,
+                              sizeof (s_entry_t) + entry->key_size + entry->val_alloc);
+            atomic_fetch_sub (&self->dirty_count, 1);
+        }
+        s_unlock (shard);
+    }
+
+    int rc = 0;
+    size_t txnid = 0;
+    if (lmdbstage_count (stage)) {
+        lmdbtxn_t *txn = lmdbtxn_new_rdrw (self->env);
+        if (txn) {
+            txnid = mdb_txn_id (lmdbtxn_handle (txn));
+            rc = lmdbstage_flush (stage, txn);
+            if (rc == 0)
+                rc = lmdbtxn_commit (txn);
+            lmdbtxn_destroy (&txn);
+        }
+        else
+            rc = -1;
+    }
+    lmdbstage_destroy (&stage);
+
+    // What we failed to write needs writing next time, unless it's been
+    // changed since, which has already made it dirty
+    for (i = 0; i < s_shard_count; i++) {
+        s_shard_t *shard = &self->shards [i];
+        s_lock (shard);
+        for (j = 0; j < shard->table_size; j++) {
+            s_entry_t *entry = shard->table [j];
+            if (!entry || !entry->is_flushing)
+                continue;
+            entry->is_flushing = false;
+            if (rc && !entry->is_dirty) {
+                entry->is_dirty = true;
+                atomic_fetch_add (&self->dirty_bytes,
+                                  sizeof (s_entry_t) + entry->key_size + entry->val_alloc);
+                atomic_fetch_add (&self->dirty_count, 1);
+            }
+        }
+        s_unlock (shard);
+    }
+
+    if (rc == 0 && atomic_load (&self->bytes) > self->max_bytes)
+        s_evict (self, txnid);
+
+    atomic_flag_clear (&self->flushing);
+    return rc;
+}
+
+int
+lmdbmemtable_flush (lmdbmemtable_t *self)
+{
+    assert (self);
+    return s_flush (self);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Accessors
+
+size_t
+lmdbmemtable_dirty (lmdbmemtable_t *self)
+{
+    assert (self);
+    return atomic_load (&self->dirty_count);
+}
+
+size_t
+lmdbmemtable_size (lmdbmemtable_t *self)
+{
+    assert (self);
+    return atomic_load (&self->bytes);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+// Adds 1 to each of a few counters, many times over, merging through the
+// memtable from its own thread
+typedef struct {
+    lmdbenv_t *env;
+    lmdbmemtable_t *memtable;
+    size_t failures;
+} s_counter_args_t;
+
+static void
+s_counter_actor (zsock_t *pipe, void *args)
+{
+    s_counter_args_t *counter = (s_counter_args_t *) args;
+    zsock_signal (pipe, 0);
+    lmdbtxn_t *txn = lmdbtxn_new_rdonly (counter->env);
+    uint64_t one = 1;
+    uint32_t i;
+    for (i = 0; txn && i < 5000; i++) {
+        uint32_t key = 2000 + i % 8;
+        // A txn older than an eviction is refused, so renew and retry
+        while (lmdbmemtable_merge (counter->memtable, txn, &key, sizeof (key),
+                                   LMDBDBI_MERGE_ADD_U64, &one, sizeof (one))) {
+            counter->failures++;
+            lmdbtxn_reset (txn);
+            lmdbtxn_renew (txn);
+        }
+    }
+    lmdbtxn_destroy (&txn);
+    zsock_signal (pipe, 0);
+
+    char *command = zstr_recv (pipe);
+    zstr_free (&command);
+}
+
+void
+lmdbmemtable_test (bool verbose)
+{
+    printf (" * lmdbmemtable: ");
+
+    //  @selftest
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+    assert (SELFTEST_DIR_RW);
+
+    char *test_db_path = zsys_sprintf ("%s/%s", SELFTEST_DIR_RW, "LMDBMEMTABLE_TEST.db");
+    if (zsys_file_exists (test_db_path))
+        zsys_file_delete (test_db_path);
+    lmdbenv_t *env = lmdbenv_new (test_db_path);
+    assert (env);
+    zstr_free (&test_db_path);
+    lmdbdbi_t *dbi = lmdbdbi_new (env, "counters");
+    assert (dbi);
+
+    assert (! lmdbmemtable_new (env, dbi, 1024, 0, 0));
+    assert (! lmdbmemtable_new (env, dbi, 1024, 4096, 0));
+
+    // Writes are seen through the memtable straight away, and in LMDB
+    // only once flushed
+    lmdbmemtable_t *memtable = lmdbmemtable_new (env, dbi, 1 << 20, 1 << 16, 0);
+    assert (memtable);
+    int rc = lmdbmemtable_put (memtable, "cat", 4, "felix", 6);
+    assert (rc == 0);
+    rc = lmdbmemtable_put (memtable, "dog", 4, "rex", 4);
+    assert (rc == 0);
+    rc = lmdbmemtable_del (memtable, "dog", 4);
+    assert (rc == 0);
+    rc = lmdbmemtable_del (memtable, "cow", 4);
+    assert (rc == 0);
+    assert (lmdbmemtable_dirty (memtable) == 3);
+    assert (lmdbmemtable_size (memtable) > 0);
+
+    lmdbtxn_t *txn = lmdbtxn_new_rdonly (env);
+    assert (txn);
+    assert (streq (lmdbspan_asstr (lmdbmemtable_get (memtable, txn, "cat", 4)), "felix"));
+    assert (! lmdbspan_valid (lmdbmemtable_get (memtable, txn, "dog", 4)));
+    assert (! lmdbspan_valid (lmdbdbi_get_str (dbi, txn, "cat")));
+    lmdbtxn_destroy (&txn);
+
+    rc = lmdbmemtable_flush (memtable);
+    assert (rc == 0);
+    assert (lmdbmemtable_dirty (memtable) == 0);
+    txn = lmdbtxn_new_rdonly (env);
+    assert (txn);
+    assert (streq (lmdbspan_asstr (lmdbdbi_get_str (dbi, txn, "cat")), "felix"));
+    assert (! lmdbspan_valid (lmdbdbi_get_str (dbi, txn, "dog")));
+    assert (streq (lmdbspan_asstr (lmdbmemtable_get (memtable, txn, "cat", 4)), "felix"));
+
+    // Merges build on what's in the memtable, or failing that in LMDB,
+    // and refuse values the operator can't take
+    uint64_t one = 1;
+    uint32_t key = 100;
+    rc = lmdbmemtable_merge (memtable, txn, &key, sizeof (key),
+                             LMDBDBI_MERGE_ADD_U64, &one, sizeof (one));
+    assert (rc == 0);
+    rc = lmdbmemtable_merge (memtable, txn, &key, sizeof (key),
+                             LMDBDBI_MERGE_ADD_U64, &one, sizeof (one));
+    assert (rc == 0);
+    assert (lmdbspan_asui64 (lmdbmemtable_get (memtable, txn, &key, sizeof (key))) == 2);
+    rc = lmdbmemtable_merge (memtable, txn, "cat", 4,
+                             LMDBDBI_MERGE_ADD_U64, &one, sizeof (one));
+    assert (rc == -1);
+    lmdbtxn_destroy (&txn);
+
+    // Write txns are refused, as a flush the merge caused would wait on them
+    txn = lmdbtxn_new_rdrw (env);
+    assert (txn);
+    rc = lmdbmemtable_merge (memtable, txn, &key, sizeof (key),
+                             LMDBDBI_MERGE_ADD_U64, &one, sizeof (one));
+    assert (rc == -1);
+    lmdbtxn_destroy (&txn);
+    txn = lmdbtxn_new_rdonly (env);
+    assert (txn);
+    assert (lmdbspan_asui64 (lmdbmemtable_get (memtable, txn, &key, sizeof (key))) == 2);
+    lmdbtxn_destroy (&txn);
+    lmdbmemtable_destroy (&memtable);
+    assert (!memtable);
+
+    // Destroying flushed the counter, and a new memtable picks it up
+    memtable = lmdbmemtable_new (env, dbi, 1 << 20, 1 << 16, 0);
+    assert (memtable);
+    txn = lmdbtxn_new_rdonly (env);
+    assert (txn);
+    rc = lmdbmemtable_merge (memtable, txn, &key, sizeof (key),
+                             LMDBDBI_MERGE_ADD_U64, &one, sizeof (one));
+    assert (rc == 0);
+    assert (lmdbspan_asui64 (lmdbmemtable_get (memtable, txn, &key, sizeof (key))) == 3);
+    lmdbtxn_destroy (&txn);
+    lmdbmemtable_destroy (&memtable);
+
+    // Small budgets: writes flush once enough is dirty, and flushes
+    // evict, after which merges need a txn that can see what went
+    memtable = lmdbmemtable_new (env, dbi, 16 * 1024, 4 * 1024, 0);
+    assert (memtable);
+    txn = lmdbtxn_new_rdonly (env);
+    assert (txn);
+    uint32_t i;
+    for (i = 0; i < 1000; i++) {
+        rc = lmdbmemtable_put (memtable, &i, sizeof (i), &i, sizeof (i));
+        assert (rc == 0);
+    }
+    assert (lmdbmemtable_size (memtable) <= 24 * 1024);
+    assert (lmdbmemtable_dirty (memtable) < 1000);
+
+    // The txn is older than the flushes, so only sees what's resident
+    size_t seen = 0;
+    for (i = 0; i < 1000; i++)
+        seen += lmdbspan_valid (lmdbmemtable_get (memtable, txn, &i, sizeof (i)));
+    assert (seen < 1000);
+    uint32_t fresh = 5000;
+    rc = lmdbmemtable_merge (memtable, txn, &fresh, sizeof (fresh),
+                             LMDBDBI_MERGE_ADD_U64, &one, sizeof (one));
+    assert (rc == -1);
+    lmdbtxn_reset (txn);
+    lmdbtxn_renew (txn);
+    for (i = 0; i < 1000; i++)
+        assert (lmdbspan_asui32 (lmdbmemtable_get (memtable, txn, &i, sizeof (i))) == i);
+    rc = lmdbmemtable_merge (memtable, txn, &fresh, sizeof (fresh),
+                             LMDBDBI_MERGE_ADD_U64, &one, sizeof (one));
+    assert (rc == 0);
+    lmdbtxn_destroy (&txn);
+    lmdbmemtable_destroy (&memtable);
+
+    // With a maximum age, a thread flushes without being asked
+    memtable = lmdbmemtable_new (env, dbi, 1 << 20, 1 << 16, 10);
+    assert (memtable);
+    rc = lmdbmemtable_put (memtable, "late", 5, "yes", 4);
+    assert (rc == 0);
+    // Entries count as clean once copied out, before the flush commits,
+    // so wait for the write itself
+    int64_t deadline = zclock_mono () + 5000;
+    bool is_written = false;
+    while (!is_written && zclock_mono () < deadline) {
+        txn = lmdbtxn_new_rdonly (env);
+        assert (txn);
+        is_written = lmdbspan_valid (lmdbdbi_get_str (dbi, txn, "late"));
+        lmdbtxn_destroy (&txn);
+        if (!is_written)
+            zclock_sleep (5);
+    }
+    assert (is_written);
+    assert (lmdbmemtable_dirty (memtable) == 0);
+    txn = lmdbtxn_new_rdonly (env);
+    assert (txn);
+    assert (streq (lmdbspan_asstr (lmdbdbi_get_str (dbi, txn, "late")), "yes"));
+    lmdbtxn_destroy (&txn);
+
+    // Threads counting into the same keys lose no increments
+    s_counter_args_t counters [4];
+    zactor_t *actors [4];
+    for (i = 0; i < 4; i++) {
+        counters [i] = (s_counter_args_t) { .env = env, .memtable = memtable };
+        actors [i] = zactor_new (s_counter_actor, &counters [i]);
+        assert (actors [i]);
+    }
+    for (i = 0; i < 4; i++) {
+        zsock_wait (actors [i]);
+        zactor_destroy (&actors [i]);
+    }
+    rc = lmdbmemtable_flush (memtable);
+    assert (rc == 0);
+    txn = lmdbtxn_new_rdonly (env);
+    assert (txn);
+    for (i = 2000; i < 2008; i++) {
+        uint64_t count = lmdbspan_asui64 (lmdbdbi_get (dbi, txn, &i, sizeof (i)));
+        assert (count == 4 * 5000 / 8);
+    }
+    lmdbtxn_destroy (&txn);
+    lmdbmemtable_destroy (&memtable);
+
+    lmdbdbi_destroy (&dbi);
+    lmdbenv_destroy (&env);
+
+    if (verbose)
+        log ("Wrote back puts, dels and merges, from several threads");
+    //  @end
+    printf ("OK\n");
+}
@@ -0,0 +1,327 @@
+/*  =========================================================================
+    lmdbmerge - Merge operators applied by lmdbdbi_merge, built in and user registered
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+/*
+@header
+    lmdbmerge - Merge operators applied by lmdbdbi_merge, built in and user registered
+@discuss
+    Every operator, built in or not, follows the lmdbdbi_merge_fn
+    contract: return the size of the merged value, and only write it if
+    it fits. lmdbdbi calls each one twice, once to size the space it
+    reserves in the map and once to fill it, so the result is written
+    straight into the page with no intermediate copy.
+
+    Numbers are stored as 8 bytes in native byte order, as memcpy'ing an
+    int64_t, uint64_t or double would give. Numeric operators refuse old
+    values of any other size rather than guess what they hold.
+@end
+*/
+
+#include "classlmdb_classes.h"
+
+#include "logging.h"
+
+//  Structure of our class
+
+typedef struct {
+    lmdbdbi_merge_fn *fn;
+    void *arg;
+} s_op_t;
+
+struct _lmdbmerge_t {
+    s_op_t user [LMDBMERGE_MAX_USER];
+    size_t user_count;
+};
+
+
+//  --------------------------------------------------------------------------
+//  Built in operators
+
+// Add, min and max all work on one 8 byte number each side; an absent old
+// value is the identity for add, and for min/max just takes the operand
+typedef enum { s_add, s_min, s_max } s_numop_t;
+
+static size_t
+s_numeric (int kind, s_numop_t numop,
+           const void *old_val, size_t old_size,
+           const void *operand, size_t operand_size,
+           void *out, size_t out_size)
+{
+    if (operand_size != 8 || (old_val && old_size != 8))
+        return SIZE_MAX;
+    if (out_size < 8)
+        return 8;
+
+    if (!old_val) {
+        memcpy (out, operand, 8);
+        return 8;
+    }
+
+    if (kind == 'd') {
+        double a, b;
+        memcpy (&a, old_val, 8);
+        memcpy (&b, operand, 8);
+        double r = numop == s_add ? a + b
+                 : numop == s_min ? (b < a ? b : a)
+                 :                  (b > a ? b : a);
+        memcpy (out, &r, 8);
+    }
+    else
+    if (kind == 'i') {
+        int64_t a, b;
+        memcpy (&a, old_val, 8);
+        memcpy (&b, operand, 8);
+        // Unsigned add, so overflow wraps rather than being undefined
+        int64_t r = numop == s_add ? (int64_t) ((uint64_t) a + (uint64_t) b)
+                  : numop == s_min ? (b < a ? b : a)
+                  :                  (b > a ? b : a);
+        memcpy (out, &r, 8);
+    }
+    else {
+        uint64_t a, b;
+        memcpy (&a, old_val, 8);
+        memcpy (&b, operand, 8);
+        uint64_t r = numop == s_add ? a + b
+                   : numop == s_min ? (b < a ? b : a)
+                   :                  (b > a ? b : a);
+        memcpy (out, &r, 8);
+    }
+    return 8;
+}
+
+static size_t
+s_append (const void *old_val, size_t old_size,
+          const void *operand, size_t operand_size,
+          void *out, size_t out_size)
+{
+    size_t size = (old_val ? old_size : 0) + operand_size;
+    if (out_size < size)
+        return size;
+    if (old_val)
+        memcpy (out, old_val, old_size);
+    memcpy ((byte *) out + (old_val ? old_size : 0), operand, operand_size);
+    return size;
+}
+
+// Byte by byte; the shorter side counts as zero bytes past its end
+static size_t
+s_or (const void *old_val, size_t old_size,
+      const void *operand, size_t operand_size,
+      void *out, size_t out_size)
+{
+    if (!old_val)
+        old_size = 0;
+    size_t size = old_size > operand_size ? old_size : operand_size;
+    if (out_size < size)
+        return size;
+
+    const byte *a = (const byte *) old_val;
+    const byte *b = (const byte *) operand;
+    byte *r = (byte *) out;
+    size_t i;
+    for (i = 0; i < size; i++)
+        r [i] = (i < old_size ? a [i] : 0) | (i < operand_size ? b [i] : 0);
+    return size;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Create a new lmdbmerge
+
+lmdbmerge_t *
+lmdbmerge_new (void)
+{
+    lmdbmerge_t *self = (lmdbmerge_t *) lmdballoc_zmalloc (sizeof (lmdbmerge_t));
+    assert (self);
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the lmdbmerge
+
+void
+lmdbmerge_destroy (lmdbmerge_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        lmdbmerge_t *self = *self_p;
+        lmdballoc_free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Operators
+
+int
+lmdbmerge_add (lmdbmerge_t *self, lmdbdbi_merge_fn fn, void *arg)
+{
+    assert (self);
+    assert (fn);
+    if (self->user_count == LMDBMERGE_MAX_USER)
+        return -1;
+    self->user [self->user_count] = (s_op_t) { .fn = fn, .arg = arg };
+    return LMDBDBI_MERGE_USER + (int) self->user_count++;
+}
+
+size_t
+lmdbmerge_apply (lmdbmerge_t *self, int op,
+                 const void *old_val, size_t old_size,
+                 const void *operand, size_t operand_size,
+                 void *out, size_t out_size)
+{
+    assert (self);
+    assert (operand || !operand_size);
+    assert (out || !out_size);
+
+    switch (op) {
+        case LMDBDBI_MERGE_ADD_I64:
+            return s_numeric ('i', s_add, old_val, old_size, operand, operand_size, out, out_size);
+        case LMDBDBI_MERGE_ADD_U64:
+            return s_numeric ('u', s_add, old_val, old_size, operand, operand_size, out, out_size);
+        case LMDBDBI_MERGE_ADD_DOUBLE:
+            return s_numeric ('d', s_add, old_val, old_size, operand, operand_size, out, out_size);
+        case LMDBDBI_MERGE_MAX_I64:
+            return s_numeric ('i', s_max, old_val, old_size, operand, operand_size, out, out_size);
+        case LMDBDBI_MERGE_MIN_I64:
+            return s_numeric ('i', s_min, old_val, old_size, operand, operand_size, out, out_size);
+        case LMDBDBI_MERGE_MAX_U64:
+            return s_numeric ('u', s_max, old_val, old_size, operand, operand_size, out, out_size);
+        case LMDBDBI_MERGE_MIN_U64:
+            return s_numeric ('u', s_min, old_val, old_size, operand, operand_size, out, out_size);
+        case LMDBDBI_MERGE_MAX_DOUBLE:
+            return s_numeric ('d', s_max, old_val, old_size, operand, operand_size, out, out_size);
+        case LMDBDBI_MERGE_MIN_DOUBLE:
+            return s_numeric ('d', s_min, old_val, old_size, operand, operand_size, out, out_size);
+        case LMDBDBI_MERGE_APPEND:
+            return s_append (old_val, old_size, operand, operand_size, out, out_size);
+        case LMDBDBI_MERGE_OR:
+            return s_or (old_val, old_size, operand, operand_size, out, out_size);
+    }
+
+    if (op < LMDBDBI_MERGE_USER || op >= LMDBDBI_MERGE_USER + (int) self->user_count)
+        return SIZE_MAX;
+    s_op_t *user = &self->user [op - LMDBDBI_MERGE_USER];
+    return user->fn (old_val, old_size, operand, operand_size, out, out_size, user->arg);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+// Keeps the largest operand seen, by length
+static size_t
+s_test_longest (const void *old_val, size_t old_size,
+                const void *operand, size_t operand_size,
+                void *out, size_t out_size, void *arg)
+{
+    int *calls = (int *) arg;
+    (*calls)++;
+    if (old_val && old_size >= operand_size) {
+        if (out_size >= old_size)
+            memcpy (out, old_val, old_size);
+        return old_size;
+    }
+    if (out_size >= operand_size)
+        memcpy (out, operand, operand_size);
+    return operand_size;
+}
+
+void
+lmdbmerge_test (bool verbose)
+{
+    printf (" * lmdbmerge: ");
+
+    //  @selftest
+    lmdbmerge_t *merge = lmdbmerge_new ();
+    assert (merge);
+    byte out [64];
+
+    // Sizing calls write nothing
+    int64_t i64 = -5, j64 = 7, r64 = 0;
+    assert (lmdbmerge_apply (merge, LMDBDBI_MERGE_ADD_I64, &i64, 8, &j64, 8, NULL, 0) == 8);
+
+    assert (lmdbmerge_apply (merge, LMDBDBI_MERGE_ADD_I64, &i64, 8, &j64, 8, out, 8) == 8);
+    memcpy (&r64, out, 8);
+    assert (r64 == 2);
+    assert (lmdbmerge_apply (merge, LMDBDBI_MERGE_ADD_I64, NULL, 0, &j64, 8, out, 8) == 8);
+    memcpy (&r64, out, 8);
+    assert (r64 == 7);
+    assert (lmdbmerge_apply (merge, LMDBDBI_MERGE_MIN_I64, &i64, 8, &j64, 8, out, 8) == 8);
+    memcpy (&r64, out, 8);
+    assert (r64 == -5);
+    assert (lmdbmerge_apply (merge, LMDBDBI_MERGE_MAX_I64, &i64, 8, &j64, 8, out, 8) == 8);
+    memcpy (&r64, out, 8);
+    assert (r64 == 7);
+
+    // Signed and unsigned order differently
+    uint64_t u = UINT64_MAX, v = 1, ru = 0;
+    assert (lmdbmerge_apply (merge, LMDBDBI_MERGE_ADD_U64, &u, 8, &v, 8, out, 8) == 8);
+    memcpy (&ru, out, 8);
+    assert (ru == 0);
+    assert (lmdbmerge_apply (merge, LMDBDBI_MERGE_MAX_U64, &u, 8, &v, 8, out, 8) == 8);
+    memcpy (&ru, out, 8);
+    assert (ru == UINT64_MAX);
+    assert (lmdbmerge_apply (merge, LMDBDBI_MERGE_MAX_I64, &u, 8, &v, 8, out, 8) == 8);
+    memcpy (&ru, out, 8);
+    assert (ru == 1);
+
+    double d = 1.5, e = 2.25, rd = 0;
+    assert (lmdbmerge_apply (merge, LMDBDBI_MERGE_ADD_DOUBLE, &d, 8, &e, 8, out, 8) == 8);
+    memcpy (&rd, out, 8);
+    assert (rd == 3.75);
+    assert (lmdbmerge_apply (merge, LMDBDBI_MERGE_MIN_DOUBLE, &d, 8, &e, 8, out, 8) == 8);
+    memcpy (&rd, out, 8);
+    assert (rd == 1.5);
+    assert (lmdbmerge_apply (merge, LMDBDBI_MERGE_MAX_DOUBLE, NULL, 0, &e, 8, out, 8) == 8);
+    memcpy (&rd, out, 8);
+    assert (rd == 2.25);
+
+    // Numeric ops refuse values that aren't 8 bytes
+    assert (lmdbmerge_apply (merge, LMDBDBI_MERGE_ADD_I64, "abc", 3, &j64, 8, out, 8) == SIZE_MAX);
+    assert (lmdbmerge_apply (merge, LMDBDBI_MERGE_ADD_I64, &i64, 8, "abc", 3, out, 8) == SIZE_MAX);
+
+    assert (lmdbmerge_apply (merge, LMDBDBI_MERGE_APPEND, "abc", 3, "de", 2, out, 3) == 5);
+    assert (lmdbmerge_apply (merge, LMDBDBI_MERGE_APPEND, "abc", 3, "de", 2, out, 5) == 5);
+    assert (memcmp (out, "abcde", 5) == 0);
+    assert (lmdbmerge_apply (merge, LMDBDBI_MERGE_APPEND, NULL, 0, "de", 2, out, 5) == 2);
+    assert (memcmp (out, "de", 2) == 0);
+
+    byte a [] = { 0x01, 0x10 }, b [] = { 0x02, 0x20, 0x40 };
+    assert (lmdbmerge_apply (merge, LMDBDBI_MERGE_OR, a, 2, b, 3, out, 3) == 3);
+    assert (out [0] == 0x03 && out [1] == 0x30 && out [2] == 0x40);
+
+    // User operators
+    assert (lmdbmerge_apply (merge, LMDBDBI_MERGE_USER, NULL, 0, "x", 1, out, 1) == SIZE_MAX);
+    assert (lmdbmerge_apply (merge, 0, NULL, 0, "x", 1, out, 1) == SIZE_MAX);
+    int calls = 0;
+    int op = lmdbmerge_add (merge, s_test_longest, &calls);
+    assert (op == LMDBDBI_MERGE_USER);
+    assert (lmdbmerge_apply (merge, op, "abc", 3, "de", 2, out, 3) == 3);
+    assert (memcmp (out, "abc", 3) == 0);
+    assert (lmdbmerge_apply (merge, op, "abc", 3, "defg", 4, out, 4) == 4);
+    assert (memcmp (out, "defg", 4) == 0);
+    assert (calls == 2);
+
+    int i;
+    for (i = 1; i < LMDBMERGE_MAX_USER; i++)
+        assert (lmdbmerge_add (merge, s_test_longest, &calls) == LMDBDBI_MERGE_USER + i);
+    assert (lmdbmerge_add (merge, s_test_longest, &calls) == -1);
+
+    lmdbmerge_destroy (&merge);
+
+    if (verbose)
+        log ("Built in and user merge operators passed");
+    //  @end
+    printf ("OK\n");
+}
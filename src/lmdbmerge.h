@@ -0,0 +1,64 @@
+/*  =========================================================================
+    lmdbmerge - Merge operators applied by lmdbdbi_merge, built in and user registered
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+#ifndef LMDBMERGE_H_INCLUDED
+#define LMDBMERGE_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Most user operators one dbi can have
+#define LMDBMERGE_MAX_USER 64
+
+//  @warning THE FOLLOWING @INTERFACE BLOCK IS AUTO-GENERATED BY ZPROJECT
+//  @warning Please edit the model at "api/lmdbmerge.xml" to make changes.
+//  @interface
+//  This API is a draft, and may change without notice.
+#ifdef CLASSLMDB_BUILD_DRAFT_API
+//  *** Draft method, defined for internal use only ***
+//  Create a table holding just the built in LMDBDBI_MERGE_xxx operators.
+CLASSLMDB_PRIVATE lmdbmerge_t *
+    lmdbmerge_new (void);
+
+//  *** Draft method, defined for internal use only ***
+//  Destroy the lmdbmerge.
+CLASSLMDB_PRIVATE void
+    lmdbmerge_destroy (lmdbmerge_t **self_p);
+
+//  *** Draft method, defined for internal use only ***
+//  Register a user operator.
+//  Returns its op id, counting up from LMDBDBI_MERGE_USER, or -1 if the
+//  table is full.
+CLASSLMDB_PRIVATE int
+    lmdbmerge_add (lmdbmerge_t *self, lmdbdbi_merge_fn fn, void *arg);
+
+//  *** Draft method, defined for internal use only ***
+//  Merge operand into old_val (NULL if the key is absent) with operator
+//  op, writing the result to out if it's at most out_size bytes.
+//  Returns the size of the result, or SIZE_MAX if op is unknown or
+//  refuses the inputs.
+CLASSLMDB_PRIVATE size_t
+    lmdbmerge_apply (lmdbmerge_t *self, int op, const void *old_val, size_t old_size, const void *operand, size_t operand_size, void *out, size_t out_size);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+CLASSLMDB_PRIVATE void
+    lmdbmerge_test (bool verbose);
+
+#endif // CLASSLMDB_BUILD_DRAFT_API
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
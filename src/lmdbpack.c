@@ -0,0 +1,699 @@
+/*  =========================================================================
+    lmdbpack - Codec for the prefix-compressed blocks used by packed lmdbdbi's
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+/*
+@header
+    lmdbpack - Codec for the prefix-compressed blocks used by packed lmdbdbi's
+@discuss
+    A packed dbi stores runs of consecutive k/v pairs as one LMDB value (a
+    'block'), keyed by the largest key in the run. Block layout, with all
+    integers in native byte order:
+
+        uint16_t count
+        uint16_t prefix_size
+        uint16_t offsets [count]    -- start of each entry, from block start
+        prefix bytes                -- shared by every key in the block
+        entries                     -- varint suffix_size, varint val_size,
+                                       key suffix, value
+
+    The offset table lets us binary search a block in place, and values are
+    stored raw so lookups can hand out spans pointing straight into the map.
+    Values aren't aligned. Encoding splits runs that would make a block of
+    64KB or more, whatever size was asked for, so offsets fit 16 bits.
+@end
+*/
+
+#include "classlmdb_classes.h"
+
+#include "logging.h"
+
+//  Structure of our class
+
+typedef struct {
+    size_t key_offset;  // into self->keys
+    size_t key_size;
+    const void *val;    // not owned
+    size_t val_size;
+} s_entry_t;
+
+struct _lmdbpack_t {
+    // Decoded entries, in ascending key order
+    s_entry_t *entries;
+    size_t count;
+    size_t entries_max;
+
+    // Full copies of every key, back to back
+    byte *keys;
+    size_t keys_size;
+    size_t keys_max;
+
+    // Output of the last encode; piece i is bytes [piece_starts [i],
+    // piece_starts [i + 1]) and holds entries up to piece_lasts [i]
+    byte *encoded;
+    size_t encoded_max;
+    size_t *piece_starts;
+    size_t *piece_lasts;
+    size_t piece_count;
+    size_t pieces_max;
+};
+
+#define s_header_size 4
+
+// Offsets and the count are 16 bits, so whatever the target, a block's
+// entries stop short of this, leaving room for the largest prefix
+#define s_block_max (UINT16_MAX - LMDBPACK_MAX_KEY)
+
+
+//  --------------------------------------------------------------------------
+//  Helpers
+
+static size_t
+s_varint_size (size_t value)
+{
+    size_t size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+static size_t
+s_varint_put (byte *out, size_t value)
+{
+    size_t size = 0;
+    while (value >= 0x80) {
+        out [size++] = (byte) (value | 0x80);
+        value >>= 7;
+    }
+    out [size++] = (byte) value;
+    return size;
+}
+
+static const byte *
+s_varint_get (const byte *in, size_t *value)
+{
+    size_t result = 0;
+    int shift = 0;
+    while (*in & 0x80) {
+        result |= (size_t) (*in++ & 0x7F) << shift;
+        shift += 7;
+    }
+    result |= (size_t) *in++ << shift;
+    *value = result;
+    return in;
+}
+
+static uint16_t
+s_get16 (const byte *in)
+{
+    uint16_t value;
+    memcpy (&value, in, sizeof (value));
+    return value;
+}
+
+// Callers keep value in range: encode caps blocks at s_block_max
+static void
+s_put16 (byte *out, size_t value)
+{
+    assert (value <= UINT16_MAX);
+    uint16_t v = (uint16_t) value;
+    memcpy (out, &v, sizeof (v));
+}
+
+// LMDB's default ordering: memcmp, then shorter sorts first
+static int
+s_compare (const void *a, size_t a_size, const void *b, size_t b_size)
+{
+    size_t n = a_size < b_size ? a_size : b_size;
+    int rc = n ? memcmp (a, b, n) : 0;
+    if (rc)
+        return rc;
+    return a_size < b_size ? -1 : a_size > b_size;
+}
+
+// As s_compare, where b is given as a prefix and a suffix
+static int
+s_compare_split (const byte *a, size_t a_size,
+                 const byte *prefix, size_t prefix_size,
+                 const byte *suffix, size_t suffix_size)
+{
+    size_t n = a_size < prefix_size ? a_size : prefix_size;
+    int rc = n ? memcmp (a, prefix, n) : 0;
+    if (rc)
+        return rc;
+    if (a_size <= prefix_size)
+        return a_size == prefix_size + suffix_size ? 0 : -1;
+    return s_compare (a + prefix_size, a_size - prefix_size, suffix, suffix_size);
+}
+
+// Worst case bytes an entry adds to a block
+static size_t
+s_entry_cost (s_entry_t *entry)
+{
+    return sizeof (uint16_t)
+           + s_varint_size (entry->key_size) + s_varint_size (entry->val_size)
+           + entry->key_size + entry->val_size;
+}
+
+static const byte *
+s_entry_key (lmdbpack_t *self, size_t index)
+{
+    return self->keys + self->entries [index].key_offset;
+}
+
+// Index of first entry >= key
+static size_t
+s_search (lmdbpack_t *self, const void *key, size_t key_size, bool *exact)
+{
+    size_t lo = 0, hi = self->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int rc = s_compare (s_entry_key (self, mid), self->entries [mid].key_size,
+                            key, key_size);
+        if (rc < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *exact = lo < self->count
+             && s_compare (s_entry_key (self, lo), self->entries [lo].key_size,
+                           key, key_size) == 0;
+    return lo;
+}
+
+static void
+s_reserve (void **buf, size_t *max, size_t want, size_t elem_size)
+{
+    if (want <= *max)
+        return;
+    size_t new_max = *max ? *max * 2 : 16;
+    while (new_max < want)
+        new_max *= 2;
+    *buf = lmdballoc_realloc (*buf, new_max * elem_size);
+    assert (*buf);
+    *max = new_max;
+}
+
+// Copy a key into the key store and return its offset
+static size_t
+s_store_key (lmdbpack_t *self, const void *key, size_t key_size)
+{
+    s_reserve ((void **) &self->keys, &self->keys_max,
+               self->keys_size + key_size, 1);
+    size_t offset = self->keys_size;
+    memcpy (self->keys + offset, key, key_size);
+    self->keys_size += key_size;
+    return offset;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Create a new lmdbpack
+
+lmdbpack_t *
+lmdbpack_new (void)
+{
+    lmdbpack_t *self = (lmdbpack_t *) lmdballoc_zmalloc (sizeof (lmdbpack_t));
+    assert (self);
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the lmdbpack
+
+void
+lmdbpack_destroy (lmdbpack_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        lmdbpack_t *self = *self_p;
+
+        lmdballoc_free (self->entries);
+        lmdballoc_free (self->keys);
+        lmdballoc_free (self->encoded);
+        lmdballoc_free (self->piece_starts);
+        lmdballoc_free (self->piece_lasts);
+
+        lmdballoc_free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Building blocks
+
+void
+lmdbpack_reset (lmdbpack_t *self)
+{
+    assert (self);
+    self->count = 0;
+    self->keys_size = 0;
+    self->piece_count = 0;
+}
+
+int
+lmdbpack_load (lmdbpack_t *self, const void *block, size_t block_size)
+{
+    assert (self);
+    assert (block);
+
+    lmdbpack_reset (self);
+    if (block_size < s_header_size)
+        return -1;
+
+    const byte *data = (const byte *) block;
+    size_t count = s_get16 (data);
+    size_t prefix_size = s_get16 (data + 2);
+    size_t prefix_start = s_header_size + count * sizeof (uint16_t);
+    if (prefix_start + prefix_size > block_size)
+        return -1;
+    const byte *prefix = data + prefix_start;
+
+    s_reserve ((void **) &self->entries, &self->entries_max,
+               count, sizeof (s_entry_t));
+
+    size_t i;
+    for (i = 0; i < count; i++) {
+        size_t offset = s_get16 (data + s_header_size + i * sizeof (uint16_t));
+        if (offset >= block_size)
+            return -1;
+
+        size_t suffix_size, val_size;
+        const byte *pos = s_varint_get (data + offset, &suffix_size);
+        pos = s_varint_get (pos, &val_size);
+        if (pos + suffix_size + val_size > data + block_size
+        ||  prefix_size + suffix_size > LMDBPACK_MAX_KEY)
+            return -1;
+
+        s_entry_t *entry = &self->entries [i];
+        entry->key_offset = s_store_key (self, prefix, prefix_size);
+        s_store_key (self, pos, suffix_size);
+        entry->key_size = prefix_size + suffix_size;
+        entry->val = pos + suffix_size;
+        entry->val_size = val_size;
+    }
+    self->count = count;
+    return 0;
+}
+
+bool
+lmdbpack_insert (lmdbpack_t *self, const void *key, size_t key_size,
+                 const void *val, size_t val_size)
+{
+    assert (self);
+    assert (key);
+    assert (key_size <= LMDBPACK_MAX_KEY);
+    assert (val_size <= LMDBPACK_MAX_VALUE);
+
+    bool exact;
+    size_t pos = s_search (self, key, key_size, &exact);
+    if (exact) {
+        self->entries [pos].val = val;
+        self->entries [pos].val_size = val_size;
+        return true;
+    }
+
+    s_reserve ((void **) &self->entries, &self->entries_max,
+               self->count + 1, sizeof (s_entry_t));
+    memmove (&self->entries [pos + 1], &self->entries [pos],
+             (self->count - pos) * sizeof (s_entry_t));
+    self->count++;
+
+    s_entry_t *entry = &self->entries [pos];
+    entry->key_offset = s_store_key (self, key, key_size);
+    entry->key_size = key_size;
+    entry->val = val;
+    entry->val_size = val_size;
+    return false;
+}
+
+bool
+lmdbpack_remove (lmdbpack_t *self, const void *key, size_t key_size)
+{
+    assert (self);
+    assert (key);
+
+    bool exact;
+    size_t pos = s_search (self, key, key_size, &exact);
+    if (!exact)
+        return false;
+
+    // The key bytes are left in the store; they go on the next load
+    memmove (&self->entries [pos], &self->entries [pos + 1],
+             (self->count - pos - 1) * sizeof (s_entry_t));
+    self->count--;
+    return true;
+}
+
+size_t
+lmdbpack_count (lmdbpack_t *self)
+{
+    assert (self);
+    return self->count;
+}
+
+size_t
+lmdbpack_encoded_size (lmdbpack_t *self)
+{
+    assert (self);
+    size_t size = s_header_size;
+    size_t i;
+    for (i = 0; i < self->count; i++)
+        size += s_entry_cost (&self->entries [i]);
+    return size;
+}
+
+// Append a block holding entries [first, last] to the encode buffer
+static void
+s_encode_piece (lmdbpack_t *self, size_t first, size_t last, size_t *out_pos)
+{
+    const byte *first_key = s_entry_key (self, first);
+    const byte *last_key = s_entry_key (self, last);
+    size_t first_size = self->entries [first].key_size;
+    size_t last_size = self->entries [last].key_size;
+
+    // Keys are sorted, so the first and last share the prefix of the lot
+    size_t prefix_size = 0;
+    while (prefix_size < first_size && prefix_size < last_size
+       &&  first_key [prefix_size] == last_key [prefix_size])
+        prefix_size++;
+
+    size_t count = last - first + 1;
+    size_t max_size = s_header_size + prefix_size;
+    size_t i;
+    for (i = first; i <= last; i++)
+        max_size += s_entry_cost (&self->entries [i]);
+    s_reserve ((void **) &self->encoded, &self->encoded_max,
+               *out_pos + max_size, 1);
+
+    byte *block = self->encoded + *out_pos;
+    s_put16 (block, count);
+    s_put16 (block + 2, prefix_size);
+    size_t pos = s_header_size + count * sizeof (uint16_t);
+    memcpy (block + pos, first_key, prefix_size);
+    pos += prefix_size;
+
+    for (i = first; i <= last; i++) {
+        s_entry_t *entry = &self->entries [i];
+        size_t suffix_size = entry->key_size - prefix_size;
+        s_put16 (block + s_header_size + (i - first) * sizeof (uint16_t), pos);
+        pos += s_varint_put (block + pos, suffix_size);
+        pos += s_varint_put (block + pos, entry->val_size);
+        memcpy (block + pos, s_entry_key (self, i) + prefix_size, suffix_size);
+        pos += suffix_size;
+        if (entry->val_size)
+            memcpy (block + pos, entry->val, entry->val_size);
+        pos += entry->val_size;
+    }
+    *out_pos += pos;
+}
+
+size_t
+lmdbpack_encode (lmdbpack_t *self, size_t piece_target)
+{
+    assert (self);
+    self->piece_count = 0;
+
+    size_t out_pos = 0;
+    size_t i = 0;
+    while (i < self->count) {
+        size_t first = i;
+        size_t size = s_header_size;
+        while (i < self->count) {
+            size_t cost = s_entry_cost (&self->entries [i]);
+            if (i > first
+            && (size + cost > piece_target || size + cost > s_block_max))
+                break;
+            size += cost;
+            i++;
+        }
+
+        // piece_lasts is always grown alongside piece_starts
+        size_t old_max = self->pieces_max;
+        s_reserve ((void **) &self->piece_starts, &self->pieces_max,
+                   self->piece_count + 2, sizeof (size_t));
+        if (self->pieces_max != old_max) {
+            self->piece_lasts = (size_t *) lmdballoc_realloc (self->piece_lasts,
+                                                    self->pieces_max * sizeof (size_t));
+            assert (self->piece_lasts);
+        }
+
+        self->piece_starts [self->piece_count] = out_pos;
+        self->piece_lasts [self->piece_count] = i - 1;
+        s_encode_piece (self, first, i - 1, &out_pos);
+        self->piece_count++;
+        self->piece_starts [self->piece_count] = out_pos;
+    }
+    return self->piece_count;
+}
+
+lmdbspan
+lmdbpack_piece (lmdbpack_t *self, size_t index)
+{
+    assert (self);
+    assert (index < self->piece_count);
+    size_t start = self->piece_starts [index];
+    return (lmdbspan){ .data = self->encoded + start,
+                       .size = self->piece_starts [index + 1] - start };
+}
+
+lmdbspan
+lmdbpack_piece_maxkey (lmdbpack_t *self, size_t index)
+{
+    assert (self);
+    assert (index < self->piece_count);
+    size_t last = self->piece_lasts [index];
+    return (lmdbspan){ .data = s_entry_key (self, last),
+                       .size = self->entries [last].key_size };
+}
+
+
+//  --------------------------------------------------------------------------
+//  Reading encoded blocks in place
+
+size_t
+lmdbpack_block_count (const void *block)
+{
+    assert (block);
+    return s_get16 ((const byte *) block);
+}
+
+// Locate the parts of an entry inside a block
+static void
+s_block_parts (const byte *block, size_t index,
+               const byte **suffix, size_t *suffix_size,
+               const byte **val, size_t *val_size)
+{
+    size_t offset = s_get16 (block + s_header_size + index * sizeof (uint16_t));
+    const byte *pos = s_varint_get (block + offset, suffix_size);
+    pos = s_varint_get (pos, val_size);
+    *suffix = pos;
+    *val = pos + *suffix_size;
+}
+
+size_t
+lmdbpack_block_search (const void *block, const void *key, size_t key_size,
+                       bool *exact)
+{
+    assert (block);
+    assert (key);
+    assert (exact);
+
+    const byte *data = (const byte *) block;
+    size_t count = s_get16 (data);
+    size_t prefix_size = s_get16 (data + 2);
+    const byte *prefix = data + s_header_size + count * sizeof (uint16_t);
+
+    size_t lo = 0, hi = count;
+    int rc = 1;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const byte *suffix, *val;
+        size_t suffix_size, val_size;
+        s_block_parts (data, mid, &suffix, &suffix_size, &val, &val_size);
+        int mid_rc = s_compare_split ((const byte *) key, key_size,
+                                      prefix, prefix_size, suffix, suffix_size);
+        if (mid_rc > 0)
+            lo = mid + 1;
+        else {
+            hi = mid;
+            rc = mid_rc;
+        }
+    }
+    *exact = lo < count && rc == 0;
+    return lo;
+}
+
+lmdbspan
+lmdbpack_block_entry (const void *block, size_t index,
+                      void *keybuf, size_t *key_size)
+{
+    assert (block);
+
+    const byte *data = (const byte *) block;
+    size_t count = s_get16 (data);
+    assert (index < count);
+    size_t prefix_size = s_get16 (data + 2);
+    const byte *prefix = data + s_header_size + count * sizeof (uint16_t);
+
+    const byte *suffix, *val;
+    size_t suffix_size, val_size;
+    s_block_parts (data, index, &suffix, &suffix_size, &val, &val_size);
+
+    if (keybuf) {
+        assert (key_size);
+        memcpy (keybuf, prefix, prefix_size);
+        memcpy ((byte *) keybuf + prefix_size, suffix, suffix_size);
+        *key_size = prefix_size + suffix_size;
+    }
+    return (lmdbspan){ .data = val, .size = val_size };
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+lmdbpack_test (bool verbose)
+{
+    printf (" * lmdbpack: ");
+
+    //  @selftest
+    char keybuf [LMDBPACK_MAX_KEY];
+    size_t key_size = 0;
+    bool exact = false;
+
+    lmdbpack_t *pack = lmdbpack_new ();
+    assert (pack);
+
+    // Insert out of order, plus one replacement
+    const char *keys [] = { "user:0003", "user:0001", "user:0002", "user:0010" };
+    const char *vals [] = { "three", "one", "two", "ten" };
+    size_t i;
+    for (i = 0; i < 4; i++)
+        assert (! lmdbpack_insert (pack, keys [i], strlen (keys [i]) + 1,
+                                   vals [i], strlen (vals [i]) + 1));
+    assert (lmdbpack_insert (pack, "user:0002", 10, "TWO", 4));
+    assert (lmdbpack_count (pack) == 4);
+
+    // One block, shared prefix, searchable in place
+    size_t pieces = lmdbpack_encode (pack, 4096);
+    assert (pieces == 1);
+    lmdbspan block = lmdbpack_piece (pack, 0);
+    assert (block.size < lmdbpack_encoded_size (pack));
+    assert (lmdbpack_block_count (block.data) == 4);
+    lmdbspan maxkey = lmdbpack_piece_maxkey (pack, 0);
+    assert (streq ((const char *) maxkey.data, "user:0010"));
+
+    size_t pos = lmdbpack_block_search (block.data, "user:0002", 10, &exact);
+    assert (exact && pos == 1);
+    lmdbspan val = lmdbpack_block_entry (block.data, pos, keybuf, &key_size);
+    assert (streq ((const char *) val.data, "TWO"));
+    assert (key_size == 10 && streq (keybuf, "user:0002"));
+
+    pos = lmdbpack_block_search (block.data, "user:0004", 10, &exact);
+    assert (!exact && pos == 3);
+    pos = lmdbpack_block_search (block.data, "user", 5, &exact);
+    assert (!exact && pos == 0);
+    pos = lmdbpack_block_search (block.data, "user:", 5, &exact);
+    assert (!exact && pos == 0);
+    pos = lmdbpack_block_search (block.data, "zzz", 4, &exact);
+    assert (!exact && pos == 4);
+    if (verbose)
+        log ("Block encode and in-place search passed");
+
+    // Reload from the encoded copy and remove an entry
+    byte *copy = (byte *) malloc (block.size);
+    assert (copy);
+    memcpy (copy, block.data, block.size);
+    int rc = lmdbpack_load (pack, copy, block.size);
+    assert (!rc);
+    assert (lmdbpack_count (pack) == 4);
+    assert (lmdbpack_remove (pack, "user:0001", 10));
+    assert (! lmdbpack_remove (pack, "user:0001", 10));
+    pieces = lmdbpack_encode (pack, 4096);
+    assert (pieces == 1);
+    lmdbspan reblock = lmdbpack_piece (pack, 0);
+    assert (lmdbpack_block_count (reblock.data) == 3);
+    lmdbspan reval = lmdbpack_block_entry (reblock.data, 0, keybuf, &key_size);
+    assert (streq (keybuf, "user:0002") && streq ((const char *) reval.data, "TWO"));
+    free (copy);
+
+    rc = lmdbpack_load (pack, "x", 1);
+    assert (rc == -1);
+    if (verbose)
+        log ("Block reload passed");
+
+    // Many entries split into several blocks, each under the target
+    uint32_t value = 0;
+    for (i = 0; i < 500; i++) {
+        char key [32];
+        snprintf (key, sizeof (key), "key:%06d", (int) i);
+        lmdbpack_insert (pack, key, strlen (key) + 1, &value, sizeof (value));
+    }
+    pieces = lmdbpack_encode (pack, 1024);
+    assert (pieces > 1);
+    size_t total = 0;
+    for (i = 0; i < pieces; i++) {
+        lmdbspan piece = lmdbpack_piece (pack, i);
+        assert (piece.size <= 1024);
+        size_t n = lmdbpack_block_count (piece.data);
+        total += n;
+
+        // Block's maxkey matches its last entry
+        lmdbpack_block_entry (piece.data, n - 1, keybuf, &key_size);
+        lmdbspan piece_maxkey = lmdbpack_piece_maxkey (pack, i);
+        assert (piece_maxkey.size == key_size);
+        assert (memcmp (piece_maxkey.data, keybuf, key_size) == 0);
+    }
+    assert (total == lmdbpack_count (pack));
+    if (verbose)
+        log ("Block splitting passed");
+
+    // Blocks stay within 16 bit offsets, however large the target
+    lmdbpack_reset (pack);
+    byte *big = (byte *) zmalloc (10 * LMDBPACK_MAX_VALUE);
+    assert (big);
+    for (i = 0; i < 10; i++) {
+        char key [32];
+        snprintf (key, sizeof (key), "big:%02d", (int) i);
+        big [i * LMDBPACK_MAX_VALUE] = (byte) i;
+        lmdbpack_insert (pack, key, strlen (key) + 1,
+                         big + i * LMDBPACK_MAX_VALUE, LMDBPACK_MAX_VALUE);
+    }
+    pieces = lmdbpack_encode (pack, SIZE_MAX);
+    assert (pieces >= 3);
+    total = 0;
+    for (i = 0; i < pieces; i++) {
+        lmdbspan piece = lmdbpack_piece (pack, i);
+        assert (piece.size <= UINT16_MAX);
+        size_t n = lmdbpack_block_count (piece.data);
+        size_t j;
+        for (j = 0; j < n; j++) {
+            lmdbspan bigval = lmdbpack_block_entry (piece.data, j, keybuf, &key_size);
+            assert (bigval.size == LMDBPACK_MAX_VALUE);
+            assert (((const byte *) bigval.data) [0] == (byte) (total + j));
+        }
+        total += n;
+    }
+    assert (total == 10);
+    free (big);
+    if (verbose)
+        log ("Block size cap passed");
+
+    lmdbpack_destroy (&pack);
+    //  @end
+
+    printf ("OK\n");
+}
@@ -0,0 +1,126 @@
+/*  =========================================================================
+    lmdbpack - Codec for the prefix-compressed blocks used by packed lmdbdbi's
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+#ifndef LMDBPACK_H_INCLUDED
+#define LMDBPACK_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Largest key we can hold, matching LMDB's default max key size
+#define LMDBPACK_MAX_KEY 511
+
+//  Largest value we will store in a packed block
+#define LMDBPACK_MAX_VALUE 16384
+
+//  @warning THE FOLLOWING @INTERFACE BLOCK IS AUTO-GENERATED BY ZPROJECT
+//  @warning Please edit the model at "api/lmdbpack.xml" to make changes.
+//  @interface
+//  This API is a draft, and may change without notice.
+#ifdef CLASSLMDB_BUILD_DRAFT_API
+//  *** Draft method, defined for internal use only ***
+//  Create an empty block builder.
+CLASSLMDB_PRIVATE lmdbpack_t *
+    lmdbpack_new (void);
+
+//  *** Draft method, defined for internal use only ***
+//  Destroy the lmdbpack.
+CLASSLMDB_PRIVATE void
+    lmdbpack_destroy (lmdbpack_t **self_p);
+
+//  *** Draft method, defined for internal use only ***
+//  Remove all entries.
+CLASSLMDB_PRIVATE void
+    lmdbpack_reset (lmdbpack_t *self);
+
+//  *** Draft method, defined for internal use only ***
+//  Replace the builder's contents with the entries of an encoded block.
+//  Values are not copied, so the block must stay valid until the builder
+//  has been encoded.
+//  Returns 0 on success, -1 if the block is malformed.
+CLASSLMDB_PRIVATE int
+    lmdbpack_load (lmdbpack_t *self, const void *block, size_t block_size);
+
+//  *** Draft method, defined for internal use only ***
+//  Insert a key/val pair, replacing the value if the key already exists.
+//  The key is copied, the value is not.
+//  Returns true if an existing key was replaced.
+CLASSLMDB_PRIVATE bool
+    lmdbpack_insert (lmdbpack_t *self, const void *key, size_t key_size, const void *val, size_t val_size);
+
+//  *** Draft method, defined for internal use only ***
+//  Remove the entry with the given key.
+//  Returns true if the key was present.
+CLASSLMDB_PRIVATE bool
+    lmdbpack_remove (lmdbpack_t *self, const void *key, size_t key_size);
+
+//  *** Draft method, defined for internal use only ***
+//  Number of entries currently in the builder.
+CLASSLMDB_PRIVATE size_t
+    lmdbpack_count (lmdbpack_t *self);
+
+//  *** Draft method, defined for internal use only ***
+//  Encode the entries into one or more blocks, starting a new block
+//  whenever the current one would grow beyond piece_target bytes.
+//  Any previously encoded pieces are discarded.
+//  Returns the number of blocks produced.
+CLASSLMDB_PRIVATE size_t
+    lmdbpack_encode (lmdbpack_t *self, size_t piece_target);
+
+//  *** Draft method, defined for internal use only ***
+//  Return the i'th encoded block. Valid until the next encode or load.
+CLASSLMDB_PRIVATE lmdbspan
+    lmdbpack_piece (lmdbpack_t *self, size_t index);
+
+//  *** Draft method, defined for internal use only ***
+//  Return the largest key in the i'th encoded block, which is the key the
+//  block is stored under.
+CLASSLMDB_PRIVATE lmdbspan
+    lmdbpack_piece_maxkey (lmdbpack_t *self, size_t index);
+
+//  *** Draft method, defined for internal use only ***
+//  Upper bound on the total size of encoding every entry as a single block.
+CLASSLMDB_PRIVATE size_t
+    lmdbpack_encoded_size (lmdbpack_t *self);
+
+//  *** Draft method, defined for internal use only ***
+//  Number of entries in an encoded block.
+CLASSLMDB_PRIVATE size_t
+    lmdbpack_block_count (const void *block);
+
+//  *** Draft method, defined for internal use only ***
+//  Find the position of the first entry whose key is greater than or equal
+//  to the given key, setting *exact if the keys are equal.
+//  Returns the entry count if all keys in the block are smaller.
+CLASSLMDB_PRIVATE size_t
+    lmdbpack_block_search (const void *block, const void *key, size_t key_size, bool *exact);
+
+//  *** Draft method, defined for internal use only ***
+//  Return the value of the index'th entry in an encoded block, pointing
+//  into the block. If keybuf is not NULL, the full key is written there
+//  (it must hold LMDBPACK_MAX_KEY bytes) and its size stored in *key_size.
+CLASSLMDB_PRIVATE lmdbspan
+    lmdbpack_block_entry (const void *block, size_t index, void *keybuf, size_t *key_size);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+CLASSLMDB_PRIVATE void
+    lmdbpack_test (bool verbose);
+
+#endif // CLASSLMDB_BUILD_DRAFT_API
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,602 @@
+/*  =========================================================================
+    lmdbrepl - Streams an lmdbdbi's change log to replicas over ZeroMQ
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+/*
+@header
+    lmdbrepl - Streams an lmdbdbi's change log to replicas over ZeroMQ
+@discuss
+    Subscribers pull: each sends a REQ for the changes after the last one
+    it applied, and the publisher's REP socket answers with the next batch
+    straight from the log. So the publisher keeps no state per subscriber,
+    any number can share one endpoint, and a subscriber that restarts or
+    reconnects just asks again from where its own txns say it got to.
+
+    Wire format, every number 8 bytes big endian:
+        request:  "LMDBREPL1", first seq wanted
+        reply:    newest seq in the log, then (seq, log entry) frame pairs
+    A subscriber asks again straight away while the reply says there's
+    more, and otherwise waits a little between polls.
+@end
+*/
+
+#include "classlmdb_classes.h"
+
+#include <stdatomic.h>
+
+#include "logging.h"
+
+#define s_protocol "LMDBREPL1"
+#define s_state_key "seq"
+
+// Keep batches, and so the replica's write txns, modest
+#define s_batch_max_entries 1000
+#define s_batch_max_bytes (1024 * 1024)
+
+// How long a caught up subscriber waits before polling again, and for a
+// reply before giving up on the connection and making a new one
+#define s_idle_msecs 20
+#define s_reply_timeout_msecs 2000
+
+//  Structure of our class
+
+struct _lmdbrepl_t {
+    lmdbenv_t *env;
+    lmdbdbi_t *dbi;
+    char *endpoint;
+
+    // Publishers only: bound here, then handed to the actor
+    zsock_t *rep;
+
+    // Subscribers only: how far we've got, updated with each batch
+    lmdbdbi_t *state_dbi;
+
+    atomic_uint_fast64_t seq;
+    atomic_bool out_of_sync;
+    zactor_t *actor;
+};
+
+
+//  --------------------------------------------------------------------------
+//  Helpers
+
+static void
+s_put_be64 (byte *buf, uint64_t value)
+{
+    int i;
+    for (i = 7; i >= 0; i--, value >>= 8)
+        buf [i] = (byte) value;
+}
+
+static uint64_t
+s_get_be64 (const byte *buf)
+{
+    uint64_t value = 0;
+    int i;
+    for (i = 0; i < 8; i++)
+        value = (value << 8) | buf [i];
+    return value;
+}
+
+// Returns true if the actor was told to stop
+static bool
+s_pipe_terminated (zsock_t *pipe)
+{
+    char *command = zstr_recv (pipe);
+    bool terminated = !command || streq (command, "$TERM");
+    zstr_free (&command);
+    return terminated;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Publishing
+
+// Answer a request with the log entries from the seq it asks for on, up
+// to our batch limits
+static zmsg_t *
+s_read_batch (lmdbrepl_t *self, zmsg_t *request)
+{
+    zmsg_t *reply = zmsg_new ();
+    assert (reply);
+    byte seq_bytes [8];
+
+    lmdbtxn_t *txn = lmdbtxn_new_rdonly (self->env);
+    uint64_t newest = txn ? lmdbdbi_log_seq (self->dbi, txn) : 0;
+    s_put_be64 (seq_bytes, newest);
+    zmsg_addmem (reply, seq_bytes, 8);
+
+    zframe_t *proto = zmsg_first (request);
+    zframe_t *from = zmsg_next (request);
+    MDB_cursor *cur = NULL;
+    if (!txn || !proto || !from
+    ||  zframe_size (proto) != strlen (s_protocol)
+    ||  memcmp (zframe_data (proto), s_protocol, strlen (s_protocol))
+    ||  zframe_size (from) != 8
+    ||  mdb_cursor_open (lmdbtxn_handle (txn),
+                         lmdbdbi_handle (lmdbdbi_log_dbi (self->dbi)), &cur))
+        goto done;
+
+    MDB_val mkey = {.mv_data = zframe_data (from), .mv_size = 8};
+    MDB_val mval;
+    size_t entries = 0, bytes = 0;
+    int err = mdb_cursor_get (cur, &mkey, &mval, MDB_SET_RANGE);
+    while (err == 0 && entries < s_batch_max_entries && bytes < s_batch_max_bytes) {
+        // A key that isn't a sequence number isn't a log entry
+        if (mkey.mv_size != 8)
+            break;
+        zmsg_addmem (reply, mkey.mv_data, mkey.mv_size);
+        zmsg_addmem (reply, mval.mv_data, mval.mv_size);
+        atomic_store_explicit (&self->seq, s_get_be64 ((const byte *) mkey.mv_data),
+                               memory_order_relaxed);
+        entries++;
+        bytes += mval.mv_size;
+        err = mdb_cursor_get (cur, &mkey, &mval, MDB_NEXT);
+    }
+
+ done:
+    if (cur)
+        mdb_cursor_close (cur);
+    lmdbtxn_destroy (&txn);
+    return reply;
+}
+
+static void
+s_publisher_actor (zsock_t *pipe, void *args)
+{
+    lmdbrepl_t *self = (lmdbrepl_t *) args;
+    zsock_t *rep = self->rep;
+    self->rep = NULL;
+    zpoller_t *poller = zpoller_new (pipe, rep, NULL);
+    assert (poller);
+    zsock_signal (pipe, 0);
+
+    while (true) {
+        void *which = zpoller_wait (poller, -1);
+        if (which == pipe) {
+            if (s_pipe_terminated (pipe))
+                break;
+        }
+        else
+        if (which == rep) {
+            zmsg_t *request = zmsg_recv (rep);
+            if (!request)
+                continue;
+            zmsg_t *reply = s_read_batch (self, request);
+            zmsg_destroy (&request);
+            zmsg_send (&reply, rep);
+        }
+        else
+            break;
+    }
+    zpoller_destroy (&poller);
+    zsock_destroy (&rep);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Subscribing
+
+static zsock_t *
+s_req_new (lmdbrepl_t *self)
+{
+    zsock_t *req = zsock_new_req (self->endpoint);
+    assert (req);
+    // Don't hang on to unanswered requests once we've given up on them
+    zsock_set_linger (req, 0);
+    return req;
+}
+
+static void
+s_send_request (lmdbrepl_t *self, zsock_t *req)
+{
+    byte from [8];
+    s_put_be64 (from, atomic_load_explicit (&self->seq, memory_order_relaxed) + 1);
+    zmsg_t *request = zmsg_new ();
+    assert (request);
+    zmsg_addmem (request, s_protocol, strlen (s_protocol));
+    zmsg_addmem (request, from, 8);
+    zmsg_send (&request, req);
+}
+
+// Apply a reply's entries in one txn. Sets *more if the publisher has
+// more for us. Returns 0 on success, -1 on failure.
+static int
+s_apply_batch (lmdbrepl_t *self, zmsg_t *reply, bool *more)
+{
+    *more = false;
+    zframe_t *frame = zmsg_first (reply);
+    if (!frame || zframe_size (frame) != 8)
+        return -1;
+    uint64_t newest = s_get_be64 (zframe_data (frame));
+    uint64_t seq = atomic_load_explicit (&self->seq, memory_order_relaxed);
+
+    // A primary behind us has been replaced, and its log is another one
+    if (newest < seq) {
+        atomic_store (&self->out_of_sync, true);
+        return -1;
+    }
+    frame = zmsg_next (reply);
+    if (!frame)
+        return 0;
+
+    lmdbtxn_t *txn = lmdbtxn_new_rdrw (self->env);
+    if (!txn)
+        return -1;
+    for (; frame; frame = zmsg_next (reply)) {
+        zframe_t *entry = zmsg_next (reply);
+        if (!entry || zframe_size (frame) != 8)
+            goto die;
+
+        // We may be sent entries twice after reconnecting
+        uint64_t entry_seq = s_get_be64 (zframe_data (frame));
+        if (entry_seq <= seq)
+            continue;
+
+        // The ones between were trimmed before we got them
+        if (entry_seq != seq + 1) {
+            atomic_store (&self->out_of_sync, true);
+            goto die;
+        }
+        if (lmdbdbi_log_apply (self->dbi, txn, zframe_data (entry), zframe_size (entry)))
+            goto die;
+        seq = entry_seq;
+    }
+
+    byte seq_bytes [8];
+    s_put_be64 (seq_bytes, seq);
+    if (lmdbdbi_put_str (self->state_dbi, txn, s_state_key, seq_bytes, 8)
+    ||  lmdbtxn_commit (txn))
+        goto die;
+    lmdbtxn_destroy (&txn);
+
+    atomic_store_explicit (&self->seq, seq, memory_order_relaxed);
+    *more = newest > seq;
+    return 0;
+
+ die:
+    lmdbtxn_destroy (&txn);
+    return -1;
+}
+
+static void
+s_subscriber_actor (zsock_t *pipe, void *args)
+{
+    lmdbrepl_t *self = (lmdbrepl_t *) args;
+    zsock_t *req = s_req_new (self);
+    zpoller_t *poller = zpoller_new (pipe, req, NULL);
+    assert (poller);
+    zsock_signal (pipe, 0);
+
+    // Timing out while waiting means the reply's late; otherwise it's
+    // time to ask for more
+    bool waiting = false;
+    int timeout = 0;
+    while (true) {
+        void *which = zpoller_wait (poller, timeout);
+        if (which == pipe) {
+            if (s_pipe_terminated (pipe))
+                break;
+        }
+        else
+        if (which == req) {
+            zmsg_t *reply = zmsg_recv (req);
+            waiting = false;
+            bool more = false;
+            if (reply)
+                s_apply_batch (self, reply, &more);
+            zmsg_destroy (&reply);
+
+            // Once out of sync we just wait to be destroyed
+            if (atomic_load (&self->out_of_sync))
+                timeout = -1;
+            else
+                timeout = more ? 0 : s_idle_msecs;
+        }
+        else
+        if (!zpoller_expired (poller))
+            break;
+        else {
+            // A REQ socket can't ask again until it's answered, so start
+            // over with a new one
+            if (waiting) {
+                zpoller_remove (poller, req);
+                zsock_destroy (&req);
+                req = s_req_new (self);
+                zpoller_add (poller, req);
+            }
+            s_send_request (self, req);
+            waiting = true;
+            timeout = s_reply_timeout_msecs;
+        }
+    }
+    zpoller_destroy (&poller);
+    zsock_destroy (&req);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Create a new lmdbrepl
+
+static lmdbrepl_t *
+s_new (lmdbenv_t *env, lmdbdbi_t *dbi, const char *endpoint)
+{
+    lmdbrepl_t *self = (lmdbrepl_t *) lmdballoc_zmalloc (sizeof (lmdbrepl_t));
+    assert (self);
+    self->env = env;
+    self->dbi = dbi;
+    self->endpoint = lmdballoc_strdup (endpoint);
+    assert (self->endpoint);
+    atomic_init (&self->seq, 0);
+    atomic_init (&self->out_of_sync, false);
+    return self;
+}
+
+lmdbrepl_t *
+lmdbrepl_new_publisher (lmdbenv_t *env, lmdbdbi_t *dbi, const char *endpoint)
+{
+    assert (env);
+    assert (dbi);
+    assert (endpoint);
+    if (!lmdbdbi_log_dbi (dbi))
+        return NULL;
+
+    lmdbrepl_t *self = s_new (env, dbi, endpoint);
+    self->rep = zsock_new_rep (endpoint);
+    if (!self->rep)
+        goto die;
+    self->actor = zactor_new (s_publisher_actor, self);
+    if (!self->actor)
+        goto die;
+    return self;
+
+ die:
+    zsock_destroy (&self->rep);
+    lmdbrepl_destroy (&self);
+    return NULL;
+}
+
+lmdbrepl_t *
+lmdbrepl_new_subscriber (lmdbenv_t *env, lmdbdbi_t *dbi, const char *endpoint)
+{
+    assert (env);
+    assert (dbi);
+    assert (endpoint);
+    if (!lmdbdbi_name (dbi))
+        return NULL;
+
+    lmdbrepl_t *self = s_new (env, dbi, endpoint);
+    char *state_name = zsys_sprintf ("%s.repl", lmdbdbi_name (dbi));
+    self->state_dbi = lmdbdbi_new (env, state_name);
+    zstr_free (&state_name);
+    if (!self->state_dbi)
+        goto die;
+
+    // Carry on from where we got to last time
+    lmdbtxn_t *txn = lmdbtxn_new_rdonly (env);
+    if (!txn)
+        goto die;
+    lmdbspan state = lmdbdbi_get_str (self->state_dbi, txn, s_state_key);
+    if (lmdbspan_size (state) == 8)
+        atomic_store (&self->seq, s_get_be64 ((const byte *) state.data));
+    lmdbtxn_destroy (&txn);
+
+    self->actor = zactor_new (s_subscriber_actor, self);
+    if (!self->actor)
+        goto die;
+    return self;
+
+ die:
+    lmdbrepl_destroy (&self);
+    return NULL;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the lmdbrepl
+
+void
+lmdbrepl_destroy (lmdbrepl_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        lmdbrepl_t *self = *self_p;
+        zactor_destroy (&self->actor);
+        lmdbdbi_destroy (&self->state_dbi);
+        lmdballoc_free (self->endpoint);
+        lmdballoc_free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Accessors
+
+uint64_t
+lmdbrepl_seq (lmdbrepl_t *self)
+{
+    assert (self);
+    return atomic_load_explicit (&self->seq, memory_order_relaxed);
+}
+
+bool
+lmdbrepl_out_of_sync (lmdbrepl_t *self)
+{
+    assert (self);
+    return atomic_load (&self->out_of_sync);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+// Wait for a subscriber to apply up to seq; false if it doesn't in time
+static bool
+s_test_wait_for (lmdbrepl_t *sub, uint64_t seq)
+{
+    int64_t deadline = zclock_mono () + 5000;
+    while (lmdbrepl_seq (sub) < seq && zclock_mono () < deadline)
+        zclock_sleep (5);
+    return lmdbrepl_seq (sub) == seq;
+}
+
+static lmdbenv_t *
+s_test_env (const char *dir, const char *file)
+{
+    char *test_db_path = zsys_sprintf ("%s/%s", dir, file);
+    if (zsys_file_exists (test_db_path))
+        zsys_file_delete (test_db_path);
+    lmdbenv_t *env = lmdbenv_new (test_db_path);
+    assert (env);
+    zstr_free (&test_db_path);
+    return env;
+}
+
+void
+lmdbrepl_test (bool verbose)
+{
+    printf (" * lmdbrepl: ");
+
+    //  @selftest
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+    assert (SELFTEST_DIR_RW);
+    const char *endpoint = "inproc://lmdbrepl-selftest";
+
+    lmdbenv_t *primary_env = s_test_env (SELFTEST_DIR_RW, "LMDBREPL_TEST_PRIMARY.db");
+    lmdbenv_t *replica_env = s_test_env (SELFTEST_DIR_RW, "LMDBREPL_TEST_REPLICA.db");
+    lmdbdbi_t *primary = lmdbdbi_new (primary_env, "users");
+    assert (primary);
+    lmdbdbi_t *replica = lmdbdbi_new (replica_env, "users");
+    assert (replica);
+
+    // No log, nothing to publish
+    assert (lmdbrepl_new_publisher (primary_env, primary, endpoint) == NULL);
+    int rc = lmdbdbi_enable_log (primary, primary_env);
+    assert (rc == 0);
+
+    // 100 puts and 10 dels before anyone's listening
+    lmdbtxn_t *txn = lmdbtxn_new_rdrw (primary_env);
+    assert (txn);
+    uint32_t i;
+    for (i = 0; i < 100; i++) {
+        rc = lmdbdbi_put_ui32 (primary, txn, i, &i, sizeof (i));
+        assert (rc == 0);
+    }
+    for (i = 0; i < 100; i += 10) {
+        rc = lmdbdbi_del (primary, txn, &i, sizeof (i));
+        assert (rc == 0);
+    }
+    assert (lmdbdbi_log_seq (primary, txn) == 110);
+    rc = lmdbtxn_commit (txn);
+    assert (rc == 0);
+    lmdbtxn_destroy (&txn);
+
+    lmdbrepl_t *pub = lmdbrepl_new_publisher (primary_env, primary, endpoint);
+    assert (pub);
+    lmdbrepl_t *sub = lmdbrepl_new_subscriber (replica_env, replica, endpoint);
+    assert (sub);
+    assert (s_test_wait_for (sub, 110));
+
+    // Later changes stream across too, merges as the puts they made
+    txn = lmdbtxn_new_rdrw (primary_env);
+    assert (txn);
+    rc = lmdbdbi_put_strstr (primary, txn, "name", "primary");
+    assert (rc == 0);
+    uint64_t one = 1;
+    rc = lmdbdbi_merge (primary, txn, "hits", 5, LMDBDBI_MERGE_ADD_U64, &one, 8);
+    assert (rc == 0);
+    rc = lmdbdbi_merge (primary, txn, "hits", 5, LMDBDBI_MERGE_ADD_U64, &one, 8);
+    assert (rc == 0);
+    rc = lmdbtxn_commit (txn);
+    assert (rc == 0);
+    lmdbtxn_destroy (&txn);
+    assert (s_test_wait_for (sub, 113));
+    assert (lmdbrepl_seq (pub) == 113);
+
+    txn = lmdbtxn_new_rdonly (replica_env);
+    assert (txn);
+    for (i = 0; i < 100; i++) {
+        lmdbspan val = lmdbdbi_get (replica, txn, &i, sizeof (i));
+        if (i % 10 == 0)
+            assert (! lmdbspan_valid (val));
+        else
+            assert (lmdbspan_size (val) == sizeof (i) && memcmp (val.data, &i, sizeof (i)) == 0);
+    }
+    assert (streq (lmdbspan_asstr (lmdbdbi_get_str (replica, txn, "name")), "primary"));
+    lmdbspan hits = lmdbdbi_get_str (replica, txn, "hits");
+    assert (lmdbspan_size (hits) == 8 && memcmp (hits.data, &(uint64_t) {2}, 8) == 0);
+    lmdbtxn_destroy (&txn);
+
+    // A restarted subscriber carries on where it left off
+    lmdbrepl_destroy (&sub);
+    txn = lmdbtxn_new_rdrw (primary_env);
+    assert (txn);
+    rc = lmdbdbi_put_strstr (primary, txn, "name", "changed");
+    assert (rc == 0);
+    rc = lmdbtxn_commit (txn);
+    assert (rc == 0);
+    lmdbtxn_destroy (&txn);
+    sub = lmdbrepl_new_subscriber (replica_env, replica, endpoint);
+    assert (sub);
+    assert (lmdbrepl_seq (sub) >= 113);
+    assert (s_test_wait_for (sub, 114));
+    lmdbrepl_destroy (&sub);
+
+    txn = lmdbtxn_new_rdonly (replica_env);
+    assert (txn);
+    assert (streq (lmdbspan_asstr (lmdbdbi_get_str (replica, txn, "name")), "changed"));
+    lmdbtxn_destroy (&txn);
+
+    // Trimming keeps the newest entry; a new replica can't catch up now
+    rc = lmdbdbi_trim_log (primary, primary_env, 1000);
+    assert (rc == 113);
+    lmdbenv_t *late_env = s_test_env (SELFTEST_DIR_RW, "LMDBREPL_TEST_LATE.db");
+    lmdbdbi_t *late = lmdbdbi_new (late_env, "users");
+    assert (late);
+    sub = lmdbrepl_new_subscriber (late_env, late, endpoint);
+    assert (sub);
+    int64_t deadline = zclock_mono () + 5000;
+    while (! lmdbrepl_out_of_sync (sub) && zclock_mono () < deadline)
+        zclock_sleep (5);
+    assert (lmdbrepl_out_of_sync (sub));
+    assert (lmdbrepl_seq (sub) == 0);
+    lmdbrepl_destroy (&sub);
+
+    // A key in the log that isn't a sequence number fails the trim, and
+    // entries that don't parse aren't applied
+    txn = lmdbtxn_new_rdrw (primary_env);
+    assert (txn);
+    byte foreign = 0;
+    rc = lmdbdbi_put (lmdbdbi_log_dbi (primary), txn, &foreign, 1, "?", 1);
+    assert (rc == 0);
+    rc = lmdbtxn_commit (txn);
+    assert (rc == 0);
+    lmdbtxn_destroy (&txn);
+    assert (lmdbdbi_trim_log (primary, primary_env, 1000) == -1);
+    txn = lmdbtxn_new_rdrw (replica_env);
+    assert (txn);
+    assert (lmdbdbi_log_apply (replica, txn, "p\0\0\0\xff", 5) == -1);
+    assert (lmdbdbi_log_apply (replica, txn, "p\0", 2) == -1);
+    lmdbtxn_destroy (&txn);
+
+    lmdbrepl_destroy (&pub);
+    lmdbdbi_destroy (&late);
+    lmdbdbi_destroy (&replica);
+    lmdbdbi_destroy (&primary);
+    lmdbenv_destroy (&late_env);
+    lmdbenv_destroy (&replica_env);
+    lmdbenv_destroy (&primary_env);
+
+    if (verbose)
+        log ("Replicated puts, dels and merges, and spotted a gap");
+    //  @end
+    printf ("OK\n");
+}
@@ -0,0 +1,529 @@
+/*  =========================================================================
+    lmdbsnapshot - Leased read-only view of an env, for reads spread over many calls
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+/*
+@header
+    lmdbsnapshot - Leased read-only view of an env, for reads spread over many calls
+@discuss
+    Paging through a scan with a new read txn per page can show a record
+    twice, or skip it, if it moves between pages; holding one txn for as
+    long as a client might come back stops LMDB reusing any page freed
+    since, and the file grows. A snapshot holds the txn only while it's
+    being used: each use extends its lease, and once that runs out the
+    txn is released, and later pages fail cleanly rather than showing
+    different data.
+
+    The env keeps a list of its snapshots, so they can be found by id and
+    reaped without the caller keeping track. Reaping frees them too, so
+    the list only ever holds those still in use, however many clients
+    walk away mid scan. Ids are never reused, which makes an id a safe
+    way to hold on to a snapshot that might be reaped: finding it again
+    fails, rather than turning up a later snapshot. Tokens are the
+    snapshot's id and txnid, both 8 byte big endian, then the key to
+    carry on from.
+@end
+*/
+
+#include "classlmdb_classes.h"
+
+#include "logging.h"
+
+//  Structure of our class
+
+struct _lmdbsnapshot_t {
+    lmdbenv_t *env;
+    lmdbsnapshot_t *next;   // In the env's list
+
+    // NULL once the lease has run out, until it's reaped
+    lmdbtxn_t *txn;
+    uint64_t id;
+    uint64_t txnid;
+
+    int lease_msecs;
+    int64_t expires_at;     // zclock_mono() time
+};
+
+static size_t
+s_token_header = 16;
+
+
+//  --------------------------------------------------------------------------
+//  Helpers
+
+static void
+s_put_be64 (byte *out, uint64_t value)
+{
+    int i;
+    for (i = 7; i >= 0; i--) {
+        out [i] = (byte) value;
+        value >>= 8;
+    }
+}
+
+static uint64_t
+s_get_be64 (const byte *in)
+{
+    uint64_t value = 0;
+    int i;
+    for (i = 0; i < 8; i++)
+        value = (value << 8) | in [i];
+    return value;
+}
+
+// Leases are read and extended with the env's snapshot lock held
+
+static void
+s_touch (lmdbsnapshot_t *self)
+{
+    if (self->lease_msecs > 0)
+        self->expires_at = zclock_mono () + self->lease_msecs;
+}
+
+static bool
+s_expired (lmdbsnapshot_t *self)
+{
+    return self->lease_msecs > 0 && zclock_mono () >= self->expires_at;
+}
+
+// Unlink and free env's snapshots that have run out; call with the lock held
+static size_t
+s_reap (lmdbenv_t *env)
+{
+    size_t reaped = 0;
+    lmdbsnapshot_t **link = lmdbenv_snapshots (env);
+    while (*link) {
+        lmdbsnapshot_t *snapshot = *link;
+        if (snapshot->txn && !s_expired (snapshot))
+            link = &snapshot->next;
+        else {
+            *link = snapshot->next;
+            lmdbtxn_destroy (&snapshot->txn);
+            lmdballoc_free (snapshot);
+            reaped++;
+        }
+    }
+    return reaped;
+}
+
+// Find a live snapshot of env by id, extending its lease; call with the
+// lock held
+static lmdbsnapshot_t *
+s_find (lmdbenv_t *env, uint64_t id)
+{
+    s_reap (env);
+    lmdbsnapshot_t *snapshot = *lmdbenv_snapshots (env);
+    while (snapshot && snapshot->id != id)
+        snapshot = snapshot->next;
+    if (!snapshot || !snapshot->txn)
+        return NULL;
+    s_touch (snapshot);
+    return snapshot;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Create a new lmdbsnapshot
+
+lmdbsnapshot_t *
+lmdbsnapshot_new (lmdbenv_t *env, int lease_msecs)
+{
+    assert (env);
+    if (lease_msecs < 0)
+        return NULL;
+
+    // Reap first, in case it frees the reader slot we need
+    lmdbsnapshot_reap (env);
+
+    lmdbsnapshot_t *self = (lmdbsnapshot_t *) lmdballoc_zmalloc (sizeof (lmdbsnapshot_t));
+    assert (self);
+    self->env = env;
+    self->lease_msecs = lease_msecs;
+    self->txn = lmdbtxn_new_rdonly (env);
+    if (!self->txn) {
+        lmdballoc_free (self);
+        return NULL;
+    }
+    self->txnid = mdb_txn_id (lmdbtxn_handle (self->txn));
+    s_touch (self);
+
+    lmdbenv_lock_snapshots (env);
+    self->id = lmdbenv_next_snapshot_id (env);
+    lmdbsnapshot_t **snapshots = lmdbenv_snapshots (env);
+    self->next = *snapshots;
+    *snapshots = self;
+    lmdbenv_unlock_snapshots (env);
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the lmdbsnapshot
+
+void
+lmdbsnapshot_destroy (lmdbsnapshot_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        lmdbsnapshot_t *self = *self_p;
+
+        lmdbenv_lock_snapshots (self->env);
+        lmdbsnapshot_t **link = lmdbenv_snapshots (self->env);
+        while (*link != self)
+            link = &(*link)->next;
+        *link = self->next;
+        lmdbenv_unlock_snapshots (self->env);
+
+        lmdbtxn_destroy (&self->txn);
+        lmdballoc_free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Finding and reaping
+
+lmdbsnapshot_t *
+lmdbsnapshot_find (lmdbenv_t *env, uint64_t id)
+{
+    assert (env);
+    lmdbenv_lock_snapshots (env);
+    lmdbsnapshot_t *snapshot = s_find (env, id);
+    lmdbenv_unlock_snapshots (env);
+    return snapshot;
+}
+
+size_t
+lmdbsnapshot_reap (lmdbenv_t *env)
+{
+    assert (env);
+    lmdbenv_lock_snapshots (env);
+    size_t reaped = s_reap (env);
+    lmdbenv_unlock_snapshots (env);
+    return reaped;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Reading
+
+lmdbtxn_t *
+lmdbsnapshot_txn (lmdbsnapshot_t *self)
+{
+    assert (self);
+    lmdbenv_lock_snapshots (self->env);
+    if (self->txn && s_expired (self))
+        lmdbtxn_destroy (&self->txn);
+    lmdbtxn_t *txn = self->txn;
+    if (txn)
+        s_touch (self);
+    lmdbenv_unlock_snapshots (self->env);
+    return txn;
+}
+
+bool
+lmdbsnapshot_expired (lmdbsnapshot_t *self)
+{
+    assert (self);
+    lmdbenv_lock_snapshots (self->env);
+    bool expired = s_expired (self);
+    lmdbenv_unlock_snapshots (self->env);
+    return expired;
+}
+
+uint64_t
+lmdbsnapshot_id (lmdbsnapshot_t *self)
+{
+    assert (self);
+    return self->id;
+}
+
+uint64_t
+lmdbsnapshot_txnid (lmdbsnapshot_t *self)
+{
+    assert (self);
+    return self->txnid;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Continuation tokens
+
+size_t
+lmdbsnapshot_token (lmdbsnapshot_t *self, lmdbspan key, void *buf, size_t buf_size)
+{
+    assert (self);
+    assert (buf);
+    size_t key_size = lmdbspan_valid (key) ? key.size : 0;
+    if (buf_size < s_token_header + key_size)
+        return 0;
+    byte *out = (byte *) buf;
+    s_put_be64 (out, self->id);
+    s_put_be64 (out + 8, self->txnid);
+    if (key_size)
+        memcpy (out + s_token_header, key.data, key_size);
+    return s_token_header + key_size;
+}
+
+lmdbcur_t *
+lmdbsnapshot_resume (lmdbenv_t *env, lmdbdbi_t *dbi, const void *token, size_t token_size)
+{
+    assert (env);
+    assert (dbi);
+    assert (token);
+    if (token_size < s_token_header)
+        return NULL;
+
+    // Ids restart with the process, so check the data is the same too.
+    // Held until the cursor's open, so no other thread reaps the txn first.
+    const byte *in = (const byte *) token;
+    lmdbcur_t *cur = NULL;
+    lmdbenv_lock_snapshots (env);
+    lmdbsnapshot_t *snapshot = s_find (env, s_get_be64 (in));
+    if (snapshot && snapshot->txnid == s_get_be64 (in + 8)) {
+        if (token_size == s_token_header)
+            cur = lmdbcur_new_overall (dbi, snapshot->txn);
+        else
+            cur = lmdbcur_new_gekey (dbi, snapshot->txn, in + s_token_header,
+                                     token_size - s_token_header);
+    }
+    lmdbenv_unlock_snapshots (env);
+    return cur;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+// Reads up to page_size records of a page through cur, which may be NULL
+// for a scan that's finished; checks they're the next keys expected, and
+// writes a token for the rest to token. Returns the token's size, or 0 if
+// the scan's done.
+static size_t
+s_test_page (lmdbsnapshot_t *snapshot, lmdbcur_t *cur, int *next_expected,
+             size_t page_size, byte *token, size_t token_size)
+{
+    size_t count = 0;
+    size_t written = 0;
+    while (cur && lmdbspan_valid (lmdbcur_key (cur))) {
+        if (count == page_size) {
+            written = lmdbsnapshot_token (snapshot, lmdbcur_key (cur), token, token_size);
+            assert (written);
+            break;
+        }
+        char expected [16];
+        snprintf (expected, sizeof (expected), "key-%03d", (*next_expected)++);
+        assert (streq (lmdbspan_asstr (lmdbcur_key (cur)), expected));
+        count++;
+        if (lmdbcur_next (cur))
+            break;
+    }
+    return written;
+}
+
+// Opens snapshots, abandoning some and destroying the rest, while other
+// threads do the same on the env
+static void
+s_test_snapshotter (zsock_t *pipe, void *args)
+{
+    lmdbenv_t *env = (lmdbenv_t *) args;
+    zsock_signal (pipe, 0);
+    int i;
+    for (i = 0; i < 200; i++) {
+        // Left for whichever thread's call reaps it
+        lmdbsnapshot_new (env, 1);
+
+        // Reader slots can run short while abandoned ones wait to be reaped
+        lmdbsnapshot_t *kept = lmdbsnapshot_new (env, 0);
+        if (!kept)
+            continue;
+        assert (lmdbsnapshot_find (env, lmdbsnapshot_id (kept)) == kept);
+        assert (lmdbsnapshot_txn (kept));
+        lmdbsnapshot_destroy (&kept);
+    }
+}
+
+void
+lmdbsnapshot_test (bool verbose)
+{
+    printf (" * lmdbsnapshot: ");
+
+    //  @selftest
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+    assert (SELFTEST_DIR_RW);
+
+    char *test_db_path = zsys_sprintf ("%s/%s", SELFTEST_DIR_RW, "LMDBSNAPSHOT_TEST.db");
+    if (zsys_file_exists (test_db_path))
+        zsys_file_delete (test_db_path);
+    lmdbenv_t *env = lmdbenv_new_threaded (test_db_path, 1 << 24, 10, 0);
+    assert (env);
+    zstr_free (&test_db_path);
+
+    lmdbdbi_t *dbi = lmdbdbi_new (env, "pages");
+    assert (dbi);
+    lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
+    assert (txn);
+    char key [16];
+    int i;
+    for (i = 0; i < 100; i++) {
+        snprintf (key, sizeof (key), "key-%03d", i);
+        int rc = lmdbdbi_put_strstr (dbi, txn, key, "value");
+        assert (rc == 0);
+    }
+    int rc = lmdbtxn_commit (txn);
+    assert (rc == 0);
+    lmdbtxn_destroy (&txn);
+
+    {
+        //  Page through in tens, writing between pages: every page comes
+        //  from the snapshot, so we see exactly the original keys
+        lmdbsnapshot_t *snapshot = lmdbsnapshot_new (env, 10000);
+        assert (snapshot);
+        assert (lmdbsnapshot_find (env, lmdbsnapshot_id (snapshot)) == snapshot);
+        uint64_t txnid = lmdbsnapshot_txnid (snapshot);
+
+        byte token [64];
+        int next_expected = 0;
+        lmdbcur_t *cur = lmdbcur_new_overall (dbi, lmdbsnapshot_txn (snapshot));
+        assert (cur);
+        size_t token_size = s_test_page (snapshot, cur, &next_expected, 10,
+                                         token, sizeof (token));
+        lmdbcur_destroy (&cur);
+        assert (token_size == 16 + strlen ("key-010") + 1);
+
+        int pages = 1;
+        while (token_size) {
+            txn = lmdbtxn_new_rdrw (env);
+            snprintf (key, sizeof (key), "key-%03d", next_expected);
+            rc = lmdbdbi_del (dbi, txn, key, strlen (key) + 1);
+            assert (rc == 0);
+            snprintf (key, sizeof (key), "key-%03d", 100 + pages);
+            rc = lmdbdbi_put_strstr (dbi, txn, key, "value");
+            assert (rc == 0);
+            rc = lmdbtxn_commit (txn);
+            assert (rc == 0);
+            lmdbtxn_destroy (&txn);
+
+            cur = lmdbsnapshot_resume (env, dbi, token, token_size);
+            assert (cur);
+            token_size = s_test_page (snapshot, cur, &next_expected, 10,
+                                      token, sizeof (token));
+            lmdbcur_destroy (&cur);
+            pages++;
+        }
+        assert (pages == 10);
+        assert (next_expected == 100);
+
+        //  A new snapshot sees the writes
+        lmdbsnapshot_t *later = lmdbsnapshot_new (env, 0);
+        assert (later);
+        assert (lmdbsnapshot_id (later) != lmdbsnapshot_id (snapshot));
+        assert (lmdbsnapshot_txnid (later) > txnid);
+        assert (!lmdbspan_valid (lmdbdbi_get_str (dbi, lmdbsnapshot_txn (later), "key-010")));
+        assert (lmdbspan_valid (lmdbdbi_get_str (dbi, lmdbsnapshot_txn (snapshot), "key-010")));
+
+        //  Tokens only resume in their own snapshot
+        assert (lmdbsnapshot_token (later, lmdbspan_makenull (), token, 15) == 0);
+        token_size = lmdbsnapshot_token (later, lmdbspan_makenull (), token, sizeof (token));
+        assert (token_size == 16);
+        cur = lmdbsnapshot_resume (env, dbi, token, token_size);
+        assert (cur);
+        assert (streq (lmdbspan_asstr (lmdbcur_key (cur)), "key-000"));
+        lmdbcur_destroy (&cur);
+        token [15] ^= 1;
+        assert (lmdbsnapshot_resume (env, dbi, token, token_size) == NULL);
+        assert (lmdbsnapshot_resume (env, dbi, token, 8) == NULL);
+
+        lmdbsnapshot_destroy (&snapshot);
+        assert (snapshot == NULL);
+        lmdbsnapshot_destroy (&later);
+    }
+
+    {
+        //  Snapshots nobody uses are reaped once their lease runs out;
+        //  used ones aren't
+        lmdbsnapshot_t *abandoned = lmdbsnapshot_new (env, 50);
+        lmdbsnapshot_t *used = lmdbsnapshot_new (env, 200);
+        lmdbsnapshot_t *forever = lmdbsnapshot_new (env, 0);
+        assert (abandoned && used && forever);
+        uint64_t abandoned_id = lmdbsnapshot_id (abandoned);
+        byte token [32];
+        size_t token_size = lmdbsnapshot_token (abandoned, lmdbspan_makenull (),
+                                                token, sizeof (token));
+        assert (token_size);
+
+        for (i = 0; i < 8; i++) {
+            zclock_sleep (20);
+            assert (lmdbsnapshot_txn (used));
+        }
+        assert (lmdbsnapshot_expired (abandoned));
+        assert (!lmdbsnapshot_expired (used));
+        assert (!lmdbsnapshot_expired (forever));
+        assert (lmdbsnapshot_reap (env) == 1);
+        assert (lmdbsnapshot_reap (env) == 0);
+        assert (lmdbsnapshot_find (env, abandoned_id) == NULL);
+        assert (lmdbsnapshot_resume (env, dbi, token, token_size) == NULL);
+        assert (lmdbsnapshot_txn (used));
+        assert (lmdbsnapshot_txn (forever));
+
+        //  abandoned was freed with its txn
+        lmdbsnapshot_destroy (&used);
+
+        //  forever goes with the env
+    }
+
+    {
+        //  However many are abandoned, the env only keeps those in use
+        uint64_t first_id = 0;
+        int round;
+        for (round = 0; round < 50; round++) {
+            for (i = 0; i < 5; i++) {
+                lmdbsnapshot_t *snapshot = lmdbsnapshot_new (env, 5);
+                assert (snapshot);
+                if (!first_id)
+                    first_id = lmdbsnapshot_id (snapshot);
+            }
+            size_t listed = 0;
+            lmdbsnapshot_t *snapshot = *lmdbenv_snapshots (env);
+            for (; snapshot; snapshot = snapshot->next)
+                listed++;
+            assert (listed <= 1 + 5);
+            zclock_sleep (10);
+        }
+        assert (lmdbsnapshot_reap (env) <= 5);
+        assert (lmdbsnapshot_find (env, first_id) == NULL);
+        assert (*lmdbenv_snapshots (env) && (*lmdbenv_snapshots (env))->next == NULL);
+    }
+
+    {
+        //  Threaded envs take snapshot calls from any thread
+        zactor_t *actors [4];
+        for (i = 0; i < 4; i++) {
+            actors [i] = zactor_new (s_test_snapshotter, env);
+            assert (actors [i]);
+        }
+        for (i = 0; i < 4; i++)
+            zactor_destroy (&actors [i]);
+        zclock_sleep (5);
+        lmdbsnapshot_reap (env);
+        assert (*lmdbenv_snapshots (env) && (*lmdbenv_snapshots (env))->next == NULL);
+    }
+
+    assert (lmdbsnapshot_new (env, -1) == NULL);
+
+    lmdbdbi_destroy (&dbi);
+    lmdbenv_destroy (&env);
+
+    if (verbose)
+        log ("Paged through a snapshot while writing, and reaped an abandoned one");
+    //  @end
+    printf ("OK\n");
+}
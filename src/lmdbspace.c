@@ -0,0 +1,649 @@
+/*  =========================================================================
+    lmdbspace - How the map's pages are used, and compacting it when too many are free
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+/*
+@header
+    lmdbspace - How the map's pages are used, and compacting it when too many are free
+@discuss
+    LMDB never shrinks its file. Pages freed by dels and by copy-on-write
+    go on the free list, kept in database 0, and are reused by later
+    commits, but a file that once held much more than it does now stays
+    that size, and its free pages end up scattered in short runs. A value
+    needing more consecutive pages than any run has then grows the file
+    even with plenty free.
+
+    lmdbspace_new reads the free list, and the page counts of the main
+    database and every named one, all in one read txn, and scores the
+    result: the share of the file that's free, and how fragmented that
+    free space is, from 0 when it's one run to nearly 1 when it's all
+    single pages. lmdbspace_needs_compact checks both scores against
+    thresholds.
+
+    An env can't swap its own file out from under its map, so compacting
+    is two steps. lmdbspace_compact writes a compacted copy while the env
+    stays open, readers carrying on, and lmdbspace_swap renames the copy
+    over the original once every env on it is destroyed, after which it's
+    reopened as usual.
+@end
+*/
+
+#include "classlmdb_classes.h"
+
+#include "logging.h"
+
+//  A named database's share
+
+typedef struct {
+    char *name;
+    uint64_t entries;
+    uint64_t pages;
+    uint64_t overflow_pages;
+} s_dbi_t;
+
+//  Structure of our class
+
+struct _lmdbspace_t {
+    size_t page_size;
+    uint64_t total_pages;
+    uint64_t live_pages;
+    uint64_t overflow_pages;
+
+    // Free page numbers, sorted once all are read
+    size_t *free;
+    size_t free_count;
+    size_t free_max;
+    uint64_t free_runs;
+    uint64_t largest_free_run;
+
+    s_dbi_t *dbis;
+    size_t dbi_count;
+    size_t dbi_max;
+};
+
+
+//  --------------------------------------------------------------------------
+//  Tallying
+
+static void
+s_add_stat (lmdbspace_t *self, const MDB_stat *stat)
+{
+    self->live_pages += stat->ms_branch_pages + stat->ms_leaf_pages
+                      + stat->ms_overflow_pages;
+    self->overflow_pages += stat->ms_overflow_pages;
+}
+
+// Add a free list value's page numbers: a count, then that many pages
+static int
+s_add_free (lmdbspace_t *self, const void *data, size_t size)
+{
+    size_t words = size / sizeof (size_t);
+    if (words == 0 || size % sizeof (size_t))
+        return -1;
+    size_t count;
+    memcpy (&count, data, sizeof (size_t));
+    if (count > words - 1)
+        return -1;
+
+    if (self->free_count + count > self->free_max) {
+        size_t max = self->free_max ? self->free_max : 256;
+        while (max < self->free_count + count)
+            max *= 2;
+        self->free = (size_t *) lmdballoc_realloc (self->free, max * sizeof (size_t));
+        assert (self->free);
+        self->free_max = max;
+    }
+    memcpy (self->free + self->free_count,
+            (const size_t *) data + 1, count * sizeof (size_t));
+    self->free_count += count;
+    return 0;
+}
+
+static int
+s_compare_pages (const void *a, const void *b)
+{
+    size_t pa = *(const size_t *) a;
+    size_t pb = *(const size_t *) b;
+    return pa < pb ? -1 : pa > pb;
+}
+
+static void
+s_count_runs (lmdbspace_t *self)
+{
+    self->free_runs = 0;
+    self->largest_free_run = 0;
+    if (self->free_count == 0)
+        return;
+
+    qsort (self->free, self->free_count, sizeof (size_t), s_compare_pages);
+    uint64_t run = 1;
+    self->free_runs = 1;
+    size_t i;
+    for (i = 1; i < self->free_count; i++) {
+        if (self->free [i] == self->free [i - 1] + 1)
+            run++;
+        else {
+            if (run > self->largest_free_run)
+                self->largest_free_run = run;
+            run = 1;
+            self->free_runs++;
+        }
+    }
+    if (run > self->largest_free_run)
+        self->largest_free_run = run;
+}
+
+static void
+s_add_dbi (lmdbspace_t *self, const char *name, const MDB_stat *stat)
+{
+    if (self->dbi_count == self->dbi_max) {
+        self->dbi_max = self->dbi_max ? self->dbi_max * 2 : 8;
+        self->dbis = (s_dbi_t *) lmdballoc_realloc (self->dbis, self->dbi_max * sizeof (s_dbi_t));
+        assert (self->dbis);
+    }
+    s_dbi_t *dbi = &self->dbis [self->dbi_count++];
+    dbi->name = lmdballoc_strdup (name);
+    assert (dbi->name);
+    dbi->entries = stat->ms_entries;
+    dbi->pages = stat->ms_branch_pages + stat->ms_leaf_pages + stat->ms_overflow_pages;
+    dbi->overflow_pages = stat->ms_overflow_pages;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Walking the env
+
+static int
+s_read_free_list (lmdbspace_t *self, MDB_txn *txn)
+{
+    MDB_stat stat;
+    if (mdb_stat (txn, 0, &stat))
+        return -1;
+    s_add_stat (self, &stat);
+
+    MDB_cursor *cur;
+    if (mdb_cursor_open (txn, 0, &cur))
+        return -1;
+    int rc = 0;
+    MDB_val key, val;
+    int mdb_rc = mdb_cursor_get (cur, &key, &val, MDB_FIRST);
+    while (mdb_rc == 0) {
+        if (s_add_free (self, val.mv_data, val.mv_size)) {
+            rc = -1;
+            break;
+        }
+        mdb_rc = mdb_cursor_get (cur, &key, &val, MDB_NEXT);
+    }
+    if (mdb_rc && mdb_rc != MDB_NOTFOUND)
+        rc = -1;
+    mdb_cursor_close (cur);
+    return rc;
+}
+
+// Named databases are keys in the main one. Those keys that aren't
+// names, because the main database holds data too, fail to open and are
+// skipped. Handles opened here are closed when the txn is aborted.
+static int
+s_read_dbis (lmdbspace_t *self, MDB_txn *txn)
+{
+    MDB_dbi main_dbi;
+    if (mdb_dbi_open (txn, NULL, 0, &main_dbi))
+        return -1;
+    MDB_stat stat;
+    if (mdb_stat (txn, main_dbi, &stat))
+        return -1;
+    s_add_stat (self, &stat);
+
+    MDB_cursor *cur;
+    if (mdb_cursor_open (txn, main_dbi, &cur))
+        return -1;
+    int rc = 0;
+    char *name = NULL;
+    size_t name_max = 0;
+    MDB_val key, val;
+    int mdb_rc = mdb_cursor_get (cur, &key, &val, MDB_FIRST);
+    while (mdb_rc == 0) {
+        if (key.mv_size > 0 && ! memchr (key.mv_data, 0, key.mv_size)) {
+            if (key.mv_size + 1 > name_max) {
+                name_max = key.mv_size + 1;
+                name = (char *) lmdballoc_realloc (name, name_max);
+                assert (name);
+            }
+            memcpy (name, key.mv_data, key.mv_size);
+            name [key.mv_size] = 0;
+
+            MDB_dbi dbi;
+            if (mdb_dbi_open (txn, name, 0, &dbi) == 0) {
+                if (mdb_stat (txn, dbi, &stat)) {
+                    rc = -1;
+                    break;
+                }
+                s_add_stat (self, &stat);
+                s_add_dbi (self, name, &stat);
+            }
+        }
+        mdb_rc = mdb_cursor_get (cur, &key, &val, MDB_NEXT);
+    }
+    if (mdb_rc && mdb_rc != MDB_NOTFOUND)
+        rc = -1;
+    lmdballoc_free (name);
+    mdb_cursor_close (cur);
+    return rc;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Create a new lmdbspace
+
+lmdbspace_t *
+lmdbspace_new (lmdbenv_t *env)
+{
+    assert (env);
+    lmdbspace_t *self = (lmdbspace_t *) lmdballoc_zmalloc (sizeof (lmdbspace_t));
+    assert (self);
+
+    lmdbtxn_t *txn = lmdbtxn_new_rdonly (env);
+    if (!txn)
+        goto die;
+    MDB_txn *handle = lmdbtxn_handle (txn);
+
+    MDB_envinfo info;
+    MDB_stat stat;
+    if (mdb_env_info (lmdbenv_handle (env), &info)
+    ||  mdb_stat (handle, 0, &stat))
+        goto die;
+    self->page_size = stat.ms_psize;
+    self->total_pages = (uint64_t) info.me_last_pgno + 1;
+
+    if (s_read_free_list (self, handle)
+    ||  s_read_dbis (self, handle))
+        goto die;
+    s_count_runs (self);
+
+    lmdbtxn_destroy (&txn);
+    return self;
+
+die:
+    lmdbtxn_destroy (&txn);
+    lmdbspace_destroy (&self);
+    return NULL;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the lmdbspace
+
+void
+lmdbspace_destroy (lmdbspace_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        lmdbspace_t *self = *self_p;
+
+        size_t i;
+        for (i = 0; i < self->dbi_count; i++)
+            lmdballoc_free (self->dbis [i].name);
+        lmdballoc_free (self->dbis);
+        lmdballoc_free (self->free);
+
+        lmdballoc_free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Pages
+
+size_t
+lmdbspace_page_size (lmdbspace_t *self)
+{
+    assert (self);
+    return self->page_size;
+}
+
+uint64_t
+lmdbspace_total_pages (lmdbspace_t *self)
+{
+    assert (self);
+    return self->total_pages;
+}
+
+uint64_t
+lmdbspace_live_pages (lmdbspace_t *self)
+{
+    assert (self);
+    return self->live_pages;
+}
+
+uint64_t
+lmdbspace_overflow_pages (lmdbspace_t *self)
+{
+    assert (self);
+    return self->overflow_pages;
+}
+
+uint64_t
+lmdbspace_free_pages (lmdbspace_t *self)
+{
+    assert (self);
+    return self->free_count;
+}
+
+uint64_t
+lmdbspace_free_runs (lmdbspace_t *self)
+{
+    assert (self);
+    return self->free_runs;
+}
+
+uint64_t
+lmdbspace_largest_free_run (lmdbspace_t *self)
+{
+    assert (self);
+    return self->largest_free_run;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Scores
+
+double
+lmdbspace_free_ratio (lmdbspace_t *self)
+{
+    assert (self);
+    if (self->total_pages == 0)
+        return 0;
+    return (double) self->free_count / (double) self->total_pages;
+}
+
+double
+lmdbspace_fragmentation (lmdbspace_t *self)
+{
+    assert (self);
+    if (self->free_count == 0)
+        return 0;
+    return 1 - (double) self->largest_free_run / (double) self->free_count;
+}
+
+bool
+lmdbspace_needs_compact (lmdbspace_t *self, double max_free_ratio, double max_fragmentation)
+{
+    assert (self);
+    if (self->free_count == 0)
+        return false;
+    if (max_free_ratio > 0 && lmdbspace_free_ratio (self) <= max_free_ratio)
+        return false;
+    if (max_fragmentation > 0 && lmdbspace_fragmentation (self) <= max_fragmentation)
+        return false;
+    return true;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Databases
+
+size_t
+lmdbspace_dbis (lmdbspace_t *self)
+{
+    assert (self);
+    return self->dbi_count;
+}
+
+const char *
+lmdbspace_dbi_name (lmdbspace_t *self, size_t index)
+{
+    assert (self);
+    return index < self->dbi_count ? self->dbis [index].name : NULL;
+}
+
+uint64_t
+lmdbspace_dbi_entries (lmdbspace_t *self, size_t index)
+{
+    assert (self);
+    return index < self->dbi_count ? self->dbis [index].entries : 0;
+}
+
+uint64_t
+lmdbspace_dbi_pages (lmdbspace_t *self, size_t index)
+{
+    assert (self);
+    return index < self->dbi_count ? self->dbis [index].pages : 0;
+}
+
+uint64_t
+lmdbspace_dbi_overflow_pages (lmdbspace_t *self, size_t index)
+{
+    assert (self);
+    return index < self->dbi_count ? self->dbis [index].overflow_pages : 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Compacting
+
+int
+lmdbspace_compact (lmdbenv_t *env, const char *path)
+{
+    assert (env);
+    assert (path);
+    int rc = -1;
+    char *tmp_path = zsys_sprintf ("%s.tmp", path);
+    assert (tmp_path);
+
+    // The copy reads a snapshot of its own, so holds off no one. We hold
+    // no txn, as in an env that isn't threaded the copy's read txn would
+    // be this thread's second.
+#if defined (__WINDOWS__)
+    if (zsys_file_exists (tmp_path))
+        zsys_file_delete (tmp_path);
+    if (mdb_env_copy2 (lmdbenv_handle (env), tmp_path, MDB_CP_COMPACT))
+        goto die;
+#else
+    int fd = open (tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        goto die;
+    if (mdb_env_copyfd2 (lmdbenv_handle (env), fd, MDB_CP_COMPACT)
+    ||  fsync (fd)) {
+        close (fd);
+        zsys_file_delete (tmp_path);
+        goto die;
+    }
+    close (fd);
+#endif
+    if (rename (tmp_path, path)) {
+        zsys_file_delete (tmp_path);
+        goto die;
+    }
+    rc = 0;
+
+die:
+    zstr_free (&tmp_path);
+    return rc;
+}
+
+int
+lmdbspace_swap (const char *path, const char *copy_path)
+{
+    assert (path);
+    assert (copy_path);
+    if (rename (copy_path, path))
+        return -1;
+
+    // The lock file's reader table describes the old file
+    char *lock_path = zsys_sprintf ("%s-lock", path);
+    assert (lock_path);
+    if (zsys_file_exists (lock_path))
+        zsys_file_delete (lock_path);
+    zstr_free (&lock_path);
+    return 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+// Build a free list value, a count then the pages, as LMDB stores them
+static size_t
+s_test_free_value (size_t *value, const size_t *pages, size_t count)
+{
+    value [0] = count;
+    memcpy (value + 1, pages, count * sizeof (size_t));
+    return (count + 1) * sizeof (size_t);
+}
+
+void
+lmdbspace_test (bool verbose)
+{
+    printf (" * lmdbspace: ");
+
+    //  @selftest
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+    assert (SELFTEST_DIR_RW);
+
+    char *test_db_path = zsys_sprintf ("%s/%s", SELFTEST_DIR_RW, "LMDBSPACE_TEST.db");
+    char *copy_path = zsys_sprintf ("%s/%s", SELFTEST_DIR_RW, "LMDBSPACE_COPY.db");
+    if (zsys_file_exists (test_db_path))
+        zsys_file_delete (test_db_path);
+    if (zsys_file_exists (copy_path))
+        zsys_file_delete (copy_path);
+    lmdbenv_t *env = lmdbenv_new (test_db_path);
+    assert (env);
+    lmdbdbi_t *dbi = lmdbdbi_new (env, "space");
+    assert (dbi);
+
+    lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
+    assert (txn);
+    uint32_t i;
+    for (i = 0; i < 1000; i++) {
+        char key [16];
+        snprintf (key, sizeof key, "key%04u", i);
+        int rc = lmdbdbi_put (dbi, txn, key, strlen (key), &i, sizeof i);
+        assert (rc == 0);
+    }
+    int rc = lmdbtxn_commit (txn);
+    assert (rc == 0);
+    lmdbtxn_destroy (&txn);
+
+    // A report of the whole env adds up
+    lmdbspace_t *space = lmdbspace_new (env);
+    assert (space);
+    assert (lmdbspace_page_size (space) >= 512);
+    assert (lmdbspace_total_pages (space) > 0);
+    assert (lmdbspace_live_pages (space) > 0);
+    assert (lmdbspace_live_pages (space) + lmdbspace_free_pages (space)
+            <= lmdbspace_total_pages (space));
+    assert (lmdbspace_overflow_pages (space) <= lmdbspace_live_pages (space));
+    assert (lmdbspace_largest_free_run (space) <= lmdbspace_free_pages (space));
+    assert (lmdbspace_free_ratio (space) >= 0 && lmdbspace_free_ratio (space) <= 1);
+    assert (lmdbspace_fragmentation (space) >= 0 && lmdbspace_fragmentation (space) < 1);
+    size_t index;
+    for (index = 0; index < lmdbspace_dbis (space); index++)
+        if (streq (lmdbspace_dbi_name (space, index), "space"))
+            assert (lmdbspace_dbi_entries (space, index) == 1000);
+    assert (! lmdbspace_dbi_name (space, lmdbspace_dbis (space)));
+    lmdbspace_destroy (&space);
+
+    // Runs and scores, from free list values built by hand
+    space = (lmdbspace_t *) lmdballoc_zmalloc (sizeof (lmdbspace_t));
+    assert (space);
+    space->total_pages = 100;
+    size_t value [16];
+    size_t pages_a [] = { 40, 12, 11, 10 };
+    size_t pages_b [] = { 43, 42, 41, 30, 20 };
+    rc = s_add_free (space, value, s_test_free_value (value, pages_a, 4));
+    assert (rc == 0);
+    rc = s_add_free (space, value, s_test_free_value (value, pages_b, 5));
+    assert (rc == 0);
+    value [0] = 99;
+    rc = s_add_free (space, value, 3 * sizeof (size_t));
+    assert (rc == -1);
+    rc = s_add_free (space, value, sizeof (size_t) + 1);
+    assert (rc == -1);
+    s_count_runs (space);
+    // 10-12, 20, 30, 40-43
+    assert (lmdbspace_free_pages (space) == 9);
+    assert (lmdbspace_free_runs (space) == 4);
+    assert (lmdbspace_largest_free_run (space) == 4);
+    assert (lmdbspace_free_ratio (space) > 0.089 && lmdbspace_free_ratio (space) < 0.091);
+    assert (lmdbspace_fragmentation (space) > 0.55 && lmdbspace_fragmentation (space) < 0.56);
+    assert (lmdbspace_needs_compact (space, 0.05, 0.5));
+    assert (! lmdbspace_needs_compact (space, 0.1, 0.5));
+    assert (! lmdbspace_needs_compact (space, 0.05, 0.6));
+    assert (lmdbspace_needs_compact (space, 0, 0.5));
+    lmdbspace_destroy (&space);
+
+    // Free most of the pages, compact to a copy, then swap it in once the
+    // env is gone: the file shrinks, and holds what's left
+    txn = lmdbtxn_new_rdrw (env);
+    assert (txn);
+    for (i = 100; i < 1000; i++) {
+        char key [16];
+        snprintf (key, sizeof key, "key%04u", i);
+        rc = lmdbdbi_del (dbi, txn, key, strlen (key));
+        assert (rc == 0);
+    }
+    rc = lmdbtxn_commit (txn);
+    assert (rc == 0);
+    lmdbtxn_destroy (&txn);
+
+    rc = lmdbspace_compact (env, copy_path);
+    assert (rc == 0);
+    assert (zsys_file_exists (copy_path));
+    char *tmp_path = zsys_sprintf ("%s.tmp", copy_path);
+    assert (! zsys_file_exists (tmp_path));
+    zstr_free (&tmp_path);
+
+    lmdbdbi_destroy (&dbi);
+    lmdbenv_destroy (&env);
+    ssize_t size_before = zsys_file_size (test_db_path);
+    assert (size_before > 0);
+    rc = lmdbspace_swap (test_db_path, copy_path);
+    assert (rc == 0);
+    assert (! zsys_file_exists (copy_path));
+    ssize_t size_after = zsys_file_size (test_db_path);
+    assert (size_after > 0 && size_after < size_before);
+    rc = lmdbspace_swap (test_db_path, copy_path);
+    assert (rc == -1);
+
+    env = lmdbenv_new (test_db_path);
+    assert (env);
+    dbi = lmdbdbi_new (env, "space");
+    assert (dbi);
+    txn = lmdbtxn_new_rdonly (env);
+    assert (txn);
+    for (i = 0; i < 1000; i += 37) {
+        char key [16];
+        snprintf (key, sizeof key, "key%04u", i);
+        lmdbspan val = lmdbdbi_get (dbi, txn, key, strlen (key));
+        if (i < 100)
+            assert (val.size == sizeof i && memcmp (val.data, &i, sizeof i) == 0);
+        else
+            assert (! lmdbspan_valid (val));
+    }
+    lmdbtxn_destroy (&txn);
+    space = lmdbspace_new (env);
+    assert (space);
+    for (index = 0; index < lmdbspace_dbis (space); index++)
+        if (streq (lmdbspace_dbi_name (space, index), "space"))
+            assert (lmdbspace_dbi_entries (space, index) == 100);
+    lmdbspace_destroy (&space);
+    lmdbdbi_destroy (&dbi);
+    lmdbenv_destroy (&env);
+    zsys_file_delete (test_db_path);
+
+    zstr_free (&copy_path);
+    zstr_free (&test_db_path);
+
+    if (verbose)
+        log ("Reported page use and compacted a copy");
+    //  @end
+    printf ("OK\n");
+}
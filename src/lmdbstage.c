@@ -0,0 +1,461 @@
+/*  =========================================================================
+    lmdbstage - Puts held back by a write lmdbtxn, to be written in key order
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+/*
+@header
+    lmdbstage - Puts held back by a write lmdbtxn, to be written in key order
+@discuss
+    Puts are copied one after another into big chunks, and a hash table
+    of (dbi, key) finds the latest for each key, for gets and so a key put
+    twice is written once. Sorting happens only when flushing: the entries
+    are sorted by dbi and then key, and put in that order, so each put
+    lands on or next to the pages the last one touched.
+
+    Dels are entries with no value, which flushing turns into a del if
+    the key is there to delete.
+
+    Intkeys dbis compare keys as numbers, so we do the same for them;
+    every other dbi compares bytes. Getting the order wrong would only
+    cost locality, never correctness.
+@end
+*/
+
+#include "classlmdb_classes.h"
+
+#include "logging.h"
+
+#define s_chunk_min (64 * 1024)
+#define s_table_min 1024
+#define s_align(n) (((n) + 7) & ~(size_t) 7)
+
+typedef struct _s_chunk_t {
+    struct _s_chunk_t *next;
+    size_t size;
+    // Then size bytes for entries, 8 byte aligned
+} s_chunk_t;
+
+// An entry is this header, the key and the value, each 8 byte aligned
+typedef struct {
+    lmdbdbi_t *dbi;
+    uint64_t hash;
+    size_t key_size;
+    size_t val_size;
+    bool is_replaced;           // By a later put of the same key
+    bool is_deleted;            // A del rather than a put
+} s_entry_t;
+
+#define s_entry_key(e) ((byte *) (e) + s_align (sizeof (s_entry_t)))
+#define s_entry_val(e) (s_entry_key (e) + s_align ((e)->key_size))
+
+//  Structure of our class
+
+struct _lmdbstage_t {
+    s_chunk_t *chunks;          // Newest first; we allocate from that
+    size_t chunk_used;
+
+    // Every entry in put order, replaced ones too
+    s_entry_t **entries;
+    size_t entry_count;
+    size_t entry_alloc;
+
+    // Latest entry per key, open addressed
+    s_entry_t **table;
+    size_t table_size;          // A power of two, or 0
+
+    size_t count;
+    size_t size;
+};
+
+
+//  --------------------------------------------------------------------------
+//  Create a new lmdbstage
+
+lmdbstage_t *
+lmdbstage_new (void)
+{
+    lmdbstage_t *self = (lmdbstage_t *) lmdballoc_zmalloc (sizeof (lmdbstage_t));
+    assert (self);
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the lmdbstage
+
+void
+lmdbstage_destroy (lmdbstage_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        lmdbstage_t *self = *self_p;
+        lmdbstage_clear (self);
+        lmdballoc_free (self->entries);
+        lmdballoc_free (self->table);
+        lmdballoc_free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Memory and hashing
+
+static void *
+s_alloc (lmdbstage_t *self, size_t size)
+{
+    size = s_align (size);
+    if (!self->chunks || self->chunk_used + size > self->chunks->size) {
+        size_t chunk_size = size > s_chunk_min ? size : s_chunk_min;
+        s_chunk_t *chunk = (s_chunk_t *) lmdballoc_malloc (sizeof (s_chunk_t) + chunk_size);
+        assert (chunk);
+        chunk->size = chunk_size;
+        chunk->next = self->chunks;
+        self->chunks = chunk;
+        self->chunk_used = 0;
+    }
+    void *data = (byte *) (self->chunks + 1) + self->chunk_used;
+    self->chunk_used += size;
+    return data;
+}
+
+// FNV-1a over the key, mixed with the dbi
+static uint64_t
+s_hash (lmdbdbi_t *dbi, const void *key, size_t key_size)
+{
+    uint64_t h = 0xcbf29ce484222325ULL ^ ((uint64_t) (uintptr_t) dbi * 0x9e3779b97f4a7c15ULL);
+    const byte *data = (const byte *) key;
+    size_t i;
+    for (i = 0; i < key_size; i++) {
+        h ^= data [i];
+        h *= 0x100000001b3ULL;
+    }
+    return h ^ (h >> 29);
+}
+
+// The slot holding key, or the empty one it would go in
+static size_t
+s_slot (lmdbstage_t *self, lmdbdbi_t *dbi, uint64_t hash,
+        const void *key, size_t key_size)
+{
+    size_t mask = self->table_size - 1;
+    size_t slot = hash & mask;
+    while (self->table [slot]) {
+        s_entry_t *entry = self->table [slot];
+        if (entry->hash == hash && entry->dbi == dbi && entry->key_size == key_size
+        &&  memcmp (s_entry_key (entry), key, key_size) == 0)
+            break;
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static void
+s_grow_table (lmdbstage_t *self)
+{
+    size_t old_size = self->table_size;
+    s_entry_t **old_table = self->table;
+    self->table_size = old_size ? old_size * 2 : s_table_min;
+    self->table = (s_entry_t **) lmdballoc_zmalloc (self->table_size * sizeof (s_entry_t *));
+    assert (self->table);
+
+    size_t mask = self->table_size - 1;
+    size_t i;
+    for (i = 0; i < old_size; i++) {
+        if (!old_table [i])
+            continue;
+        size_t slot = old_table [i]->hash & mask;
+        while (self->table [slot])
+            slot = (slot + 1) & mask;
+        self->table [slot] = old_table [i];
+    }
+    lmdballoc_free (old_table);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Staging
+
+static void
+s_stage (lmdbstage_t *self, lmdbdbi_t *dbi,
+         const void *key, size_t key_size,
+         const void *val, size_t val_size, bool is_deleted)
+{
+    if ((self->count + 1) * 2 > self->table_size)
+        s_grow_table (self);
+    if (self->entry_count == self->entry_alloc) {
+        self->entry_alloc = self->entry_alloc ? self->entry_alloc * 2 : s_table_min;
+        self->entries = (s_entry_t **) lmdballoc_realloc (self->entries,
+                                                          self->entry_alloc * sizeof (s_entry_t *));
+        assert (self->entries);
+    }
+
+    uint64_t hash = s_hash (dbi, key, key_size);
+    size_t slot = s_slot (self, dbi, hash, key, key_size);
+    size_t entry_size = s_align (sizeof (s_entry_t)) + s_align (key_size) + val_size;
+    s_entry_t *entry = (s_entry_t *) s_alloc (self, entry_size);
+    *entry = (s_entry_t) {
+        .dbi = dbi,
+        .hash = hash,
+        .key_size = key_size,
+        .val_size = val_size,
+        .is_deleted = is_deleted
+    };
+    memcpy (s_entry_key (entry), key, key_size);
+    if (val_size)
+        memcpy (s_entry_val (entry), val, val_size);
+
+    if (self->table [slot])
+        self->table [slot]->is_replaced = true;
+    else
+        self->count++;
+    self->table [slot] = entry;
+    self->entries [self->entry_count++] = entry;
+    self->size += s_align (entry_size) + sizeof (s_entry_t *);
+}
+
+void
+lmdbstage_put (lmdbstage_t *self, lmdbdbi_t *dbi,
+               const void *key, size_t key_size,
+               const void *val, size_t val_size)
+{
+    assert (self);
+    assert (dbi);
+    assert (key);
+    assert (val || !val_size);
+    s_stage (self, dbi, key, key_size, val, val_size, false);
+}
+
+void
+lmdbstage_del (lmdbstage_t *self, lmdbdbi_t *dbi, const void *key, size_t key_size)
+{
+    assert (self);
+    assert (dbi);
+    assert (key);
+    s_stage (self, dbi, key, key_size, NULL, 0, true);
+}
+
+lmdbspan
+lmdbstage_get (lmdbstage_t *self, lmdbdbi_t *dbi, const void *key, size_t key_size)
+{
+    assert (self);
+    assert (dbi);
+    assert (key);
+
+    if (!self->count)
+        return lmdbspan_makenull ();
+    size_t slot = s_slot (self, dbi, s_hash (dbi, key, key_size), key, key_size);
+    s_entry_t *entry = self->table [slot];
+    if (!entry || entry->is_deleted)
+        return lmdbspan_makenull ();
+    return (lmdbspan) { .data = s_entry_val (entry), .size = entry->val_size };
+}
+
+// By dbi, then key in the dbi's order
+static int
+s_compare (const void *a, const void *b)
+{
+    const s_entry_t *x = *(const s_entry_t **) a;
+    const s_entry_t *y = *(const s_entry_t **) b;
+    if (x->dbi != y->dbi)
+        return (uintptr_t) x->dbi < (uintptr_t) y->dbi ? -1 : 1;
+
+    const byte *x_key = s_entry_key (x);
+    const byte *y_key = s_entry_key (y);
+    if (lmdbdbi_intkeys (x->dbi) && x->key_size == y->key_size) {
+        if (x->key_size == sizeof (uint64_t)) {
+            uint64_t x_num, y_num;
+            memcpy (&x_num, x_key, sizeof (x_num));
+            memcpy (&y_num, y_key, sizeof (y_num));
+            return x_num < y_num ? -1 : x_num > y_num;
+        }
+        if (x->key_size == sizeof (uint32_t)) {
+            uint32_t x_num, y_num;
+            memcpy (&x_num, x_key, sizeof (x_num));
+            memcpy (&y_num, y_key, sizeof (y_num));
+            return x_num < y_num ? -1 : x_num > y_num;
+        }
+    }
+    size_t common = x->key_size < y->key_size ? x->key_size : y->key_size;
+    int diff = memcmp (x_key, y_key, common);
+    if (diff)
+        return diff;
+    return x->key_size < y->key_size ? -1 : x->key_size > y->key_size;
+}
+
+int
+lmdbstage_flush (lmdbstage_t *self, lmdbtxn_t *txn)
+{
+    assert (self);
+    assert (txn);
+
+    int rc = 0;
+    qsort (self->entries, self->entry_count, sizeof (s_entry_t *), s_compare);
+    size_t i;
+    for (i = 0; i < self->entry_count; i++) {
+        s_entry_t *entry = self->entries [i];
+        if (entry->is_replaced)
+            continue;
+        if (entry->is_deleted) {
+            // Deleting a key that isn't there isn't a failure here
+            if (lmdbspan_valid (lmdbdbi_get (entry->dbi, txn, s_entry_key (entry),
+                                             entry->key_size))
+            &&  lmdbdbi_del (entry->dbi, txn, s_entry_key (entry), entry->key_size)) {
+                rc = -1;
+                break;
+            }
+        }
+        else
+        if (lmdbdbi_put (entry->dbi, txn, s_entry_key (entry), entry->key_size,
+                         s_entry_val (entry), entry->val_size)) {
+            rc = -1;
+            break;
+        }
+    }
+    lmdbstage_clear (self);
+    return rc;
+}
+
+void
+lmdbstage_clear (lmdbstage_t *self)
+{
+    assert (self);
+    while (self->chunks) {
+        s_chunk_t *next = self->chunks->next;
+        lmdballoc_free (self->chunks);
+        self->chunks = next;
+    }
+    self->chunk_used = 0;
+    if (self->table)
+        memset (self->table, 0, self->table_size * sizeof (s_entry_t *));
+    self->entry_count = 0;
+    self->count = 0;
+    self->size = 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Accessors
+
+size_t
+lmdbstage_count (lmdbstage_t *self)
+{
+    assert (self);
+    return self->count;
+}
+
+size_t
+lmdbstage_size (lmdbstage_t *self)
+{
+    assert (self);
+    return self->size;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+lmdbstage_test (bool verbose)
+{
+    printf (" * lmdbstage: ");
+
+    //  @selftest
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+    assert (SELFTEST_DIR_RW);
+
+    char *test_db_path = zsys_sprintf ("%s/%s", SELFTEST_DIR_RW, "LMDBSTAGE_TEST.db");
+    if (zsys_file_exists (test_db_path))
+        zsys_file_delete (test_db_path);
+    lmdbenv_t *env = lmdbenv_new (test_db_path);
+    assert (env);
+    zstr_free (&test_db_path);
+    lmdbdbi_t *dbi = lmdbdbi_new (env, "bytes");
+    lmdbdbi_t *dbiik = lmdbdbi_new_intkeys (env, "numbers");
+    assert (dbi && dbiik);
+
+    lmdbstage_t *stage = lmdbstage_new ();
+    assert (stage);
+    assert (! lmdbspan_valid (lmdbstage_get (stage, dbi, "a", 1)));
+
+    // Keys are per dbi, later puts replace earlier ones, and empty values
+    // are still values
+    lmdbstage_put (stage, dbi, "a", 1, "first", 5);
+    lmdbstage_put (stage, dbiik, "a", 1, "other", 5);
+    lmdbstage_put (stage, dbi, "a", 1, "second", 6);
+    lmdbstage_put (stage, dbi, "b", 1, "", 0);
+    assert (lmdbstage_count (stage) == 3);
+    assert (lmdbstage_size (stage) > 0);
+    lmdbspan a = lmdbstage_get (stage, dbi, "a", 1);
+    assert (a.size == 6 && memcmp (a.data, "second", 6) == 0);
+    lmdbspan other = lmdbstage_get (stage, dbiik, "a", 1);
+    assert (other.size == 5 && memcmp (other.data, "other", 5) == 0);
+    lmdbspan empty = lmdbstage_get (stage, dbi, "b", 1);
+    assert (lmdbspan_valid (empty) && empty.size == 0);
+    assert (! lmdbspan_valid (lmdbstage_get (stage, dbi, "c", 1)));
+    lmdbstage_del (stage, dbi, "b", 1);
+    assert (lmdbstage_count (stage) == 3);
+    assert (! lmdbspan_valid (lmdbstage_get (stage, dbi, "b", 1)));
+    lmdbstage_clear (stage);
+    assert (lmdbstage_count (stage) == 0);
+    assert (lmdbstage_size (stage) == 0);
+    assert (! lmdbspan_valid (lmdbstage_get (stage, dbi, "a", 1)));
+
+    // Enough keys to grow the table and chunks; values stay 8 byte aligned
+    uint32_t i;
+    for (i = 0; i < 20000; i++) {
+        uint64_t num = (uint64_t) i * 7919 % 20000;
+        lmdbstage_put (stage, dbiik, &num, sizeof (num), &num, sizeof (num));
+    }
+    assert (lmdbstage_count (stage) == 20000);
+    for (i = 0; i < 20000; i += 97) {
+        uint64_t num = i;
+        lmdbspan val = lmdbstage_get (stage, dbiik, &num, sizeof (num));
+        assert (((uintptr_t) val.data & 7) == 0);
+        assert (lmdbspan_asui64 (val) == num);
+    }
+
+    // Flushing writes them, numbers in numeric order
+    lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
+    assert (txn);
+    int rc = lmdbstage_flush (stage, txn);
+    assert (rc == 0);
+    assert (lmdbstage_count (stage) == 0);
+    lmdbcur_t *cur = lmdbcur_new_overall (dbiik, txn);
+    for (i = 0; i < 20000; i++) {
+        assert (lmdbspan_asui64 (lmdbcur_key (cur)) == i);
+        lmdbcur_next (cur);
+    }
+    lmdbcur_destroy (&cur);
+
+    // Dels delete, whether or not the key is there, and a put after a del
+    // puts
+    uint64_t gone = 10, back = 11, never = 30000;
+    lmdbstage_del (stage, dbiik, &gone, sizeof (gone));
+    lmdbstage_del (stage, dbiik, &back, sizeof (back));
+    lmdbstage_put (stage, dbiik, &back, sizeof (back), "back", 4);
+    lmdbstage_del (stage, dbiik, &never, sizeof (never));
+    rc = lmdbstage_flush (stage, txn);
+    assert (rc == 0);
+    assert (! lmdbspan_valid (lmdbdbi_get_ui64 (dbiik, txn, gone)));
+    assert (lmdbspan_size (lmdbdbi_get_ui64 (dbiik, txn, back)) == 4);
+    lmdbtxn_destroy (&txn);
+
+    lmdbstage_destroy (&stage);
+    assert (!stage);
+    lmdbdbi_destroy (&dbiik);
+    lmdbdbi_destroy (&dbi);
+    lmdbenv_destroy (&env);
+
+    if (verbose)
+        log ("Staged, replaced and flushed puts and dels");
+    //  @end
+    printf ("OK\n");
+}
@@ -0,0 +1,86 @@
+/*  =========================================================================
+    lmdbstage - Puts held back by a write lmdbtxn, to be written in key order
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+#ifndef LMDBSTAGE_H_INCLUDED
+#define LMDBSTAGE_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @warning THE FOLLOWING @INTERFACE BLOCK IS AUTO-GENERATED BY ZPROJECT
+//  @warning Please edit the model at "api/lmdbstage.xml" to make changes.
+//  @interface
+//  This API is a draft, and may change without notice.
+#ifdef CLASSLMDB_BUILD_DRAFT_API
+//  *** Draft method, defined for internal use only ***
+//  Create an empty stage.
+CLASSLMDB_PRIVATE lmdbstage_t *
+    lmdbstage_new (void);
+
+//  *** Draft method, defined for internal use only ***
+//  Destroy the lmdbstage.
+CLASSLMDB_PRIVATE void
+    lmdbstage_destroy (lmdbstage_t **self_p);
+
+//  *** Draft method, defined for internal use only ***
+//  Copy a put to dbi in, replacing any staged for the same key.
+CLASSLMDB_PRIVATE void
+    lmdbstage_put (lmdbstage_t *self, lmdbdbi_t *dbi, const void *key, size_t key_size, const void *val, size_t val_size);
+
+//  *** Draft method, defined for internal use only ***
+//  Stage a del of key from dbi, replacing any put staged for it.
+CLASSLMDB_PRIVATE void
+    lmdbstage_del (lmdbstage_t *self, lmdbdbi_t *dbi, const void *key, size_t key_size);
+
+//  *** Draft method, defined for internal use only ***
+//  The value staged for key in dbi, valid until the stage is flushed or
+//  cleared, or nullish if there is none or a del is staged.
+CLASSLMDB_PRIVATE lmdbspan
+    lmdbstage_get (lmdbstage_t *self, lmdbdbi_t *dbi, const void *key, size_t key_size);
+
+//  *** Draft method, defined for internal use only ***
+//  Put and del everything staged in txn, dbi by dbi in each dbi's key order, then
+//  clear the stage. The caller must make sure the puts aren't staged
+//  again.
+//  Returns 0 on success, -1 if any put failed; the stage is cleared
+//  either way.
+CLASSLMDB_PRIVATE int
+    lmdbstage_flush (lmdbstage_t *self, lmdbtxn_t *txn);
+
+//  *** Draft method, defined for internal use only ***
+//  Drop everything staged.
+CLASSLMDB_PRIVATE void
+    lmdbstage_clear (lmdbstage_t *self);
+
+//  *** Draft method, defined for internal use only ***
+//  Number of keys staged.
+CLASSLMDB_PRIVATE size_t
+    lmdbstage_count (lmdbstage_t *self);
+
+//  *** Draft method, defined for internal use only ***
+//  Bytes of memory the staged puts take.
+CLASSLMDB_PRIVATE size_t
+    lmdbstage_size (lmdbstage_t *self);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+CLASSLMDB_PRIVATE void
+    lmdbstage_test (bool verbose);
+
+#endif // CLASSLMDB_BUILD_DRAFT_API
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,203 @@
+/*  =========================================================================
+    lmdbsweeper - Background thread deleting expired keys from an lmdbdbi
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+/*
+@header
+    lmdbsweeper - Background thread deleting expired keys from an lmdbdbi
+@discuss
+    Gets already treat expired keys as missing, so sweeping is only about
+    reclaiming space, and can be done a little at a time. Each sweep is
+    one lmdbdbi_expire() call, i.e. one write txn of at most batch deletes,
+    so it never holds the write lock for long; other writers just queue
+    behind it as they would behind each other.
+
+    The thread is a czmq actor, waiting on its pipe between sweeps so
+    that destroying the sweeper stops it promptly.
+@end
+*/
+
+#include "classlmdb_classes.h"
+
+#include <stdatomic.h>
+
+#include "logging.h"
+
+//  Structure of our class
+
+struct _lmdbsweeper_t {
+    lmdbenv_t *env;
+    lmdbdbi_t *dbi;
+    int interval_msecs;
+    size_t batch;
+
+    atomic_uint_fast64_t swept;
+    zactor_t *actor;
+};
+
+
+//  --------------------------------------------------------------------------
+//  The sweeping thread
+
+static void
+s_sweeper_actor (zsock_t *pipe, void *args)
+{
+    lmdbsweeper_t *self = (lmdbsweeper_t *) args;
+    zpoller_t *poller = zpoller_new (pipe, NULL);
+    assert (poller);
+    zsock_signal (pipe, 0);
+
+    int timeout = self->interval_msecs;
+    while (true) {
+        void *which = zpoller_wait (poller, timeout);
+        if (which == pipe) {
+            char *command = zstr_recv (pipe);
+            bool terminated = !command || streq (command, "$TERM");
+            zstr_free (&command);
+            if (terminated)
+                break;
+        }
+        else
+        if (zpoller_terminated (poller))
+            break;
+        else {
+            int swept = lmdbdbi_expire (self->dbi, self->env, self->batch);
+            if (swept > 0)
+                atomic_fetch_add_explicit (&self->swept, (uint64_t) swept,
+                                           memory_order_relaxed);
+
+            // A full batch means there may be more, so don't wait
+            timeout = swept > 0 && (size_t) swept == self->batch
+                    ? 0 : self->interval_msecs;
+        }
+    }
+    zpoller_destroy (&poller);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Create a new lmdbsweeper
+
+lmdbsweeper_t *
+lmdbsweeper_new (lmdbenv_t *env, lmdbdbi_t *dbi, int interval_msecs, size_t batch)
+{
+    assert (env);
+    assert (dbi);
+    if (interval_msecs <= 0 || batch == 0)
+        return NULL;
+
+    lmdbsweeper_t *self = (lmdbsweeper_t *) lmdballoc_zmalloc (sizeof (lmdbsweeper_t));
+    assert (self);
+    self->env = env;
+    self->dbi = dbi;
+    self->interval_msecs = interval_msecs;
+    self->batch = batch;
+    atomic_init (&self->swept, 0);
+
+    self->actor = zactor_new (s_sweeper_actor, self);
+    if (!self->actor)
+        lmdbsweeper_destroy (&self);
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the lmdbsweeper
+
+void
+lmdbsweeper_destroy (lmdbsweeper_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        lmdbsweeper_t *self = *self_p;
+        zactor_destroy (&self->actor);
+        lmdballoc_free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Accessors
+
+uint64_t
+lmdbsweeper_swept (lmdbsweeper_t *self)
+{
+    assert (self);
+    return atomic_load_explicit (&self->swept, memory_order_relaxed);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+lmdbsweeper_test (bool verbose)
+{
+    printf (" * lmdbsweeper: ");
+
+    //  @selftest
+    const char *SELFTEST_DIR_RW = "src/selftest-rw";
+    assert (SELFTEST_DIR_RW);
+
+    char *test_db_path = zsys_sprintf ("%s/%s", SELFTEST_DIR_RW, "LMDBSWEEPER_TEST.db");
+    if (zsys_file_exists (test_db_path))
+        zsys_file_delete (test_db_path);
+    lmdbenv_t *env = lmdbenv_new (test_db_path);
+    assert (env);
+    zstr_free (&test_db_path);
+
+    lmdbdbi_t *dbi = lmdbdbi_new (env, "sessions");
+    assert (dbi);
+    int rc = lmdbdbi_enable_ttl (dbi, env);
+    assert (rc == 0);
+
+    // 100 sessions that have already expired, and 5 that haven't
+    lmdbtxn_t *txn = lmdbtxn_new_rdrw (env);
+    assert (txn);
+    uint32_t i;
+    for (i = 0; i < 105; i++) {
+        uint64_t ttl = i < 100 ? 0 : 3600 * 1000;
+        rc = lmdbdbi_put_ttl (dbi, txn, &i, sizeof (i), "s", 2, ttl);
+        assert (rc == 0);
+    }
+    rc = lmdbtxn_commit (txn);
+    assert (rc == 0);
+    lmdbtxn_destroy (&txn);
+
+    // Small batches still clear the backlog without waiting between them
+    lmdbsweeper_t *sweeper = lmdbsweeper_new (env, dbi, 10, 8);
+    assert (sweeper);
+    int64_t deadline = zclock_mono () + 5000;
+    while (lmdbsweeper_swept (sweeper) < 100 && zclock_mono () < deadline)
+        zclock_sleep (5);
+    assert (lmdbsweeper_swept (sweeper) == 100);
+    lmdbsweeper_destroy (&sweeper);
+    assert (sweeper == NULL);
+
+    txn = lmdbtxn_new_rdonly (env);
+    assert (txn);
+    for (i = 0; i < 105; i++)
+        assert (lmdbspan_valid (lmdbdbi_get (dbi, txn, &i, sizeof (i))) == (i >= 100));
+    lmdbtxn_destroy (&txn);
+    assert (lmdbdbi_expire (dbi, env, 100) == 0);
+
+    assert (lmdbsweeper_new (env, dbi, 10, 0) == NULL);
+    assert (lmdbsweeper_new (env, dbi, 0, 8) == NULL);
+    assert (lmdbsweeper_new (env, dbi, -1, 8) == NULL);
+
+    lmdbdbi_destroy (&dbi);
+    lmdbenv_destroy (&env);
+
+    if (verbose)
+        log ("Swept expired keys in the background");
+    //  @end
+    printf ("OK\n");
+}
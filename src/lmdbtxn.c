@@ -13,6 +13,23 @@
 @header
     lmdbtxn - Manager for an LMDB transaction
 @discuss
+    A txn, and the cursors and spans got through it, must only be used by
+    one thread at a time. Normally that's the thread that opened it; in
+    envs from lmdbenv_new_threaded a read-only txn can be passed to
+    another thread, best while it's reset.
+
+    A staging write txn keeps puts in an lmdbstage until they're needed.
+    Anything that takes the txn's handle may read any key, so flushes the
+    stage first; gets of keys that aren't staged hold it back, as those
+    read the same either way.
+
+    A caching write txn keeps copies of values it got or put in an
+    lmdbcache, which lmdbdbi asks before searching the tree, and keeps
+    current as it writes. Staged puts are asked first, as they're newer.
+
+    A write txn also notes which segments of each dbi's membership filter
+    its puts changed, and has the dbi write each of them once on commit,
+    rather than once per put.
 @end
 */
 
@@ -20,12 +37,42 @@
 
 #include "logging.h"
 
+//  Segments of one dbi's filter a write txn has changed
+
+typedef struct {
+    lmdbdbi_t *dbi;
+    byte *segments;             // A bit per segment
+    size_t segment_count;
+    uint64_t generation;        // As saved, once it is
+} s_dirty_filter_t;
+
 //  Structure of our class
 
 struct _lmdbtxn_t {
     // We NULL this out on commit or abort
     MDB_txn *handle;
     bool is_rdonly;
+
+    // Read-only txns only: reset, and waiting to be renewed
+    bool is_reset;
+
+    // For lmdbtxn_scratch() and lmdbtxn_arena(), reset when the txn closes
+    lmdbarena_t *arena;
+
+    // Write txns only: puts held back until the budget fills, or until
+    // something needs the tree as it would be with them
+    lmdbstage_t *stage;
+    size_t stage_budget;
+    bool is_flushing;       // So puts from the stage go through
+    bool is_holding;        // So gets of keys not staged don't flush
+    bool flush_failed;      // Commit will fail
+
+    // Write txns only: copies of values got and put, for gets of them
+    lmdbcache_t *cache;
+
+    // Write txns only: filters to write back on commit
+    s_dirty_filter_t *dirty_filters;
+    size_t dirty_filter_count;
 };
 
 
@@ -38,7 +85,7 @@ s_lmdbtxn_new_withflags (lmdbenv_t *env, unsigned int flags)
 {
     assert (env);
     
-    lmdbtxn_t *self = (lmdbtxn_t *) zmalloc (sizeof (lmdbtxn_t));
+    lmdbtxn_t *self = (lmdbtxn_t *) lmdballoc_zmalloc (sizeof (lmdbtxn_t));
     assert (self);
 
     int err = mdb_txn_begin (lmdbenv_handle (env), NULL, flags, &self->handle);
@@ -73,6 +120,97 @@ lmdbtxn_new_rdrw (lmdbenv_t *env)
 }
 
 
+//  --------------------------------------------------------------------------
+//  Scratch buffers
+
+static void
+s_free_scratch (lmdbtxn_t *self)
+{
+    if (self->arena)
+        lmdbarena_reset (self->arena);
+}
+
+lmdbarena_t *
+lmdbtxn_arena (lmdbtxn_t *self)
+{
+    assert (self);
+    if (!self->arena)
+        self->arena = lmdbarena_new (0);
+    return self->arena;
+}
+
+void *
+lmdbtxn_scratch (lmdbtxn_t *self, size_t size)
+{
+    assert (self);
+    return lmdbarena_alloc (lmdbtxn_arena (self), size);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Filter segments to write back
+
+int
+lmdbtxn_filter_changed (lmdbtxn_t *self, lmdbdbi_t *dbi,
+                        size_t index, size_t segment_count)
+{
+    assert (self);
+    assert (dbi);
+    assert (index < segment_count);
+
+    s_dirty_filter_t *dirty = NULL;
+    size_t i;
+    for (i = 0; i < self->dirty_filter_count && !dirty; i++)
+        if (self->dirty_filters [i].dbi == dbi)
+            dirty = &self->dirty_filters [i];
+    if (!dirty) {
+        s_dirty_filter_t *grown = (s_dirty_filter_t *) lmdballoc_realloc (
+            self->dirty_filters, (self->dirty_filter_count + 1) * sizeof (s_dirty_filter_t));
+        if (!grown)
+            return -1;
+        self->dirty_filters = grown;
+        byte *segments = (byte *) lmdballoc_zmalloc ((segment_count + 7) / 8);
+        if (!segments)
+            return -1;
+        dirty = &self->dirty_filters [self->dirty_filter_count++];
+        *dirty = (s_dirty_filter_t) {
+            .dbi = dbi,
+            .segments = segments,
+            .segment_count = segment_count
+        };
+    }
+    // Filters are only resized in write txns of their own
+    assert (dirty->segment_count == segment_count);
+    dirty->segments [index / 8] |= (byte) (1 << (index % 8));
+    return 0;
+}
+
+// Write back the changed filter segments; 0 on success, -1 on failure
+static int
+s_save_filters (lmdbtxn_t *self)
+{
+    size_t i;
+    for (i = 0; i < self->dirty_filter_count; i++) {
+        s_dirty_filter_t *dirty = &self->dirty_filters [i];
+        if (lmdbdbi_save_filter (dirty->dbi, self, dirty->segments, dirty->segment_count,
+                                 &dirty->generation))
+            return -1;
+    }
+    return 0;
+}
+
+static void
+s_free_filters (lmdbtxn_t *self)
+{
+    size_t i;
+    for (i = 0; i < self->dirty_filter_count; i++)
+        lmdballoc_free (self->dirty_filters [i].segments);
+    lmdballoc_free (self->dirty_filters);
+    self->dirty_filters = NULL;
+    self->dirty_filter_count = 0;
+}
+
+
 //  --------------------------------------------------------------------------
 //  Destroy the lmdbtxn
 
@@ -87,8 +225,12 @@ lmdbtxn_destroy (lmdbtxn_t **self_p)
             mdb_txn_abort (self->handle);
             self->handle = NULL;
         }
+        lmdbarena_destroy (&self->arena);
+        lmdbstage_destroy (&self->stage);
+        lmdbcache_destroy (&self->cache);
+        s_free_filters (self);
 
-        free (self);
+        lmdballoc_free (self);
         *self_p = NULL;
     }
 }
@@ -103,13 +245,161 @@ lmdbtxn_commit (lmdbtxn_t *self)
     assert (self);
     if (!self->handle)
         return -1;
-    
+
+    if (self->stage)
+        lmdbtxn_flush (self);
+    if (self->flush_failed || s_save_filters (self)) {
+        mdb_txn_abort (self->handle);
+        self->handle = NULL;
+        s_free_scratch (self);
+        lmdbcache_destroy (&self->cache);
+        s_free_filters (self);
+        return -1;
+    }
+
     int err = mdb_txn_commit (self->handle);
     self->handle = NULL;
+    size_t i;
+    for (i = 0; i < self->dirty_filter_count && !err; i++)
+        lmdbdbi_filter_saved (self->dirty_filters [i].dbi, self->dirty_filters [i].generation);
+    s_free_scratch (self);
+    lmdbcache_destroy (&self->cache);
+    s_free_filters (self);
     return err;
 }
 
 
+//  --------------------------------------------------------------------------
+//  Staging puts
+
+int
+lmdbtxn_stage (lmdbtxn_t *self, size_t budget)
+{
+    assert (self);
+    if (self->is_rdonly || !self->handle)
+        return -1;
+
+    if (budget == 0) {
+        int rc = lmdbtxn_flush (self);
+        lmdbstage_destroy (&self->stage);
+        return rc;
+    }
+    if (!self->stage)
+        self->stage = lmdbstage_new ();
+    self->stage_budget = budget;
+    return 0;
+}
+
+int
+lmdbtxn_flush (lmdbtxn_t *self)
+{
+    assert (self);
+    if (!self->stage || self->is_flushing || !lmdbstage_count (self->stage))
+        return self->flush_failed ? -1 : 0;
+
+    self->is_flushing = true;
+    if (lmdbstage_flush (self->stage, self))
+        self->flush_failed = true;
+    self->is_flushing = false;
+    return self->flush_failed ? -1 : 0;
+}
+
+bool
+lmdbtxn_staging (lmdbtxn_t *self)
+{
+    assert (self);
+    return self->stage && !self->is_flushing;
+}
+
+int
+lmdbtxn_stage_put (lmdbtxn_t *self, lmdbdbi_t *dbi,
+                   const void *key, size_t key_size,
+                   const void *val, size_t val_size)
+{
+    assert (self);
+    assert (lmdbtxn_staging (self));
+    lmdbstage_put (self->stage, dbi, key, key_size, val, val_size);
+    if (lmdbstage_size (self->stage) >= self->stage_budget)
+        return lmdbtxn_flush (self);
+    return self->flush_failed ? -1 : 0;
+}
+
+lmdbspan
+lmdbtxn_staged_get (lmdbtxn_t *self, lmdbdbi_t *dbi, const void *key, size_t key_size)
+{
+    assert (self);
+    if (!self->stage)
+        return lmdbspan_makenull ();
+    return lmdbstage_get (self->stage, dbi, key, key_size);
+}
+
+bool
+lmdbtxn_hold (lmdbtxn_t *self, bool hold)
+{
+    assert (self);
+    bool was_holding = self->is_holding;
+    self->is_holding = hold;
+    return was_holding;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Caching reads
+
+int
+lmdbtxn_cache (lmdbtxn_t *self, size_t budget)
+{
+    assert (self);
+    if (self->is_rdonly || !self->handle)
+        return -1;
+
+    lmdbcache_destroy (&self->cache);
+    if (budget)
+        self->cache = lmdbcache_new (budget);
+    return 0;
+}
+
+lmdbcache_t *
+lmdbtxn_read_cache (lmdbtxn_t *self)
+{
+    assert (self);
+    return self->cache;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Reset and renew
+
+int
+lmdbtxn_reset (lmdbtxn_t *self)
+{
+    assert (self);
+    if (!self->is_rdonly || !self->handle)
+        return -1;
+
+    if (!self->is_reset) {
+        mdb_txn_reset (self->handle);
+        self->is_reset = true;
+    }
+    s_free_scratch (self);
+    return 0;
+}
+
+int
+lmdbtxn_renew (lmdbtxn_t *self)
+{
+    assert (self);
+    if (!self->is_reset)
+        return -1;
+
+    int err = mdb_txn_renew (self->handle);
+    if (err)
+        return -1;
+    self->is_reset = false;
+    return 0;
+}
+
+
 //  --------------------------------------------------------------------------
 //  Accessors
 
@@ -117,6 +407,10 @@ MDB_txn *
 lmdbtxn_handle (lmdbtxn_t *self)
 {
     assert (self);
+    // Whoever wants the handle may read anything, so gets the tree with
+    // every staged put in it
+    if (self->stage && !self->is_holding)
+        lmdbtxn_flush (self);
     return self->handle;
 }
 
@@ -196,10 +490,213 @@ lmdbtxn_test (bool verbose)
         assert (lmdbtxn_handle (txn));
         assert (lmdbtxn_rdonly (txn));
 
+        int err = lmdbtxn_renew (txn);
+        assert (err);
+        err = lmdbtxn_reset (txn);
+        assert (!err);
+        err = lmdbtxn_reset (txn);
+        assert (!err);
+        err = lmdbtxn_renew (txn);
+        assert (!err);
+        assert (lmdbtxn_handle (txn));
+
+        lmdbtxn_destroy (&txn);
+
+        txn = lmdbtxn_new_rdrw (env);
+        assert (txn);
+        err = lmdbtxn_reset (txn);
+        assert (err);
         lmdbtxn_destroy (&txn);
     }
     if (verbose)
         log ("rdrw txn tests passed");
+
+    {  // staging
+        lmdbdbi_t *dbi = lmdbdbi_new (env, "staged");
+        assert (dbi);
+        int rc = lmdbdbi_enable_filter (dbi, env, 1000);
+        assert (rc == 0);
+
+        lmdbtxn_t *txn = lmdbtxn_new_rdonly (env);
+        assert (lmdbtxn_stage (txn, 1 << 20) == -1);
+        lmdbtxn_destroy (&txn);
+
+        // Random order puts, a tiny budget so some flush along the way
+        txn = lmdbtxn_new_rdrw (env);
+        rc = lmdbdbi_put_strstr (dbi, txn, "unstaged", "old");
+        assert (rc == 0);
+        rc = lmdbtxn_stage (txn, 4096);
+        assert (rc == 0);
+        uint32_t i;
+        for (i = 0; i < 1000; i++) {
+            uint32_t key = i * 7919 % 1000;
+            rc = lmdbdbi_put_ui32 (dbi, txn, key, &i, sizeof (i));
+            assert (rc == 0);
+        }
+        rc = lmdbdbi_put_ui32 (dbi, txn, 5, "five", 4);
+        assert (rc == 0);
+        lmdbspan five = lmdbdbi_get_ui32 (dbi, txn, 5);
+        assert (five.size == 4 && memcmp (five.data, "five", 4) == 0);
+        assert (streq (lmdbspan_asstr (lmdbdbi_get_str (dbi, txn, "unstaged")), "old"));
+        assert (! lmdbspan_valid (lmdbdbi_get_ui32 (dbi, txn, 1000)));
+
+        // Deleting a key only staged so far; the filter hasn't seen it
+        uint32_t key = 7;
+        rc = lmdbdbi_put_ui32 (dbi, txn, 1001, &key, sizeof (key));
+        assert (rc == 0);
+        rc = lmdbdbi_del (dbi, txn, &(uint32_t) {1001}, sizeof (uint32_t));
+        assert (rc == 0);
+
+        // Cursors see every staged put
+        lmdbcur_t *cur = lmdbcur_new_overall (dbi, txn);
+        size_t count = 0;
+        while (lmdbspan_valid (lmdbcur_key (cur))) {
+            count++;
+            lmdbcur_next (cur);
+        }
+        lmdbcur_destroy (&cur);
+        assert (count == 1001);
+
+        rc = lmdbdbi_put_ui32 (dbi, txn, 6, "six", 3);
+        assert (rc == 0);
+        rc = lmdbtxn_commit (txn);
+        assert (rc == 0);
+        lmdbtxn_destroy (&txn);
+
+        txn = lmdbtxn_new_rdonly (env);
+        lmdbspan six = lmdbdbi_get_ui32 (dbi, txn, 6);
+        assert (six.size == 3 && memcmp (six.data, "six", 3) == 0);
+        for (i = 0; i < 1000; i += 37) {
+            key = i * 7919 % 1000;
+            if (key != 5 && key != 6)
+                assert (lmdbspan_asui32 (lmdbdbi_get_ui32 (dbi, txn, key)) == i);
+        }
+        assert (! lmdbspan_valid (lmdbdbi_get_ui32 (dbi, txn, 1001)));
+        lmdbtxn_destroy (&txn);
+
+        // A put that fails when flushed fails the commit, writing nothing
+        lmdbdbi_t *dbipk = lmdbdbi_new_packed (env, "staged_packed");
+        assert (dbipk);
+        txn = lmdbtxn_new_rdrw (env);
+        rc = lmdbtxn_stage (txn, 1 << 20);
+        assert (rc == 0);
+        rc = lmdbdbi_put (dbipk, txn, "a", 1, "ok", 2);
+        assert (rc == 0);
+        rc = lmdbdbi_put (dbipk, txn, "", 0, "empty keys can't pack", 21);
+        assert (rc == 0);
+        rc = lmdbtxn_flush (txn);
+        assert (rc == -1);
+        rc = lmdbtxn_commit (txn);
+        assert (rc == -1);
+        lmdbtxn_destroy (&txn);
+        txn = lmdbtxn_new_rdonly (env);
+        assert (! lmdbspan_valid (lmdbdbi_get (dbipk, txn, "a", 1)));
+        lmdbtxn_destroy (&txn);
+
+        // A budget of 0 writes the stage and stops staging
+        txn = lmdbtxn_new_rdrw (env);
+        rc = lmdbtxn_stage (txn, 1 << 20);
+        assert (rc == 0);
+        rc = lmdbdbi_put (dbipk, txn, "a", 1, "ok", 2);
+        assert (rc == 0);
+        rc = lmdbtxn_stage (txn, 0);
+        assert (rc == 0);
+        rc = lmdbdbi_put (dbipk, txn, "", 0, "fails now", 9);
+        assert (rc == -1);
+        rc = lmdbtxn_commit (txn);
+        assert (rc == 0);
+        lmdbtxn_destroy (&txn);
+
+        lmdbdbi_destroy (&dbipk);
+        lmdbdbi_destroy (&dbi);
+    }
+    if (verbose)
+        log ("staging txn tests passed");
+
+    {  // caching
+        lmdbdbi_t *dbi = lmdbdbi_new_intkeys (env, "cached");
+        lmdbdbi_t *dbipk = lmdbdbi_new_packed (env, "cached_packed");
+        assert (dbi && dbipk);
+
+        lmdbtxn_t *txn = lmdbtxn_new_rdonly (env);
+        assert (lmdbtxn_cache (txn, 1 << 20) == -1);
+        lmdbtxn_destroy (&txn);
+
+        txn = lmdbtxn_new_rdrw (env);
+        uint32_t i;
+        for (i = 0; i < 100; i++)
+            assert (lmdbdbi_put_ui32 (dbi, txn, i, &i, sizeof (i)) == 0);
+        int rc = lmdbtxn_cache (txn, 1 << 20);
+        assert (rc == 0);
+        lmdbcache_t *cache = lmdbtxn_read_cache (txn);
+        assert (cache);
+
+        // Gets fill the cache, and the same keys come from it after, bar
+        // the odd one pushed out by others hashed alongside
+        for (i = 0; i < 100; i++)
+            assert (lmdbspan_asui32 (lmdbdbi_get_ui32 (dbi, txn, i)) == i);
+        assert (lmdbcache_misses (cache) == 100 && lmdbcache_hits (cache) == 0);
+        for (i = 0; i < 100; i++)
+            assert (lmdbspan_asui32 (lmdbdbi_get_ui32 (dbi, txn, i)) == i);
+        assert (lmdbcache_hits (cache) >= 95);
+
+        // Writes of every kind keep it current
+        uint32_t ten = 10;
+        assert (lmdbdbi_put_ui32 (dbi, txn, 1, "one", 3) == 0);
+        assert (lmdbdbi_put_ui32 (dbi, txn, 2, "a longer two", 12) == 0);
+        assert (lmdbdbi_del (dbi, txn, &ten, sizeof (ten)) == 0);
+        uint32_t three = 3, add = 4;
+        assert (lmdbdbi_merge (dbi, txn, &three, sizeof (three), LMDBDBI_MERGE_OR,
+                               &add, sizeof (add)) == 0);
+        size_t hits = lmdbcache_hits (cache);
+        lmdbspan one = lmdbdbi_get_ui32 (dbi, txn, 1);
+        assert (one.size == 3 && memcmp (one.data, "one", 3) == 0);
+        lmdbspan two = lmdbdbi_get_ui32 (dbi, txn, 2);
+        assert (two.size == 12 && memcmp (two.data, "a longer two", 12) == 0);
+        assert (lmdbspan_asui32 (lmdbdbi_get_ui32 (dbi, txn, 3)) == 7);
+        assert (lmdbcache_hits (cache) == hits + 3);
+        assert (! lmdbspan_valid (lmdbdbi_get_ui32 (dbi, txn, 10)));
+
+        // Staged puts are newer than anything cached
+        rc = lmdbtxn_stage (txn, 1 << 20);
+        assert (rc == 0);
+        assert (lmdbdbi_put_ui32 (dbi, txn, 4, "four", 4) == 0);
+        lmdbspan four = lmdbdbi_get_ui32 (dbi, txn, 4);
+        assert (four.size == 4 && memcmp (four.data, "four", 4) == 0);
+        rc = lmdbtxn_stage (txn, 0);
+        assert (rc == 0);
+        lmdbspan written = lmdbdbi_get_ui32 (dbi, txn, 4);
+        assert (written.size == 4 && memcmp (written.data, "four", 4) == 0);
+
+        // Packed values are cached decoded
+        assert (lmdbdbi_put (dbipk, txn, "k", 1, "packed", 6) == 0);
+        hits = lmdbcache_hits (cache);
+        lmdbspan packed = lmdbdbi_get (dbipk, txn, "k", 1);
+        assert (packed.size == 6 && memcmp (packed.data, "packed", 6) == 0);
+        assert (lmdbcache_hits (cache) == hits + 1);
+        assert (lmdbdbi_del (dbipk, txn, "k", 1) == 0);
+        assert (! lmdbspan_valid (lmdbdbi_get (dbipk, txn, "k", 1)));
+
+        // A budget of 0 stops caching
+        rc = lmdbtxn_cache (txn, 0);
+        assert (rc == 0);
+        assert (! lmdbtxn_read_cache (txn));
+        assert (lmdbspan_asui32 (lmdbdbi_get_ui32 (dbi, txn, 5)) == 5);
+        rc = lmdbtxn_commit (txn);
+        assert (rc == 0);
+        assert (lmdbtxn_cache (txn, 1 << 20) == -1);
+        lmdbtxn_destroy (&txn);
+
+        txn = lmdbtxn_new_rdonly (env);
+        assert (lmdbspan_asui32 (lmdbdbi_get_ui32 (dbi, txn, 3)) == 7);
+        assert (! lmdbspan_valid (lmdbdbi_get_ui32 (dbi, txn, 10)));
+        lmdbtxn_destroy (&txn);
+
+        lmdbdbi_destroy (&dbipk);
+        lmdbdbi_destroy (&dbi);
+    }
+    if (verbose)
+        log ("caching txn tests passed");
         
     lmdbenv_destroy (&env);
     
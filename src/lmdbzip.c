@@ -0,0 +1,444 @@
+/*  =========================================================================
+    lmdbzip - Value codec used by compressed lmdbdbi's, wrapping zstd
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+/*
+@header
+    lmdbzip - Value codec used by compressed lmdbdbi's, wrapping zstd
+@discuss
+    Every stored value starts with a one byte tag:
+
+        0   the value follows, uncompressed
+        1   a zstd frame follows, holding its content size and the id of
+            the dictionary it was compressed with (0 for none)
+
+    Small values, and values that don't shrink, are stored raw so reading
+    them back costs nothing, and gets can point straight into the map.
+
+    Encoding only happens in write txns, so one compression context is
+    enough. Decoding can happen in any number of read txns at once: they
+    share one decompression context while it's free, and make a throwaway
+    one when it isn't.
+
+    Without zstd the codec can't be created, but raw values can still be
+    read back.
+@end
+*/
+
+#include "classlmdb_classes.h"
+
+#include "logging.h"
+
+#include <stdatomic.h>
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+
+#define s_tag_raw  0
+#define s_tag_zstd 1
+
+// zstd's default; the sweet spot for speed vs ratio on small values
+#define s_level 3
+
+//  Structure of our class
+
+struct _lmdbzip_t {
+#ifdef HAVE_LIBZSTD
+    // Encoding, write txns only
+    ZSTD_CCtx *cctx;
+    ZSTD_CDict *cdict;     // NULL to encode without a dictionary
+    uint32_t cdict_id;
+    byte *out;
+    size_t out_max;
+
+    // Decoding. dict_count is only bumped once a slot is filled, so
+    // readers never see a half-built entry.
+    ZSTD_DCtx *dctx;
+    atomic_flag dctx_busy;
+    ZSTD_DDict *ddicts [LMDBZIP_MAX_DICTS];
+    uint32_t ddict_ids [LMDBZIP_MAX_DICTS];
+    atomic_size_t dict_count;
+#else
+    int unused;
+#endif
+};
+
+
+//  --------------------------------------------------------------------------
+//  Create a new lmdbzip
+
+lmdbzip_t *
+lmdbzip_new (void)
+{
+#ifdef HAVE_LIBZSTD
+    lmdbzip_t *self = (lmdbzip_t *) lmdballoc_zmalloc (sizeof (lmdbzip_t));
+    assert (self);
+    self->cctx = ZSTD_createCCtx ();
+    self->dctx = ZSTD_createDCtx ();
+    atomic_flag_clear (&self->dctx_busy);
+    atomic_init (&self->dict_count, 0);
+    if (!self->cctx || !self->dctx)
+        lmdbzip_destroy (&self);
+    return self;
+#else
+    return NULL;
+#endif
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the lmdbzip
+
+void
+lmdbzip_destroy (lmdbzip_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        lmdbzip_t *self = *self_p;
+#ifdef HAVE_LIBZSTD
+        ZSTD_freeCCtx (self->cctx);
+        ZSTD_freeCDict (self->cdict);
+        ZSTD_freeDCtx (self->dctx);
+        size_t i;
+        for (i = 0; i < atomic_load (&self->dict_count); i++)
+            ZSTD_freeDDict (self->ddicts [i]);
+        lmdballoc_free (self->out);
+#endif
+        lmdballoc_free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Dictionaries
+
+#ifdef HAVE_LIBZSTD
+static ZSTD_DDict *
+s_find_ddict (lmdbzip_t *self, uint32_t id)
+{
+    size_t count = atomic_load_explicit (&self->dict_count, memory_order_acquire);
+    size_t i;
+    for (i = 0; i < count; i++)
+        if (self->ddict_ids [i] == id)
+            return self->ddicts [i];
+    return NULL;
+}
+#endif
+
+uint32_t
+lmdbzip_add_dict (lmdbzip_t *self, const void *dict, size_t dict_size)
+{
+    assert (self);
+    assert (dict);
+#ifdef HAVE_LIBZSTD
+    ZSTD_CDict *cdict = ZSTD_createCDict (dict, dict_size, s_level);
+    if (!cdict)
+        return 0;
+
+    uint32_t id = 0;
+    ZSTD_DDict *ddict = ZSTD_createDDict (dict, dict_size);
+    if (ddict)
+        id = ZSTD_getDictID_fromDDict (ddict);
+    if (!id)
+        goto die;   // raw content dictionaries can't be told apart on decode
+
+    if (s_find_ddict (self, id))
+        ZSTD_freeDDict (ddict);
+    else {
+        size_t count = atomic_load (&self->dict_count);
+        if (count == LMDBZIP_MAX_DICTS)
+            goto die;
+        self->ddicts [count] = ddict;
+        self->ddict_ids [count] = id;
+        atomic_store_explicit (&self->dict_count, count + 1, memory_order_release);
+    }
+
+    ZSTD_freeCDict (self->cdict);
+    self->cdict = cdict;
+    self->cdict_id = id;
+    return id;
+
+ die:
+    ZSTD_freeCDict (cdict);
+    ZSTD_freeDDict (ddict);
+    return 0;
+#else
+    return 0;
+#endif
+}
+
+uint32_t
+lmdbzip_dict_id (lmdbzip_t *self)
+{
+    assert (self);
+#ifdef HAVE_LIBZSTD
+    return self->cdict_id;
+#else
+    return 0;
+#endif
+}
+
+uint32_t
+lmdbzip_dict_id_of (const void *dict, size_t dict_size)
+{
+    assert (dict);
+#ifdef HAVE_LIBZSTD
+    return ZDICT_getDictID (dict, dict_size);
+#else
+    return 0;
+#endif
+}
+
+size_t
+lmdbzip_train (const void *samples, const size_t *sample_sizes, size_t sample_count,
+               void *dict, size_t dict_max)
+{
+    assert (samples);
+    assert (sample_sizes);
+    assert (dict);
+#ifdef HAVE_LIBZSTD
+    size_t rc = ZDICT_trainFromBuffer (dict, dict_max, samples, sample_sizes,
+                                       (unsigned) sample_count);
+    if (ZDICT_isError (rc))
+        return 0;
+    return rc;
+#else
+    return 0;
+#endif
+}
+
+
+//  --------------------------------------------------------------------------
+//  Coding
+
+lmdbspan
+lmdbzip_encode (lmdbzip_t *self, const void *val, size_t val_size, size_t threshold)
+{
+    assert (self);
+    assert (val);
+#ifdef HAVE_LIBZSTD
+    size_t bound = 1 + (val_size < threshold ? val_size : ZSTD_compressBound (val_size));
+    if (bound < 1 + val_size)
+        bound = 1 + val_size;
+    if (bound > self->out_max) {
+        byte *out = (byte *) lmdballoc_realloc (self->out, bound);
+        if (!out)
+            return lmdbspan_makenull ();
+        self->out = out;
+        self->out_max = bound;
+    }
+
+    if (val_size >= threshold) {
+        size_t rc;
+        if (self->cdict)
+            rc = ZSTD_compress_usingCDict (self->cctx, self->out + 1, bound - 1,
+                                           val, val_size, self->cdict);
+        else
+            rc = ZSTD_compressCCtx (self->cctx, self->out + 1, bound - 1,
+                                    val, val_size, s_level);
+        if (!ZSTD_isError (rc) && rc < val_size) {
+            self->out [0] = s_tag_zstd;
+            return (lmdbspan) { .data = self->out, .size = 1 + rc };
+        }
+    }
+
+    self->out [0] = s_tag_raw;
+    memcpy (self->out + 1, val, val_size);
+    return (lmdbspan) { .data = self->out, .size = 1 + val_size };
+#else
+    return lmdbspan_makenull ();
+#endif
+}
+
+lmdbspan
+lmdbzip_raw (const void *stored, size_t stored_size)
+{
+    assert (stored);
+    if (stored_size < 1 || *(const byte *) stored != s_tag_raw)
+        return lmdbspan_makenull ();
+    return (lmdbspan) { .data = (const byte *) stored + 1, .size = stored_size - 1 };
+}
+
+size_t
+lmdbzip_decoded_size (const void *stored, size_t stored_size)
+{
+    assert (stored);
+    if (stored_size < 1)
+        return SIZE_MAX;
+
+    const byte *tagged = (const byte *) stored;
+    if (tagged [0] == s_tag_raw)
+        return stored_size - 1;
+#ifdef HAVE_LIBZSTD
+    if (tagged [0] == s_tag_zstd) {
+        unsigned long long size = ZSTD_getFrameContentSize (tagged + 1, stored_size - 1);
+        if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN
+        ||  size > SIZE_MAX - 1)
+            return SIZE_MAX;
+        return (size_t) size;
+    }
+#endif
+    return SIZE_MAX;
+}
+
+int
+lmdbzip_decode (lmdbzip_t *self, const void *stored, size_t stored_size,
+                void *buf, size_t buf_size)
+{
+    assert (self);
+    assert (stored);
+    assert (buf || !buf_size);
+
+    size_t size = lmdbzip_decoded_size (stored, stored_size);
+    if (size == SIZE_MAX || size > buf_size)
+        return -1;
+
+    const byte *tagged = (const byte *) stored;
+    if (tagged [0] == s_tag_raw) {
+        memcpy (buf, tagged + 1, size);
+        return 0;
+    }
+#ifdef HAVE_LIBZSTD
+    const void *frame = tagged + 1;
+    size_t frame_size = stored_size - 1;
+    uint32_t id = ZSTD_getDictID_fromFrame (frame, frame_size);
+    ZSTD_DDict *ddict = NULL;
+    if (id) {
+        ddict = s_find_ddict (self, id);
+        if (!ddict)
+            return -1;
+    }
+
+    ZSTD_DCtx *dctx = self->dctx;
+    bool is_shared = ! atomic_flag_test_and_set_explicit (&self->dctx_busy,
+                                                          memory_order_acquire);
+    if (!is_shared) {
+        dctx = ZSTD_createDCtx ();
+        if (!dctx)
+            return -1;
+    }
+
+    size_t rc;
+    if (ddict)
+        rc = ZSTD_decompress_usingDDict (dctx, buf, size, frame, frame_size, ddict);
+    else
+        rc = ZSTD_decompressDCtx (dctx, buf, size, frame, frame_size);
+
+    if (is_shared)
+        atomic_flag_clear_explicit (&self->dctx_busy, memory_order_release);
+    else
+        ZSTD_freeDCtx (dctx);
+
+    if (ZSTD_isError (rc) || rc != size)
+        return -1;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+lmdbzip_test (bool verbose)
+{
+    printf (" * lmdbzip: ");
+
+    //  @selftest
+    // Raw values can be read back even without zstd
+    const byte stored_raw [] = { s_tag_raw, 'h', 'i', 0 };
+    lmdbspan raw = lmdbzip_raw (stored_raw, sizeof (stored_raw));
+    assert (raw.size == 3 && streq ((const char *) raw.data, "hi"));
+    assert (lmdbzip_decoded_size (stored_raw, sizeof (stored_raw)) == 3);
+    assert (lmdbzip_decoded_size (stored_raw, 0) == SIZE_MAX);
+
+    lmdbzip_t *zip = lmdbzip_new ();
+#ifdef HAVE_LIBZSTD
+    assert (zip);
+    assert (lmdbzip_dict_id (zip) == 0);
+
+    char val [1024];
+    size_t i;
+    for (i = 0; i < sizeof (val); i++)
+        val [i] = "{\"name\": \"lmdb\", \"count\": 12}" [i % 29];
+
+    // Below threshold: stored raw
+    lmdbspan small = lmdbzip_encode (zip, val, 20, 64);
+    assert (small.size == 21);
+    lmdbspan small_raw = lmdbzip_raw (small.data, small.size);
+    assert (small_raw.size == 20 && memcmp (small_raw.data, val, 20) == 0);
+
+    // Above threshold: compressed, and round trips
+    lmdbspan big = lmdbzip_encode (zip, val, sizeof (val), 64);
+    assert (big.size < sizeof (val) / 2);
+    assert (! lmdbspan_valid (lmdbzip_raw (big.data, big.size)));
+    assert (lmdbzip_decoded_size (big.data, big.size) == sizeof (val));
+    char out [1024];
+    int rc = lmdbzip_decode (zip, big.data, big.size, out, sizeof (out));
+    assert (rc == 0 && memcmp (out, val, sizeof (val)) == 0);
+    rc = lmdbzip_decode (zip, big.data, big.size, out, sizeof (out) - 1);
+    assert (rc == -1);
+
+    // Train a dictionary on records that share structure
+    size_t sample_sizes [200];
+    char *samples = (char *) zmalloc (200 * 64);
+    size_t samples_size = 0;
+    for (i = 0; i < 200; i++) {
+        int n = snprintf (samples + samples_size, 64,
+                          "{\"id\": %zu, \"kind\": \"sample\", \"ok\": true}", i * 7919);
+        sample_sizes [i] = n;
+        samples_size += n;
+    }
+    char dict [4096];
+    size_t dict_size = lmdbzip_train (samples, sample_sizes, 200, dict, sizeof (dict));
+    if (dict_size) {
+        // Values written before the dictionary still decode after it
+        lmdbspan plain = lmdbzip_encode (zip, val, sizeof (val), 64);
+        char *plain_copy = (char *) zmalloc (plain.size);
+        memcpy (plain_copy, plain.data, plain.size);
+
+        uint32_t id = lmdbzip_add_dict (zip, dict, dict_size);
+        assert (id);
+        assert (id == lmdbzip_dict_id_of (dict, dict_size));
+        assert (lmdbzip_dict_id (zip) == id);
+
+        lmdbspan withdict = lmdbzip_encode (zip, samples, sample_sizes [0], 16);
+        rc = lmdbzip_decode (zip, withdict.data, withdict.size, out, sizeof (out));
+        assert (rc == 0 && memcmp (out, samples, sample_sizes [0]) == 0);
+
+        rc = lmdbzip_decode (zip, plain_copy, plain.size, out, sizeof (out));
+        assert (rc == 0 && memcmp (out, val, sizeof (val)) == 0);
+        free (plain_copy);
+
+        // A codec without the dictionary can't decode its values
+        lmdbzip_t *other = lmdbzip_new ();
+        lmdbspan again = lmdbzip_encode (zip, samples, sample_sizes [0], 16);
+        if (! lmdbspan_valid (lmdbzip_raw (again.data, again.size))) {
+            rc = lmdbzip_decode (other, again.data, again.size, out, sizeof (out));
+            assert (rc == -1);
+        }
+        lmdbzip_destroy (&other);
+    }
+    free (samples);
+
+    if (verbose)
+        log ("zstd coding tests passed");
+#else
+    assert (!zip);
+#endif
+    lmdbzip_destroy (&zip);
+
+    //  @end
+    printf ("OK\n");
+}
@@ -0,0 +1,100 @@
+/*  =========================================================================
+    lmdbzip - Value codec used by compressed lmdbdbi's, wrapping zstd
+
+    Copyright (c) 2017 Inkblot Software Limited.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+#ifndef LMDBZIP_H_INCLUDED
+#define LMDBZIP_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  Most dictionaries one codec will hold
+#define LMDBZIP_MAX_DICTS 64
+
+//  @warning THE FOLLOWING @INTERFACE BLOCK IS AUTO-GENERATED BY ZPROJECT
+//  @warning Please edit the model at "api/lmdbzip.xml" to make changes.
+//  @interface
+//  This API is a draft, and may change without notice.
+#ifdef CLASSLMDB_BUILD_DRAFT_API
+//  *** Draft method, defined for internal use only ***
+//  Create a codec with no dictionaries.
+//  Returns NULL if the library was built without zstd.
+CLASSLMDB_PRIVATE lmdbzip_t *
+    lmdbzip_new (void);
+
+//  *** Draft method, defined for internal use only ***
+//  Destroy the lmdbzip.
+CLASSLMDB_PRIVATE void
+    lmdbzip_destroy (lmdbzip_t **self_p);
+
+//  *** Draft method, defined for internal use only ***
+//  Load a trained dictionary, which is used to encode from now on. Every
+//  dictionary loaded stays available for decoding, up to LMDBZIP_MAX_DICTS.
+//  Returns the dictionary's id, or 0 on failure.
+CLASSLMDB_PRIVATE uint32_t
+    lmdbzip_add_dict (lmdbzip_t *self, const void *dict, size_t dict_size);
+
+//  *** Draft method, defined for internal use only ***
+//  Id of the dictionary used to encode, or 0 if there is none.
+CLASSLMDB_PRIVATE uint32_t
+    lmdbzip_dict_id (lmdbzip_t *self);
+
+//  *** Draft method, defined for internal use only ***
+//  Id of a trained dictionary, or 0 if it has none.
+CLASSLMDB_PRIVATE uint32_t
+    lmdbzip_dict_id_of (const void *dict, size_t dict_size);
+
+//  *** Draft method, defined for internal use only ***
+//  Train a dictionary from sample values stored back to back, writing it
+//  to dict, which must hold dict_max bytes.
+//  Returns the dictionary size, or 0 if training failed (e.g. too few
+//  samples).
+CLASSLMDB_PRIVATE size_t
+    lmdbzip_train (const void *samples, const size_t *sample_sizes, size_t sample_count, void *dict, size_t dict_max);
+
+//  *** Draft method, defined for internal use only ***
+//  Encode a value for storage. Values smaller than threshold, or that
+//  don't shrink, are stored raw behind a one byte tag.
+//  Returns a span valid until the next encode, or nullish on error.
+CLASSLMDB_PRIVATE lmdbspan
+    lmdbzip_encode (lmdbzip_t *self, const void *val, size_t val_size, size_t threshold);
+
+//  *** Draft method, defined for internal use only ***
+//  If an encoded value is stored raw, return a span over the value within
+//  it, else a nullish span.
+CLASSLMDB_PRIVATE lmdbspan
+    lmdbzip_raw (const void *stored, size_t stored_size);
+
+//  *** Draft method, defined for internal use only ***
+//  Size of an encoded value once decoded, or SIZE_MAX if it is malformed.
+CLASSLMDB_PRIVATE size_t
+    lmdbzip_decoded_size (const void *stored, size_t stored_size);
+
+//  *** Draft method, defined for internal use only ***
+//  Decode a value into buf, which must hold its decoded size.
+//  Safe to call from several threads at once, and alongside add dict.
+//  Returns 0 on success, -1 on failure.
+CLASSLMDB_PRIVATE int
+    lmdbzip_decode (lmdbzip_t *self, const void *stored, size_t stored_size, void *buf, size_t buf_size);
+
+//  *** Draft method, defined for internal use only ***
+//  Self test of this class.
+CLASSLMDB_PRIVATE void
+    lmdbzip_test (bool verbose);
+
+#endif // CLASSLMDB_BUILD_DRAFT_API
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif